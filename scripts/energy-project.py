@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Projects the battery drain from the energy totals of the device.
+
+usage: energy-project.py [--battery MAH] [--ua CONSUMER=UA]... FILE
+
+The last line of the file is one read of the energy totals
+characteristic as hex (spaces, colons and dashes are ignored), as
+copied from a BLE client or written by the native simulation with -e.
+
+The totals hold the time spent by each consumer since the last cold
+boot and the current draw the firmware was built with; --ua overrides
+a current draw, in microamps, to try another board without rebuilding.
+The drain is scaled to a day using the time the totals cover, awake
+plus deep sleep.
+"""
+
+import argparse
+import sys
+
+TOTALS_VERSION = 1
+CONSUMER_SIZE = 12
+
+# must match EnergyConsumer in src/Energy.h
+CONSUMERS = [
+    "cpu boot",
+    "cpu configuration",
+    "cpu deep sleep",
+    "cpu sunrise",
+    "wifi",
+    "ble",
+    "leds",
+    "sleep",
+    "cpu sync",
+]
+AWAKE = [0, 1, 2, 3, 8]
+SLEEP = 7
+
+US_PER_DAY = 86400e6
+# one mAh is 1000 uA for 3600e6 us
+UA_US_PER_MAH = 3.6e12
+
+
+def parse_totals(line):
+    data = bytes.fromhex("".join(c for c in line if c not in " :-\t\r\n"))
+    if len(data) < 6 or data[0] != TOTALS_VERSION:
+        raise ValueError("unsupported totals")
+    count = data[1]
+    if len(data) != 6 + count * CONSUMER_SIZE:
+        raise ValueError("totals have %d bytes, expected %d" % (len(data), 6 + count * CONSUMER_SIZE))
+    deep_sleeps = int.from_bytes(data[2:6], "little")
+    consumers = []
+    for i in range(count):
+        consumer = data[6 + i * CONSUMER_SIZE:6 + (i + 1) * CONSUMER_SIZE]
+        consumers.append((int.from_bytes(consumer[0:8], "little"), int.from_bytes(consumer[8:12], "little")))
+    return deep_sleeps, consumers
+
+
+def parse_override(value):
+    name, _, ua = value.partition("=")
+    if name not in CONSUMERS or not ua.isdigit():
+        raise argparse.ArgumentTypeError("expected CONSUMER=UA, consumer one of: %s" % ", ".join(CONSUMERS))
+    return CONSUMERS.index(name), int(ua)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--battery", type=float, metavar="MAH", help="battery capacity, to project its life")
+    parser.add_argument("--ua", type=parse_override, action="append", default=[], metavar="CONSUMER=UA",
+                        help="override the current draw of a consumer")
+    parser.add_argument("file")
+    args = parser.parse_args()
+
+    with open(args.file) as file:
+        lines = [line for line in file if line.strip()]
+    if not lines:
+        print("%s: no totals" % args.file, file=sys.stderr)
+        return 1
+    try:
+        deep_sleeps, consumers = parse_totals(lines[-1])
+    except ValueError as error:
+        print("%s: %s" % (args.file, error), file=sys.stderr)
+        return 1
+    for index, ua in args.ua:
+        if index < len(consumers):
+            consumers[index] = (consumers[index][0], ua)
+
+    awake_us = sum(consumers[i][0] for i in AWAKE if i < len(consumers))
+    sleep_us = consumers[SLEEP][0] if SLEEP < len(consumers) else 0
+    covered_us = awake_us + sleep_us
+    if covered_us == 0:
+        print("%s: the totals cover no time" % args.file, file=sys.stderr)
+        return 1
+
+    scale = US_PER_DAY / covered_us
+    print("covered: %.2f days, %d deep sleeps, awake %.3f%% of the time\n" % (
+        covered_us / US_PER_DAY, deep_sleeps, 100.0 * awake_us / covered_us))
+    print("%-18s %14s %10s %12s" % ("consumer", "time (s)", "uA", "mAh/day"))
+    total = 0.0
+    for index, (us, ua) in enumerate(consumers):
+        name = CONSUMERS[index] if index < len(CONSUMERS) else "consumer %d" % index
+        per_day = us * ua / UA_US_PER_MAH * scale
+        total += per_day
+        print("%-18s %14.1f %10d %12.3f" % (name, us / 1e6, ua, per_day))
+    print("%-18s %14s %10s %12.3f" % ("total", "", "", total))
+
+    if args.battery:
+        print("\nbattery life: %.1f days on %.0f mAh" % (args.battery / total, args.battery))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Decodes boot and wake profile traces and prints per phase latency histograms.
+
+usage: profile-decode.py FILE...
+
+Each line of the files is one read of the profile trace characteristic
+as hex (spaces, colons and dashes are ignored), as copied from a BLE
+client or written by the native simulation with -t. Reads made at
+different times overlap; records seen more than once are counted once.
+
+Phases are reported as their duration, instants (boot, first state,
+deep sleep, first frame) as the time since the chip was reset.
+"""
+
+import sys
+
+TRACE_VERSION = 1
+RECORD_SIZE = 8
+PHASE_END = 0x80
+
+# must match ProfilePhase in src/Profiler.h
+PHASES = {
+    1: "boot",
+    2: "setup",
+    3: "settings init",
+    4: "first state",
+    5: "device name",
+    6: "wifi init",
+    7: "ble init",
+    8: "ntp sync",
+    9: "deep sleep",
+    10: "first frame",
+    11: "household sync",
+}
+INSTANTS = {1, 4, 9, 10}
+
+
+def parse_trace(line):
+    data = bytes.fromhex("".join(c for c in line if c not in " :-\t\r\n"))
+    if len(data) < 2 or data[0] != TRACE_VERSION:
+        raise ValueError("unsupported trace")
+    count = data[1]
+    if len(data) != 2 + count * RECORD_SIZE:
+        raise ValueError("trace has %d bytes, expected %d" % (len(data), 2 + count * RECORD_SIZE))
+    for i in range(count):
+        record = data[2 + i * RECORD_SIZE:2 + (i + 1) * RECORD_SIZE]
+        timestamp = int.from_bytes(record[0:4], "little")
+        boot = int.from_bytes(record[4:6], "little")
+        yield boot, timestamp, record[6]
+
+
+def read_records(paths):
+    """Returns the unique records of every boot, in the order they were recorded."""
+    boots = {}
+    for path in paths:
+        with open(path) as file:
+            for number, line in enumerate(file, 1):
+                if not line.strip():
+                    continue
+                try:
+                    records = list(parse_trace(line))
+                except ValueError as error:
+                    print("%s:%d: %s" % (path, number, error), file=sys.stderr)
+                    continue
+                for boot, timestamp, phase in records:
+                    seen = boots.setdefault(boot, {})
+                    seen.setdefault((timestamp, phase), len(seen))
+    return {boot: sorted(seen, key=lambda record: (record[0], seen[record])) for boot, seen in boots.items()}
+
+
+def latencies(boots):
+    """Returns the latencies of every phase, in microseconds."""
+    result = {}
+    for records in boots.values():
+        started = {}
+        for timestamp, phase in records:
+            if phase in INSTANTS:
+                result.setdefault(phase, []).append(timestamp)
+            elif phase & PHASE_END:
+                begin = started.pop(phase & ~PHASE_END, None)
+                if begin is not None:
+                    result.setdefault(phase & ~PHASE_END, []).append(timestamp - begin)
+            else:
+                started[phase] = timestamp
+    return result
+
+
+def format_us(value):
+    if value >= 1000000:
+        return "%.2f s" % (value / 1e6)
+    if value >= 1000:
+        return "%.2f ms" % (value / 1e3)
+    return "%d us" % value
+
+
+def print_histogram(name, values):
+    values = sorted(values)
+    percentile = lambda p: values[min(len(values) - 1, int(p * len(values)))]
+    print("%s: %d samples, min %s, p50 %s, p90 %s, max %s" % (
+        name, len(values), format_us(values[0]), format_us(percentile(0.5)),
+        format_us(percentile(0.9)), format_us(values[-1])))
+
+    # power of two buckets
+    buckets = {}
+    for value in values:
+        buckets[value.bit_length()] = buckets.get(value.bit_length(), 0) + 1
+    largest = max(buckets.values())
+    for bucket in range(min(buckets), max(buckets) + 1):
+        count = buckets.get(bucket, 0)
+        low = 0 if bucket == 0 else 1 << (bucket - 1)
+        print("  %10s - %-10s %6d %s" % (format_us(low), format_us((1 << bucket) - 1), count, "#" * (40 * count // largest)))
+    print()
+
+
+def main(paths):
+    if not paths:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    boots = read_records(paths)
+    print("%d boots\n" % len(boots))
+    phases = latencies(boots)
+    for phase in sorted(phases):
+        print_histogram(PHASES.get(phase, "phase %d" % phase), phases[phase])
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -1,3 +1,3 @@
 @echo off
 scp src\* pi@rasp2esp32.ddns.net:/home/pi/workspace/alarmista-esp32/src
-scp *.ini pi@rasp2esp32.ddns.net:/home/pi/workspace/alarmista-esp32
\ No newline at end of file
+scp *.ini *.csv pi@rasp2esp32.ddns.net:/home/pi/workspace/alarmista-esp32
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef Alarm_h
+#define Alarm_h
+
+#include <stdint.h>
+
+const int MAX_ALARMS = 4;
+
+const int ALARM_SONG_SIZE = 24;
+
+// Alarm has a fixed layout so it can be stored as a binary blob
+struct Alarm
+{
+    uint32_t number;
+    int32_t when;
+    char song[ALARM_SONG_SIZE];
+    uint32_t activeMatrix;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "AlarmProtocol.h"
+
+#include <string.h>
+
+static const uint32_t SECONDS_IN_DAY = 24UL * 60UL * 60UL;
+static const uint32_t ALL_WEEKDAYS = 0x7F;
+static const int CSV_FIELDS = 4;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// readUInt32 reads a little endian 32-bit value
+static uint32_t readUInt32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// writeUInt32 writes a little endian 32-bit value
+static void writeUInt32(uint8_t *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+// parseUInt32 parses a decimal number made only of digits,
+// rejecting empty fields, signs, spaces and overflows
+static bool parseUInt32(const char *data, size_t length, uint32_t *value)
+{
+    if (length == 0 || length > 10)
+    {
+        return false;
+    }
+
+    uint64_t result = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] < '0' || data[i] > '9')
+        {
+            return false;
+        }
+        result = result * 10 + (data[i] - '0');
+    }
+    if (result > UINT32_MAX)
+    {
+        return false;
+    }
+
+    *value = (uint32_t)result;
+    return true;
+}
+
+// isSongValid returns false if a song name holds a NUL, which would hide
+// the rest of the name once stored
+static bool isSongValid(const void *song, size_t length)
+{
+    return memchr(song, '\0', length) == NULL;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// alarmValidate checks the alarm fields are in range, whatever
+// the format the alarm was received in
+AlarmStatus alarmValidate(const Alarm *alarm)
+{
+    if (alarm->number == 0 || alarm->number > MAX_ALARMS)
+    {
+        return ALARM_STATUS_INVALID_NUMBER;
+    }
+    if (alarm->when < 0 || (uint32_t)alarm->when >= SECONDS_IN_DAY)
+    {
+        return ALARM_STATUS_INVALID_TIME;
+    }
+    if (alarm->activeMatrix == 0 || (alarm->activeMatrix & ~ALL_WEEKDAYS) != 0)
+    {
+        return ALARM_STATUS_INVALID_DAYS;
+    }
+    if (memchr(alarm->song, '\0', ALARM_SONG_SIZE) == NULL)
+    {
+        return ALARM_STATUS_SONG_TOO_LONG;
+    }
+    return ALARM_STATUS_SUCCESS;
+}
+
+// alarmProtocolParseBinary parses a binary alarm record
+AlarmStatus alarmProtocolParseBinary(const uint8_t *data, size_t length, Alarm *alarm)
+{
+    if (length < 1 || data[0] != ALARM_RECORD_VERSION)
+    {
+        return ALARM_STATUS_UNSUPPORTED_VERSION;
+    }
+    if (length < ALARM_RECORD_HEADER_SIZE)
+    {
+        return ALARM_STATUS_TRUNCATED;
+    }
+
+    uint8_t songLength = data[7];
+    if (songLength >= ALARM_SONG_SIZE)
+    {
+        return ALARM_STATUS_SONG_TOO_LONG;
+    }
+    if (length < ALARM_RECORD_HEADER_SIZE + songLength)
+    {
+        return ALARM_STATUS_TRUNCATED;
+    }
+    if (length > ALARM_RECORD_HEADER_SIZE + songLength)
+    {
+        return ALARM_STATUS_TRAILING_DATA;
+    }
+    if (!isSongValid(data + ALARM_RECORD_HEADER_SIZE, songLength))
+    {
+        return ALARM_STATUS_INVALID_FIELDS;
+    }
+
+    memset(alarm, 0, sizeof(Alarm));
+    alarm->number = data[1];
+    alarm->when = (int32_t)readUInt32(data + 2);
+    alarm->activeMatrix = data[6];
+    memcpy(alarm->song, data + ALARM_RECORD_HEADER_SIZE, songLength);
+
+    return alarmValidate(alarm);
+}
+
+// alarmProtocolParseCsv parses an alarm in the legacy format:
+// alarm number,time in seconds since the start of the day,song,active days
+AlarmStatus alarmProtocolParseCsv(const char *data, size_t length, Alarm *alarm)
+{
+    const char *fields[CSV_FIELDS];
+    size_t lengths[CSV_FIELDS];
+
+    int field = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= length; i++)
+    {
+        if (i < length && data[i] != ',')
+        {
+            continue;
+        }
+        if (field == CSV_FIELDS)
+        {
+            return ALARM_STATUS_TRAILING_DATA;
+        }
+        fields[field] = data + start;
+        lengths[field] = i - start;
+        field++;
+        start = i + 1;
+    }
+    if (field != CSV_FIELDS)
+    {
+        return ALARM_STATUS_MISSING_FIELDS;
+    }
+
+    uint32_t number;
+    uint32_t when;
+    uint32_t activeMatrix;
+    if (!parseUInt32(fields[0], lengths[0], &number) ||
+        !parseUInt32(fields[1], lengths[1], &when) ||
+        !parseUInt32(fields[3], lengths[3], &activeMatrix))
+    {
+        return ALARM_STATUS_INVALID_FIELDS;
+    }
+    if (lengths[2] >= ALARM_SONG_SIZE)
+    {
+        return ALARM_STATUS_SONG_TOO_LONG;
+    }
+    if (!isSongValid(fields[2], lengths[2]))
+    {
+        return ALARM_STATUS_INVALID_FIELDS;
+    }
+    if (when > INT32_MAX)
+    {
+        return ALARM_STATUS_INVALID_TIME;
+    }
+
+    memset(alarm, 0, sizeof(Alarm));
+    alarm->number = number;
+    alarm->when = (int32_t)when;
+    alarm->activeMatrix = activeMatrix;
+    memcpy(alarm->song, fields[2], lengths[2]);
+
+    return alarmValidate(alarm);
+}
+
+// alarmProtocolParse parses an alarm in either format without allocating;
+// the alarm is only meaningful when ALARM_STATUS_SUCCESS is returned
+AlarmStatus alarmProtocolParse(const uint8_t *data, size_t length, Alarm *alarm)
+{
+    if (length > 0 && data[0] == ALARM_RECORD_VERSION)
+    {
+        return alarmProtocolParseBinary(data, length, alarm);
+    }
+    if (length > 0 && data[0] >= '0' && data[0] <= '9')
+    {
+        return alarmProtocolParseCsv((const char *)data, length, alarm);
+    }
+    return length == 0 ? ALARM_STATUS_MISSING_FIELDS : ALARM_STATUS_UNSUPPORTED_VERSION;
+}
+
+// alarmProtocolEncode writes an alarm as a binary record, returning
+// the record size, or 0 if the buffer is too small
+size_t alarmProtocolEncode(const Alarm *alarm, uint8_t *buffer, size_t size)
+{
+    size_t songLength = strnlen(alarm->song, ALARM_SONG_SIZE - 1);
+    if (size < ALARM_RECORD_HEADER_SIZE + songLength)
+    {
+        return 0;
+    }
+
+    buffer[0] = ALARM_RECORD_VERSION;
+    buffer[1] = (uint8_t)alarm->number;
+    writeUInt32(buffer + 2, (uint32_t)alarm->when);
+    buffer[6] = (uint8_t)alarm->activeMatrix;
+    buffer[7] = (uint8_t)songLength;
+    memcpy(buffer + ALARM_RECORD_HEADER_SIZE, alarm->song, songLength);
+
+    return ALARM_RECORD_HEADER_SIZE + songLength;
+}
@@ -0,0 +1,45 @@
+#ifndef AlarmProtocol_h
+#define AlarmProtocol_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Alarm.h"
+
+// first byte of a binary alarm record; never an ASCII digit, so
+// records in the legacy CSV format can still be told apart
+const uint8_t ALARM_RECORD_VERSION = 0xA1;
+
+// binary alarm record, little endian, without padding:
+// version (1) | number (1) | when (4) | active matrix (1) | song length (1) | song
+const size_t ALARM_RECORD_HEADER_SIZE = 8;
+const size_t ALARM_RECORD_MAX_SIZE = ALARM_RECORD_HEADER_SIZE + ALARM_SONG_SIZE - 1;
+
+// AlarmStatus values are reported as the last operation status,
+// so the existing values must not change
+enum AlarmStatus : uint8_t
+{
+    ALARM_STATUS_SUCCESS = 0,
+    ALARM_STATUS_MISSING_FIELDS = 1,
+    ALARM_STATUS_INVALID_FIELDS = 2,
+    ALARM_STATUS_NOT_SAVED = 3,
+    ALARM_STATUS_UNSUPPORTED_VERSION = 4,
+    ALARM_STATUS_TRUNCATED = 5,
+    ALARM_STATUS_TRAILING_DATA = 6,
+    ALARM_STATUS_INVALID_NUMBER = 7,
+    ALARM_STATUS_INVALID_TIME = 8,
+    ALARM_STATUS_INVALID_DAYS = 9,
+    ALARM_STATUS_SONG_TOO_LONG = 10,
+};
+
+AlarmStatus alarmValidate(const Alarm *alarm);
+
+AlarmStatus alarmProtocolParseBinary(const uint8_t *data, size_t length, Alarm *alarm);
+
+AlarmStatus alarmProtocolParseCsv(const char *data, size_t length, Alarm *alarm);
+
+AlarmStatus alarmProtocolParse(const uint8_t *data, size_t length, Alarm *alarm);
+
+size_t alarmProtocolEncode(const Alarm *alarm, uint8_t *buffer, size_t size);
+
+#endif
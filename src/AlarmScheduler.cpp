@@ -0,0 +1,134 @@
+#include "AlarmScheduler.h"
+
+#include <string.h>
+
+// the unix epoch (1970-01-01) was a Thursday
+static const uint8_t EPOCH_WEEKDAY = 4;
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// alarmSchedulerClear removes all the alarms from the schedule
+void alarmSchedulerClear(AlarmSchedule *schedule)
+{
+    memset(schedule, 0, sizeof(AlarmSchedule));
+}
+
+// alarmSchedulerAdd inserts an alarm in the index of every weekday enabled
+// in its active matrix, keeping each weekday sorted by time.
+// alarmSchedulerBuild must be called after all the alarms are added.
+bool alarmSchedulerAdd(AlarmSchedule *schedule, uint8_t number, uint32_t when, uint8_t activeMatrix)
+{
+    if (when >= SECONDS_PER_DAY || (activeMatrix & 0x7F) == 0)
+    {
+        return false;
+    }
+
+    for (uint8_t day = 0; day < DAYS_PER_WEEK; day++)
+    {
+        if ((activeMatrix & (1 << day)) == 0)
+        {
+            continue;
+        }
+
+        uint8_t count = schedule->dayCounts[day];
+        if (count >= SCHEDULER_MAX_ALARMS)
+        {
+            return false;
+        }
+
+        uint8_t position = count;
+        while (position > 0 && schedule->dayTimes[day][position - 1] > when)
+        {
+            schedule->dayTimes[day][position] = schedule->dayTimes[day][position - 1];
+            schedule->dayNumbers[day][position] = schedule->dayNumbers[day][position - 1];
+            position--;
+        }
+        schedule->dayTimes[day][position] = when;
+        schedule->dayNumbers[day][position] = number;
+        schedule->dayCounts[day] = count + 1;
+    }
+
+    schedule->count++;
+    return true;
+}
+
+// alarmSchedulerBuild precomputes, for each weekday, how many days ahead
+// the next weekday with an alarm is (7 when it is the same weekday).
+void alarmSchedulerBuild(AlarmSchedule *schedule)
+{
+    for (uint8_t day = 0; day < DAYS_PER_WEEK; day++)
+    {
+        schedule->daysToNextActiveDay[day] = 0;
+        for (uint8_t ahead = 1; ahead <= DAYS_PER_WEEK; ahead++)
+        {
+            if (schedule->dayCounts[(day + ahead) % DAYS_PER_WEEK] > 0)
+            {
+                schedule->daysToNextActiveDay[day] = ahead;
+                break;
+            }
+        }
+    }
+}
+
+// alarmSchedulerNext returns the number of seconds from epoch until the
+// earliest alarm of the schedule fires, and the number of that alarm.
+// An alarm set for the current second is considered to fire next week.
+// Returns false when no alarm is scheduled.
+bool alarmSchedulerNext(const AlarmSchedule *schedule, uint32_t epoch, uint32_t *secondsToNext, uint8_t *alarmNumber)
+{
+    if (schedule->count == 0)
+    {
+        return false;
+    }
+
+    uint32_t secondsOfDay = epoch % SECONDS_PER_DAY;
+    uint8_t weekday = (epoch / SECONDS_PER_DAY + EPOCH_WEEKDAY) % DAYS_PER_WEEK;
+
+    for (uint8_t i = 0; i < schedule->dayCounts[weekday]; i++)
+    {
+        if (schedule->dayTimes[weekday][i] > secondsOfDay)
+        {
+            *secondsToNext = schedule->dayTimes[weekday][i] - secondsOfDay;
+            *alarmNumber = schedule->dayNumbers[weekday][i];
+            return true;
+        }
+    }
+
+    uint8_t ahead = schedule->daysToNextActiveDay[weekday];
+    uint8_t day = (weekday + ahead) % DAYS_PER_WEEK;
+    *secondsToNext = ahead * SECONDS_PER_DAY - secondsOfDay + schedule->dayTimes[day][0];
+    *alarmNumber = schedule->dayNumbers[day][0];
+    return true;
+}
+
+// alarmSchedulerNextInZone returns the number of seconds from the UTC
+// epoch until the earliest alarm of the schedule fires, the alarm times
+// being local times of the zone, and the number of that alarm. An alarm in
+// the hour skipped when the clocks go forward fires when they do, and one
+// in the hour repeated when they go back fires the first time only.
+// Returns false when no alarm is scheduled.
+bool alarmSchedulerNextInZone(const AlarmSchedule *schedule, const TimeZoneTable *zone, uint32_t epoch,
+                              uint32_t *secondsToNext, uint8_t *alarmNumber)
+{
+    uint32_t local = timeZoneToLocal(zone, epoch);
+    // the alarms of a repeated hour that already fired are passed over,
+    // at most all the alarms of a day
+    for (uint8_t i = 0; i <= SCHEDULER_MAX_ALARMS; i++)
+    {
+        uint32_t localToNext;
+        if (!alarmSchedulerNext(schedule, local, &localToNext, alarmNumber))
+        {
+            return false;
+        }
+        local += localToNext;
+        uint32_t fires = timeZoneToUtc(zone, local);
+        if (fires > epoch)
+        {
+            *secondsToNext = fires - epoch;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,37 @@
+#ifndef AlarmScheduler_h
+#define AlarmScheduler_h
+
+#include <stdint.h>
+
+#include "TimeZone.h"
+
+const uint8_t SCHEDULER_MAX_ALARMS = 8;
+const uint8_t DAYS_PER_WEEK = 7;
+const uint32_t SECONDS_PER_DAY = 24UL * 60UL * 60UL;
+
+// AlarmSchedule is a per-weekday index of the alarm times, sorted by time.
+// Times and weekdays are local (see alarmSchedulerNextInZone). Weekdays
+// follow the tm_wday convention (0 is Sunday) and bit N of an alarm active
+// matrix enables the alarm on weekday N.
+struct AlarmSchedule
+{
+    uint8_t count;
+    uint8_t dayCounts[DAYS_PER_WEEK];
+    uint32_t dayTimes[DAYS_PER_WEEK][SCHEDULER_MAX_ALARMS];
+    uint8_t dayNumbers[DAYS_PER_WEEK][SCHEDULER_MAX_ALARMS];
+    // days from each weekday to the next weekday with an alarm (1 to 7)
+    uint8_t daysToNextActiveDay[DAYS_PER_WEEK];
+};
+
+void alarmSchedulerClear(AlarmSchedule *schedule);
+
+bool alarmSchedulerAdd(AlarmSchedule *schedule, uint8_t number, uint32_t when, uint8_t activeMatrix);
+
+void alarmSchedulerBuild(AlarmSchedule *schedule);
+
+bool alarmSchedulerNext(const AlarmSchedule *schedule, uint32_t epoch, uint32_t *secondsToNext, uint8_t *alarmNumber);
+
+bool alarmSchedulerNextInZone(const AlarmSchedule *schedule, const TimeZoneTable *zone, uint32_t epoch,
+                              uint32_t *secondsToNext, uint8_t *alarmNumber);
+
+#endif
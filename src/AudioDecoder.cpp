@@ -0,0 +1,435 @@
+#include "AudioDecoder.h"
+
+#include <string.h>
+
+/* =========================================================================
+   Definitions
+   ========================================================================= */
+
+// IMA-ADPCM quantizer steps and how each code moves the step index
+static constexpr int16_t IMA_STEPS[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80,
+    88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544,
+    598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749,
+    3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635,
+    13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static constexpr int8_t IMA_INDEX_ADJUST[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+static constexpr uint8_t IMA_MAX_STEP_INDEX = 88;
+
+// ImaDecodeTable holds, for each step index and code, the difference the
+// code adds to the predictor (without the sign) and the next step index,
+// so decoding a nibble is two lookups instead of a chain of tests
+struct ImaDecodeTable
+{
+    uint16_t differences[89][8];
+    uint8_t nextIndexes[89][16];
+};
+
+// buildImaDecodeTable computes the decode table at compile time, with the
+// shifts of the reference decoder, so the samples are the same
+constexpr ImaDecodeTable buildImaDecodeTable()
+{
+    ImaDecodeTable table = {};
+    for (int index = 0; index <= IMA_MAX_STEP_INDEX; index++)
+    {
+        int32_t step = IMA_STEPS[index];
+        for (int code = 0; code < 16; code++)
+        {
+            if (code < 8)
+            {
+                table.differences[index][code] = (uint16_t)((step >> 3) + ((code & 4) ? step : 0) +
+                                                            ((code & 2) ? step >> 1 : 0) + ((code & 1) ? step >> 2 : 0));
+            }
+            int next = index + IMA_INDEX_ADJUST[code];
+            table.nextIndexes[index][code] = next < 0 ? 0 : next > IMA_MAX_STEP_INDEX ? IMA_MAX_STEP_INDEX : next;
+        }
+    }
+    return table;
+}
+
+static constexpr ImaDecodeTable IMA_DECODE_TABLE = buildImaDecodeTable();
+
+// the header of an IMA-ADPCM block: first sample (2) | step index (1) | 0 (1)
+static const uint16_t IMA_BLOCK_HEADER_SIZE = 4;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint16_t getUint16(const uint8_t *data)
+{
+    return data[0] | (uint16_t)data[1] << 8;
+}
+
+static uint32_t getUint32(const uint8_t *data)
+{
+    return getUint16(data) | (uint32_t)getUint16(data + 2) << 16;
+}
+
+// readAt reads from the file, returning false unless it read all of it
+static bool readAt(AudioDecoder *decoder, uint32_t offset, void *buffer, size_t length)
+{
+    const AudioSource &source = decoder->source;
+    if (offset > source.length || length > source.length - offset)
+    {
+        return false;
+    }
+    return source.read(source.offset + offset, buffer, length) == length;
+}
+
+// parseFormat checks the format chunk, returning its status
+static AudioStatus parseFormat(const uint8_t *chunk, uint32_t size, AudioFormat *format)
+{
+    if (size < 16)
+    {
+        return AUDIO_STATUS_BAD_FORMAT;
+    }
+    uint16_t encoding = getUint16(chunk);
+    uint16_t channels = getUint16(chunk + 2);
+    uint32_t sampleRate = getUint32(chunk + 4);
+    uint16_t blockSize = getUint16(chunk + 12);
+    uint16_t bits = getUint16(chunk + 14);
+    if (sampleRate == 0 || channels == 0)
+    {
+        return AUDIO_STATUS_BAD_FORMAT;
+    }
+
+    format->sampleRate = sampleRate;
+    format->channels = channels;
+    if (encoding == AUDIO_ENCODING_PCM16 && bits == 16 && channels <= 2)
+    {
+        format->encoding = AUDIO_ENCODING_PCM16;
+        format->blockSize = 2 * channels;
+        format->samplesPerBlock = 1;
+        return blockSize == format->blockSize ? AUDIO_STATUS_OK : AUDIO_STATUS_BAD_FORMAT;
+    }
+    if (encoding == AUDIO_ENCODING_IMA_ADPCM && bits == 4 && channels == 1)
+    {
+        if (blockSize <= IMA_BLOCK_HEADER_SIZE || blockSize > AUDIO_MAX_ADPCM_BLOCK_SIZE)
+        {
+            return AUDIO_STATUS_UNSUPPORTED;
+        }
+        format->encoding = AUDIO_ENCODING_IMA_ADPCM;
+        format->blockSize = blockSize;
+        format->samplesPerBlock = (blockSize - IMA_BLOCK_HEADER_SIZE) * 2 + 1;
+        // the extension, when there, repeats the samples per block
+        if (size >= 20 && getUint16(chunk + 18) != format->samplesPerBlock)
+        {
+            return AUDIO_STATUS_BAD_FORMAT;
+        }
+        return AUDIO_STATUS_OK;
+    }
+    return AUDIO_STATUS_UNSUPPORTED;
+}
+
+// fillBuffer reads the next input block, up to size bytes, returning
+// false at the end of the data or if the read failed
+static bool fillBuffer(AudioDecoder *decoder, uint16_t size)
+{
+    uint32_t remaining = decoder->format.dataLength - decoder->position;
+    if (remaining < size)
+    {
+        size = remaining;
+    }
+    if (size == 0)
+    {
+        return false;
+    }
+    if (!readAt(decoder, decoder->format.dataOffset + decoder->position, decoder->buffer, size))
+    {
+        decoder->status = AUDIO_STATUS_READ_FAILED;
+        return false;
+    }
+    decoder->position += size;
+    decoder->bufferLength = size;
+    decoder->bufferPosition = 0;
+    return true;
+}
+
+// readPcm converts 16 bits PCM frames, mixing stereo down to mono
+static size_t readPcm(AudioDecoder *decoder, int16_t *samples, size_t count)
+{
+    uint16_t frameSize = decoder->format.blockSize;
+    uint16_t bufferSize = sizeof(decoder->buffer) - sizeof(decoder->buffer) % frameSize;
+    size_t produced = 0;
+    while (produced < count)
+    {
+        if (decoder->bufferPosition + frameSize > decoder->bufferLength && !fillBuffer(decoder, bufferSize))
+        {
+            break;
+        }
+        const uint8_t *frame = decoder->buffer + decoder->bufferPosition;
+        if (frameSize == 2)
+        {
+            samples[produced++] = (int16_t)getUint16(frame);
+        }
+        else
+        {
+            samples[produced++] = ((int32_t)(int16_t)getUint16(frame) + (int16_t)getUint16(frame + 2)) >> 1;
+        }
+        decoder->bufferPosition += frameSize;
+    }
+    return produced;
+}
+
+// decodeNibble decodes an IMA-ADPCM code, updating the predictor and
+// the step index, which the caller keeps in locals
+static inline int16_t decodeNibble(uint8_t code, int32_t *predictor, int32_t *stepIndex)
+{
+    int32_t difference = IMA_DECODE_TABLE.differences[*stepIndex][code & 7];
+    int32_t sign = -(int32_t)(code >> 3);
+    int32_t value = *predictor + ((difference ^ sign) - sign);
+    *predictor = value < -32768 ? -32768 : value > 32767 ? 32767 : value;
+    *stepIndex = IMA_DECODE_TABLE.nextIndexes[*stepIndex][code];
+    return *predictor;
+}
+
+// startBlock reads the next IMA-ADPCM block and its header, returning
+// false at the end of the data or if the block is broken
+static bool startBlock(AudioDecoder *decoder)
+{
+    if (decoder->format.dataLength - decoder->position < IMA_BLOCK_HEADER_SIZE ||
+        !fillBuffer(decoder, decoder->format.blockSize))
+    {
+        return false;
+    }
+    if (decoder->buffer[2] > IMA_MAX_STEP_INDEX)
+    {
+        decoder->status = AUDIO_STATUS_BAD_FORMAT;
+        return false;
+    }
+    decoder->predictor = (int16_t)getUint16(decoder->buffer);
+    decoder->stepIndex = decoder->buffer[2];
+    decoder->bufferPosition = IMA_BLOCK_HEADER_SIZE;
+    decoder->blockSample = 1;
+    return true;
+}
+
+// readAdpcm decodes IMA-ADPCM blocks: a header with the first sample,
+// then two samples per byte, low nibble first. The last block may be
+// short. The bytes are decoded whole, with the state in locals, and the
+// state is only saved when a block or the samples asked for run out.
+static size_t readAdpcm(AudioDecoder *decoder, int16_t *samples, size_t count)
+{
+    size_t produced = 0;
+    while (produced < count)
+    {
+        if (decoder->bufferPosition >= decoder->bufferLength)
+        {
+            if (!startBlock(decoder))
+            {
+                break;
+            }
+            samples[produced++] = decoder->predictor;
+            continue;
+        }
+
+        int32_t predictor = decoder->predictor;
+        int32_t stepIndex = decoder->stepIndex;
+        uint16_t position = decoder->bufferPosition;
+        uint16_t length = decoder->bufferLength;
+        const uint8_t *buffer = decoder->buffer;
+
+        // the high nibble left over by the last call
+        if (decoder->blockSample % 2 == 0)
+        {
+            samples[produced++] = decodeNibble(buffer[position++] >> 4, &predictor, &stepIndex);
+        }
+        size_t bytes = (count - produced) / 2;
+        if (bytes > (size_t)(length - position))
+        {
+            bytes = length - position;
+        }
+        for (const uint8_t *end = buffer + position + bytes; buffer + position < end; position++)
+        {
+            uint8_t byte = buffer[position];
+            samples[produced] = decodeNibble(byte & 0x0F, &predictor, &stepIndex);
+            samples[produced + 1] = decodeNibble(byte >> 4, &predictor, &stepIndex);
+            produced += 2;
+        }
+        uint16_t blockSample = 1 + (position - IMA_BLOCK_HEADER_SIZE) * 2;
+        // one more sample asked for: the low nibble of the next byte
+        if (produced < count && position < length)
+        {
+            samples[produced++] = decodeNibble(buffer[position] & 0x0F, &predictor, &stepIndex);
+            blockSample++;
+        }
+
+        decoder->predictor = predictor;
+        decoder->stepIndex = stepIndex;
+        decoder->bufferPosition = position;
+        decoder->blockSample = blockSample;
+    }
+    return produced;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// audioDecoderOpen reads the headers of a WAV file and gets ready to
+// decode it from the start
+AudioStatus audioDecoderOpen(AudioDecoder *decoder, const AudioSource *source)
+{
+    memset(decoder, 0, sizeof(AudioDecoder) - sizeof(decoder->buffer));
+    decoder->source = *source;
+
+    uint8_t header[12];
+    if (!readAt(decoder, 0, header, sizeof(header)))
+    {
+        return decoder->status = source->length < sizeof(header) ? AUDIO_STATUS_NOT_WAV : AUDIO_STATUS_READ_FAILED;
+    }
+    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+    {
+        return decoder->status = AUDIO_STATUS_NOT_WAV;
+    }
+
+    // the chunks are walked through until the data, which must follow the format
+    bool hasFormat = false;
+    uint32_t offset = sizeof(header);
+    while (offset <= source->length && source->length - offset >= 8)
+    {
+        uint8_t chunk[20];
+        if (!readAt(decoder, offset, chunk, 8))
+        {
+            return decoder->status = AUDIO_STATUS_READ_FAILED;
+        }
+        uint32_t size = getUint32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            uint32_t length = size < sizeof(chunk) ? size : sizeof(chunk);
+            if (!readAt(decoder, offset + 8, chunk, length))
+            {
+                return decoder->status = AUDIO_STATUS_READ_FAILED;
+            }
+            AudioStatus status = parseFormat(chunk, size, &decoder->format);
+            if (status != AUDIO_STATUS_OK)
+            {
+                return decoder->status = status;
+            }
+            hasFormat = true;
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            if (!hasFormat)
+            {
+                return decoder->status = AUDIO_STATUS_BAD_FORMAT;
+            }
+            AudioFormat &format = decoder->format;
+            format.dataOffset = offset + 8;
+            format.dataLength = source->length - format.dataOffset < size ? source->length - format.dataOffset : size;
+            if (format.encoding == AUDIO_ENCODING_PCM16)
+            {
+                format.dataLength -= format.dataLength % format.blockSize;
+            }
+            audioDecoderRewind(decoder);
+            return decoder->status = AUDIO_STATUS_OK;
+        }
+        if (size > source->length)
+        {
+            break;
+        }
+        offset += 8 + size + (size & 1);
+    }
+    return decoder->status = AUDIO_STATUS_BAD_FORMAT;
+}
+
+// audioDecoderRewind gets back to the first sample
+void audioDecoderRewind(AudioDecoder *decoder)
+{
+    decoder->position = 0;
+    decoder->bufferLength = 0;
+    decoder->bufferPosition = 0;
+    decoder->blockSample = 0;
+}
+
+// audioDecoderRead decodes up to count mono samples, returning how many.
+// Fewer are returned only at the end of the file, or if it failed, in
+// which case the status tells why. The file is read one block at a time.
+size_t audioDecoderRead(AudioDecoder *decoder, int16_t *samples, size_t count)
+{
+    if (decoder->status != AUDIO_STATUS_OK)
+    {
+        return 0;
+    }
+    if (decoder->format.encoding == AUDIO_ENCODING_IMA_ADPCM)
+    {
+        return readAdpcm(decoder, samples, count);
+    }
+    return readPcm(decoder, samples, count);
+}
+
+// audioApplyGain scales the samples by a gain going linearly from
+// fromGain to toGain over them, so a volume change makes no click
+void audioApplyGain(int16_t *samples, size_t count, uint16_t fromGain, uint16_t toGain)
+{
+    if (count == 0 || (fromGain == AUDIO_GAIN_UNITY && toGain == AUDIO_GAIN_UNITY))
+    {
+        return;
+    }
+
+    // the gain is kept with 8 more bits of precision along the ramp
+    int32_t gain = (int32_t)fromGain << 8;
+    int32_t step = ((int32_t)toGain - fromGain) * 256 / (int32_t)count;
+    for (size_t i = 0; i < count; i++)
+    {
+        gain += step;
+        int32_t value = ((int32_t)samples[i] * (gain >> 8)) >> 15;
+        samples[i] = value < -32768 ? -32768 : value > 32767 ? 32767 : value;
+    }
+}
+
+// audioRampGain returns the gain for the sunrise progress (0 to 65535),
+// growing with its square so the loudness rises about evenly
+uint16_t audioRampGain(uint16_t progress)
+{
+    return ((uint32_t)progress * progress) >> 17;
+}
+
+// audioStreamOpen opens a file to play it, silent until a target gain is set
+AudioStatus audioStreamOpen(AudioStream *stream, const AudioSource *source, bool loop)
+{
+    stream->loop = loop;
+    stream->gain = 0;
+    stream->targetGain = 0;
+    stream->blockLength = 0;
+    stream->written = 0;
+    stream->loops = 0;
+    return audioDecoderOpen(&stream->decoder, source);
+}
+
+// audioStreamPump decodes blocks and hands them to the output until it
+// takes no more; write returns how many samples it took and must not
+// block. Returns false once the file is over, if not looping, or failed.
+bool audioStreamPump(AudioStream *stream, size_t (*write)(const int16_t *samples, size_t count))
+{
+    for (;;)
+    {
+        if (stream->written == stream->blockLength)
+        {
+            size_t length = audioDecoderRead(&stream->decoder, stream->block, AUDIO_BLOCK_SAMPLES);
+            if (length < AUDIO_BLOCK_SAMPLES && stream->loop && stream->decoder.status == AUDIO_STATUS_OK)
+            {
+                audioDecoderRewind(&stream->decoder);
+                stream->loops++;
+                length += audioDecoderRead(&stream->decoder, stream->block + length, AUDIO_BLOCK_SAMPLES - length);
+            }
+            if (length == 0)
+            {
+                return false;
+            }
+            audioApplyGain(stream->block, length, stream->gain, stream->targetGain);
+            stream->gain = stream->targetGain;
+            stream->blockLength = length;
+            stream->written = 0;
+        }
+
+        stream->written += write(stream->block + stream->written, stream->blockLength - stream->written);
+        if (stream->written < stream->blockLength)
+        {
+            return true;
+        }
+    }
+}
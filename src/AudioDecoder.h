@@ -0,0 +1,100 @@
+#ifndef AudioDecoder_h
+#define AudioDecoder_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The audio decoder streams a WAV file, 16 bits PCM (mono or stereo,
+// mixed down to mono) or IMA-ADPCM (mono), from wherever the source reads
+// it, one small block at a time, and an audio stream feeds the decoded
+// samples to an output with a volume ramp. Neither touches the hardware
+// nor allocates memory, so both also run on the host.
+
+// samples decoded at a time, and the largest IMA-ADPCM block supported
+const size_t AUDIO_BLOCK_SAMPLES = 256;
+const size_t AUDIO_MAX_ADPCM_BLOCK_SIZE = 1024;
+
+// gains are in Q15: AUDIO_GAIN_UNITY leaves the samples as they are
+const uint16_t AUDIO_GAIN_UNITY = 0x8000;
+
+enum AudioEncoding : uint8_t
+{
+    AUDIO_ENCODING_PCM16 = 1,
+    AUDIO_ENCODING_IMA_ADPCM = 0x11,
+};
+
+enum AudioStatus : uint8_t
+{
+    AUDIO_STATUS_OK = 0,
+    AUDIO_STATUS_READ_FAILED,
+    AUDIO_STATUS_NOT_WAV,
+    AUDIO_STATUS_UNSUPPORTED,
+    AUDIO_STATUS_BAD_FORMAT,
+};
+
+// AudioSource is where a file is read from: length bytes from offset,
+// through read, which returns how many bytes it read
+struct AudioSource
+{
+    size_t (*read)(uint32_t offset, void *buffer, size_t length);
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct AudioFormat
+{
+    uint8_t encoding;
+    uint8_t channels;
+    uint16_t blockSize;
+    uint16_t samplesPerBlock;
+    uint32_t sampleRate;
+    uint32_t dataOffset;
+    uint32_t dataLength;
+};
+
+// AudioDecoder is the decoding state of a file; the input block being
+// decoded is kept in buffer
+struct AudioDecoder
+{
+    AudioSource source;
+    AudioFormat format;
+    AudioStatus status;
+    uint32_t position;
+    uint16_t bufferLength;
+    uint16_t bufferPosition;
+    int32_t predictor;
+    int8_t stepIndex;
+    uint16_t blockSample;
+    uint8_t buffer[AUDIO_MAX_ADPCM_BLOCK_SIZE];
+};
+
+// AudioStream plays a decoder, looping if asked to. Each block ramps the
+// gain from where the last one ended to targetGain. block holds the last
+// decoded block, of which written samples were taken by the output.
+struct AudioStream
+{
+    AudioDecoder decoder;
+    bool loop;
+    uint16_t gain;
+    uint16_t targetGain;
+    uint16_t blockLength;
+    uint16_t written;
+    uint32_t loops;
+    int16_t block[AUDIO_BLOCK_SAMPLES];
+};
+
+AudioStatus audioDecoderOpen(AudioDecoder *decoder, const AudioSource *source);
+
+void audioDecoderRewind(AudioDecoder *decoder);
+
+size_t audioDecoderRead(AudioDecoder *decoder, int16_t *samples, size_t count);
+
+void audioApplyGain(int16_t *samples, size_t count, uint16_t fromGain, uint16_t toGain);
+
+uint16_t audioRampGain(uint16_t progress);
+
+AudioStatus audioStreamOpen(AudioStream *stream, const AudioSource *source, bool loop);
+
+bool audioStreamPump(AudioStream *stream, size_t (*write)(const int16_t *samples, size_t count));
+
+#endif
@@ -0,0 +1,177 @@
+#include "AudioPlayer.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+#include "AudioDecoder.h"
+#include "Hal.h"
+#include "Logger.h"
+#include "SongStore.h"
+
+// above the render task, on the loop core: a late frame is hardly seen,
+// a late audio buffer is heard
+const uint8_t AUDIO_PLAYER_TASK_PRIORITY = 3;
+
+// the task refills the DMA buffers this many times while they play, so
+// they never run dry
+const uint32_t AUDIO_PLAYER_STEPS_PER_DMA = 4;
+
+enum AudioPlayerState : uint8_t
+{
+  AUDIO_PLAYER_IDLE = 0,
+  AUDIO_PLAYER_PLAYING,
+  AUDIO_PLAYER_STOPPING,
+};
+
+// the stream is set up by audioPlayerStart while idle, then owned by the
+// audio task until it is idle again
+AudioStream playerStream;
+std::atomic<uint8_t> playerState(AUDIO_PLAYER_IDLE);
+std::atomic<uint16_t> playerGain(0);
+bool playerTaskStarted = false;
+
+// owned by the audio task: when the stream went silent while stopping
+uint64_t playerSilentSinceUs = 0;
+bool playerSilent = false;
+
+volatile AudioPlayerStats playerStats;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// finishStop stops the output once the fade out has been played: the
+// stream got to a gain of 0 and the DMA buffers only hold silence
+bool finishStop(uint64_t now)
+{
+  if (playerStream.gain != 0)
+  {
+    return false;
+  }
+  if (!playerSilent)
+  {
+    playerSilent = true;
+    playerSilentSinceUs = now;
+    return false;
+  }
+  return now - playerSilentSinceUs >= playerStats.periodUs * AUDIO_PLAYER_STEPS_PER_DMA;
+}
+
+// playerStep decodes the song into the free DMA buffers; it is the step
+// of the audio task
+void playerStep()
+{
+  uint8_t state = playerState.load(std::memory_order_acquire);
+  if (state == AUDIO_PLAYER_IDLE)
+  {
+    return;
+  }
+
+  uint64_t startedUs = halMicros();
+  playerStream.targetGain = state == AUDIO_PLAYER_STOPPING ? 0 : playerGain.load(std::memory_order_relaxed);
+  bool playing = audioStreamPump(&playerStream, halAudioWrite);
+  if (!playing || (state == AUDIO_PLAYER_STOPPING && finishStop(startedUs)))
+  {
+    halAudioStop();
+    playerStats.status = playerStream.decoder.status;
+    playerState.store(AUDIO_PLAYER_IDLE, std::memory_order_release);
+  }
+
+  uint32_t stepUs = halMicros() - startedUs;
+  playerStats.steps++;
+  playerStats.lastStepUs = stepUs;
+  playerStats.loops = playerStream.loops;
+  if (stepUs > playerStats.maxStepUs)
+  {
+    playerStats.maxStepUs = stepUs;
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// audioPlayerStart plays a song of the song store, over and over, from
+// the audio task. It starts silent: the gain is set by audioPlayerSetGain.
+// Returns false if the song is not found, can not be decoded or the
+// output could not be started.
+bool audioPlayerStart(const char *song)
+{
+  if (playerState.load(std::memory_order_acquire) != AUDIO_PLAYER_IDLE)
+  {
+    LOG_WARNING("a song is already playing\n");
+    return false;
+  }
+
+  SongEntry entry;
+  if (!songStoreFind(song, &entry))
+  {
+    LOG_WARNING("song %s not found\n", song);
+    return false;
+  }
+  AudioSource source = {halSongRead, entry.offset, entry.length};
+  AudioStatus status = audioStreamOpen(&playerStream, &source, true);
+  if (status != AUDIO_STATUS_OK)
+  {
+    LOG_ERROR("song %s can not be played, status %d\n", song, status);
+    return false;
+  }
+  uint32_t sampleRate = playerStream.decoder.format.sampleRate;
+  if (!halAudioBegin(sampleRate))
+  {
+    LOG_ERROR("could not start the audio output\n");
+    return false;
+  }
+
+  // the period is set by the first song played; the songs share a sample rate
+  if (!playerTaskStarted)
+  {
+    uint32_t periodMs = HAL_AUDIO_DMA_BUFFERS * HAL_AUDIO_DMA_SAMPLES * 1000 / sampleRate / AUDIO_PLAYER_STEPS_PER_DMA;
+    if (periodMs == 0)
+    {
+      periodMs = 1;
+    }
+    playerStats.periodUs = periodMs * 1000;
+    playerTaskStarted = halTaskStart("audio", playerStep, periodMs, AUDIO_PLAYER_TASK_PRIORITY, HAL_TASK_LOOP_CORE,
+                                    HAL_TASK_STACK_SIZE);
+    if (!playerTaskStarted)
+    {
+      LOG_ERROR("could not start the audio task\n");
+      halAudioStop();
+      return false;
+    }
+  }
+
+  LOG_TRACE("playing song %s: %u bytes, %u Hz, encoding %d\n", song, entry.length, sampleRate,
+            playerStream.decoder.format.encoding);
+  playerGain.store(0, std::memory_order_relaxed);
+  playerSilent = false;
+  playerState.store(AUDIO_PLAYER_PLAYING, std::memory_order_release);
+  return true;
+}
+
+// audioPlayerSetGain sets the volume, in Q15 (see AudioDecoder.h); the
+// audio task ramps to it over the next block, so it makes no click
+void audioPlayerSetGain(uint16_t gain)
+{
+  playerGain.store(gain, std::memory_order_relaxed);
+}
+
+// audioPlayerStop fades the song out and then stops the output, from the
+// audio task, without waiting for it
+void audioPlayerStop()
+{
+  uint8_t playing = AUDIO_PLAYER_PLAYING;
+  playerState.compare_exchange_strong(playing, AUDIO_PLAYER_STOPPING, std::memory_order_acq_rel);
+}
+
+// audioPlayerGetStats copies the counters of the audio task
+void audioPlayerGetStats(AudioPlayerStats *stats)
+{
+  stats->steps = playerStats.steps;
+  stats->lastStepUs = playerStats.lastStepUs;
+  stats->maxStepUs = playerStats.maxStepUs;
+  stats->periodUs = playerStats.periodUs;
+  stats->loops = playerStats.loops;
+  stats->status = playerStats.status;
+}
@@ -0,0 +1,26 @@
+#ifndef AudioPlayer_h
+#define AudioPlayer_h
+
+#include <stdint.h>
+
+// AudioPlayerStats are the counters of the audio task since the boot.
+// The step times against periodUs show how much of the core it takes.
+struct AudioPlayerStats
+{
+    uint32_t steps;
+    uint32_t lastStepUs;
+    uint32_t maxStepUs;
+    uint32_t periodUs;
+    uint32_t loops;
+    uint8_t status;
+};
+
+bool audioPlayerStart(const char *song);
+
+void audioPlayerSetGain(uint16_t gain);
+
+void audioPlayerStop();
+
+void audioPlayerGetStats(AudioPlayerStats *stats);
+
+#endif
@@ -1,18 +1,86 @@
 #include <BLEServices.h>
 
-#include <ArduinoLog.h>
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEServer.h>
+#include <BLE2902.h>
 
+#include <Energy.h>
 #include <GlobalStatus.h>
+#include <Logger.h>
+
+// largest MTU requested to clients, so a configuration bundle
+// fits in a single write
+const uint16_t BLE_MTU = 517;
+
+BLEStats bleStats = {};
+BLEService *bleService = NULL;
 
 // initCharacteristic initializes a characteristic and assigns it to a service.
+// Characteristics that notify or indicate get the client configuration
+// descriptor (CCCD) clients use to subscribe.
 void initCharacteristic(BLEService *pService, String uuid, uint32_t properties, BLECharacteristicCallbacks *callbacks)
 {
   BLECharacteristic *characteristic = pService->createCharacteristic(uuid.c_str(), properties);
   characteristic->setCallbacks(callbacks);
   characteristic->setValue("");
+
+  if (properties & (BLECharacteristic::PROPERTY_NOTIFY | BLECharacteristic::PROPERTY_INDICATE))
+  {
+    characteristic->addDescriptor(new BLE2902());
+  }
+}
+
+// bleGetCharacteristic returns a characteristic of the started service,
+// or NULL if the service is not started
+BLECharacteristic *bleGetCharacteristic(const char *uuid)
+{
+  if (bleService == NULL)
+  {
+    return NULL;
+  }
+  return bleService->getCharacteristic(uuid);
+}
+
+// bleNotify updates the value of a characteristic and pushes it to the
+// client, as a notification or an indication depending on what the
+// client subscribed to. Returns false if the client is not subscribed.
+bool bleNotify(const char *uuid, String value)
+{
+  return bleNotifyBytes(uuid, (const uint8_t *)value.c_str(), value.length());
+}
+
+// bleNotifyBytes is bleNotify for a binary value
+bool bleNotifyBytes(const char *uuid, const uint8_t *value, size_t length)
+{
+  BLECharacteristic *characteristic = bleGetCharacteristic(uuid);
+  if (characteristic == NULL)
+  {
+    return false;
+  }
+
+  characteristic->setValue((uint8_t *)value, length);
+
+  BLE2902 *cccd = (BLE2902 *)characteristic->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
+  if (cccd == NULL)
+  {
+    return false;
+  }
+  if (cccd->getIndications())
+  {
+    characteristic->indicate();
+  }
+  else if (cccd->getNotifications())
+  {
+    characteristic->notify();
+  }
+  else
+  {
+    return false;
+  }
+
+  bleStats.notificationsSent++;
+  return true;
 }
 
 // startBLE is used to start the BLE server and expose services and characteristics
@@ -21,17 +89,32 @@ void startBLE(String serviceUuid, BLECharacteristicConf confs[], int confsSize)
   if (!globalStatus.isBleInitialized)
   {
 
-    Log.trace("creating ble server\n");
+    LOG_TRACE("creating ble server\n");
     BLEDevice::init(globalStatus.deviceName.c_str());
+    energyRadio(ENERGY_BLE, true);
+    BLEDevice::setMTU(BLE_MTU);
     BLEServer *pServer = BLEDevice::createServer();
 
-    Log.trace("creating ble service %s\n", serviceUuid.c_str());
-    BLEService *pService = pServer->createService(serviceUuid.c_str());
+    // the service declaration takes one handle and each characteristic
+    // two, plus one for the descriptor of the notified ones
+    uint32_t handles = 1;
+    for (int i = 0; i < confsSize; i++)
+    {
+      handles += 2;
+      if (confs[i].properties & (BLECharacteristic::PROPERTY_NOTIFY | BLECharacteristic::PROPERTY_INDICATE))
+      {
+        handles++;
+      }
+    }
 
-    Log.trace("configuring %d ble characteristics\n", confsSize);
+    LOG_TRACE("creating ble service %s with %l handles\n", serviceUuid.c_str(), handles);
+    BLEService *pService = pServer->createService(BLEUUID(serviceUuid.c_str()), handles);
+    bleService = pService;
+
+    LOG_TRACE("configuring %d ble characteristics\n", confsSize);
     for (int i = 0; i < confsSize; i++)
     {
-      Log.trace("configuring characteristic %s\n", confs[i].uuid.c_str());
+      LOG_TRACE("configuring characteristic %s\n", confs[i].uuid.c_str());
       initCharacteristic(
           pService,
           confs[i].uuid,
@@ -39,11 +122,25 @@ void startBLE(String serviceUuid, BLECharacteristicConf confs[], int confsSize)
           confs[i].callbacks);
     }
 
-    Log.trace("starting ble service and advertisements\n");
+    LOG_TRACE("starting ble service and advertisements\n");
     pService->start();
     pServer->getAdvertising()->start();
 
     globalStatus.isBleInitialized = true;
-    Log.trace("listening on bluetooth as [%s]\n", globalStatus.deviceName.c_str());
+    LOG_TRACE("listening on bluetooth as [%s]\n", globalStatus.deviceName.c_str());
+  }
+}
+
+// stopBLE stops the BLE server and turns the radio off; the controller
+// memory is kept, so startBLE can bring it up again
+void stopBLE()
+{
+  if (globalStatus.isBleInitialized)
+  {
+    LOG_TRACE("stopping ble\n");
+    bleService = NULL;
+    BLEDevice::deinit(false);
+    energyRadio(ENERGY_BLE, false);
+    globalStatus.isBleInitialized = false;
   }
 }
@@ -12,8 +12,25 @@ struct BLECharacteristicConf
   BLECharacteristicCallbacks *callbacks;
 };
 
+// BLEStats counts how characteristic values reach the clients
+struct BLEStats
+{
+  uint32_t notificationsSent;
+  uint32_t notificationsCoalesced;
+  uint32_t readsServed;
+};
+
+extern BLEStats bleStats;
+
 void initCharacteristic(BLEService *pService, String uuid, uint32_t properties, BLECharacteristicCallbacks *callbacks);
 
 void startBLE(String serviceUuid, BLECharacteristicConf confs[], int confsSize);
+void stopBLE();
+
+BLECharacteristic *bleGetCharacteristic(const char *uuid);
+
+bool bleNotify(const char *uuid, String value);
+
+bool bleNotifyBytes(const char *uuid, const uint8_t *value, size_t length);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "ConfigBundle.h"
+
+#include <string.h>
+
+#include "AlarmProtocol.h"
+#include "Crc.h"
+
+static const size_t CONFIG_BUNDLE_HEADER_SIZE = 3;
+static const size_t CONFIG_BUNDLE_CRC_SIZE = 4;
+static const size_t CONFIG_FIELD_HEADER_SIZE = 2;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// copyString copies a field value as a C string, failing if it does not
+// fit or has an embedded NUL
+static bool copyString(char *destination, size_t size, const uint8_t *value, uint8_t length)
+{
+    if (length >= size || memchr(value, '\0', length) != NULL)
+    {
+        return false;
+    }
+    memcpy(destination, value, length);
+    destination[length] = '\0';
+    return true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// configBundleReset discards any partially received bundle
+void configBundleReset(ConfigBundleReader *reader)
+{
+    reader->length = 0;
+    reader->nextSequence = 0;
+    reader->active = false;
+}
+
+// configBundleAddChunk appends a chunk to the bundle being received.
+// Returns CONFIG_BUNDLE_IN_PROGRESS until the last chunk arrives and
+// CONFIG_BUNDLE_COMPLETE after it. On error the bundle is discarded
+// and the client must start again from the first chunk.
+ConfigBundleStatus configBundleAddChunk(ConfigBundleReader *reader, const uint8_t *chunk, size_t length)
+{
+    if (length < CONFIG_CHUNK_HEADER_SIZE)
+    {
+        configBundleReset(reader);
+        return CONFIG_BUNDLE_BAD_LENGTH;
+    }
+
+    uint8_t sequence = chunk[0];
+    uint8_t flags = chunk[1];
+    if (flags & CONFIG_CHUNK_FIRST)
+    {
+        configBundleReset(reader);
+        reader->active = true;
+    }
+    if (!reader->active || sequence != reader->nextSequence)
+    {
+        configBundleReset(reader);
+        return CONFIG_BUNDLE_BAD_SEQUENCE;
+    }
+
+    size_t payloadLength = length - CONFIG_CHUNK_HEADER_SIZE;
+    if (reader->length + payloadLength > CONFIG_BUNDLE_MAX_SIZE)
+    {
+        configBundleReset(reader);
+        return CONFIG_BUNDLE_TOO_LARGE;
+    }
+
+    memcpy(reader->buffer + reader->length, chunk + CONFIG_CHUNK_HEADER_SIZE, payloadLength);
+    reader->length += payloadLength;
+    reader->nextSequence++;
+
+    if (flags & CONFIG_CHUNK_LAST)
+    {
+        reader->active = false;
+        return CONFIG_BUNDLE_COMPLETE;
+    }
+    return CONFIG_BUNDLE_IN_PROGRESS;
+}
+
+// configBundleDecode validates a complete bundle as a whole (length,
+// checksum and every field) and decodes it; nothing is decoded unless
+// the whole bundle is valid.
+ConfigBundleStatus configBundleDecode(const ConfigBundleReader *reader, ConfigBundle *bundle)
+{
+    const uint8_t *data = reader->buffer;
+    size_t length = reader->length;
+
+    if (length < CONFIG_BUNDLE_HEADER_SIZE + CONFIG_BUNDLE_CRC_SIZE)
+    {
+        return CONFIG_BUNDLE_BAD_LENGTH;
+    }
+    if (data[0] != CONFIG_BUNDLE_VERSION)
+    {
+        return CONFIG_BUNDLE_UNSUPPORTED_VERSION;
+    }
+
+    size_t fieldsLength = data[1] | (data[2] << 8);
+    if (length != CONFIG_BUNDLE_HEADER_SIZE + fieldsLength + CONFIG_BUNDLE_CRC_SIZE)
+    {
+        return CONFIG_BUNDLE_BAD_LENGTH;
+    }
+
+    const uint8_t *crcBytes = data + CONFIG_BUNDLE_HEADER_SIZE + fieldsLength;
+    uint32_t crc = crcBytes[0] | (crcBytes[1] << 8) | (crcBytes[2] << 16) | ((uint32_t)crcBytes[3] << 24);
+    if (crc != crc32(data, CONFIG_BUNDLE_HEADER_SIZE + fieldsLength))
+    {
+        return CONFIG_BUNDLE_BAD_CRC;
+    }
+
+    memset(bundle, 0, sizeof(ConfigBundle));
+
+    const uint8_t *field = data + CONFIG_BUNDLE_HEADER_SIZE;
+    const uint8_t *end = field + fieldsLength;
+    while (field < end)
+    {
+        if (end - field < (ptrdiff_t)CONFIG_FIELD_HEADER_SIZE || end - field < (ptrdiff_t)(CONFIG_FIELD_HEADER_SIZE + field[1]))
+        {
+            return CONFIG_BUNDLE_BAD_FIELD;
+        }
+
+        uint8_t type = field[0];
+        uint8_t valueLength = field[1];
+        const uint8_t *value = field + CONFIG_FIELD_HEADER_SIZE;
+
+        switch (type)
+        {
+        case CONFIG_FIELD_WIFI_SSID:
+            if (!copyString(bundle->wifiSsid, CONFIG_WIFI_SSID_SIZE, value, valueLength))
+            {
+                return CONFIG_BUNDLE_BAD_FIELD;
+            }
+            bundle->hasWifiSsid = true;
+            break;
+        case CONFIG_FIELD_WIFI_PASSWORD:
+            if (!copyString(bundle->wifiPassword, CONFIG_WIFI_PASSWORD_SIZE, value, valueLength))
+            {
+                return CONFIG_BUNDLE_BAD_FIELD;
+            }
+            bundle->hasWifiPassword = true;
+            break;
+        case CONFIG_FIELD_DEVICE_NAME:
+            if (valueLength == 0 || !copyString(bundle->deviceName, CONFIG_DEVICE_NAME_SIZE, value, valueLength))
+            {
+                return CONFIG_BUNDLE_BAD_FIELD;
+            }
+            bundle->hasDeviceName = true;
+            break;
+        case CONFIG_FIELD_ALARM:
+        {
+            Alarm alarm;
+            if (alarmProtocolParseBinary(value, valueLength, &alarm) != ALARM_STATUS_SUCCESS)
+            {
+                return CONFIG_BUNDLE_INVALID_ALARM;
+            }
+            bundle->alarms[alarm.number - 1] = alarm;
+            bundle->alarmsMask |= 1 << (alarm.number - 1);
+            break;
+        }
+        default:
+            return CONFIG_BUNDLE_BAD_FIELD;
+        }
+
+        field += CONFIG_FIELD_HEADER_SIZE + valueLength;
+    }
+
+    return CONFIG_BUNDLE_COMPLETE;
+}
@@ -0,0 +1,78 @@
+#ifndef ConfigBundle_h
+#define ConfigBundle_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Alarm.h"
+
+// a bundle is sent as a sequence of chunks, each one being:
+// sequence (1) | flags (1) | payload
+const size_t CONFIG_CHUNK_HEADER_SIZE = 2;
+const uint8_t CONFIG_CHUNK_FIRST = 0x01;
+const uint8_t CONFIG_CHUNK_LAST = 0x02;
+
+// the reassembled bundle, little endian:
+// version (1) | length of the fields (2) | fields | crc32 of all the previous bytes (4)
+// where each field is: type (1) | length (1) | value
+const uint8_t CONFIG_BUNDLE_VERSION = 1;
+const size_t CONFIG_BUNDLE_MAX_SIZE = 512;
+
+const size_t CONFIG_WIFI_SSID_SIZE = 33;
+const size_t CONFIG_WIFI_PASSWORD_SIZE = 65;
+const size_t CONFIG_DEVICE_NAME_SIZE = 33;
+
+enum ConfigField : uint8_t
+{
+    CONFIG_FIELD_WIFI_SSID = 1,
+    CONFIG_FIELD_WIFI_PASSWORD = 2,
+    CONFIG_FIELD_DEVICE_NAME = 3,
+    // value is a binary alarm record (see AlarmProtocol.h)
+    CONFIG_FIELD_ALARM = 4,
+};
+
+// ConfigBundleStatus values are reported as the last operation status,
+// after the AlarmStatus values
+enum ConfigBundleStatus : uint8_t
+{
+    CONFIG_BUNDLE_COMPLETE = 0,
+    CONFIG_BUNDLE_IN_PROGRESS = 20,
+    CONFIG_BUNDLE_BAD_SEQUENCE = 21,
+    CONFIG_BUNDLE_TOO_LARGE = 22,
+    CONFIG_BUNDLE_BAD_LENGTH = 23,
+    CONFIG_BUNDLE_BAD_CRC = 24,
+    CONFIG_BUNDLE_UNSUPPORTED_VERSION = 25,
+    CONFIG_BUNDLE_BAD_FIELD = 26,
+    CONFIG_BUNDLE_INVALID_ALARM = 27,
+};
+
+// ConfigBundleReader reassembles the chunks of a bundle in a fixed buffer
+struct ConfigBundleReader
+{
+    uint8_t buffer[CONFIG_BUNDLE_MAX_SIZE];
+    uint16_t length;
+    uint8_t nextSequence;
+    bool active;
+};
+
+// ConfigBundle is a validated configuration; only the fields flagged
+// as present must be changed
+struct ConfigBundle
+{
+    bool hasWifiSsid;
+    bool hasWifiPassword;
+    bool hasDeviceName;
+    uint8_t alarmsMask;
+    char wifiSsid[CONFIG_WIFI_SSID_SIZE];
+    char wifiPassword[CONFIG_WIFI_PASSWORD_SIZE];
+    char deviceName[CONFIG_DEVICE_NAME_SIZE];
+    Alarm alarms[MAX_ALARMS];
+};
+
+void configBundleReset(ConfigBundleReader *reader);
+
+ConfigBundleStatus configBundleAddChunk(ConfigBundleReader *reader, const uint8_t *chunk, size_t length);
+
+ConfigBundleStatus configBundleDecode(const ConfigBundleReader *reader, ConfigBundle *bundle);
+
+#endif
@@ -0,0 +1,758 @@
+#include "ConfigurationBLE.h"
+
+#include <Arduino.h>
+#include <BLEDevice.h>
+#include <BLEUtils.h>
+#include <BLEServer.h>
+#include <Ticker.h>
+#include <atomic>
+
+#include "AlarmProtocol.h"
+#include "ConfigBundle.h"
+#include "ConfigurationCommit.h"
+#include "ConfigurationHttp.h"
+#include "Energy.h"
+#include "Events.h"
+#include "FirmwareUpdate.h"
+#include "GlobalStatus.h"
+#include "Logger.h"
+#include "BLEServices.h"
+#include "Profiler.h"
+#include "SensorSampler.h"
+#include "SongTransfer.h"
+#include "SyncState.h"
+#include "TimeKeeper.h"
+#include "WifiServices.h"
+#include "Settings.h"
+
+#define CONFIGURATION_SERVICE_UUID "208cf64a-e85b-4f7e-9653-83aeb1c117c9"
+#define WIFI_SET_SSID_CHARACTERISTIC_UUID "cc0bd427-c9c3-43b0-a7c6-2df108b2b7c4"
+#define WIFI_SET_PASSWORD_CHARACTERISTIC_UUID "9200f537-e530-4f2a-b446-a5db5f3fc82f"
+#define WIFI_INIT_CHARACTERISTIC_UUID "b98d1c2c-cca5-44ee-b7d2-11e79a6b192e"
+#define WIFI_STATUS_CHARACTERISTIC_UUID "db041866-4f73-4e78-be6f-59ab4152b2a1"
+#define ALARM_SET_CHARACTERISTIC_UUID "34adb56d-e9fd-4892-816f-f3c31f1d0d98"
+#define LAST_OPERATION_STATUS_CHARACTERISTIC_UUID "d5821d4f-17b5-4c3a-b46c-d7fa23cb78f6"
+#define GO_TO_SLEEP_CHARACTERISTIC_UUID "9501faf3-b697-40de-ad74-0a10f5e2de2c"
+#define CONFIG_BUNDLE_CHARACTERISTIC_UUID "ad71bf8b-5adf-4518-a180-05acef47dc32"
+#define PROFILE_TRACE_CHARACTERISTIC_UUID "b973e365-c275-4912-8c73-ea46502d836b"
+#define ENERGY_TOTALS_CHARACTERISTIC_UUID "6f576422-589a-4c8d-85bd-48603c323a97"
+#define SENSOR_HISTORY_CHARACTERISTIC_UUID "b25e09ab-2f09-4a29-a1a0-c47d916ebc60"
+#define SONG_TRANSFER_CONTROL_CHARACTERISTIC_UUID "1c79393f-a560-4577-a7f0-a207489be40d"
+#define SONG_TRANSFER_DATA_CHARACTERISTIC_UUID "000273a8-38ce-400b-9269-53ab280fd339"
+#define FIRMWARE_UPDATE_CONTROL_CHARACTERISTIC_UUID "697a9e2d-61b4-4a9b-a2c6-1ffbfa660df2"
+#define FIRMWARE_UPDATE_DATA_CHARACTERISTIC_UUID "83625a64-32d5-40ca-855e-6d1fdb274f70"
+#define TIME_ZONE_CHARACTERISTIC_UUID "70c51b65-87e5-4ea5-9b9f-767084128fdb"
+#define HOUSEHOLD_SYNC_CHARACTERISTIC_UUID "de8762d3-fafc-4beb-a762-1353a2df078b"
+#define HTTP_TOKEN_CHARACTERISTIC_UUID "4f0c7a9e-3b6d-4e21-9c58-d1a7e2b36f04"
+
+// how long status changes are collected before being notified, in milliseconds
+const uint32_t NOTIFICATION_COALESCE_MS = 50;
+
+// how long the device waits after activating new firmware before
+// restarting into it, so the client gets the notification
+const uint32_t FIRMWARE_RESTART_DELAY_MS = 1000;
+
+// alarm errors are reported with their AlarmStatus value
+const uint8_t LAST_OPERATION_STATUS_SUCCESS = 0;
+
+// the last operation status as text, a number of up to 3 digits
+const size_t LAST_OPERATION_STATUS_SIZE = 4;
+
+/* ========================================================================= 
+   Definitions
+   ========================================================================= */
+
+void saveAlarm(const uint8_t *value, size_t length);
+
+uint8_t commitConfigBundle();
+
+ConfigBundleReader configBundleReader = {};
+ConfigurationChange configChange = {};
+// the changes of a single alarm or of the time zone, each only used by
+// its BLE callback
+ConfigurationChange alarmChange = {};
+ConfigurationChange timeZoneChange = {};
+// the wifi credentials written to their characteristics, until the wifi
+// init one stores them; only used by the BLE callbacks
+ConfigurationChange wifiCredentials = {};
+SongTransfer songTransfer = {};
+FirmwareUpdate firmwareUpdate = {};
+
+Ticker notificationTicker;
+Ticker restartTicker;
+std::atomic<bool> notificationScheduled(false);
+std::atomic<bool> lastOperationStatusChanged(false);
+std::atomic<bool> wifiStatusChanged(false);
+// set by the data callback once the header of the patch is in, cleared by
+// the loop task when the update is prepared (see updateFirmware)
+std::atomic<bool> firmwareUpdatePreparing(false);
+
+// set by the BLE callbacks, the loop task and the timer tasks, so only
+// copied in or out under lastOperationStatusLock
+char lastOperationStatus[LAST_OPERATION_STATUS_SIZE] = "";
+portMUX_TYPE lastOperationStatusLock = portMUX_INITIALIZER_UNLOCKED;
+
+/* ========================================================================= 
+   Private functions 
+   ========================================================================= */
+
+// copyLastOperationStatus copies the last operation status out
+void copyLastOperationStatus(char status[LAST_OPERATION_STATUS_SIZE])
+{
+  portENTER_CRITICAL(&lastOperationStatusLock);
+  memcpy(status, lastOperationStatus, LAST_OPERATION_STATUS_SIZE);
+  portEXIT_CRITICAL(&lastOperationStatusLock);
+}
+
+// flushNotifications pushes the statuses changed since the last flush
+// to the subscribed clients; a change made while it runs schedules the
+// next flush
+void flushNotifications()
+{
+  notificationScheduled.store(false);
+
+  if (lastOperationStatusChanged.exchange(false))
+  {
+    char status[LAST_OPERATION_STATUS_SIZE];
+    copyLastOperationStatus(status);
+    bleNotifyBytes(LAST_OPERATION_STATUS_CHARACTERISTIC_UUID, (const uint8_t *)status, strlen(status));
+  }
+
+  if (wifiStatusChanged.exchange(false))
+  {
+    bleNotify(WIFI_STATUS_CHARACTERISTIC_UUID, getVerboseWifiStatus());
+  }
+
+  LOG_VERBOSE("ble notifications sent: %l, coalesced: %l, reads served: %l\n",
+              bleStats.notificationsSent, bleStats.notificationsCoalesced, bleStats.readsServed);
+}
+
+// scheduleNotifications flushes the changed statuses after a short delay,
+// so a burst of changes results in a single notification per status
+void scheduleNotifications()
+{
+  bool scheduled = false;
+  if (!notificationScheduled.compare_exchange_strong(scheduled, true))
+  {
+    bleStats.notificationsCoalesced++;
+    return;
+  }
+  notificationTicker.once_ms(NOTIFICATION_COALESCE_MS, flushNotifications);
+}
+
+// setLastOperationStatus sets the last operation status and notifies it
+void setLastOperationStatus(uint8_t status)
+{
+  char text[LAST_OPERATION_STATUS_SIZE];
+  snprintf(text, sizeof(text), "%u", status);
+  portENTER_CRITICAL(&lastOperationStatusLock);
+  memcpy(lastOperationStatus, text, LAST_OPERATION_STATUS_SIZE);
+  portEXIT_CRITICAL(&lastOperationStatusLock);
+  lastOperationStatusChanged.store(true);
+  scheduleNotifications();
+}
+
+// onWifiStatusChanged notifies the wifi status when the connection changes
+void onWifiStatusChanged()
+{
+  wifiStatusChanged.store(true);
+  scheduleNotifications();
+}
+
+// LastOperationStatusBLEConfCallback handles last operation status fetch ble command
+class LastOperationStatusBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    char status[LAST_OPERATION_STATUS_SIZE];
+    copyLastOperationStatus(status);
+    pCharacteristic->setValue(status);
+    LOG_TRACE("returning last operation status: %s\n", status);
+  }
+};
+
+// AlarmSetBLEConfCallback handles alarm set ble command
+class AlarmSetBLEConfCallback : public BLECharacteristicCallbacks
+{
+
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+    auto value = pCharacteristic->getValue();
+
+    LOG_TRACE("setting alarm (%d bytes)\n", value.length());
+    saveAlarm((const uint8_t *)value.c_str(), value.length());
+  }
+};
+
+// WifiSetSsidBLEConfCallback handles wifi ssid set ble command
+class WifiSetSsidBLEConfCallback : public BLECharacteristicCallbacks
+{
+
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+    String value = pCharacteristic->getValue().c_str();
+
+    LOG_TRACE("setting wifi ssid to %s\n", value.c_str());
+    wifiCredentials.fields.hasWifiSsid = true;
+    strlcpy(wifiCredentials.fields.wifiSsid, value.c_str(), CONFIG_WIFI_SSID_SIZE);
+  }
+
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    String ssid = wifiCredentials.fields.hasWifiSsid ? String(wifiCredentials.fields.wifiSsid) : settingsGetWifiSsid();
+    pCharacteristic->setValue(ssid.c_str());
+    LOG_VERBOSE("returning wifi ssid: %s\n", ssid.c_str());
+  }
+};
+
+// WifiResetBLEConfCallback handles wifi reset ble command
+class WifiResetBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+    String value = pCharacteristic->getValue().c_str();
+
+    LOG_TRACE("saving wifi credentials to persistent settings...\n");
+    uint8_t status = configurationCommit(&wifiCredentials);
+    if (status != ALARM_STATUS_SUCCESS)
+    {
+      LOG_ERROR("could not save the wifi credentials\n");
+      setLastOperationStatus(status);
+      return;
+    }
+
+    LOG_TRACE("connecting to wifi...\n");
+    requestWifiReconnect();
+  }
+};
+
+// WifiSetPasswordBLEConfCallback handles set wifi password ble command
+class WifiSetPasswordBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+    String value = pCharacteristic->getValue().c_str();
+
+    LOG_TRACE("setting wifi password to %s\n", value.c_str());
+    wifiCredentials.fields.hasWifiPassword = true;
+    strlcpy(wifiCredentials.fields.wifiPassword, value.c_str(), CONFIG_WIFI_PASSWORD_SIZE);
+  }
+
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    String password = wifiCredentials.fields.hasWifiPassword ? String(wifiCredentials.fields.wifiPassword)
+                                                              : settingsGetWifiPassword();
+    pCharacteristic->setValue(password.c_str());
+    LOG_VERBOSE("returning wifi password: %s\n", password.c_str());
+  }
+};
+
+// GoToSleepBLEConfCallback handles go to sleep ble command
+class GoToSleepBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    LOG_NOTICE("entering sleep mode\n");
+    eventsPost(EVENT_GO_TO_SLEEP);
+  }
+};
+
+// ProfileTraceBLEConfCallback handles the boot and wake profile fetch ble command,
+// returning the records kept in RTC memory (see Profiler.h)
+class ProfileTraceBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    uint8_t trace[PROFILE_TRACE_ENCODED_SIZE];
+    size_t length = profilerEncode(trace, sizeof(trace));
+    pCharacteristic->setValue(trace, length);
+    LOG_TRACE("returning profile trace (%d bytes)\n", length);
+  }
+};
+
+// EnergyTotalsBLEConfCallback handles the energy totals fetch ble command
+// (see Energy.h)
+class EnergyTotalsBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    uint8_t totals[ENERGY_TOTALS_ENCODED_SIZE];
+    size_t length = energyEncode(totals, sizeof(totals));
+    pCharacteristic->setValue(totals, length);
+    LOG_TRACE("returning energy totals (%d bytes)\n", length);
+  }
+};
+
+// SensorHistoryBLEConfCallback handles the sensor history fetch ble
+// command, all of it in one read (see SensorSampler.h)
+class SensorHistoryBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    uint8_t history[SENSOR_HISTORY_ENCODED_SIZE];
+    size_t length = sensorSamplerEncodeHistory(history, sizeof(history));
+    pCharacteristic->setValue(history, length);
+    LOG_TRACE("returning sensor history (%d bytes)\n", length);
+  }
+};
+
+// WifiStatusBLEConfCallback handles wifi status fetch ble command
+class WifiStatusBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    String wifiStatus = getVerboseWifiStatus();
+    pCharacteristic->setValue(wifiStatus.c_str());
+    LOG_TRACE("returning wifi status: %s\n", wifiStatus.c_str());
+  }
+};
+
+// ConfigBundleBLEConfCallback handles the chunks of a configuration bundle,
+// committing the whole configuration once the last chunk is received.
+// The last operation status is a ConfigBundleStatus or, if the alarms
+// could not be saved, ALARM_STATUS_NOT_SAVED.
+class ConfigBundleBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    auto value = pCharacteristic->getValue();
+
+    uint8_t status = configBundleAddChunk(&configBundleReader, (const uint8_t *)value.c_str(), value.length());
+    if (status == CONFIG_BUNDLE_COMPLETE)
+    {
+      status = commitConfigBundle();
+    }
+    else if (status != CONFIG_BUNDLE_IN_PROGRESS)
+    {
+      LOG_ERROR("invalid configuration bundle chunk (error %d)\n", status);
+    }
+
+    setLastOperationStatus(status);
+  }
+};
+
+// notifySongTransfer sends an acknowledgement of the song transfer; a
+// transfer that ended is also reported as the last operation status
+void notifySongTransfer(const SongTransferAck &ack)
+{
+  uint8_t value[SONG_TRANSFER_ACK_SIZE];
+  bleNotifyBytes(SONG_TRANSFER_CONTROL_CHARACTERISTIC_UUID, value, songTransferEncodeAck(&ack, value, sizeof(value)));
+  if (ack.status == SONG_TRANSFER_IN_PROGRESS)
+  {
+    return;
+  }
+  if (ack.status == SONG_TRANSFER_COMPLETE)
+  {
+    LOG_TRACE("song saved, %u chunks, %u out of order, %u duplicates, %u broken\n", songTransfer.stats.chunks,
+              songTransfer.stats.outOfOrder, songTransfer.stats.duplicates, songTransfer.stats.badChunks);
+  }
+  else
+  {
+    LOG_ERROR("song transfer ended (error %d)\n", ack.status);
+  }
+  setLastOperationStatus(ack.status);
+}
+
+// SongTransferControlBLEConfCallback opens, resumes or cancels a song
+// transfer; the acknowledgements are notified on this characteristic
+class SongTransferControlBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    auto value = pCharacteristic->getValue();
+
+    SongTransferAck ack;
+    songTransferCommand(&songTransfer, (const uint8_t *)value.c_str(), value.length(), &ack);
+    LOG_TRACE("song transfer command %d: status %d, next chunk %d\n", value.length() > 0 ? value[0] : 0, ack.status,
+              ack.next);
+    notifySongTransfer(ack);
+  }
+};
+
+// SongTransferDataBLEConfCallback writes the chunks of a song to the
+// flash as they arrive (see SongTransfer.h)
+class SongTransferDataBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    auto value = pCharacteristic->getValue();
+
+    SongTransferAck ack;
+    if (songTransferWrite(&songTransfer, (const uint8_t *)value.c_str(), value.length(), &ack))
+    {
+      notifySongTransfer(ack);
+    }
+  }
+};
+
+// restartDevice boots the firmware just activated
+void restartDevice()
+{
+  ESP.restart();
+}
+
+// notifyFirmwareUpdate sends the status of the firmware update; an update
+// that ended is also reported as the last operation status, and once the
+// new firmware is activated the device restarts into it
+void notifyFirmwareUpdate(const FirmwareUpdateAck &ack)
+{
+  uint8_t value[FIRMWARE_UPDATE_ACK_SIZE];
+  bleNotifyBytes(FIRMWARE_UPDATE_CONTROL_CHARACTERISTIC_UUID, value, firmwareUpdateEncodeAck(&ack, value, sizeof(value)));
+  if (ack.status == FIRMWARE_UPDATE_IN_PROGRESS || ack.status == FIRMWARE_UPDATE_PREPARING)
+  {
+    return;
+  }
+  setLastOperationStatus(ack.status);
+  if (ack.status != FIRMWARE_UPDATE_ACTIVATED)
+  {
+    LOG_ERROR("firmware update ended (error %d) after %u bytes\n", ack.status, ack.received);
+    return;
+  }
+  LOG_NOTICE("new firmware activated, restarting\n");
+  settingsFlush();
+  restartTicker.once_ms(FIRMWARE_RESTART_DELAY_MS, restartDevice);
+}
+
+// FirmwareUpdateControlBLEConfCallback opens, resumes or cancels a
+// firmware update; its status is notified on this characteristic
+class FirmwareUpdateControlBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    auto value = pCharacteristic->getValue();
+
+    FirmwareUpdateAck ack;
+    // the loop task owns the update until it is prepared
+    if (firmwareUpdatePreparing)
+    {
+      ack = {FIRMWARE_UPDATE_PREPARING, 0};
+      notifyFirmwareUpdate(ack);
+      return;
+    }
+    firmwareUpdateCommand(&firmwareUpdate, (const uint8_t *)value.c_str(), value.length(), &ack);
+    LOG_TRACE("firmware update command %d: status %d, %u bytes received\n", value.length() > 0 ? value[0] : 0,
+              ack.status, ack.received);
+    notifyFirmwareUpdate(ack);
+  }
+};
+
+// FirmwareUpdateDataBLEConfCallback applies the pieces of the patch as
+// they arrive (see FirmwareUpdate.h); once the header is in, the loop task
+// prepares the update and the writes are dropped until it is done
+class FirmwareUpdateDataBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    if (firmwareUpdatePreparing)
+    {
+      return;
+    }
+    auto value = pCharacteristic->getValue();
+
+    FirmwareUpdateAck ack;
+    if (!firmwareUpdateWrite(&firmwareUpdate, (const uint8_t *)value.c_str(), value.length(), &ack))
+    {
+      return;
+    }
+    if (ack.status == FIRMWARE_UPDATE_PREPARING)
+    {
+      firmwareUpdatePreparing = true;
+      eventsPost(EVENT_FIRMWARE_WORK);
+    }
+    notifyFirmwareUpdate(ack);
+  }
+};
+
+// TimeZoneBLEConfCallback handles the time zone set and fetch ble command:
+// the POSIX TZ rule of the zone the alarm times are in (see TimeZone.h),
+// e.g. "WET0WEST,M3.5.0/1,M10.5.0"; an empty rule is UTC.
+// The last operation status is a TimeZoneStatus or, if the time zone
+// could not be saved, ALARM_STATUS_NOT_SAVED, and nothing changed.
+class TimeZoneBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    String rule = pCharacteristic->getValue().c_str();
+    if (rule.length() >= TIME_ZONE_RULE_SIZE)
+    {
+      LOG_ERROR("time zone rule too long\n");
+      setLastOperationStatus(TIME_ZONE_RULE_TOO_LONG);
+      return;
+    }
+
+    memset(&timeZoneChange, 0, sizeof(ConfigurationChange));
+    timeZoneChange.hasTimeZone = true;
+    strlcpy(timeZoneChange.timeZone, rule.c_str(), TIME_ZONE_RULE_SIZE);
+    uint8_t status = configurationCommit(&timeZoneChange);
+    if (status != ALARM_STATUS_SUCCESS)
+    {
+      setLastOperationStatus(status);
+      return;
+    }
+    LOG_TRACE("time zone set to %s\n", rule.c_str());
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+  }
+
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    String rule = settingsGetTimeZoneRule();
+    pCharacteristic->setValue(rule.c_str());
+    LOG_VERBOSE("returning time zone: %s\n", rule.c_str());
+  }
+};
+
+// parseHouseholdKey reads the key of the household from its hex digits,
+// returning false if they are not HOUSEHOLD_SYNC_KEY_SIZE bytes of them
+bool parseHouseholdKey(const char *hex, uint8_t key[HOUSEHOLD_SYNC_KEY_SIZE])
+{
+  if (strlen(hex) != 2 * HOUSEHOLD_SYNC_KEY_SIZE)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < 2 * HOUSEHOLD_SYNC_KEY_SIZE; i++)
+  {
+    char c = hex[i];
+    uint8_t digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 16;
+    if (digit == 16)
+    {
+      return false;
+    }
+    key[i / 2] = i % 2 == 0 ? digit << 4 : key[i / 2] | digit;
+  }
+  return true;
+}
+
+// HouseholdSyncBLEConfCallback handles the household sync set and fetch
+// ble command: "1:" and the key of the household, 64 hex digits the phone
+// writes to every unit of it, keeps the alarms and the time zone in sync
+// with the other units on the same wifi network (see HouseholdSync.h);
+// "1" alone turns it on again with the key set before, and "0" stops.
+// The key is never read back.
+class HouseholdSyncBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    String value = pCharacteristic->getValue().c_str();
+    uint8_t key[HOUSEHOLD_SYNC_KEY_SIZE];
+    bool hasKey = value.startsWith("1:") && parseHouseholdKey(value.c_str() + 2, key);
+    bool enabled = value == "1" || hasKey;
+    if (value != "0" && !enabled)
+    {
+      LOG_ERROR("invalid household sync value\n");
+      setLastOperationStatus(ALARM_STATUS_INVALID_FIELDS);
+      return;
+    }
+    settingsBeginChange();
+    if (!syncStateEnable(enabled, hasKey ? key : NULL))
+    {
+      settingsCancelChange();
+      LOG_ERROR("no household key to sync with\n");
+      setLastOperationStatus(ALARM_STATUS_INVALID_FIELDS);
+      return;
+    }
+    if (!settingsCommitChange())
+    {
+      LOG_ERROR("could not save the household sync\n");
+      setLastOperationStatus(ALARM_STATUS_NOT_SAVED);
+      return;
+    }
+    LOG_TRACE("household sync %s\n", enabled ? "on" : "off");
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+  }
+
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    HouseholdSync sync;
+    settingsGetHouseholdSync(&sync);
+    pCharacteristic->setValue(sync.enabled ? "1" : "0");
+  }
+};
+
+// HttpTokenBLEConfCallback handles the http token set and fetch ble
+// command: the token the configuration changes by HTTP must carry (see
+// ConfigurationHttp.cpp), up to 64 characters; while it is empty, as
+// until it is first set, they are all refused.
+class HttpTokenBLEConfCallback : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    String token = pCharacteristic->getValue().c_str();
+    if (token.length() >= CONFIGURATION_HTTP_TOKEN_SIZE)
+    {
+      LOG_ERROR("http token too long\n");
+      setLastOperationStatus(ALARM_STATUS_INVALID_FIELDS);
+      return;
+    }
+    if (!settingsSaveHttpToken(token) || !settingsFlush())
+    {
+      LOG_ERROR("could not save the http token\n");
+      setLastOperationStatus(ALARM_STATUS_NOT_SAVED);
+      return;
+    }
+    LOG_TRACE("configuration changes by http %s\n", token.length() > 0 ? "allowed" : "refused");
+    setLastOperationStatus(LAST_OPERATION_STATUS_SUCCESS);
+  }
+
+  void onRead(BLECharacteristic *pCharacteristic)
+  {
+    bleStats.readsServed++;
+    pCharacteristic->setValue(settingsGetHttpToken().c_str());
+  }
+};
+
+// commitConfigBundle validates the received bundle and stores all its
+// fields; nothing is stored if any field is invalid. The alarms in the
+// bundle replace theirs, the others are kept.
+uint8_t commitConfigBundle()
+{
+  memset(&configChange, 0, sizeof(ConfigurationChange));
+  ConfigBundleStatus status = configBundleDecode(&configBundleReader, &configChange.fields);
+  configBundleReset(&configBundleReader);
+  if (status != CONFIG_BUNDLE_COMPLETE)
+  {
+    LOG_ERROR("invalid configuration bundle (error %d)\n", status);
+    return status;
+  }
+
+  uint8_t saved = configurationCommit(&configChange);
+  if (saved != ALARM_STATUS_SUCCESS)
+  {
+    LOG_ERROR("could not save the configuration bundle\n");
+    return saved;
+  }
+  LOG_TRACE("configuration bundle saved\n");
+
+  if (configChange.fields.hasWifiSsid || configChange.fields.hasWifiPassword)
+  {
+    requestWifiReconnect();
+  }
+  return CONFIG_BUNDLE_COMPLETE;
+}
+
+// saveAlarm parses and saves an alarm received by BLE, as a change of
+// the configuration: nothing changed if it could not be saved.
+// The value must be a binary alarm record (see AlarmProtocol.h) or,
+// for older clients, in the following format:
+// alarm number,time in seconds since the start of the day,song,active days
+void saveAlarm(const uint8_t *value, size_t length)
+{
+  Alarm alarm;
+  AlarmStatus status = alarmProtocolParse(value, length, &alarm);
+  if (status != ALARM_STATUS_SUCCESS)
+  {
+    LOG_ERROR("invalid value to set the alarm (error %d)\n", status);
+    setLastOperationStatus(status);
+    return;
+  }
+
+  memset(&alarmChange, 0, sizeof(ConfigurationChange));
+  alarmChange.fields.alarms[alarm.number - 1] = alarm;
+  alarmChange.fields.alarmsMask = 1 << (alarm.number - 1);
+  uint8_t saved = configurationCommit(&alarmChange);
+  if (saved != ALARM_STATUS_SUCCESS)
+  {
+    LOG_ERROR("could not save timer\n");
+    setLastOperationStatus(saved);
+    return;
+  }
+  LOG_TRACE("alarm saved: %d %l %s %d\n", alarm.number, alarm.when, alarm.song, alarm.activeMatrix);
+}
+
+// the callbacks of the characteristics, kept for as long as the firmware
+// runs, as the BLE stack is started again on every configuration state
+WifiSetSsidBLEConfCallback wifiSetSsidCallback;
+WifiSetPasswordBLEConfCallback wifiSetPasswordCallback;
+WifiResetBLEConfCallback wifiResetCallback;
+WifiStatusBLEConfCallback wifiStatusReadCallback;
+AlarmSetBLEConfCallback alarmSetCallback;
+LastOperationStatusBLEConfCallback lastOperationStatusCallback;
+GoToSleepBLEConfCallback goToSleepCallback;
+ConfigBundleBLEConfCallback configBundleCallback;
+ProfileTraceBLEConfCallback profileTraceCallback;
+EnergyTotalsBLEConfCallback energyTotalsCallback;
+SensorHistoryBLEConfCallback sensorHistoryCallback;
+SongTransferControlBLEConfCallback songTransferControlCallback;
+SongTransferDataBLEConfCallback songTransferDataCallback;
+FirmwareUpdateControlBLEConfCallback firmwareUpdateControlCallback;
+FirmwareUpdateDataBLEConfCallback firmwareUpdateDataCallback;
+TimeZoneBLEConfCallback timeZoneCallback;
+HouseholdSyncBLEConfCallback householdSyncCallback;
+HttpTokenBLEConfCallback httpTokenCallback;
+
+/* ========================================================================= 
+   Public functions 
+   ========================================================================= */
+
+// initBLE starts BLE services for the configuration state, once: it does
+// nothing while they are up.
+void initBLE()
+{
+  if (globalStatus.isBleInitialized)
+  {
+    return;
+  }
+  setWifiStatusCallback(onWifiStatusChanged);
+
+  BLECharacteristicConf confs[] = {
+      {WIFI_SET_SSID_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE, &wifiSetSsidCallback},
+      {WIFI_SET_PASSWORD_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE, &wifiSetPasswordCallback},
+      {WIFI_INIT_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE, &wifiResetCallback},
+      {WIFI_STATUS_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY | BLECharacteristic::PROPERTY_INDICATE, &wifiStatusReadCallback},
+      {ALARM_SET_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE, &alarmSetCallback},
+      {LAST_OPERATION_STATUS_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY | BLECharacteristic::PROPERTY_INDICATE, &lastOperationStatusCallback},
+      {GO_TO_SLEEP_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE, &goToSleepCallback},
+      {CONFIG_BUNDLE_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR, &configBundleCallback},
+      {PROFILE_TRACE_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ, &profileTraceCallback},
+      {ENERGY_TOTALS_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ, &energyTotalsCallback},
+      {SENSOR_HISTORY_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ, &sensorHistoryCallback},
+      {SONG_TRANSFER_CONTROL_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY, &songTransferControlCallback},
+      {SONG_TRANSFER_DATA_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE_NR, &songTransferDataCallback},
+      {FIRMWARE_UPDATE_CONTROL_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY, &firmwareUpdateControlCallback},
+      {FIRMWARE_UPDATE_DATA_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_WRITE, &firmwareUpdateDataCallback},
+      {TIME_ZONE_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE, &timeZoneCallback},
+      {HOUSEHOLD_SYNC_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE, &householdSyncCallback},
+      {HTTP_TOKEN_CHARACTERISTIC_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE, &httpTokenCallback}};
+
+  startBLE(CONFIGURATION_SERVICE_UUID, confs, sizeof(confs) / sizeof(BLECharacteristicConf));
+}
+
+// updateFirmware prepares the firmware update the data callback left, in
+// the loop task, on EVENT_FIRMWARE_WORK: the new image is started and the
+// running one hashed, which takes seconds of flash work the BLE callbacks
+// must not block on
+void updateFirmware()
+{
+  if (!firmwareUpdatePreparing)
+  {
+    return;
+  }
+  FirmwareUpdateAck ack;
+  bool due = firmwareUpdatePrepare(&firmwareUpdate, &ack);
+  firmwareUpdatePreparing = false;
+  if (due)
+  {
+    LOG_TRACE("firmware update prepared: status %d\n", ack.status);
+    notifyFirmwareUpdate(ack);
+  }
+}
+
+// deinitBLE stops the BLE services of the configuration state and the
+// radio; nothing is notified until initBLE starts them again.
+void deinitBLE()
+{
+  setWifiStatusCallback(NULL);
+  stopBLE();
+}
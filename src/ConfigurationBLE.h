@@ -0,0 +1,8 @@
+#ifndef ConfigurationBLE_h
+#define ConfigurationBLE_h
+
+void initBLE();
+void deinitBLE();
+void updateFirmware();
+
+#endif
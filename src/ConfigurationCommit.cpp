@@ -0,0 +1,98 @@
+#include "ConfigurationCommit.h"
+
+#include <Arduino.h>
+
+#include "AlarmProtocol.h"
+#include "Events.h"
+#include "Logger.h"
+#include "Settings.h"
+#include "SyncState.h"
+#include "TimeKeeper.h"
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// applyConfigurationChange makes the change in the settings, returning
+// the first error. The time zone goes first: it is only known to be valid
+// once compiled. The household sync is only turned on with the key of
+// the household, which is set over BLE.
+uint8_t applyConfigurationChange(const ConfigurationChange *change)
+{
+  const ConfigBundle *fields = &change->fields;
+  if (change->hasTimeZone)
+  {
+    uint16_t firstYear = timeKeeperIsValid() ? timeZoneYear(timeKeeperNow()) : TIME_ZONE_DEFAULT_FIRST_YEAR;
+    TimeZoneStatus status = settingsSaveTimeZone(change->timeZone, firstYear);
+    if (status != TIME_ZONE_SUCCESS)
+    {
+      LOG_ERROR("invalid time zone %s (error %d)\n", change->timeZone, status);
+      return status;
+    }
+  }
+
+  if (change->hasHouseholdSync && !syncStateEnable(change->householdSync, NULL))
+  {
+    LOG_ERROR("no household key to sync with\n");
+    return ALARM_STATUS_INVALID_FIELDS;
+  }
+
+  if (change->replaceAlarms || fields->alarmsMask != 0)
+  {
+    AlarmTable table;
+    settingsGetAlarmTable(&table);
+    for (int i = 0; i < MAX_ALARMS; i++)
+    {
+      if (fields->alarmsMask & (1 << i))
+      {
+        table.alarms[i] = fields->alarms[i];
+      }
+      else if (change->replaceAlarms)
+      {
+        memset(&table.alarms[i], 0, sizeof(Alarm));
+      }
+    }
+    if (!settingsSaveAlarmTable(&table))
+    {
+      LOG_ERROR("could not save alarms\n");
+      return ALARM_STATUS_NOT_SAVED;
+    }
+  }
+
+  if ((fields->hasDeviceName && !settingsSaveDeviceName(fields->deviceName)) ||
+      (fields->hasWifiSsid && !settingsSaveWifiSsid(fields->wifiSsid)) ||
+      (fields->hasWifiPassword && !settingsSaveWifiPassword(fields->wifiPassword)))
+  {
+    LOG_ERROR("could not save the device settings\n");
+    return ALARM_STATUS_NOT_SAVED;
+  }
+  return ALARM_STATUS_SUCCESS;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// configurationCommit stores all the fields of a valid change, from any
+// task, as one change of the settings: the other tasks never see it half
+// made, and nothing is changed if any field is refused or a write fails.
+// Returns ALARM_STATUS_SUCCESS or the error. The wifi is not reconnected,
+// that is for the caller (see requestWifiReconnect).
+uint8_t configurationCommit(const ConfigurationChange *change)
+{
+  settingsBeginChange();
+  uint8_t status = applyConfigurationChange(change);
+  if (status != ALARM_STATUS_SUCCESS)
+  {
+    settingsCancelChange();
+    return status;
+  }
+  if (!settingsCommitChange())
+  {
+    LOG_ERROR("could not save the configuration\n");
+    return ALARM_STATUS_NOT_SAVED;
+  }
+
+  eventsPost(EVENT_CONFIGURATION_CHANGED);
+  return ALARM_STATUS_SUCCESS;
+}
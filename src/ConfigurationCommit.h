@@ -0,0 +1,25 @@
+#ifndef ConfigurationCommit_h
+#define ConfigurationCommit_h
+
+#include <stdint.h>
+
+#include "ConfigBundle.h"
+#include "TimeZone.h"
+
+// ConfigurationChange is a validated change of the configuration, received
+// by BLE or HTTP; only the fields flagged as present must be changed. The
+// alarms in fields.alarmsMask replace theirs, and with replaceAlarms the
+// others are removed.
+struct ConfigurationChange
+{
+    ConfigBundle fields;
+    bool replaceAlarms;
+    bool hasTimeZone;
+    bool hasHouseholdSync;
+    bool householdSync;
+    char timeZone[TIME_ZONE_RULE_SIZE];
+};
+
+uint8_t configurationCommit(const ConfigurationChange *change);
+
+#endif
@@ -0,0 +1,416 @@
+#include "ConfigurationHttp.h"
+
+#include <Arduino.h>
+
+#include "AlarmProtocol.h"
+#include "ConfigBundle.h"
+#include "ConfigurationCommit.h"
+#include "Hal.h"
+#include "HouseholdSync.h"
+#include "JsonStream.h"
+#include "Logger.h"
+#include "Settings.h"
+#include "TimeZone.h"
+#include "WifiServices.h"
+
+// The configuration is served over HTTP, as JSON, for the clients on the
+// local network: GET /config returns the whole configuration at once,
+// e.g.
+// {"deviceName":"Alarmista X1f","wifiSsid":"home","timeZone":"WET0WEST,M3.5.0/1,M10.5.0",
+//  "householdSync":false,"alarms":[{"number":1,"when":25200,"song":"sunrise","days":127}]}
+// and PUT /config changes any of these fields, and "wifiPassword", in one
+// request. The alarms given replace all the alarms. The fields are checked
+// as for BLE, and nothing is changed if any is invalid; the response is
+// {"status":0} or the error, with the values of the last operation status.
+// A change must carry the token set over BLE, as
+// "Authorization: Bearer <token>"; they are all refused until one is set.
+
+// how often the server is polled, from its own task
+const uint32_t HTTP_POLL_MS = 5;
+const uint8_t HTTP_TASK_PRIORITY = 1;
+
+// the task commits the changes: the flash writes, the time zone compile
+// and the log lines on top of the server need more than HAL_TASK_STACK_SIZE
+const uint32_t HTTP_TASK_STACK_SIZE = 8192;
+
+const char HTTP_AUTHORIZATION_SCHEME[] = "Bearer ";
+
+// the fields of an alarm, all needed
+const uint8_t ALARM_FIELD_NUMBER = 0x01;
+const uint8_t ALARM_FIELD_WHEN = 0x02;
+const uint8_t ALARM_FIELD_SONG = 0x04;
+const uint8_t ALARM_FIELD_DAYS = 0x08;
+const uint8_t ALARM_FIELDS = 0x0F;
+
+/* =========================================================================
+   Definitions
+   ========================================================================= */
+
+// HttpConfiguration is a configuration received by HTTP, checked as it is
+// parsed. status is the first error found.
+struct HttpConfiguration
+{
+  ConfigurationChange change;
+  Alarm alarm;
+  uint8_t alarmFields;
+  uint8_t status;
+};
+
+uint16_t getConfiguration(JsonOutput *response);
+bool authorizeConfiguration(const char *credentials, size_t length);
+void beginConfiguration();
+void readConfigurationBody(const uint8_t *data, size_t length);
+uint16_t putConfiguration(JsonOutput *response);
+
+const HttpRoute HTTP_ROUTES[] = {
+    {"GET", "/config", nullptr, nullptr, getConfiguration, nullptr},
+    {"PUT", "/config", beginConfiguration, readConfigurationBody, putConfiguration, authorizeConfiguration},
+};
+
+HttpServer configurationHttpServer;
+JsonStream configurationJson;
+HttpConfiguration httpConfiguration;
+bool httpStarted = false;
+bool httpWifiChanged = false;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// rejectConfiguration keeps the first error of the configuration
+bool rejectConfiguration(HttpConfiguration *configuration, uint8_t status)
+{
+  if (configuration->status == 0)
+  {
+    configuration->status = status;
+  }
+  return false;
+}
+
+// readConfigurationString copies a string value, refusing anything else
+// or a string that does not fit
+bool readConfigurationString(HttpConfiguration *configuration, const JsonToken *token, char *destination, size_t size,
+                             uint8_t tooLong)
+{
+  if (token->event != JSON_STRING)
+  {
+    return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+  }
+  if (token->length >= size)
+  {
+    return rejectConfiguration(configuration, tooLong);
+  }
+  memcpy(destination, token->value, token->length + 1);
+  return true;
+}
+
+// readAlarmNumber reads an integer field of an alarm
+bool readAlarmNumber(HttpConfiguration *configuration, const JsonToken *token, int64_t min, int64_t max, uint8_t invalid,
+                     int64_t *value)
+{
+  if (!jsonTokenInteger(token, value) || *value < min || *value > max)
+  {
+    return rejectConfiguration(configuration, invalid);
+  }
+  return true;
+}
+
+// readAlarmField reads a field of the alarm being parsed
+bool readAlarmField(HttpConfiguration *configuration, const JsonToken *token)
+{
+  Alarm *alarm = &configuration->alarm;
+  int64_t value;
+  if (strcmp(token->key, "number") == 0)
+  {
+    if (!readAlarmNumber(configuration, token, 0, UINT32_MAX, ALARM_STATUS_INVALID_NUMBER, &value))
+    {
+      return false;
+    }
+    alarm->number = value;
+    configuration->alarmFields |= ALARM_FIELD_NUMBER;
+  }
+  else if (strcmp(token->key, "when") == 0)
+  {
+    if (!readAlarmNumber(configuration, token, INT32_MIN, INT32_MAX, ALARM_STATUS_INVALID_TIME, &value))
+    {
+      return false;
+    }
+    alarm->when = value;
+    configuration->alarmFields |= ALARM_FIELD_WHEN;
+  }
+  else if (strcmp(token->key, "days") == 0)
+  {
+    if (!readAlarmNumber(configuration, token, 0, UINT32_MAX, ALARM_STATUS_INVALID_DAYS, &value))
+    {
+      return false;
+    }
+    alarm->activeMatrix = value;
+    configuration->alarmFields |= ALARM_FIELD_DAYS;
+  }
+  else if (strcmp(token->key, "song") == 0)
+  {
+    if (!readConfigurationString(configuration, token, alarm->song, ALARM_SONG_SIZE, ALARM_STATUS_SONG_TOO_LONG))
+    {
+      return false;
+    }
+    configuration->alarmFields |= ALARM_FIELD_SONG;
+  }
+  else
+  {
+    return rejectConfiguration(configuration, ALARM_STATUS_INVALID_FIELDS);
+  }
+  return true;
+}
+
+// readAlarm starts an alarm of the alarms array and, once all its fields
+// are read, checks it as an alarm received by BLE
+bool readAlarm(HttpConfiguration *configuration, const JsonToken *token)
+{
+  Alarm *alarm = &configuration->alarm;
+  if (token->event == JSON_OBJECT_BEGIN)
+  {
+    memset(alarm, 0, sizeof(Alarm));
+    configuration->alarmFields = 0;
+    return true;
+  }
+  if (token->event != JSON_OBJECT_END)
+  {
+    return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+  }
+
+  if (configuration->alarmFields != ALARM_FIELDS)
+  {
+    return rejectConfiguration(configuration, ALARM_STATUS_MISSING_FIELDS);
+  }
+  AlarmStatus status = alarmValidate(alarm);
+  if (status != ALARM_STATUS_SUCCESS)
+  {
+    return rejectConfiguration(configuration, status);
+  }
+  ConfigBundle *fields = &configuration->change.fields;
+  uint8_t bit = 1 << (alarm->number - 1);
+  if (fields->alarmsMask & bit)
+  {
+    return rejectConfiguration(configuration, ALARM_STATUS_INVALID_NUMBER);
+  }
+  fields->alarmsMask |= bit;
+  fields->alarms[alarm->number - 1] = *alarm;
+  return true;
+}
+
+// readConfigurationField reads a field of the configuration object
+bool readConfigurationField(HttpConfiguration *configuration, const JsonToken *token)
+{
+  ConfigurationChange *change = &configuration->change;
+  ConfigBundle *fields = &change->fields;
+  if (token->event == JSON_ARRAY_END)
+  {
+    return true;
+  }
+  if (strcmp(token->key, "alarms") == 0)
+  {
+    if (token->event != JSON_ARRAY_BEGIN)
+    {
+      return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+    }
+    change->replaceAlarms = true;
+    fields->alarmsMask = 0;
+    return true;
+  }
+  if (strcmp(token->key, "householdSync") == 0)
+  {
+    if (token->event != JSON_BOOL)
+    {
+      return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+    }
+    change->hasHouseholdSync = true;
+    change->householdSync = token->value[0] == 't';
+    return true;
+  }
+  if (strcmp(token->key, "timeZone") == 0)
+  {
+    change->hasTimeZone = true;
+    return readConfigurationString(configuration, token, change->timeZone, TIME_ZONE_RULE_SIZE,
+                                   TIME_ZONE_RULE_TOO_LONG);
+  }
+  if (strcmp(token->key, "deviceName") == 0)
+  {
+    fields->hasDeviceName = true;
+    if (token->length == 0)
+    {
+      return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+    }
+    return readConfigurationString(configuration, token, fields->deviceName, CONFIG_DEVICE_NAME_SIZE,
+                                   CONFIG_BUNDLE_BAD_FIELD);
+  }
+  if (strcmp(token->key, "wifiSsid") == 0)
+  {
+    fields->hasWifiSsid = true;
+    return readConfigurationString(configuration, token, fields->wifiSsid, CONFIG_WIFI_SSID_SIZE,
+                                   CONFIG_BUNDLE_BAD_FIELD);
+  }
+  if (strcmp(token->key, "wifiPassword") == 0)
+  {
+    fields->hasWifiPassword = true;
+    return readConfigurationString(configuration, token, fields->wifiPassword, CONFIG_WIFI_PASSWORD_SIZE,
+                                   CONFIG_BUNDLE_BAD_FIELD);
+  }
+  return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+}
+
+// readConfigurationToken checks each token of the configuration as soon
+// as it is parsed: the configuration is an object whose only container
+// is the array of the alarms
+bool readConfigurationToken(void *context, const JsonToken *token)
+{
+  HttpConfiguration *configuration = (HttpConfiguration *)context;
+  switch (token->depth)
+  {
+  case 0:
+    return token->event == JSON_OBJECT_BEGIN || token->event == JSON_OBJECT_END ||
+           rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+  case 1:
+    return readConfigurationField(configuration, token);
+  case 2:
+    return readAlarm(configuration, token);
+  case 3:
+    return readAlarmField(configuration, token);
+  default:
+    return rejectConfiguration(configuration, CONFIG_BUNDLE_BAD_FIELD);
+  }
+}
+
+// getConfiguration handles GET /config; the wifi password is never sent
+uint16_t getConfiguration(JsonOutput *response)
+{
+  HouseholdSync sync;
+  bool householdSync = settingsGetHouseholdSync(&sync) && sync.enabled;
+  AlarmTable table;
+  settingsGetAlarmTable(&table);
+
+  jsonWriteBeginObject(response, nullptr);
+  jsonWriteString(response, "deviceName", settingsGetDeviceName().c_str());
+  jsonWriteString(response, "wifiSsid", settingsGetWifiSsid().c_str());
+  jsonWriteString(response, "timeZone", settingsGetTimeZoneRule().c_str());
+  jsonWriteBool(response, "householdSync", householdSync);
+  jsonWriteBeginArray(response, "alarms");
+  for (int i = 0; i < MAX_ALARMS; i++)
+  {
+    const Alarm &alarm = table.alarms[i];
+    if (alarm.number == 0)
+    {
+      continue;
+    }
+    jsonWriteBeginObject(response, nullptr);
+    jsonWriteInteger(response, "number", alarm.number);
+    jsonWriteInteger(response, "when", alarm.when);
+    jsonWriteString(response, "song", alarm.song);
+    jsonWriteInteger(response, "days", alarm.activeMatrix);
+    jsonWriteEndObject(response);
+  }
+  jsonWriteEndArray(response);
+  jsonWriteEndObject(response);
+  return 200;
+}
+
+// authorizeConfiguration lets PUT /config through if it carries the
+// token, compared in constant time; none is let through without a token
+bool authorizeConfiguration(const char *credentials, size_t length)
+{
+  String token = settingsGetHttpToken();
+  size_t schemeLength = sizeof(HTTP_AUTHORIZATION_SCHEME) - 1;
+  while (length > 0 && credentials[length - 1] == ' ')
+  {
+    length--;
+  }
+  if (token.length() == 0 || credentials == nullptr || length != schemeLength + token.length() ||
+      strncasecmp(credentials, HTTP_AUTHORIZATION_SCHEME, schemeLength) != 0)
+  {
+    return false;
+  }
+  uint8_t difference = 0;
+  for (size_t i = 0; i < token.length(); i++)
+  {
+    difference |= credentials[schemeLength + i] ^ token.c_str()[i];
+  }
+  return difference == 0;
+}
+
+// beginConfiguration gets the parser ready for the body of PUT /config
+void beginConfiguration()
+{
+  memset(&httpConfiguration, 0, sizeof(HttpConfiguration));
+  jsonStreamReset(&configurationJson, readConfigurationToken, &httpConfiguration);
+}
+
+void readConfigurationBody(const uint8_t *data, size_t length)
+{
+  jsonStreamFeed(&configurationJson, (const char *)data, length);
+}
+
+// putConfiguration handles PUT /config once the whole body is parsed
+uint16_t putConfiguration(JsonOutput *response)
+{
+  JsonStreamStatus parsed = jsonStreamFinish(&configurationJson);
+  uint8_t status = parsed == JSON_STREAM_REJECTED ? httpConfiguration.status : (uint8_t)parsed;
+  const ConfigBundle *fields = &httpConfiguration.change.fields;
+  if (status == ALARM_STATUS_SUCCESS)
+  {
+    status = configurationCommit(&httpConfiguration.change);
+    if (status == ALARM_STATUS_SUCCESS)
+    {
+      LOG_TRACE("configuration saved by http\n");
+      httpWifiChanged = fields->hasWifiSsid || fields->hasWifiPassword;
+    }
+  }
+  else
+  {
+    LOG_ERROR("invalid configuration received by http (error %d)\n", status);
+  }
+
+  jsonWriteBeginObject(response, nullptr);
+  jsonWriteInteger(response, "status", status);
+  jsonWriteEndObject(response);
+  if (status == ALARM_STATUS_SUCCESS)
+  {
+    return 200;
+  }
+  return status == ALARM_STATUS_NOT_SAVED ? 500 : 400;
+}
+
+// httpStep serves the configuration requests and, once the response to a
+// request changing the wifi network is sent, has the loop task connect to
+// the new one
+void httpStep()
+{
+  httpServerPoll(&configurationHttpServer);
+  if (httpWifiChanged && httpServerIdle(&configurationHttpServer))
+  {
+    httpWifiChanged = false;
+    requestWifiReconnect();
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// initHttp starts serving the configuration over HTTP once wifi is
+// connected, from a task of its own, so the requests never wait for the
+// state machine nor block it
+void initHttp()
+{
+  if (httpStarted || !isWiFiConnected())
+  {
+    return;
+  }
+  if (!httpServerBegin(&configurationHttpServer, CONFIGURATION_HTTP_PORT, HTTP_ROUTES,
+                       sizeof(HTTP_ROUTES) / sizeof(HttpRoute)))
+  {
+    LOG_ERROR("could not start the http server\n");
+    return;
+  }
+  httpStarted =
+      halTaskStart("http", httpStep, HTTP_POLL_MS, HTTP_TASK_PRIORITY, HAL_TASK_RADIO_CORE, HTTP_TASK_STACK_SIZE);
+  LOG_TRACE("configuration served by http on port %d\n", CONFIGURATION_HTTP_PORT);
+}
@@ -0,0 +1,17 @@
+#ifndef ConfigurationHttp_h
+#define ConfigurationHttp_h
+
+#include "HttpServer.h"
+
+// the port the configuration is served on, once wifi is connected
+const uint16_t CONFIGURATION_HTTP_PORT = 80;
+
+// the longest token the configuration changes must carry, with its
+// terminating zero; it is set over BLE
+const size_t CONFIGURATION_HTTP_TOKEN_SIZE = 65;
+
+extern HttpServer configurationHttpServer;
+
+void initHttp();
+
+#endif
@@ -1,8 +1,10 @@
 #ifndef ConfigurationState_h
 #define ConfigurationState_h
 
-void configurationStateLoop();
+void configurationStateEnter();
 
-bool configurationStateActivateSleep();
+void configurationStateUpdate();
+
+bool configurationStateCanSleep();
 
 #endif
\ No newline at end of file
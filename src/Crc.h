@@ -0,0 +1,11 @@
+#ifndef Crc_h
+#define Crc_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length);
+
+uint32_t crc32(const void *data, size_t length);
+
+#endif
@@ -1,174 +1,310 @@
 #include "DeepSleepState.h"
 
 #include <Arduino.h>
-#include <ArduinoLog.h>
-#include <WiFi.h>
-#include <NTPClient.h>
-#include <WiFiUdp.h>
 
-#include "GlobalStatus.h"
+#include "ConfigurationBLE.h"
+#include "Energy.h"
+#include "Events.h"
+#include "Hal.h"
+#include "HouseholdSync.h"
+#include "Logger.h"
+#include "Profiler.h"
 #include "Settings.h"
+#include "StateMachine.h"
+#include "TimeKeeper.h"
+#include "WifiServices.h"
+#include "WakeContext.h"
 
-#define uS_TO_S_FACTOR 1000000 /* Conversion factor for micro seconds to seconds */
+// how long to wait for a wifi connection in progress before sleeping
+const uint32_t WIFI_WAIT_TIMEOUT_MS = 12000;
+
+// a household sync window is skipped if it would end less than this
+// before the next alarm
+const uint32_t SYNC_WINDOW_MARGIN_S = 60;
+
+// how far from the clock an alarm or a sync window may be to be the one
+// the timer woke for, when the wake context was lost; the clock then runs
+// without its drift correction
+const uint32_t WAKE_DUE_TOLERANCE_S = 120;
 
 /* ========================================================================= 
    Private functions 
    ========================================================================= */
 
-void printWakeupReason()
+// printWakeupReason logs why the firmware is running
+void printWakeupReason(HalWakeCause cause)
 {
-  esp_sleep_wakeup_cause_t wakeup_reason;
-
-  wakeup_reason = esp_sleep_get_wakeup_cause();
-
-  switch (wakeup_reason)
+  switch (cause)
   {
-  case ESP_SLEEP_WAKEUP_EXT0:
-    Log.trace("wakeup caused by external signal using RTC_IO\n");
-    break;
-  case ESP_SLEEP_WAKEUP_EXT1:
-    Log.trace("wakeup caused by external signal using RTC_CNTL\n");
+  case HAL_WAKE_BUTTON:
+    LOG_TRACE("wakeup caused by the button\n");
     break;
-  case ESP_SLEEP_WAKEUP_TIMER:
-    Log.trace("wakeup caused by timer\n");
+  case HAL_WAKE_TIMER:
+    LOG_TRACE("wakeup caused by timer\n");
     break;
-  case ESP_SLEEP_WAKEUP_TOUCHPAD:
-    Log.trace("wakeup caused by touchpad\n");
-    break;
-  case ESP_SLEEP_WAKEUP_ULP:
-    Log.trace("wakeup caused by ULP program\n");
+  case HAL_WAKE_OTHER:
+    LOG_TRACE("wakeup caused by an unexpected source\n");
     break;
   default:
-    Log.trace("wakeup was not caused by deep sleep: %d\n", wakeup_reason);
+    LOG_TRACE("wakeup was not caused by deep sleep\n");
     break;
   }
 }
 
-// getSecondsToSleep returns the number of seconds to sleep based on a specific alarm.
-unsigned long getSecondsToSleep(Alarm *alarm) {
-  Log.trace("alarm time in seconds is %d \n", alarm->when);
+// loadTimeZone returns the compiled time zone, compiling the stored rule
+// again when its table ends within the next week of alarms
+void loadTimeZone(uint32_t currentTime, TimeZoneTable *zone)
+{
+  settingsGetTimeZone(zone);
+  if (timeZoneCovers(zone, currentTime + (DAYS_PER_WEEK + 1) * SECONDS_PER_DAY))
+  {
+    return;
+  }
+
+  LOG_TRACE("time zone table ends, compiling it again\n");
+  TimeZoneStatus status = settingsSaveTimeZone(settingsGetTimeZoneRule(), timeZoneYear(currentTime));
+  if (status != TIME_ZONE_SUCCESS)
+  {
+    LOG_ERROR("could not compile the time zone (error %d)\n", status);
+  }
+  settingsGetTimeZone(zone);
+}
+
+// syncWindowFirst returns true if the household sync is on and its next
+// window comes well before the next alarm, setting the seconds to it
+bool syncWindowFirst(uint32_t currentTime, uint32_t secondsToAlarm, uint32_t *secondsToWindow)
+{
+  HouseholdSync sync;
+  if (!settingsGetHouseholdSync(&sync) || !sync.enabled || settingsGetWifiSsid() == "")
+  {
+    return false;
+  }
+  *secondsToWindow = householdSyncNextWindow(currentTime) - currentTime;
+  return *secondsToWindow + SYNC_WINDOW_MARGIN_S < secondsToAlarm;
+}
 
-  WiFiUDP ntpUDP;
-  NTPClient timeClient(ntpUDP);
+// getSecondsToSleep returns the number of seconds to sleep until the
+// earliest alarm of the schedule fires, in local time, or until the next
+// household sync window if it comes first (the alarm is then 0).
+// The clock is only synced with NTP when its predicted error is too big.
+unsigned long getSecondsToSleep(AlarmSchedule *schedule) {
+  if (timeKeeperNeedsSync())
+  {
+    if (!isWiFiConnected())
+    {
+      LOG_WARNING("wifi not connected, cannot sync the clock\n");
+    }
+    else
+    {
+      profilerBegin(PROFILE_PHASE_NTP_SYNC);
+      bool synced = timeKeeperSync();
+      profilerEnd(PROFILE_PHASE_NTP_SYNC);
+      if (!synced)
+      {
+        LOG_WARNING("could not sync the clock\n");
+        // the network may not route the cached lease any more
+        forgetWifiLease();
+      }
+    }
+  }
 
-  if (WiFi.status() != WL_CONNECTED)
+  if (!timeKeeperIsValid())
   {
-    Log.error("wifi not connected, cannot fech current time\n");
+    LOG_ERROR("current time is unknown, cannot schedule the alarm\n");
     return 0;
   }
 
-  timeClient.begin();
-  // Set offset time in seconds to adjust for your timezone, for example:
-  // GMT +1 = 3600
-  // GMT +8 = 28800
-  // GMT -1 = -3600
-  // GMT 0 = 0
-  timeClient.setTimeOffset(0);
-  while(!timeClient.update()) {
-    timeClient.forceUpdate();
+  uint32_t currentTime = timeKeeperNow();
+  LOG_TRACE("current date time is %l\n", currentTime);
+
+  TimeZoneTable zone;
+  loadTimeZone(currentTime, &zone);
+
+  uint32_t secondsToNext = 0;
+  uint8_t alarmNumber = 0;
+  if (!alarmSchedulerNextInZone(schedule, &zone, currentTime, &secondsToNext, &alarmNumber))
+  {
+    LOG_ERROR("no alarm scheduled\n");
+    return 0;
   }
-  unsigned long currentTime = timeClient.getEpochTime();
-  Log.trace("current date time is %d (%s)\n", currentTime, timeClient.getFormattedTime());
 
-  unsigned long totalSecondsSinceStartDay = timeClient.getHours() * 60 * 60 + timeClient.getMinutes() * 60 + timeClient.getSeconds();
-  Log.verbose("total seconds since start day is %d\n", totalSecondsSinceStartDay);
-  
-  if (totalSecondsSinceStartDay < alarm->when) 
+  LOG_TRACE("alarm %d fires in %l seconds\n", alarmNumber, secondsToNext);
+
+  uint32_t secondsToWindow = 0;
+  if (syncWindowFirst(currentTime, secondsToNext, &secondsToWindow))
   {
-    Log.verbose("alarm will fire today\n");
-    return alarm->when - totalSecondsSinceStartDay;
+    LOG_TRACE("household sync window opens in %l seconds\n", secondsToWindow);
+    secondsToNext = secondsToWindow;
+    alarmNumber = 0;
   }
 
-  Log.verbose("alarm will fire tomorrow\n");
+  settingsLock();
+  wakeContext.expectedWakeEpoch = currentTime + secondsToNext;
+  wakeContext.expectedAlarm = alarmNumber;
+  wakeContext.syncWake = alarmNumber == 0;
+  wakeContextCommit();
+  settingsUnlock();
 
-  unsigned long startOfToday = currentTime - totalSecondsSinceStartDay;
-  Log.verbose("start of today in epoch is %d\n", startOfToday);
+  return secondsToNext;
+}
 
-  unsigned long tomorrowStartOfDay = startOfToday + (24*60*60);
-  Log.verbose("tomorrow start of day in epoch is %d\n", tomorrowStartOfDay);
+// logSettingsStats logs the flash accesses of the settings since the cold boot
+void logSettingsStats()
+{
+  SettingsStats stats;
+  settingsGetStats(&stats);
+  LOG_TRACE("settings flash reads: %u (%u us), writes: %u (%u us), skipped writes: %u\n",
+            stats.flashReads, stats.flashReadUs, stats.flashWrites, stats.flashWriteUs, stats.skippedWrites);
+}
+
+// dueWake works out what the timer woke the firmware for when the wake
+// context was lost, as settingsInit found it corrupted: the alarm of the
+// table due on the clock, else the household sync window open on it.
+// Returns STATE_DEEP_SLEEP, to sleep until the next one, if it is neither.
+StateId dueWake()
+{
+  uint32_t since = timeKeeperNow() - WAKE_DUE_TOLERANCE_S;
+  AlarmSchedule schedule;
+  TimeZoneTable zone;
+  settingsGetTimeZone(&zone);
+  uint32_t secondsToNext = 0;
+  uint8_t alarmNumber = 0;
+  if (settingsGetAlarmSchedule(&schedule) > 0 &&
+      alarmSchedulerNextInZone(&schedule, &zone, since, &secondsToNext, &alarmNumber) &&
+      secondsToNext <= 2 * WAKE_DUE_TOLERANCE_S)
+  {
+    LOG_WARNING("wake context lost, alarm %d is due\n", alarmNumber);
+    settingsLock();
+    wakeContext.expectedAlarm = alarmNumber;
+    wakeContextCommit();
+    settingsUnlock();
+    return STATE_SUNRISE;
+  }
 
-  unsigned long alarmTime = tomorrowStartOfDay + alarm->when;
-  Log.verbose("alarm time in epoch is %d\n", alarmTime);
+  HouseholdSync sync;
+  if (settingsGetHouseholdSync(&sync) && sync.enabled &&
+      householdSyncNextWindow(since) - since <= 2 * WAKE_DUE_TOLERANCE_S)
+  {
+    LOG_WARNING("wake context lost, the household sync window is open\n");
+    settingsLock();
+    wakeContext.syncWake = true;
+    wakeContextCommit();
+    settingsUnlock();
+    return STATE_SYNC;
+  }
 
-  return alarmTime - currentTime;
+  LOG_WARNING("wake context lost, nothing is due\n");
+  return STATE_DEEP_SLEEP;
+}
+
+// abortSleep gives up on sleeping, back to the configuration
+void abortSleep()
+{
+  settingsSaveInDeepSleep(false);
+  stateMachineRaise(EVENT_SLEEP_ABORTED);
 }
 
 /* ========================================================================= 
    Public functions 
    ========================================================================= */
 
-// deepSleepStateLoop contains all the logic of the deep sleep state
-void deepSleepStateLoop()
+// deepSleepStateWake returns the state to start from after a boot. After
+// a deep sleep the wake cause decides: the alarm timer goes straight to
+// the sunrise, the household sync timer to the sync and the button to
+// the configuration, without running the deep sleep state first, and it
+// is all read from RTC memory. If that was lost, the timer wake is worked
+// out from the settings and the clock.
+StateId deepSleepStateWake()
 {
-  Log.notice("=> entering state: DeepSleep\n");
-
-  if (globalStatus.inDeepSleep)
+  if (!settingsGetInDeepSleep())
   {
-    Log.trace("waking up...\n");
-    printWakeupReason();
+    return STATE_CONFIGURATION;
+  }
 
-    esp_sleep_wakeup_cause_t wakeup_reason;
-    wakeup_reason = esp_sleep_get_wakeup_cause();
-    if (wakeup_reason == ESP_SLEEP_WAKEUP_EXT0)
-    {
-      globalStatus.goToConfig = true;
-      settingsSaveInDeepSleep(false);
-      return;
-    }
-    if (wakeup_reason == ESP_SLEEP_WAKEUP_TIMER)
+  LOG_TRACE("waking up from deep sleep\n");
+  HalWakeCause cause = halWakeCause();
+  printWakeupReason(cause);
+
+  if (cause == HAL_WAKE_BUTTON)
+  {
+    settingsSaveInDeepSleep(false);
+    return STATE_CONFIGURATION;
+  }
+  if (cause == HAL_WAKE_TIMER)
+  {
+    settingsSaveInDeepSleep(false);
+    if (wakeContext.syncWake)
     {
-      globalStatus.goToSunrise = true;
-      settingsSaveInDeepSleep(false);
-      return;
+      return STATE_SYNC;
     }
+    return wakeContext.expectedAlarm != 0 ? STATE_SUNRISE : dueWake();
   }
+  return STATE_DEEP_SLEEP;
+}
 
-  Alarm alarm = settingsGetAlarm(1);
-  if (alarm.number != 1) 
+// deepSleepStateEnter tries to enter deep sleep
+void deepSleepStateEnter()
+{
+  energyEnterState(ENERGY_CPU_DEEP_SLEEP);
+  deepSleepStateUpdate();
+}
+
+// deepSleepStateUpdate tries to enter deep sleep until the next alarm,
+// waiting for the wifi first if the clock needs to be synced
+void deepSleepStateUpdate()
+{
+  AlarmSchedule schedule;
+  if (settingsGetAlarmSchedule(&schedule) == 0)
   {
-    Log.trace("alarm 1 not defined - going back to config.\n");
-    globalStatus.goToConfig = true;
-    settingsSaveInDeepSleep(false);
+    LOG_TRACE("no alarm defined - going back to config.\n");
+    abortSleep();
     return;
   }
 
-  long timeToSleep = getSecondsToSleep(&alarm);
+  static uint32_t waitingForWifiSince = 0;
+  if (timeKeeperNeedsSync() && isWiFiConnecting())
+  {
+    if (waitingForWifiSince == 0)
+    {
+      waitingForWifiSince = halMillis();
+    }
+    if (halMillis() - waitingForWifiSince < WIFI_WAIT_TIMEOUT_MS)
+    {
+      LOG_TRACE("waiting for wifi to sync the clock\n");
+      eventsRequestWakeIn(WIFI_WAIT_TIMEOUT_MS);
+      return;
+    }
+  }
+  waitingForWifiSince = 0;
+
+  long timeToSleep = getSecondsToSleep(&schedule);
   if (timeToSleep == 0) 
   {
-    Log.trace("invalid time to sleep returned - going back to config.\n");
-    globalStatus.goToConfig = true;
-    settingsSaveInDeepSleep(false);
+    LOG_TRACE("invalid time to sleep returned - going back to config.\n");
+    abortSleep();
     return;
   }
 
-  Log.trace("going to sleep now...\n");
+  LOG_TRACE("going to sleep now...\n");
   settingsSaveInDeepSleep(true);
-  esp_sleep_enable_ext0_wakeup(GPIO_NUM_13, 1);
-  esp_err_t result = esp_sleep_enable_timer_wakeup(timeToSleep * uS_TO_S_FACTOR);
-
-  if (result != ESP_OK) 
+  if (!settingsFlush())
   {
-    Log.error("error enabling timer wakeup: %d - going back to config.\n", result);
-    globalStatus.goToConfig = true;
-    settingsSaveInDeepSleep(false);
-    return;
+    LOG_ERROR("could not save the settings\n");
+  }
+  logSettingsStats();
+  LOG_TRACE("setup to sleep for %l seconds\n", timeToSleep);
+  profilerMark(PROFILE_PHASE_DEEP_SLEEP);
+  // the radios are stopped before the deep sleep, as the IDF asks, so
+  // the energy accounts for each one turning off
+  disconnectWifi();
+  deinitBLE();
+  energySleep();
+  loggerFlush();
+  // timed last, from the clock corrected for its drift, so the time
+  // spent getting here is not slept too
+  if (!halDeepSleep(timeKeeperSleepUs(wakeContext.expectedWakeEpoch)))
+  {
+    LOG_ERROR("could not enter deep sleep - going back to config.\n");
+    abortSleep();
   }
-  Log.trace("setup ESP32 to sleep for %s seconds\n", String(timeToSleep).c_str());
-  esp_deep_sleep_start();
-}
-
-// deepSleepStateButtonInterrupt will return true when the sleep was
-// interrupted by a button press
-bool deepSleepStateButtonInterrupt()
-{
-  Log.trace("going to config? %b\n", globalStatus.goToConfig);
-  return globalStatus.goToConfig;
 }
-
-// deepSleepStateTimerInterrupt will return true when the sleep was
-// interrupted by a timer interrupt
-bool deepSleepStateTimerInterrupt()
-{
-  Log.trace("going to sunrise? %b\n", globalStatus.goToSunrise);
-  return globalStatus.goToSunrise;
-}
\ No newline at end of file
@@ -1,10 +1,12 @@
 #ifndef DeepSleepState_h
 #define DeepSleepState_h
 
-void deepSleepStateLoop();
+#include "StateMachine.h"
 
-bool deepSleepStateButtonInterrupt();
+StateId deepSleepStateWake();
 
-bool deepSleepStateTimerInterrupt();
+void deepSleepStateEnter();
+
+void deepSleepStateUpdate();
 
 #endif
\ No newline at end of file
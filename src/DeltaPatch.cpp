@@ -0,0 +1,350 @@
+#include "DeltaPatch.h"
+
+#include <string.h>
+
+// varintShift once the varint of the operation is read
+static const uint8_t DELTA_VARINT_DONE = 0xFF;
+static const uint8_t DELTA_VARINT_MAX_SHIFT = 35;
+// the fifth byte of a varint only has 4 bits left of 32
+static const uint8_t DELTA_VARINT_LAST_SHIFT = 28;
+
+static const uint16_t DELTA_LZ_WINDOW_MASK = (1 << DELTA_LZ_WINDOW_BITS) - 1;
+static const uint8_t DELTA_LZ_REFERENCE_BITS = 1 + DELTA_LZ_WINDOW_BITS + DELTA_LZ_LENGTH_BITS;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint32_t getUint32(const uint8_t *data)
+{
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+// fail stops the patch with an error status
+static void fail(DeltaPatch *patch, DeltaStatus status)
+{
+    if (patch->status == DELTA_STATUS_OK)
+    {
+        patch->status = status;
+    }
+}
+
+// readHeader reads the header gathered in oldBlock, which is not used
+// until the operations start
+static void readHeader(DeltaPatch *patch)
+{
+    const uint8_t *bytes = patch->oldBlock;
+    DeltaPatchHeader *header = &patch->header;
+    header->magic = getUint32(bytes);
+    header->version = bytes[4];
+    header->windowBits = bytes[5];
+    header->lengthBits = bytes[6];
+    header->reserved = bytes[7];
+    header->oldLength = getUint32(bytes + 8);
+    header->newLength = getUint32(bytes + 12);
+    memcpy(header->oldHash, bytes + 16, SHA256_SIZE);
+    memcpy(header->newHash, bytes + 16 + SHA256_SIZE, SHA256_SIZE);
+    if (header->magic != DELTA_PATCH_MAGIC || header->version != DELTA_PATCH_VERSION ||
+        header->windowBits != DELTA_LZ_WINDOW_BITS || header->lengthBits != DELTA_LZ_LENGTH_BITS ||
+        header->newLength == 0)
+    {
+        fail(patch, DELTA_STATUS_BAD_HEADER);
+    }
+}
+
+// checkBase hashes the old image, to make sure it is the one the patch is for
+static void checkBase(DeltaPatch *patch)
+{
+    Sha256 sha;
+    sha256Begin(&sha);
+    for (uint32_t position = 0; position < patch->header.oldLength; position += sizeof(patch->oldBlock))
+    {
+        size_t length = patch->header.oldLength - position < sizeof(patch->oldBlock) ? patch->header.oldLength - position
+                                                                                      : sizeof(patch->oldBlock);
+        if (patch->readOld(position, patch->oldBlock, length) != length)
+        {
+            fail(patch, DELTA_STATUS_BAD_BASE);
+            return;
+        }
+        sha256Update(&sha, patch->oldBlock, length);
+    }
+    uint8_t hash[SHA256_SIZE];
+    sha256End(&sha, hash);
+    if (memcmp(hash, patch->header.oldHash, SHA256_SIZE) != 0)
+    {
+        fail(patch, DELTA_STATUS_BAD_BASE);
+    }
+    patch->oldBlockLength = 0;
+}
+
+// flushNew writes the new bytes held so far
+static void flushNew(DeltaPatch *patch)
+{
+    if (patch->newBlockLength == 0)
+    {
+        return;
+    }
+    sha256Update(&patch->newSha, patch->newBlock, patch->newBlockLength);
+    if (!patch->writeNew(patch->newBlock, patch->newBlockLength))
+    {
+        fail(patch, DELTA_STATUS_WRITE_FAILED);
+    }
+    patch->written += patch->newBlockLength;
+    patch->newBlockLength = 0;
+}
+
+// putNew adds a byte to the new image, writing it a block at a time
+static void putNew(DeltaPatch *patch, uint8_t value)
+{
+    if (patch->written + patch->newBlockLength >= patch->header.newLength)
+    {
+        fail(patch, DELTA_STATUS_BAD_OP);
+        return;
+    }
+    patch->newBlock[patch->newBlockLength++] = value;
+    if (patch->newBlockLength == sizeof(patch->newBlock))
+    {
+        flushNew(patch);
+    }
+}
+
+// loadOld makes sure the old block holds the old position, reading a
+// block ahead if it does not
+static bool loadOld(DeltaPatch *patch)
+{
+    uint32_t position = patch->oldPosition;
+    if (position >= patch->header.oldLength)
+    {
+        fail(patch, DELTA_STATUS_BAD_OP);
+        return false;
+    }
+    if (position - patch->oldBlockStart < patch->oldBlockLength)
+    {
+        return true;
+    }
+    size_t length = patch->header.oldLength - position < sizeof(patch->oldBlock) ? patch->header.oldLength - position
+                                                                                 : sizeof(patch->oldBlock);
+    if (patch->readOld(position, patch->oldBlock, length) != length)
+    {
+        fail(patch, DELTA_STATUS_BAD_BASE);
+        return false;
+    }
+    patch->oldBlockStart = position;
+    patch->oldBlockLength = length;
+    return true;
+}
+
+// nextOld returns the next byte of the old image
+static uint8_t nextOld(DeltaPatch *patch)
+{
+    if (!loadOld(patch))
+    {
+        return 0;
+    }
+    return patch->oldBlock[patch->oldPosition++ - patch->oldBlockStart];
+}
+
+// copyOld copies the old bytes of a DELTA_OP_COPY, a block at a time
+static void copyOld(DeltaPatch *patch)
+{
+    if (patch->remaining > patch->header.newLength - patch->written - patch->newBlockLength)
+    {
+        fail(patch, DELTA_STATUS_BAD_OP);
+        return;
+    }
+    while (patch->remaining > 0 && loadOld(patch))
+    {
+        uint32_t offset = patch->oldPosition - patch->oldBlockStart;
+        uint32_t length = patch->oldBlockLength - offset;
+        length = sizeof(patch->newBlock) - patch->newBlockLength < length ? sizeof(patch->newBlock) - patch->newBlockLength
+                                                                          : length;
+        length = patch->remaining < length ? patch->remaining : length;
+        memcpy(patch->newBlock + patch->newBlockLength, patch->oldBlock + offset, length);
+        patch->newBlockLength += length;
+        patch->oldPosition += length;
+        patch->remaining -= length;
+        if (patch->newBlockLength == sizeof(patch->newBlock))
+        {
+            flushNew(patch);
+        }
+    }
+}
+
+// endVarint applies the length or distance just read
+static void endVarint(DeltaPatch *patch)
+{
+    patch->varintShift = DELTA_VARINT_DONE;
+    if (patch->op == DELTA_OP_COPY)
+    {
+        patch->remaining = patch->varint;
+        copyOld(patch);
+        patch->op = 0;
+        return;
+    }
+    if (patch->op != DELTA_OP_SEEK)
+    {
+        patch->remaining = patch->varint;
+        patch->op = patch->remaining > 0 ? patch->op : 0;
+        return;
+    }
+    int64_t distance = (int64_t)(patch->varint >> 1) ^ -(int64_t)(patch->varint & 1);
+    int64_t position = (int64_t)patch->oldPosition + distance;
+    if (position < 0 || position > patch->header.oldLength)
+    {
+        fail(patch, DELTA_STATUS_BAD_OP);
+        return;
+    }
+    patch->oldPosition = position;
+    patch->op = 0;
+}
+
+// applyByte runs a decoded byte of the operations
+static void applyByte(DeltaPatch *patch, uint8_t value)
+{
+    if (patch->op == 0)
+    {
+        if (value < DELTA_OP_ADD || value > DELTA_OP_COPY)
+        {
+            fail(patch, DELTA_STATUS_BAD_OP);
+            return;
+        }
+        patch->op = value;
+        patch->varint = 0;
+        patch->varintShift = 0;
+    }
+    else if (patch->varintShift != DELTA_VARINT_DONE)
+    {
+        if (patch->varintShift >= DELTA_VARINT_MAX_SHIFT ||
+            (patch->varintShift == DELTA_VARINT_LAST_SHIFT && (value & 0x70)))
+        {
+            fail(patch, DELTA_STATUS_BAD_OP);
+            return;
+        }
+        patch->varint |= (uint32_t)(value & 0x7F) << patch->varintShift;
+        patch->varintShift += 7;
+        if (!(value & 0x80))
+        {
+            endVarint(patch);
+        }
+    }
+    else
+    {
+        putNew(patch, patch->op == DELTA_OP_ADD ? (uint8_t)(nextOld(patch) + value) : value);
+        if (--patch->remaining == 0)
+        {
+            patch->op = 0;
+        }
+    }
+}
+
+static void decodeByte(DeltaPatch *patch, uint8_t value)
+{
+    patch->window[patch->windowPosition] = value;
+    patch->windowPosition = (patch->windowPosition + 1) & DELTA_LZ_WINDOW_MASK;
+    applyByte(patch, value);
+}
+
+// decodeBits decodes the literals and references complete in bits
+static void decodeBits(DeltaPatch *patch)
+{
+    while (patch->status == DELTA_STATUS_OK && patch->bitCount >= 9)
+    {
+        if ((patch->bits >> (patch->bitCount - 1)) & 1)
+        {
+            patch->bitCount -= 9;
+            decodeByte(patch, patch->bits >> patch->bitCount);
+            continue;
+        }
+        if (patch->bitCount < DELTA_LZ_REFERENCE_BITS)
+        {
+            return;
+        }
+        patch->bitCount -= DELTA_LZ_REFERENCE_BITS;
+        uint32_t reference = patch->bits >> patch->bitCount;
+        uint16_t index = (reference >> DELTA_LZ_LENGTH_BITS) & DELTA_LZ_WINDOW_MASK;
+        uint16_t count = (reference & ((1 << DELTA_LZ_LENGTH_BITS) - 1)) + DELTA_LZ_MIN_MATCH;
+        uint16_t from = (patch->windowPosition - index - 1) & DELTA_LZ_WINDOW_MASK;
+        for (uint16_t i = 0; i < count && patch->status == DELTA_STATUS_OK; i++)
+        {
+            decodeByte(patch, patch->window[(from + i) & DELTA_LZ_WINDOW_MASK]);
+        }
+    }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// deltaPatchBegin starts applying a patch
+void deltaPatchBegin(DeltaPatch *patch, size_t (*readOld)(uint32_t offset, void *buffer, size_t length),
+                     bool (*writeNew)(const void *data, size_t length))
+{
+    memset(patch, 0, sizeof(DeltaPatch));
+    patch->readOld = readOld;
+    patch->writeNew = writeNew;
+    sha256Begin(&patch->newSha);
+}
+
+// deltaPatchFeed applies the next piece of the patch, returning
+// DELTA_STATUS_OK while more of it is expected. Once the header is in it
+// returns DELTA_STATUS_CHECK_BASE, taking nothing after the header, until
+// deltaPatchCheckBase is done.
+DeltaStatus deltaPatchFeed(DeltaPatch *patch, const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+    while (patch->status == DELTA_STATUS_OK && i < length && patch->headerLength < DELTA_PATCH_HEADER_SIZE)
+    {
+        patch->oldBlock[patch->headerLength++] = data[i++];
+        if (patch->headerLength == DELTA_PATCH_HEADER_SIZE)
+        {
+            readHeader(patch);
+        }
+    }
+    if (patch->status == DELTA_STATUS_OK && patch->headerLength == DELTA_PATCH_HEADER_SIZE && !patch->baseChecked)
+    {
+        return DELTA_STATUS_CHECK_BASE;
+    }
+    for (; patch->status == DELTA_STATUS_OK && i < length; i++)
+    {
+        patch->bits = patch->bits << 8 | data[i];
+        patch->bitCount += 8;
+        decodeBits(patch);
+    }
+    return patch->status;
+}
+
+// deltaPatchCheckBase hashes the old image, once the header is in, to
+// make sure it is the one the patch is for
+DeltaStatus deltaPatchCheckBase(DeltaPatch *patch)
+{
+    if (patch->status == DELTA_STATUS_OK && patch->headerLength == DELTA_PATCH_HEADER_SIZE && !patch->baseChecked)
+    {
+        checkBase(patch);
+        patch->baseChecked = true;
+    }
+    return patch->status;
+}
+
+// deltaPatchFinish writes the end of the new image once all the patch
+// was fed, and checks its hash
+DeltaStatus deltaPatchFinish(DeltaPatch *patch)
+{
+    if (patch->status != DELTA_STATUS_OK)
+    {
+        return patch->status;
+    }
+    if (!patch->baseChecked || patch->op != 0 ||
+        patch->written + patch->newBlockLength != patch->header.newLength)
+    {
+        fail(patch, DELTA_STATUS_TRUNCATED);
+        return patch->status;
+    }
+    flushNew(patch);
+    uint8_t hash[SHA256_SIZE];
+    sha256End(&patch->newSha, hash);
+    if (patch->status == DELTA_STATUS_OK)
+    {
+        patch->status = memcmp(hash, patch->header.newHash, SHA256_SIZE) == 0 ? DELTA_STATUS_DONE : DELTA_STATUS_BAD_HASH;
+    }
+    return patch->status;
+}
@@ -0,0 +1,124 @@
+#ifndef DeltaPatch_h
+#define DeltaPatch_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Sha256.h"
+
+// A delta patch turns the running firmware image (old) into a new one,
+// in the style of bsdiff: the new image is made of regions added byte by
+// byte to regions of the old one, which leaves mostly zeros where code
+// only moved, and of bytes inserted as they are. The patch applier reads
+// the old image and writes the new one through callbacks, as the patch
+// comes in, in any pieces, with a fixed amount of memory.
+//
+// The patch starts with a header, little endian:
+// magic (4) | version (1) | window bits (1) | length bits (1) | reserved (1) |
+// old length (4) | new length (4) | old SHA-256 (32) | new SHA-256 (32)
+// then the operations, compressed (see below):
+// DELTA_OP_ADD | length | that many bytes, each added to the next old byte
+// DELTA_OP_INSERT | length | that many bytes of the new image
+// DELTA_OP_SEEK | signed distance to move in the old image
+// DELTA_OP_COPY | length, to copy that many old bytes as they are
+// where lengths are unsigned LEB128 varints, and distances zigzag ones.
+//
+// The operations are compressed in the style of heatshrink: an LZSS bit
+// stream, most significant bit first, of 1 + 8 bits literals and of
+// 0 + window bits + length bits references to what was decoded last,
+// index - 1 back and DELTA_LZ_MIN_MATCH + count bytes long.
+//
+// The old image is checked against its hash before anything is written,
+// and the new one once it is complete. Hashing the old image is the slow
+// part: deltaPatchFeed stops after the header, so the caller can run
+// deltaPatchCheckBase where it may take its time, then feeds the rest.
+const uint32_t DELTA_PATCH_MAGIC = 0x544C4441; // "ADLT"
+const uint8_t DELTA_PATCH_VERSION = 1;
+const size_t DELTA_PATCH_HEADER_SIZE = 80;
+
+const uint8_t DELTA_LZ_WINDOW_BITS = 10;
+const uint8_t DELTA_LZ_LENGTH_BITS = 8;
+const uint16_t DELTA_LZ_MIN_MATCH = 3;
+
+// how much of the old and new images the applier holds at a time
+const size_t DELTA_PATCH_BLOCK_SIZE = 256;
+
+enum DeltaOp : uint8_t
+{
+    DELTA_OP_ADD = 1,
+    DELTA_OP_INSERT,
+    DELTA_OP_SEEK,
+    DELTA_OP_COPY,
+};
+
+enum DeltaStatus : uint8_t
+{
+    DELTA_STATUS_OK = 0, // more of the patch is expected
+    DELTA_STATUS_DONE,
+    DELTA_STATUS_BAD_HEADER,
+    DELTA_STATUS_BAD_BASE, // the old image is not the one the patch is for
+    DELTA_STATUS_BAD_OP,
+    DELTA_STATUS_TRUNCATED,
+    DELTA_STATUS_WRITE_FAILED,
+    DELTA_STATUS_BAD_HASH,
+    DELTA_STATUS_CHECK_BASE, // the header is in, deltaPatchCheckBase is due
+};
+
+struct DeltaPatchHeader
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t windowBits;
+    uint8_t lengthBits;
+    uint8_t reserved;
+    uint32_t oldLength;
+    uint32_t newLength;
+    uint8_t oldHash[SHA256_SIZE];
+    uint8_t newHash[SHA256_SIZE];
+};
+
+// DeltaPatch is the state of a patch being applied: readOld reads the old
+// image, returning how many bytes it read, and writeNew appends to the new
+// one. The last decoded bytes are kept in window, the old bytes being
+// added to in oldBlock, and the new ones not written yet in newBlock.
+struct DeltaPatch
+{
+    size_t (*readOld)(uint32_t offset, void *buffer, size_t length);
+    bool (*writeNew)(const void *data, size_t length);
+    DeltaStatus status;
+    DeltaPatchHeader header;
+    uint8_t headerLength;
+    bool baseChecked;
+
+    // the compressed stream
+    uint32_t bits;
+    uint8_t bitCount;
+    uint16_t windowPosition;
+    uint8_t window[1 << DELTA_LZ_WINDOW_BITS];
+
+    // the operation being decoded
+    uint8_t op;
+    uint8_t varintShift;
+    uint32_t varint;
+    uint32_t remaining;
+    uint32_t oldPosition;
+
+    uint32_t oldBlockStart;
+    uint16_t oldBlockLength;
+    uint8_t oldBlock[DELTA_PATCH_BLOCK_SIZE];
+    uint32_t written;
+    uint16_t newBlockLength;
+    uint8_t newBlock[DELTA_PATCH_BLOCK_SIZE];
+    Sha256 newSha;
+};
+
+void deltaPatchBegin(DeltaPatch *patch, size_t (*readOld)(uint32_t offset, void *buffer, size_t length),
+                     bool (*writeNew)(const void *data, size_t length));
+
+DeltaStatus deltaPatchFeed(DeltaPatch *patch, const uint8_t *data, size_t length);
+
+DeltaStatus deltaPatchCheckBase(DeltaPatch *patch);
+
+DeltaStatus deltaPatchFinish(DeltaPatch *patch);
+
+#endif
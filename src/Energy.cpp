@@ -0,0 +1,188 @@
+#include "Energy.h"
+
+#include <Arduino.h>
+
+#include "Hal.h"
+
+// current draw of each consumer, in microamps; may be set with build
+// flags to match the board. The cpu figure is the whole board while
+// awake, the radio and led figures are on top of it.
+#ifndef ENERGY_CPU_UA
+#define ENERGY_CPU_UA 45000
+#endif
+#ifndef ENERGY_WIFI_UA
+#define ENERGY_WIFI_UA 80000
+#endif
+#ifndef ENERGY_BLE_UA
+#define ENERGY_BLE_UA 25000
+#endif
+#ifndef ENERGY_LED_CHANNEL_UA
+#define ENERGY_LED_CHANNEL_UA 20000
+#endif
+#ifndef ENERGY_SLEEP_UA
+#define ENERGY_SLEEP_UA 150
+#endif
+
+const uint32_t ENERGY_MODEL_UA[ENERGY_CONSUMERS] = {
+    ENERGY_CPU_UA,
+    ENERGY_CPU_UA,
+    ENERGY_CPU_UA,
+    ENERGY_CPU_UA,
+    ENERGY_WIFI_UA,
+    ENERGY_BLE_UA,
+    ENERGY_LED_CHANNEL_UA,
+    ENERGY_SLEEP_UA,
+    ENERGY_CPU_UA,
+};
+
+const uint32_t ENERGY_TOTALS_MAGIC = 0x454E5247;
+
+// EnergyTotals is kept in RTC memory, so the totals add up
+// across deep sleeps until the next cold boot
+struct EnergyTotals
+{
+  uint32_t magic;
+  uint32_t deepSleeps;
+  int64_t sleepStartedMs;
+  uint64_t us[ENERGY_CONSUMERS];
+};
+
+RTC_DATA_ATTR EnergyTotals energyTotals;
+
+// what is being accounted in the current boot, since when (in
+// microseconds since the reset)
+EnergyConsumer energyState = ENERGY_CPU_BOOT;
+uint64_t energyStateSinceUs = 0;
+bool radioOn[2] = {false, false};
+uint64_t radioOnSinceUs[2] = {0, 0};
+uint32_t ledLevel = 0;
+uint64_t ledLevelSinceUs = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// accountUntil adds the time elapsed until now to the totals
+void accountUntil(uint64_t now)
+{
+  energyTotals.us[energyState] += now - energyStateSinceUs;
+  energyStateSinceUs = now;
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (radioOn[i])
+    {
+      energyTotals.us[ENERGY_WIFI + i] += now - radioOnSinceUs[i];
+    }
+    radioOnSinceUs[i] = now;
+  }
+
+  energyTotals.us[ENERGY_LEDS] += (uint64_t)ledLevel * (now - ledLevelSinceUs) / 65535;
+  ledLevelSinceUs = now;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// energyInit needs to be called at the start of setup; it adds the
+// deep sleep that just ended to the totals, clearing them after a cold boot
+void energyInit()
+{
+  if (energyTotals.magic != ENERGY_TOTALS_MAGIC)
+  {
+    memset(&energyTotals, 0, sizeof(EnergyTotals));
+    energyTotals.magic = ENERGY_TOTALS_MAGIC;
+  }
+
+  if (energyTotals.sleepStartedMs != 0)
+  {
+    int64_t sleptMs = halWallClockMs() - energyTotals.sleepStartedMs;
+    if (sleptMs > 0)
+    {
+      energyTotals.us[ENERGY_SLEEP] += (uint64_t)sleptMs * 1000;
+    }
+    energyTotals.sleepStartedMs = 0;
+  }
+}
+
+// energyEnterState accounts the time from now on to the given state
+void energyEnterState(EnergyConsumer state)
+{
+  if (state == energyState)
+  {
+    return;
+  }
+  accountUntil(halMicros());
+  energyState = state;
+}
+
+// energyRadio accounts a radio (ENERGY_WIFI or ENERGY_BLE) being turned on or off
+void energyRadio(EnergyConsumer radio, bool on)
+{
+  int i = radio - ENERGY_WIFI;
+  if (i < 0 || i > 1 || radioOn[i] == on)
+  {
+    return;
+  }
+  accountUntil(halMicros());
+  radioOn[i] = on;
+}
+
+// energyLedFrame accounts the leds showing a new frame, weighting the
+// time by how bright each channel is
+void energyLedFrame(const SunriseColor frame[], uint8_t count)
+{
+  accountUntil(halMicros());
+  ledLevel = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    ledLevel += frame[i].r + frame[i].g + frame[i].b;
+  }
+}
+
+// energySleep needs to be called right before entering deep sleep,
+// which turns the radios and the led strip off
+void energySleep()
+{
+  accountUntil(halMicros());
+  radioOn[0] = false;
+  radioOn[1] = false;
+  ledLevel = 0;
+
+  energyTotals.deepSleeps++;
+  energyTotals.sleepStartedMs = halWallClockMs();
+}
+
+// energyEncode writes the totals up to now (see Energy.h), returning
+// their size, or 0 if the buffer is too small
+size_t energyEncode(uint8_t *buffer, size_t size)
+{
+  if (size < ENERGY_TOTALS_ENCODED_SIZE)
+  {
+    return 0;
+  }
+  accountUntil(halMicros());
+
+  buffer[0] = ENERGY_TOTALS_VERSION;
+  buffer[1] = ENERGY_CONSUMERS;
+  for (int i = 0; i < 4; i++)
+  {
+    buffer[2 + i] = energyTotals.deepSleeps >> (8 * i);
+  }
+
+  uint8_t *data = buffer + 6;
+  for (int consumer = 0; consumer < ENERGY_CONSUMERS; consumer++)
+  {
+    for (int i = 0; i < 8; i++)
+    {
+      data[i] = energyTotals.us[consumer] >> (8 * i);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      data[8 + i] = ENERGY_MODEL_UA[consumer] >> (8 * i);
+    }
+    data += 12;
+  }
+  return ENERGY_TOTALS_ENCODED_SIZE;
+}
@@ -0,0 +1,44 @@
+#ifndef Energy_h
+#define Energy_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "SunriseCurve.h"
+
+// EnergyConsumer is what the totals are kept for: the time awake in each
+// state, the time each radio is on, the equivalent time a single led
+// channel is on at full brightness and the time in deep sleep.
+// The values are decoded by scripts/energy-project.py, so they must not change.
+enum EnergyConsumer : uint8_t
+{
+    ENERGY_CPU_BOOT = 0,
+    ENERGY_CPU_CONFIGURATION = 1,
+    ENERGY_CPU_DEEP_SLEEP = 2,
+    ENERGY_CPU_SUNRISE = 3,
+    ENERGY_WIFI = 4,
+    ENERGY_BLE = 5,
+    ENERGY_LEDS = 6,
+    ENERGY_SLEEP = 7,
+    ENERGY_CPU_SYNC = 8,
+    ENERGY_CONSUMERS = 9,
+};
+
+// the encoded totals, little endian:
+// version (1) | consumer count (1) | deep sleeps (4) | per consumer: microseconds (8) | current draw in uA (4)
+const uint8_t ENERGY_TOTALS_VERSION = 1;
+const size_t ENERGY_TOTALS_ENCODED_SIZE = 6 + ENERGY_CONSUMERS * 12;
+
+void energyInit();
+
+void energyEnterState(EnergyConsumer state);
+
+void energyRadio(EnergyConsumer radio, bool on);
+
+void energyLedFrame(const SunriseColor frame[], uint8_t count);
+
+void energySleep();
+
+size_t energyEncode(uint8_t *buffer, size_t size);
+
+#endif
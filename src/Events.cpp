@@ -0,0 +1,94 @@
+#include "Events.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "Hal.h"
+#include "Logger.h"
+
+const int EVENTS_QUEUE_SIZE = 16;
+
+QueueHandle_t eventsQueue = NULL;
+
+// halMillis() value of the earliest deadline requested by the states
+uint32_t eventsDeadline = 0;
+bool eventsHasDeadline = false;
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// eventsInit creates the event queue; it needs to be called (maybe in setup)
+// before any event is posted
+void eventsInit()
+{
+  if (eventsQueue == NULL)
+  {
+    eventsQueue = xQueueCreate(EVENTS_QUEUE_SIZE, sizeof(Event));
+  }
+}
+
+// eventsPost wakes up the state machine with an event.
+// Must not be called from an interrupt handler.
+bool eventsPost(Event event)
+{
+  if (eventsQueue == NULL)
+  {
+    return false;
+  }
+  return xQueueSend(eventsQueue, &event, 0) == pdTRUE;
+}
+
+// eventsPostFromISR wakes up the state machine with an event
+// posted from an interrupt handler.
+bool IRAM_ATTR eventsPostFromISR(Event event)
+{
+  if (eventsQueue == NULL)
+  {
+    return false;
+  }
+
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  bool result = xQueueSendFromISR(eventsQueue, &event, &higherPriorityTaskWoken) == pdTRUE;
+  if (higherPriorityTaskWoken)
+  {
+    portYIELD_FROM_ISR();
+  }
+  return result;
+}
+
+// eventsRequestWakeIn asks for the state machine to run again after the
+// given number of milliseconds, even if no event is posted meanwhile.
+// When called several times the earliest deadline wins.
+void eventsRequestWakeIn(uint32_t milliseconds)
+{
+  uint32_t deadline = halMillis() + milliseconds;
+  if (!eventsHasDeadline || (int32_t)(deadline - eventsDeadline) < 0)
+  {
+    eventsDeadline = deadline;
+    eventsHasDeadline = true;
+  }
+}
+
+// eventsWait blocks the caller until an event is posted or the requested
+// deadline is reached, returning EVENT_NONE in the latter case.
+// Without a deadline it waits for an event forever.
+Event eventsWait()
+{
+  TickType_t ticksToWait = portMAX_DELAY;
+  if (eventsHasDeadline)
+  {
+    int32_t remaining = (int32_t)(eventsDeadline - halMillis());
+    ticksToWait = remaining > 0 ? pdMS_TO_TICKS(remaining) : 0;
+    eventsHasDeadline = false;
+  }
+
+  Event event = EVENT_NONE;
+  if (xQueueReceive(eventsQueue, &event, ticksToWait) != pdTRUE)
+  {
+    return EVENT_NONE;
+  }
+
+  LOG_TRACE("received event %d\n", event);
+  return event;
+}
@@ -0,0 +1,34 @@
+#ifndef Events_h
+#define Events_h
+
+#include <Arduino.h>
+
+// Event is what drives the state machine (see StateMachine.h). EVENT_NONE
+// is returned when a requested deadline is reached without any event.
+enum Event : uint8_t
+{
+    EVENT_NONE = 0,
+    EVENT_BUTTON_PRESSED,
+    EVENT_GO_TO_SLEEP,
+    EVENT_CONFIGURATION_CHANGED,
+    EVENT_WIFI_CONNECTED,
+    EVENT_WIFI_DISCONNECTED,
+    EVENT_SLEEP_ABORTED, // could not enter deep sleep
+    EVENT_SUNRISE_DONE,
+    EVENT_SYNC_DONE,
+    EVENT_WIFI_WORK, // the wifi callbacks left work to the loop task
+    EVENT_FIRMWARE_WORK, // the firmware update is to be prepared in the loop task
+    EVENT_COUNT,
+};
+
+void eventsInit();
+
+bool eventsPost(Event event);
+
+bool eventsPostFromISR(Event event);
+
+void eventsRequestWakeIn(uint32_t milliseconds);
+
+Event eventsWait();
+
+#endif
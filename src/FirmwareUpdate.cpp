@@ -0,0 +1,224 @@
+#include "FirmwareUpdate.h"
+
+#include <string.h>
+
+#include "Crc.h"
+#include "Hal.h"
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint32_t getUint32(const uint8_t *data)
+{
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static bool fillAck(const FirmwareUpdate *update, uint8_t status, FirmwareUpdateAck *ack)
+{
+    ack->status = status;
+    ack->received = update->received;
+    return true;
+}
+
+// end stops the update, dropping the new image unless it was activated;
+// the HAL ignores the drop if the image was not started yet
+static bool end(FirmwareUpdate *update, uint8_t status, FirmwareUpdateAck *ack)
+{
+    if (update->active && status != FIRMWARE_UPDATE_ACTIVATED)
+    {
+        halFirmwareEnd(false);
+    }
+    update->active = false;
+    return fillAck(update, status, ack);
+}
+
+// failure turns the status of the patch into the status of the update
+static uint8_t failure(DeltaStatus status)
+{
+    switch (status)
+    {
+    case DELTA_STATUS_BAD_BASE:
+        return FIRMWARE_UPDATE_BAD_BASE;
+    case DELTA_STATUS_WRITE_FAILED:
+        return FIRMWARE_UPDATE_FLASH_ERROR;
+    case DELTA_STATUS_BAD_HASH:
+        return FIRMWARE_UPDATE_BAD_HASH;
+    default:
+        return FIRMWARE_UPDATE_BAD_PATCH;
+    }
+}
+
+// openUpdate starts an update, or resumes it if it is the same patch
+static uint8_t openUpdate(FirmwareUpdate *update, const uint8_t *command, size_t length)
+{
+    if (length != FIRMWARE_UPDATE_OPEN_SIZE)
+    {
+        return FIRMWARE_UPDATE_BAD_COMMAND;
+    }
+    uint32_t patchLength = getUint32(command + 1);
+    uint32_t patchCrc = getUint32(command + 5);
+    if (patchLength <= DELTA_PATCH_HEADER_SIZE)
+    {
+        return FIRMWARE_UPDATE_BAD_COMMAND;
+    }
+    if (update->active && update->patchLength == patchLength && update->patchCrc == patchCrc)
+    {
+        return FIRMWARE_UPDATE_IN_PROGRESS;
+    }
+
+    if (update->active)
+    {
+        halFirmwareEnd(false);
+    }
+    memset(update, 0, sizeof(FirmwareUpdate));
+    update->active = true;
+    update->patchLength = patchLength;
+    update->patchCrc = patchCrc;
+    deltaPatchBegin(&update->patch, halFirmwareRead, halFirmwareWrite);
+    return FIRMWARE_UPDATE_IN_PROGRESS;
+}
+
+// complete checks the patch and the new image, and boots it next
+static bool complete(FirmwareUpdate *update, FirmwareUpdateAck *ack)
+{
+    if (update->receivedCrc != update->patchCrc)
+    {
+        return end(update, FIRMWARE_UPDATE_BAD_PATCH, ack);
+    }
+    DeltaStatus status = deltaPatchFinish(&update->patch);
+    if (status != DELTA_STATUS_DONE)
+    {
+        return end(update, failure(status), ack);
+    }
+    if (!halFirmwareEnd(true))
+    {
+        update->active = false;
+        return fillAck(update, FIRMWARE_UPDATE_FLASH_ERROR, ack);
+    }
+    return end(update, FIRMWARE_UPDATE_ACTIVATED, ack);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// firmwareUpdateCommand handles a command of the client, setting the
+// notification to send back
+void firmwareUpdateCommand(FirmwareUpdate *update, const uint8_t *command, size_t length, FirmwareUpdateAck *ack)
+{
+    if (length >= 1 && command[0] == FIRMWARE_UPDATE_OPEN)
+    {
+        uint8_t status = openUpdate(update, command, length);
+        fillAck(update, status, ack);
+    }
+    else if (length == 1 && command[0] == FIRMWARE_UPDATE_CANCEL)
+    {
+        end(update, FIRMWARE_UPDATE_IDLE, ack);
+    }
+    else
+    {
+        fillAck(update, FIRMWARE_UPDATE_BAD_COMMAND, ack);
+    }
+}
+
+// firmwareUpdateWrite applies the next piece of the patch, returning true
+// if a notification is due
+bool firmwareUpdateWrite(FirmwareUpdate *update, const uint8_t *data, size_t length, FirmwareUpdateAck *ack)
+{
+    if (!update->active)
+    {
+        return fillAck(update, FIRMWARE_UPDATE_IDLE, ack);
+    }
+    // firmwareUpdatePrepare notifies where to go on from
+    if (update->preparing)
+    {
+        return false;
+    }
+    if (length < FIRMWARE_UPDATE_DATA_HEADER_SIZE)
+    {
+        return fillAck(update, FIRMWARE_UPDATE_BAD_COMMAND, ack);
+    }
+    uint32_t offset = getUint32(data);
+    const uint8_t *piece = data + FIRMWARE_UPDATE_DATA_HEADER_SIZE;
+    uint32_t pieceLength = length - FIRMWARE_UPDATE_DATA_HEADER_SIZE;
+    if (offset > update->received)
+    {
+        return fillAck(update, FIRMWARE_UPDATE_IN_PROGRESS, ack);
+    }
+    // only the part not received yet is applied
+    uint32_t skipped = update->received - offset;
+    if (skipped >= pieceLength)
+    {
+        return false;
+    }
+    piece += skipped;
+    pieceLength -= skipped;
+    if (pieceLength > update->patchLength - update->received)
+    {
+        return end(update, FIRMWARE_UPDATE_BAD_PATCH, ack);
+    }
+    // the header alone, the rest once prepared
+    if (update->received < DELTA_PATCH_HEADER_SIZE && pieceLength > DELTA_PATCH_HEADER_SIZE - update->received)
+    {
+        pieceLength = DELTA_PATCH_HEADER_SIZE - update->received;
+    }
+
+    update->receivedCrc = crc32Update(update->receivedCrc, piece, pieceLength);
+    update->received += pieceLength;
+    DeltaStatus status = deltaPatchFeed(&update->patch, piece, pieceLength);
+    if (status == DELTA_STATUS_CHECK_BASE)
+    {
+        update->preparing = true;
+        return fillAck(update, FIRMWARE_UPDATE_PREPARING, ack);
+    }
+    if (status != DELTA_STATUS_OK)
+    {
+        return end(update, failure(status), ack);
+    }
+    if (update->received == update->patchLength)
+    {
+        return complete(update, ack);
+    }
+    return false;
+}
+
+// firmwareUpdatePrepare starts the new image and checks the patch is for
+// the running one, once firmwareUpdateWrite got the header. It erases and
+// hashes flash, for up to seconds, so it is left to a task that can take
+// its time. Returns true if a notification is due.
+bool firmwareUpdatePrepare(FirmwareUpdate *update, FirmwareUpdateAck *ack)
+{
+    if (!update->active || !update->preparing)
+    {
+        return false;
+    }
+    update->preparing = false;
+    if (!halFirmwareBegin())
+    {
+        update->active = false;
+        return fillAck(update, FIRMWARE_UPDATE_FLASH_ERROR, ack);
+    }
+    DeltaStatus status = deltaPatchCheckBase(&update->patch);
+    if (status != DELTA_STATUS_OK)
+    {
+        return end(update, failure(status), ack);
+    }
+    return fillAck(update, FIRMWARE_UPDATE_IN_PROGRESS, ack);
+}
+
+// firmwareUpdateEncodeAck writes a notification as sent to the client,
+// returning its length, or 0 if the buffer is too small
+size_t firmwareUpdateEncodeAck(const FirmwareUpdateAck *ack, uint8_t *buffer, size_t size)
+{
+    if (size < FIRMWARE_UPDATE_ACK_SIZE)
+    {
+        return 0;
+    }
+    buffer[0] = ack->status;
+    for (int i = 0; i < 4; i++)
+    {
+        buffer[1 + i] = ack->received >> (8 * i);
+    }
+    return FIRMWARE_UPDATE_ACK_SIZE;
+}
@@ -0,0 +1,82 @@
+#ifndef FirmwareUpdate_h
+#define FirmwareUpdate_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "DeltaPatch.h"
+
+// The firmware is updated by BLE with a delta patch against the running
+// image (see DeltaPatch.h), applied as it arrives to the OTA slot not
+// running, without keeping the patch nor the image in RAM. The slot is
+// booted next only once the new image matches its hash.
+//
+// The client opens the update with a command, little endian:
+// FIRMWARE_UPDATE_OPEN (1) | patch length (4) | crc32 of the patch (4)
+// then writes the patch in order, with response:
+// offset in the patch (4) | piece of the patch
+// The device notifies:
+// status (1) | bytes of the patch received (4)
+// when the update opens or ends, and when a write is not the next piece:
+// pieces already received are ignored, later ones dropped, and the client
+// goes on from what was received. Opening the same patch again (length
+// and crc) resumes it; anything else starts over.
+// Once the header of the patch is in, the device notifies
+// FIRMWARE_UPDATE_PREPARING and drops the writes while it starts the new
+// image and hashes the running one, away from the BLE callbacks (see
+// firmwareUpdatePrepare), then notifies FIRMWARE_UPDATE_IN_PROGRESS and
+// the client goes on from what was received.
+const size_t FIRMWARE_UPDATE_OPEN_SIZE = 9;
+const size_t FIRMWARE_UPDATE_DATA_HEADER_SIZE = 4;
+const size_t FIRMWARE_UPDATE_ACK_SIZE = 5;
+
+enum FirmwareUpdateCommand : uint8_t
+{
+    FIRMWARE_UPDATE_OPEN = 1,
+    FIRMWARE_UPDATE_CANCEL = 2,
+};
+
+// FirmwareUpdateStatus values are reported in the notifications, and as
+// the last operation status once an update ends
+enum FirmwareUpdateStatus : uint8_t
+{
+    FIRMWARE_UPDATE_ACTIVATED = 0,
+    FIRMWARE_UPDATE_IN_PROGRESS = 50,
+    FIRMWARE_UPDATE_IDLE = 51,
+    FIRMWARE_UPDATE_BAD_COMMAND = 52,
+    FIRMWARE_UPDATE_BAD_PATCH = 53,
+    FIRMWARE_UPDATE_BAD_BASE = 54, // the patch is not for the running image
+    FIRMWARE_UPDATE_BAD_HASH = 55,
+    FIRMWARE_UPDATE_FLASH_ERROR = 56,
+    FIRMWARE_UPDATE_PREPARING = 57,
+};
+
+struct FirmwareUpdateAck
+{
+    uint8_t status;
+    uint32_t received;
+};
+
+// FirmwareUpdate is the state of the update: received bytes of the patch
+// were applied, and receivedCrc is their crc32. While preparing, only
+// firmwareUpdatePrepare may change it.
+struct FirmwareUpdate
+{
+    bool active;
+    bool preparing;
+    uint32_t patchLength;
+    uint32_t patchCrc;
+    uint32_t received;
+    uint32_t receivedCrc;
+    DeltaPatch patch;
+};
+
+void firmwareUpdateCommand(FirmwareUpdate *update, const uint8_t *command, size_t length, FirmwareUpdateAck *ack);
+
+bool firmwareUpdateWrite(FirmwareUpdate *update, const uint8_t *data, size_t length, FirmwareUpdateAck *ack);
+
+bool firmwareUpdatePrepare(FirmwareUpdate *update, FirmwareUpdateAck *ack);
+
+size_t firmwareUpdateEncodeAck(const FirmwareUpdateAck *ack, uint8_t *buffer, size_t size);
+
+#endif
@@ -3,23 +3,11 @@
 
 #include <Arduino.h>
 
-struct Alarm
-{
-    uint number;
-    long when;
-    String song;
-    uint activeMatrix;
-};
+#include "Alarm.h"
 
 struct GlobalStatus
 {
     bool isBleInitialized = false;
-    bool goToSleep = false;
-    bool goToConfig = false;
-    bool goToSunrise = false;
-    bool isAlarmTimeout = false;
-    bool inDeepSleep = false;
-    String lastOperationStatus = "";
     String wifiSsid = "";
     String wifiPassword = "";
     String deviceName = "";
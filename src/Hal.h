@@ -0,0 +1,184 @@
+#ifndef Hal_h
+#define Hal_h
+
+#include <WString.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "SunriseCurve.h"
+
+// The hardware abstraction layer: everything the states need from the
+// board goes through these functions. HalEsp32.cpp implements them for the
+// device and src/native/ for the Linux simulation (see platformio.ini).
+// The wifi and BLE radios are abstracted at the service level, by
+// WifiServices.h and ConfigurationBLE.h.
+
+const uint8_t HAL_LED_COUNT = 16;
+
+// the audio output plays mono 16 bits samples from this many DMA
+// buffers of this many samples each, refilled by halAudioWrite
+const uint16_t HAL_AUDIO_DMA_SAMPLES = 512;
+const uint8_t HAL_AUDIO_DMA_BUFFERS = 2;
+
+// HalWakeCause is why the firmware is running
+enum HalWakeCause : uint8_t
+{
+    HAL_WAKE_COLD_BOOT = 0,
+    HAL_WAKE_BUTTON,
+    HAL_WAKE_TIMER,
+    HAL_WAKE_OTHER,
+};
+
+// HalLedColor is a led color as sent to the strip, 8 bits per channel
+struct HalLedColor
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+// HalSensorDriver is a temperature (in celsius) and relative humidity
+// (in %) sensor, which may be read every minIntervalMs. read may block
+// for as long as the sensor needs and returns false if the read failed.
+struct HalSensorDriver
+{
+    const char *name;
+    uint32_t minIntervalMs;
+    void (*begin)();
+    bool (*read)(float *temperature, float *humidity);
+};
+
+// halTaskStart cores: any core, the one the radios run on, or the one
+// the loop runs on
+const int8_t HAL_TASK_ANY_CORE = -1;
+const int8_t HAL_TASK_RADIO_CORE = 0;
+const int8_t HAL_TASK_LOOP_CORE = 1;
+
+// the stack of a task started by halTaskStart, enough for a step that
+// formats log lines; a step that writes the flash needs more
+const uint32_t HAL_TASK_STACK_SIZE = 4096;
+
+// HalLock is a mutex the task holding it may take again. Unlike a
+// spinlock, it may be held across flash writes.
+typedef void *HalLock;
+
+/* ===== Clock ===== */
+
+uint32_t halMillis();
+
+uint64_t halMicros();
+
+void halDelay(uint32_t milliseconds);
+
+int64_t halWallClockMs();
+
+void halSetWallClockMs(int64_t unixMs);
+
+/* ===== Sleep and wake ===== */
+
+HalWakeCause halWakeCause();
+
+bool halDeepSleep(uint64_t microseconds);
+
+void halButtonAttach(void (*handler)());
+
+/* ===== Tasks ===== */
+
+bool halTaskStart(const char *name, void (*step)(), uint32_t periodMs, uint8_t priority, int8_t core,
+                  uint32_t stackSize);
+
+/* ===== Locks ===== */
+
+HalLock halLockCreate();
+
+void halLockTake(HalLock lock);
+
+void halLockGive(HalLock lock);
+
+/* ===== Console ===== */
+
+uint8_t halConsoleLevel();
+
+void halConsoleWrite(uint8_t level, const char *text, size_t length);
+
+/* ===== Key-value store ===== */
+
+void halKvBegin(const char *name);
+
+size_t halKvGetBytesLength(const char *key);
+
+size_t halKvGetBytes(const char *key, void *buffer, size_t length);
+
+size_t halKvPutBytes(const char *key, const void *value, size_t length);
+
+String halKvGetString(const char *key);
+
+size_t halKvPutString(const char *key, const String &value);
+
+bool halKvGetBool(const char *key);
+
+size_t halKvPutBool(const char *key, bool value);
+
+uint32_t halKvGetUInt(const char *key);
+
+bool halKvRemove(const char *key);
+
+/* ===== Radio ===== */
+
+bool halUdpOpen(const char *host, uint16_t port, uint16_t localPort);
+
+bool halUdpOpenMulticast(const char *group, uint16_t port);
+
+bool halUdpSend(const uint8_t *data, size_t length);
+
+int halUdpReceive(uint8_t *buffer, size_t length);
+
+void halUdpClose();
+
+bool halTcpListen(uint16_t port);
+
+int halTcpAccept();
+
+int halTcpRead(int connection, uint8_t *buffer, size_t length);
+
+int halTcpWrite(int connection, const uint8_t *data, size_t length);
+
+void halTcpClose(int connection);
+
+/* ===== LEDs ===== */
+
+void halLedInit();
+
+void halLedShow(const HalLedColor frame[], uint8_t count);
+
+/* ===== Audio ===== */
+
+bool halAudioBegin(uint32_t sampleRate);
+
+size_t halAudioWrite(const int16_t *samples, size_t count);
+
+void halAudioStop();
+
+size_t halSongRead(uint32_t offset, void *buffer, size_t length);
+
+bool halSongErase(uint32_t offset, uint32_t length);
+
+bool halSongWrite(uint32_t offset, const void *data, size_t length);
+
+uint32_t halSongStoreSize();
+
+/* ===== Firmware update ===== */
+
+size_t halFirmwareRead(uint32_t offset, void *buffer, size_t length);
+
+bool halFirmwareBegin();
+
+bool halFirmwareWrite(const void *data, size_t length);
+
+bool halFirmwareEnd(bool activate);
+
+/* ===== Sensor ===== */
+
+const HalSensorDriver *halSensorDriver();
+
+#endif
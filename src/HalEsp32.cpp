@@ -0,0 +1,655 @@
+#include "Hal.h"
+
+#include <Arduino.h>
+#include <DHTesp.h>
+#include <FastLED.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <driver/i2s.h>
+#include <esp_idf_version.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include <sys/time.h>
+
+#include "Logger.h"
+
+#define BUTTON_INTERRUPT_PIN 13
+#define DHT_PIN 4
+#define LEDS_PIN 12
+#define I2S_BCK_PIN 26
+#define I2S_WS_PIN 25
+#define I2S_DATA_PIN 22
+
+const i2s_port_t AUDIO_I2S_PORT = I2S_NUM_0;
+
+// the songs partition (see partitions.csv)
+const char *SONGS_PARTITION_LABEL = "songs";
+const uint8_t SONGS_PARTITION_SUBTYPE = 0x40;
+
+// the connections waiting to be accepted by halTcpAccept
+const int TCP_LISTEN_BACKLOG = 4;
+
+// HalTask is what a task started by halTaskStart runs
+struct HalTask
+{
+  void (*step)();
+  TickType_t period;
+};
+
+Preferences preferences;
+WiFiUDP udp;
+IPAddress udpServer;
+uint16_t udpPort = 0;
+int tcpListener = -1;
+DHTesp dht;
+CRGB leds[HAL_LED_COUNT];
+bool ledsStarted = false;
+bool audioStarted = false;
+const esp_partition_t *songsPartition = nullptr;
+esp_ota_handle_t firmwareUpdateHandle = 0;
+bool firmwareUpdateStarted = false;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// dhtBegin sets up the DHT11 temperature and humidity sensor
+void dhtBegin()
+{
+  dht.setup(DHT_PIN, DHTesp::DHT11);
+}
+
+// dhtRead reads the DHT11. Reading takes about 250 milliseconds and
+// readings may be up to 2 seconds 'old' (it's a very slow sensor)
+bool dhtRead(float *temperature, float *humidity)
+{
+  TempAndHumidity newValues = dht.getTempAndHumidity();
+  if (dht.getStatus() != 0)
+  {
+    LOG_ERROR("DHT11 error status: %s\n", dht.getStatusString());
+    return false;
+  }
+  *temperature = newValues.temperature;
+  *humidity = newValues.humidity;
+  return true;
+}
+
+const HalSensorDriver DHT11_DRIVER = {"DHT11", 2000, dhtBegin, dhtRead};
+
+// findSongsPartition returns the songs partition, null if there is none
+const esp_partition_t *findSongsPartition()
+{
+  if (songsPartition == nullptr)
+  {
+    songsPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SONGS_PARTITION_SUBTYPE,
+                                              SONGS_PARTITION_LABEL);
+  }
+  return songsPartition;
+}
+
+// runTask runs the step of a task every period, forever
+void runTask(void *parameter)
+{
+  HalTask *task = (HalTask *)parameter;
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;)
+  {
+    task->step();
+    vTaskDelayUntil(&lastWake, task->period);
+  }
+}
+
+/* =========================================================================
+   Public functions: clock
+   ========================================================================= */
+
+// halMillis returns the milliseconds since the last boot or wake
+uint32_t halMillis()
+{
+  return millis();
+}
+
+// halMicros returns the microseconds since the last boot or wake
+uint64_t halMicros()
+{
+  return esp_timer_get_time();
+}
+
+// halDelay blocks the caller for the given milliseconds
+void halDelay(uint32_t milliseconds)
+{
+  delay(milliseconds);
+}
+
+// halWallClockMs returns the local clock in unix milliseconds.
+// The clock is kept by the RTC while in deep sleep.
+int64_t halWallClockMs()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// halSetWallClockMs sets the local clock to unix milliseconds
+void halSetWallClockMs(int64_t unixMs)
+{
+  struct timeval now = {(time_t)(unixMs / 1000), (suseconds_t)((unixMs % 1000) * 1000)};
+  settimeofday(&now, NULL);
+}
+
+/* =========================================================================
+   Public functions: sleep and wake
+   ========================================================================= */
+
+// halWakeCause returns why the chip is running
+HalWakeCause halWakeCause()
+{
+  switch (esp_sleep_get_wakeup_cause())
+  {
+  case ESP_SLEEP_WAKEUP_UNDEFINED:
+    return HAL_WAKE_COLD_BOOT;
+  case ESP_SLEEP_WAKEUP_EXT0:
+    return HAL_WAKE_BUTTON;
+  case ESP_SLEEP_WAKEUP_TIMER:
+    return HAL_WAKE_TIMER;
+  default:
+    return HAL_WAKE_OTHER;
+  }
+}
+
+// halDeepSleep enters deep sleep until the button is pressed or the given
+// microseconds pass. Only returns, with false, if the timer could not be set.
+bool halDeepSleep(uint64_t microseconds)
+{
+  esp_sleep_enable_ext0_wakeup(GPIO_NUM_13, 1);
+  esp_err_t result = esp_sleep_enable_timer_wakeup(microseconds);
+  if (result != ESP_OK)
+  {
+    LOG_ERROR("error enabling timer wakeup: %d\n", result);
+    return false;
+  }
+  Serial.flush();
+  esp_deep_sleep_start();
+  return false;
+}
+
+// halButtonAttach calls the handler, from an interrupt, when the button changes
+void halButtonAttach(void (*handler)())
+{
+  pinMode(BUTTON_INTERRUPT_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(BUTTON_INTERRUPT_PIN), handler, CHANGE);
+}
+
+/* =========================================================================
+   Public functions: tasks
+   ========================================================================= */
+
+// halTaskStart runs the step function every period from a FreeRTOS task
+// with the given priority and stack size (in bytes), pinned to the given
+// core (or HAL_TASK_ANY_CORE)
+bool halTaskStart(const char *name, void (*step)(), uint32_t periodMs, uint8_t priority, int8_t core,
+                  uint32_t stackSize)
+{
+  HalTask *task = new HalTask{step, pdMS_TO_TICKS(periodMs)};
+  BaseType_t result = xTaskCreatePinnedToCore(runTask, name, stackSize, task, priority, NULL,
+                                              core == HAL_TASK_ANY_CORE ? tskNO_AFFINITY : core);
+  if (result != pdPASS)
+  {
+    delete task;
+    return false;
+  }
+  return true;
+}
+
+/* =========================================================================
+   Public functions: locks
+   ========================================================================= */
+
+// halLockCreate returns a new recursive FreeRTOS mutex, NULL if there is
+// no memory left for it
+HalLock halLockCreate()
+{
+  return xSemaphoreCreateRecursiveMutex();
+}
+
+// halLockTake waits for the lock as long as it takes
+void halLockTake(HalLock lock)
+{
+  xSemaphoreTakeRecursive((SemaphoreHandle_t)lock, portMAX_DELAY);
+}
+
+void halLockGive(HalLock lock)
+{
+  xSemaphoreGiveRecursive((SemaphoreHandle_t)lock);
+}
+
+/* =========================================================================
+   Public functions: console
+   ========================================================================= */
+
+// halConsoleLevel returns the most verbose log level the console shows:
+// all the logs compiled in (see LOGGER_LEVEL)
+uint8_t halConsoleLevel()
+{
+  return LOG_LEVEL_VERBOSE;
+}
+
+// halConsoleWrite writes a log line to the serial port
+void halConsoleWrite(uint8_t level, const char *text, size_t length)
+{
+  Serial.write((const uint8_t *)text, length);
+}
+
+/* =========================================================================
+   Public functions: key-value store
+   ========================================================================= */
+
+// halKvBegin opens the key-value store namespace used by the other halKv functions
+void halKvBegin(const char *name)
+{
+  preferences.begin(name);
+}
+
+size_t halKvGetBytesLength(const char *key)
+{
+  return preferences.getBytesLength(key);
+}
+
+size_t halKvGetBytes(const char *key, void *buffer, size_t length)
+{
+  return preferences.getBytes(key, buffer, length);
+}
+
+size_t halKvPutBytes(const char *key, const void *value, size_t length)
+{
+  return preferences.putBytes(key, value, length);
+}
+
+String halKvGetString(const char *key)
+{
+  return preferences.getString(key);
+}
+
+size_t halKvPutString(const char *key, const String &value)
+{
+  return preferences.putString(key, value);
+}
+
+bool halKvGetBool(const char *key)
+{
+  return preferences.getBool(key);
+}
+
+size_t halKvPutBool(const char *key, bool value)
+{
+  return preferences.putBool(key, value);
+}
+
+uint32_t halKvGetUInt(const char *key)
+{
+  return preferences.getUInt(key);
+}
+
+bool halKvRemove(const char *key)
+{
+  return preferences.remove(key);
+}
+
+/* =========================================================================
+   Public functions: radio
+   ========================================================================= */
+
+// halUdpOpen resolves the host and opens a socket to exchange datagrams
+// with it. Requires a wifi connection.
+bool halUdpOpen(const char *host, uint16_t port, uint16_t localPort)
+{
+  if (!WiFi.hostByName(host, udpServer))
+  {
+    LOG_ERROR("could not resolve %s\n", host);
+    return false;
+  }
+  udpPort = port;
+  return udp.begin(localPort);
+}
+
+// halUdpOpenMulticast joins a multicast group on the port, to send
+// datagrams to the group and receive the ones sent to it. Requires a
+// wifi connection.
+bool halUdpOpenMulticast(const char *group, uint16_t port)
+{
+  if (!udpServer.fromString(group))
+  {
+    LOG_ERROR("invalid multicast group %s\n", group);
+    return false;
+  }
+  udpPort = port;
+  return udp.beginMulticast(udpServer, port);
+}
+
+// halUdpSend sends a datagram to the host or the group given to halUdpOpen
+// or halUdpOpenMulticast
+bool halUdpSend(const uint8_t *data, size_t length)
+{
+  return udp.beginPacket(udpServer, udpPort) && udp.write(data, length) == length && udp.endPacket();
+}
+
+// halUdpReceive reads a received datagram without blocking,
+// returning its length or 0 if none was received
+int halUdpReceive(uint8_t *buffer, size_t length)
+{
+  if (udp.parsePacket() <= 0)
+  {
+    return 0;
+  }
+  return udp.read(buffer, length);
+}
+
+void halUdpClose()
+{
+  udp.stop();
+}
+
+// halTcpListen starts listening for TCP connections on the port, on all
+// the interfaces; the socket is non-blocking, as are the connections it
+// accepts, so none of the TCP functions ever waits
+bool halTcpListen(uint16_t port)
+{
+  if (tcpListener >= 0)
+  {
+    return true;
+  }
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+  {
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, TCP_LISTEN_BACKLOG) != 0 ||
+      fcntl(listener, F_SETFL, O_NONBLOCK) != 0)
+  {
+    LOG_ERROR("could not listen on port %d (error %d)\n", port, errno);
+    close(listener);
+    return false;
+  }
+  tcpListener = listener;
+  return true;
+}
+
+// halTcpAccept returns a connection waiting, or -1 if there is none
+int halTcpAccept()
+{
+  if (tcpListener < 0)
+  {
+    return -1;
+  }
+  int connection = accept(tcpListener, NULL, NULL);
+  if (connection < 0)
+  {
+    return -1;
+  }
+  int noDelay = 1;
+  setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  fcntl(connection, F_SETFL, O_NONBLOCK);
+  return connection;
+}
+
+// halTcpRead reads what was received on a connection, returning its
+// length, 0 if nothing was, or -1 if the connection is closed
+int halTcpRead(int connection, uint8_t *buffer, size_t length)
+{
+  int received = recv(connection, buffer, length, 0);
+  if (received > 0)
+  {
+    return received;
+  }
+  return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+// halTcpWrite queues data on a connection, returning how much the socket
+// took, 0 if its buffer is full, or -1 if the connection is closed
+int halTcpWrite(int connection, const uint8_t *data, size_t length)
+{
+  int sent = send(connection, data, length, 0);
+  if (sent >= 0)
+  {
+    return sent;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+void halTcpClose(int connection)
+{
+  close(connection);
+}
+
+/* =========================================================================
+   Public functions: leds
+   ========================================================================= */
+
+// halLedInit sets up the led strip
+void halLedInit()
+{
+  if (!ledsStarted)
+  {
+    FastLED.addLeds<NEOPIXEL, LEDS_PIN>(leds, HAL_LED_COUNT);
+    FastLED.setDither(DISABLE_DITHER);
+    ledsStarted = true;
+  }
+}
+
+// halLedShow sends a frame to the strip. The dithering is done by the
+// caller (see LedRender.cpp), so the one of FastLED is disabled.
+void halLedShow(const HalLedColor frame[], uint8_t count)
+{
+  for (uint8_t i = 0; i < count && i < HAL_LED_COUNT; i++)
+  {
+    leds[i] = CRGB(frame[i].r, frame[i].g, frame[i].b);
+  }
+  FastLED.show();
+}
+
+/* =========================================================================
+   Public functions: audio
+   ========================================================================= */
+
+// halAudioBegin starts the I2S output to the amplifier at a sample rate.
+// The DMA plays from HAL_AUDIO_DMA_BUFFERS buffers while the others are
+// refilled, and plays silence if they all run dry.
+bool halAudioBegin(uint32_t sampleRate)
+{
+  if (audioStarted)
+  {
+    return i2s_set_sample_rates(AUDIO_I2S_PORT, sampleRate) == ESP_OK;
+  }
+
+  i2s_config_t config = {};
+  config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX);
+  config.sample_rate = sampleRate;
+  config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+  config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+  config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+  config.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1;
+  config.dma_buf_count = HAL_AUDIO_DMA_BUFFERS;
+  config.dma_buf_len = HAL_AUDIO_DMA_SAMPLES;
+  config.tx_desc_auto_clear = true;
+
+  i2s_pin_config_t pins = {};
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+  pins.mck_io_num = I2S_PIN_NO_CHANGE;
+#endif
+  pins.bck_io_num = I2S_BCK_PIN;
+  pins.ws_io_num = I2S_WS_PIN;
+  pins.data_out_num = I2S_DATA_PIN;
+  pins.data_in_num = I2S_PIN_NO_CHANGE;
+
+  esp_err_t result = i2s_driver_install(AUDIO_I2S_PORT, &config, 0, NULL);
+  if (result != ESP_OK)
+  {
+    LOG_ERROR("error installing the i2s driver: %d\n", result);
+    return false;
+  }
+  result = i2s_set_pin(AUDIO_I2S_PORT, &pins);
+  if (result != ESP_OK)
+  {
+    LOG_ERROR("error setting the i2s pins: %d\n", result);
+    i2s_driver_uninstall(AUDIO_I2S_PORT);
+    return false;
+  }
+  audioStarted = true;
+  return true;
+}
+
+// halAudioWrite copies as many samples as fit in the free DMA buffers,
+// without waiting, returning how many it took
+size_t halAudioWrite(const int16_t *samples, size_t count)
+{
+  size_t written = 0;
+  i2s_write(AUDIO_I2S_PORT, samples, count * sizeof(int16_t), &written, 0);
+  return written / sizeof(int16_t);
+}
+
+// halAudioStop silences the output and releases the I2S driver
+void halAudioStop()
+{
+  if (!audioStarted)
+  {
+    return;
+  }
+  i2s_zero_dma_buffer(AUDIO_I2S_PORT);
+  i2s_driver_uninstall(AUDIO_I2S_PORT);
+  audioStarted = false;
+}
+
+// halSongRead reads from the songs partition, returning how many bytes it read
+size_t halSongRead(uint32_t offset, void *buffer, size_t length)
+{
+  const esp_partition_t *partition = findSongsPartition();
+  if (partition == nullptr || esp_partition_read(partition, offset, buffer, length) != ESP_OK)
+  {
+    return 0;
+  }
+  return length;
+}
+
+// halSongErase erases whole sectors of the songs partition
+bool halSongErase(uint32_t offset, uint32_t length)
+{
+  const esp_partition_t *partition = findSongsPartition();
+  return partition != nullptr && esp_partition_erase_range(partition, offset, length) == ESP_OK;
+}
+
+// halSongWrite writes to erased flash of the songs partition
+bool halSongWrite(uint32_t offset, const void *data, size_t length)
+{
+  const esp_partition_t *partition = findSongsPartition();
+  return partition != nullptr && esp_partition_write(partition, offset, data, length) == ESP_OK;
+}
+
+// halSongStoreSize returns the size of the songs partition, 0 if there is none
+uint32_t halSongStoreSize()
+{
+  const esp_partition_t *partition = findSongsPartition();
+  return partition == nullptr ? 0 : partition->size;
+}
+
+/* =========================================================================
+   Public functions: firmware update
+   ========================================================================= */
+
+// halFirmwareRead reads the image running, returning how many bytes it read
+size_t halFirmwareRead(uint32_t offset, void *buffer, size_t length)
+{
+  const esp_partition_t *partition = esp_ota_get_running_partition();
+  if (partition == nullptr || esp_partition_read(partition, offset, buffer, length) != ESP_OK)
+  {
+    return 0;
+  }
+  return length;
+}
+
+// halFirmwareBegin starts a new image in the OTA slot not running. Its
+// sectors are erased as the writes reach them, rather than all at once;
+// an IDF without sequential writes erases the whole slot here, for
+// seconds, which is why the update starts it in the loop task (see
+// firmwareUpdatePrepare).
+bool halFirmwareBegin()
+{
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(nullptr);
+  if (partition == nullptr)
+  {
+    LOG_ERROR("no OTA slot to update\n");
+    return false;
+  }
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+  esp_err_t result = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &firmwareUpdateHandle);
+#else
+  esp_err_t result = esp_ota_begin(partition, OTA_SIZE_UNKNOWN, &firmwareUpdateHandle);
+#endif
+  if (result != ESP_OK)
+  {
+    LOG_ERROR("error starting the firmware update: %d\n", result);
+    return false;
+  }
+  firmwareUpdateStarted = true;
+  return true;
+}
+
+// halFirmwareWrite appends to the new image
+bool halFirmwareWrite(const void *data, size_t length)
+{
+  return firmwareUpdateStarted && esp_ota_write(firmwareUpdateHandle, data, length) == ESP_OK;
+}
+
+// halFirmwareEnd ends the new image. Activated, it is checked and booted
+// next; otherwise it is dropped.
+bool halFirmwareEnd(bool activate)
+{
+  if (!firmwareUpdateStarted)
+  {
+    return false;
+  }
+  firmwareUpdateStarted = false;
+  if (!activate)
+  {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
+    esp_ota_abort(firmwareUpdateHandle);
+#else
+    esp_ota_end(firmwareUpdateHandle);
+#endif
+    return true;
+  }
+  esp_err_t result = esp_ota_end(firmwareUpdateHandle);
+  if (result == ESP_OK)
+  {
+    result = esp_ota_set_boot_partition(esp_ota_get_next_update_partition(nullptr));
+  }
+  if (result != ESP_OK)
+  {
+    LOG_ERROR("error activating the new firmware: %d\n", result);
+    return false;
+  }
+  return true;
+}
+
+/* =========================================================================
+   Public functions: sensor
+   ========================================================================= */
+
+// halSensorDriver returns the DHT11 on the board
+const HalSensorDriver *halSensorDriver()
+{
+  return &DHT11_DRIVER;
+}
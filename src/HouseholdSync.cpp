@@ -0,0 +1,553 @@
+#include "HouseholdSync.h"
+
+#include <string.h>
+
+#include "Crc.h"
+#include "Sha256.h"
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint32_t getUint32(const uint8_t *data)
+{
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static void putUint32(uint8_t *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+// isNewer returns true if a change stamped a wins over one stamped b
+static bool isNewer(const HouseholdSyncStamp &a, const HouseholdSyncStamp &b)
+{
+    return a.counter > b.counter || (a.counter == b.counter && a.node > b.node);
+}
+
+// raise records that the changes of a node up to counter are known,
+// returning false if there is no room left for another node
+static bool raise(HouseholdSyncVector *vector, uint32_t node, uint32_t counter)
+{
+    for (uint8_t i = 0; i < vector->count; i++)
+    {
+        if (vector->entries[i].node == node)
+        {
+            if (counter > vector->entries[i].counter)
+            {
+                vector->entries[i].counter = counter;
+            }
+            return true;
+        }
+    }
+    if (vector->count == HOUSEHOLD_SYNC_MAX_NODES)
+    {
+        return false;
+    }
+    vector->entries[vector->count++] = HouseholdSyncStamp{counter, node};
+    return true;
+}
+
+// observe moves the Lamport clock past a counter seen
+static void observe(HouseholdSync *sync, uint32_t counter)
+{
+    if (counter > sync->clock)
+    {
+        sync->clock = counter;
+    }
+}
+
+// readCrc returns the crc of the content of an item as it is now
+static uint32_t readCrc(const HouseholdSyncSession *session, uint8_t item)
+{
+    uint8_t content[HOUSEHOLD_SYNC_MAX_ITEM_SIZE];
+    size_t length = session->readItem(item, content, sizeof(content));
+    return crc32(content, length < sizeof(content) ? length : sizeof(content));
+}
+
+// stampChanges stamps the items changed here since they were last
+// synced, as new changes of this node
+static void stampChanges(HouseholdSyncSession *session)
+{
+    HouseholdSync *sync = session->sync;
+    for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+    {
+        uint32_t crc = readCrc(session, item);
+        if (crc == sync->items[item].crc)
+        {
+            continue;
+        }
+        sync->clock++;
+        sync->items[item].stamp = HouseholdSyncStamp{sync->clock, sync->node};
+        sync->items[item].crc = crc;
+        raise(&sync->known, sync->node, sync->clock);
+        session->stats.localChanges++;
+    }
+}
+
+// seal appends the tag to a packet of length, returning the length with it
+static size_t seal(const HouseholdSyncSession *session, uint8_t *packet, size_t length)
+{
+    uint8_t mac[SHA256_SIZE];
+    hmacSha256(session->sync->key, HOUSEHOLD_SYNC_KEY_SIZE, packet, length, mac);
+    memcpy(packet + length, mac, HOUSEHOLD_SYNC_TAG_SIZE);
+    return length + HOUSEHOLD_SYNC_TAG_SIZE;
+}
+
+// isSealed returns true if a packet ends with its tag, comparing all of it
+// whatever differs so the time taken tells nothing of the right one
+static bool isSealed(const HouseholdSyncSession *session, const uint8_t *packet, size_t length)
+{
+    if (length < HOUSEHOLD_SYNC_TAG_SIZE)
+    {
+        return false;
+    }
+    uint8_t mac[SHA256_SIZE];
+    length -= HOUSEHOLD_SYNC_TAG_SIZE;
+    hmacSha256(session->sync->key, HOUSEHOLD_SYNC_KEY_SIZE, packet, length, mac);
+    uint8_t difference = 0;
+    for (size_t i = 0; i < HOUSEHOLD_SYNC_TAG_SIZE; i++)
+    {
+        difference |= mac[i] ^ packet[length + i];
+    }
+    return difference == 0;
+}
+
+// encodeVector writes a vector, returning its length
+static size_t encodeVector(const HouseholdSyncVector *vector, uint8_t *buffer)
+{
+    buffer[0] = vector->count;
+    for (uint8_t i = 0; i < vector->count; i++)
+    {
+        putUint32(buffer + 1 + i * 8, vector->entries[i].node);
+        putUint32(buffer + 5 + i * 8, vector->entries[i].counter);
+    }
+    return 1 + vector->count * 8;
+}
+
+// decodeVector reads a vector, returning its length, or 0 if it is malformed
+static size_t decodeVector(const uint8_t *data, size_t length, HouseholdSyncVector *vector)
+{
+    if (length < 1 || data[0] > HOUSEHOLD_SYNC_MAX_NODES || length < 1 + data[0] * 8u)
+    {
+        return 0;
+    }
+    memset(vector, 0, sizeof(HouseholdSyncVector));
+    vector->count = data[0];
+    for (uint8_t i = 0; i < vector->count; i++)
+    {
+        vector->entries[i].node = getUint32(data + 1 + i * 8);
+        vector->entries[i].counter = getUint32(data + 5 + i * 8);
+    }
+    return 1 + vector->count * 8;
+}
+
+// encodeHeader writes the header and the vector of this node, returning their length
+static size_t encodeHeader(const HouseholdSyncSession *session, HouseholdSyncPacket type, uint8_t *buffer)
+{
+    buffer[0] = HOUSEHOLD_SYNC_MAGIC & 0xFF;
+    buffer[1] = HOUSEHOLD_SYNC_MAGIC >> 8;
+    buffer[2] = HOUSEHOLD_SYNC_VERSION;
+    buffer[3] = type;
+    putUint32(buffer + 4, session->household);
+    putUint32(buffer + 8, session->sync->node);
+    return HOUSEHOLD_SYNC_HEADER_SIZE + encodeVector(&session->sync->known, buffer + HOUSEHOLD_SYNC_HEADER_SIZE);
+}
+
+// merge raises a vector to all the changes another knows
+static void merge(HouseholdSyncVector *vector, const HouseholdSyncVector *other)
+{
+    for (uint8_t i = 0; i < other->count; i++)
+    {
+        raise(vector, other->entries[i].node, other->entries[i].counter);
+    }
+}
+
+// peersLearn records that the other nodes heard a delta multicast with
+// the vector of its sender: the ones knowing its base learned that vector,
+// unless they lost it
+static void peersLearn(HouseholdSyncSession *session, const HouseholdSyncVector *base, const HouseholdSyncVector *vector)
+{
+    for (uint8_t i = 0; i < session->peerCount; i++)
+    {
+        if (householdSyncCovers(&session->peers[i].learned, base))
+        {
+            merge(&session->peers[i].learned, vector);
+        }
+    }
+}
+
+// makeDelta writes a delta with the items changed since base, returning
+// its length, or 0 if the buffer is too small
+static size_t makeDelta(HouseholdSyncSession *session, const HouseholdSyncVector *base, uint8_t *buffer, size_t size)
+{
+    if (size < HOUSEHOLD_SYNC_MAX_PACKET_SIZE)
+    {
+        return 0;
+    }
+    const HouseholdSync *sync = session->sync;
+    size_t length = encodeHeader(session, HOUSEHOLD_SYNC_DELTA, buffer);
+    length += encodeVector(base, buffer + length);
+    uint8_t *itemCount = buffer + length++;
+    *itemCount = 0;
+    for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+    {
+        const HouseholdSyncStamp &stamp = sync->items[item].stamp;
+        if (stamp.counter == 0 || stamp.counter <= householdSyncKnown(base, stamp.node))
+        {
+            continue;
+        }
+        uint8_t *header = buffer + length;
+        size_t contentLength = session->readItem(item, header + HOUSEHOLD_SYNC_ITEM_HEADER_SIZE, HOUSEHOLD_SYNC_MAX_ITEM_SIZE);
+        header[0] = item;
+        putUint32(header + 1, stamp.counter);
+        putUint32(header + 5, stamp.node);
+        header[9] = contentLength;
+        length += HOUSEHOLD_SYNC_ITEM_HEADER_SIZE + contentLength;
+        (*itemCount)++;
+    }
+    session->stats.deltasMade++;
+    session->stats.itemsSent += *itemCount;
+    peersLearn(session, base, &sync->known);
+    session->sentDelta = true;
+    return seal(session, buffer, length);
+}
+
+// checkItems returns true if the items of a delta are well formed and
+// end the packet
+static bool checkItems(const uint8_t *data, size_t length)
+{
+    if (length < 1)
+    {
+        return false;
+    }
+    size_t offset = 1;
+    for (uint8_t i = 0; i < data[0]; i++)
+    {
+        if (length - offset < HOUSEHOLD_SYNC_ITEM_HEADER_SIZE)
+        {
+            return false;
+        }
+        const uint8_t *header = data + offset;
+        if (header[0] >= HOUSEHOLD_SYNC_ITEMS || header[9] > HOUSEHOLD_SYNC_MAX_ITEM_SIZE ||
+            length - offset - HOUSEHOLD_SYNC_ITEM_HEADER_SIZE < header[9])
+        {
+            return false;
+        }
+        offset += HOUSEHOLD_SYNC_ITEM_HEADER_SIZE + header[9];
+    }
+    return offset == length;
+}
+
+// applyItems applies the items of a delta newer than the ones here
+static void applyItems(HouseholdSyncSession *session, const uint8_t *data)
+{
+    HouseholdSync *sync = session->sync;
+    size_t offset = 1;
+    for (uint8_t i = 0; i < data[0]; i++)
+    {
+        const uint8_t *header = data + offset;
+        offset += HOUSEHOLD_SYNC_ITEM_HEADER_SIZE + header[9];
+        uint8_t item = header[0];
+        HouseholdSyncStamp stamp = {getUint32(header + 1), getUint32(header + 5)};
+        observe(sync, stamp.counter);
+        if (!isNewer(stamp, sync->items[item].stamp))
+        {
+            continue;
+        }
+
+        // an item that is not valid is not stored but counts as synced,
+        // so it is not sent again and again
+        if (session->writeItem(item, header + HOUSEHOLD_SYNC_ITEM_HEADER_SIZE, header[9]))
+        {
+            session->stats.itemsApplied++;
+        }
+        else
+        {
+            session->stats.itemsRejected++;
+        }
+        sync->items[item].stamp = stamp;
+        sync->items[item].crc = readCrc(session, item);
+    }
+}
+
+// makeSummary writes the header and vector of this node as a packet of
+// type, returning its length, or 0 if the buffer is too small
+static size_t makeSummary(HouseholdSyncSession *session, HouseholdSyncPacket type, uint8_t *buffer, size_t size)
+{
+    if (size < HOUSEHOLD_SYNC_HEADER_SIZE + HOUSEHOLD_SYNC_VECTOR_MAX_SIZE + HOUSEHOLD_SYNC_TAG_SIZE)
+    {
+        return 0;
+    }
+    session->stats.summariesMade++;
+    return seal(session, buffer, encodeHeader(session, type, buffer));
+}
+
+// recordPeer keeps the vector a node sent, the last one it is known to
+// have
+static void recordPeer(HouseholdSyncSession *session, uint32_t node, const HouseholdSyncVector *vector)
+{
+    for (uint8_t i = 0; i < session->peerCount; i++)
+    {
+        if (session->peers[i].node == node)
+        {
+            session->peers[i].vector = *vector;
+            merge(&session->peers[i].learned, vector);
+            return;
+        }
+    }
+    if (session->peerCount < HOUSEHOLD_SYNC_MAX_NODES)
+    {
+        session->peers[session->peerCount++] = HouseholdSyncPeer{node, *vector, *vector};
+    }
+}
+
+// answersFor returns true if this node is the one answering sender: no
+// other node heard in the window with a lower id knows all it knows, as
+// far as can be told from what it sent and heard
+static bool answersFor(const HouseholdSyncSession *session, uint32_t sender)
+{
+    const HouseholdSync *sync = session->sync;
+    for (uint8_t i = 0; i < session->peerCount; i++)
+    {
+        const HouseholdSyncPeer &peer = session->peers[i];
+        if (peer.node != sender && peer.node < sync->node && householdSyncCovers(&peer.learned, &sync->known))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// answer compares the vector of the sender with the one here, and makes
+// the reply: a delta if the sender misses changes and this node answers
+// for it, or else the summary if this node misses changes
+static HouseholdSyncResult answer(HouseholdSyncSession *session, uint32_t sender, const HouseholdSyncVector *vector,
+                                  HouseholdSyncPacket type, uint8_t *reply, size_t size, size_t *replyLength)
+{
+    const HouseholdSync *sync = session->sync;
+    bool senderMisses = !householdSyncCovers(vector, &sync->known);
+    bool retry = type == HOUSEHOLD_SYNC_RETRY || type == HOUSEHOLD_SYNC_PROBE;
+    if (senderMisses && (retry || answersFor(session, sender)))
+    {
+        *replyLength = makeDelta(session, vector, reply, size);
+        return HOUSEHOLD_SYNC_DIFFERENT;
+    }
+    if (!householdSyncCovers(&sync->known, vector))
+    {
+        *replyLength = makeSummary(session, HOUSEHOLD_SYNC_SUMMARY, reply, size);
+        return HOUSEHOLD_SYNC_DIFFERENT;
+    }
+    if (senderMisses)
+    {
+        return HOUSEHOLD_SYNC_ANSWERED;
+    }
+
+    // a node that heard no other must hear one
+    if (type == HOUSEHOLD_SYNC_PROBE && answersFor(session, sender))
+    {
+        *replyLength = makeSummary(session, HOUSEHOLD_SYNC_SUMMARY, reply, size);
+    }
+    return HOUSEHOLD_SYNC_IN_SYNC;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// householdSyncReset forgets all changes, starting afresh as node; any
+// item that is not empty is a change of this node on the next window
+void householdSyncReset(HouseholdSync *sync, uint32_t node)
+{
+    memset(sync, 0, sizeof(HouseholdSync));
+    sync->version = HOUSEHOLD_SYNC_STATE_VERSION;
+    sync->node = node;
+}
+
+// householdSyncHasKey returns true once the key of the household is set;
+// a unit without one does not sync
+bool householdSyncHasKey(const HouseholdSync *sync)
+{
+    uint8_t bits = 0;
+    for (size_t i = 0; i < HOUSEHOLD_SYNC_KEY_SIZE; i++)
+    {
+        bits |= sync->key[i];
+    }
+    return bits != 0;
+}
+
+// householdSyncHousehold returns the household id of the units on a
+// wifi network, from its credentials; packets of other ids are ignored
+uint32_t householdSyncHousehold(const char *ssid, const char *password)
+{
+    Sha256 sha;
+    uint8_t digest[SHA256_SIZE];
+    sha256Begin(&sha);
+    sha256Update(&sha, ssid, strlen(ssid) + 1);
+    sha256Update(&sha, password, strlen(password));
+    sha256End(&sha, digest);
+    return getUint32(digest);
+}
+
+// householdSyncNextWindow returns when the first window after epoch opens
+uint32_t householdSyncNextWindow(uint32_t epoch)
+{
+    uint32_t sincePhase = (epoch + HOUSEHOLD_SYNC_PERIOD_S - HOUSEHOLD_SYNC_PHASE_S % HOUSEHOLD_SYNC_PERIOD_S) %
+                          HOUSEHOLD_SYNC_PERIOD_S;
+    return epoch + HOUSEHOLD_SYNC_PERIOD_S - sincePhase;
+}
+
+// householdSyncKnown returns the highest counter of a node in a vector,
+// 0 if it has none
+uint32_t householdSyncKnown(const HouseholdSyncVector *vector, uint32_t node)
+{
+    for (uint8_t i = 0; i < vector->count; i++)
+    {
+        if (vector->entries[i].node == node)
+        {
+            return vector->entries[i].counter;
+        }
+    }
+    return 0;
+}
+
+// householdSyncCovers returns true if vector knows all the changes other does
+bool householdSyncCovers(const HouseholdSyncVector *vector, const HouseholdSyncVector *other)
+{
+    for (uint8_t i = 0; i < other->count; i++)
+    {
+        if (householdSyncKnown(vector, other->entries[i].node) < other->entries[i].counter)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// householdSyncBegin opens a window, stamping the items changed here
+// since the last one
+void householdSyncBegin(HouseholdSyncSession *session, HouseholdSync *sync, uint32_t household,
+                        size_t (*readItem)(uint8_t item, uint8_t *buffer, size_t size),
+                        bool (*writeItem)(uint8_t item, const uint8_t *content, size_t length))
+{
+    memset(session, 0, sizeof(HouseholdSyncSession));
+    session->sync = sync;
+    session->household = household;
+    session->readItem = readItem;
+    session->writeItem = writeItem;
+    session->opening = sync->known;
+    stampChanges(session);
+}
+
+// householdSyncAnnounce writes the packet opening the window: a delta of
+// the changes made here for the vector known before them, or the summary
+// of this node if there are none. Returns its length, or 0 if the buffer
+// is too small.
+size_t householdSyncAnnounce(HouseholdSyncSession *session, uint8_t *buffer, size_t size)
+{
+    if (session->stats.localChanges > 0)
+    {
+        return makeDelta(session, &session->opening, buffer, size);
+    }
+    return makeSummary(session, HOUSEHOLD_SYNC_SUMMARY, buffer, size);
+}
+
+// householdSyncWantsRetry returns true if the summary of this node should
+// be sent again, in case a packet was lost: no other node was heard, one
+// was heard knowing changes this one misses or missing changes it knows,
+// or a delta was sent since the last summary
+bool householdSyncWantsRetry(const HouseholdSyncSession *session)
+{
+    if (session->peerCount == 0 || session->sentDelta)
+    {
+        return true;
+    }
+    const HouseholdSyncVector *known = &session->sync->known;
+    for (uint8_t i = 0; i < session->peerCount; i++)
+    {
+        const HouseholdSyncVector *vector = &session->peers[i].vector;
+        if (!householdSyncCovers(known, vector) || !householdSyncCovers(vector, known))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// householdSyncRetry writes the summary of this node as a retry, which
+// every node knowing more answers, or as a probe if it heard no other
+// node yet. Returns its length, or 0 if the buffer is too small.
+size_t householdSyncRetry(HouseholdSyncSession *session, uint8_t *buffer, size_t size)
+{
+    session->sentDelta = false;
+    return makeSummary(session, session->peerCount == 0 ? HOUSEHOLD_SYNC_PROBE : HOUSEHOLD_SYNC_RETRY, buffer, size);
+}
+
+// householdSyncReceive handles a packet received in the window: it
+// applies the items of a delta and writes the reply to send, if any, to
+// reply. replyLength is 0 if there is nothing to send.
+HouseholdSyncResult householdSyncReceive(HouseholdSyncSession *session, const uint8_t *packet, size_t length,
+                                         uint8_t *reply, size_t size, size_t *replyLength)
+{
+    *replyLength = 0;
+    session->stats.packetsReceived++;
+    HouseholdSync *sync = session->sync;
+    if (!isSealed(session, packet, length))
+    {
+        session->stats.packetsIgnored++;
+        return HOUSEHOLD_SYNC_IGNORED;
+    }
+    length -= HOUSEHOLD_SYNC_TAG_SIZE;
+    if (length < HOUSEHOLD_SYNC_HEADER_SIZE || (packet[0] | packet[1] << 8) != HOUSEHOLD_SYNC_MAGIC ||
+        packet[2] != HOUSEHOLD_SYNC_VERSION || getUint32(packet + 4) != session->household ||
+        getUint32(packet + 8) == sync->node)
+    {
+        session->stats.packetsIgnored++;
+        return HOUSEHOLD_SYNC_IGNORED;
+    }
+
+    HouseholdSyncVector vector;
+    size_t offset = HOUSEHOLD_SYNC_HEADER_SIZE;
+    size_t vectorLength = decodeVector(packet + offset, length - offset, &vector);
+    offset += vectorLength;
+    if (vectorLength == 0 || (packet[3] != HOUSEHOLD_SYNC_DELTA && offset != length))
+    {
+        session->stats.packetsIgnored++;
+        return HOUSEHOLD_SYNC_IGNORED;
+    }
+
+    if (packet[3] == HOUSEHOLD_SYNC_DELTA)
+    {
+        HouseholdSyncVector base;
+        size_t baseLength = decodeVector(packet + offset, length - offset, &base);
+        offset += baseLength;
+        if (baseLength == 0 || !checkItems(packet + offset, length - offset))
+        {
+            session->stats.packetsIgnored++;
+            return HOUSEHOLD_SYNC_IGNORED;
+        }
+        bool knewBase = householdSyncCovers(&sync->known, &base);
+        applyItems(session, packet + offset);
+        if (knewBase)
+        {
+            merge(&sync->known, &vector);
+        }
+        peersLearn(session, &base, &vector);
+    }
+    else if (packet[3] != HOUSEHOLD_SYNC_SUMMARY && packet[3] != HOUSEHOLD_SYNC_RETRY && packet[3] != HOUSEHOLD_SYNC_PROBE)
+    {
+        session->stats.packetsIgnored++;
+        return HOUSEHOLD_SYNC_IGNORED;
+    }
+
+    for (uint8_t i = 0; i < vector.count; i++)
+    {
+        observe(sync, vector.entries[i].counter);
+    }
+    uint32_t sender = getUint32(packet + 8);
+    recordPeer(session, sender, &vector);
+    return answer(session, sender, &vector, (HouseholdSyncPacket)packet[3], reply, size, replyLength);
+}
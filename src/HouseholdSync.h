@@ -0,0 +1,196 @@
+#ifndef HouseholdSync_h
+#define HouseholdSync_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Alarm.h"
+
+// The units of a household keep their alarms and time zone in sync over
+// UDP multicast on the local network, in short radio windows all the
+// units wake for (see householdSyncNextWindow).
+//
+// Each item synced (an alarm slot, the time zone rule) carries the stamp
+// of its last change: a Lamport counter and the node that made it. The
+// higher stamp wins, so concurrent changes end the same on every node.
+// Each node also keeps a version vector: per node, the highest counter
+// of its changes known here, whether an item still holds it or a later
+// change replaced it. Changes are found by the crc of the items, so any
+// way of changing them (BLE, a bundle, ...) is synced.
+//
+// Every packet, little endian:
+// magic (2) | version (1) | type (1) | household (4) | node (4) | vector
+// where vector is: count (1) | count * (node (4) | counter (4))
+// A summary, a retry or a probe is just that. A delta adds the vector it was made
+// for and the items changed since:
+// header | vector | base vector | item count (1) | items
+// where item is: id (1) | counter (4) | node (4) | length (1) | content
+// and every packet ends with a tag: the first 16 bytes of the
+// HMAC-SHA-256 of the rest under the key of the household, which the
+// phone sets on each unit over BLE. A packet with a wrong tag is ignored,
+// so a host of the network without the key can not change the alarms or
+// the time zone. A packet replayed carries no change newer than the ones
+// it was sent with, which the stamps already settle.
+//
+// A window opens with an announce: a delta of the changes made here
+// since the last window, or a summary if there are none. A node knowing
+// all of the base of a delta knows all the sender knew once it applied
+// the items, so it takes its vector; any other node only applies the
+// items, and asks with its summary. A node receiving a vector missing
+// changes it knows answers with a delta made for that vector, but as all
+// the nodes hear it, only one of the nodes known to be able to answers:
+// the lowest node id. In case a packet was lost, a node sends its summary
+// again as a retry after it sent a delta, and while the last vector a
+// node sent knows changes it misses or misses changes it knows: all the
+// nodes knowing more answer it. One
+// that heard no other node sends it as a probe, which the node in charge
+// of answering it also answers with its summary if it is in sync.
+const uint16_t HOUSEHOLD_SYNC_MAGIC = 0x5348; // "HS"
+const uint8_t HOUSEHOLD_SYNC_VERSION = 2;
+const uint8_t HOUSEHOLD_SYNC_STATE_VERSION = 2;
+
+const uint8_t HOUSEHOLD_SYNC_MAX_NODES = 8;
+
+// the items: the alarm slots, then the time zone rule
+const uint8_t HOUSEHOLD_SYNC_ITEM_TIME_ZONE = MAX_ALARMS;
+const uint8_t HOUSEHOLD_SYNC_ITEMS = MAX_ALARMS + 1;
+const size_t HOUSEHOLD_SYNC_MAX_ITEM_SIZE = 64;
+
+const size_t HOUSEHOLD_SYNC_KEY_SIZE = 32;
+const size_t HOUSEHOLD_SYNC_TAG_SIZE = 16;
+
+const size_t HOUSEHOLD_SYNC_HEADER_SIZE = 12;
+const size_t HOUSEHOLD_SYNC_VECTOR_MAX_SIZE = 1 + HOUSEHOLD_SYNC_MAX_NODES * 8;
+const size_t HOUSEHOLD_SYNC_ITEM_HEADER_SIZE = 10;
+const size_t HOUSEHOLD_SYNC_MAX_PACKET_SIZE = HOUSEHOLD_SYNC_HEADER_SIZE + 2 * HOUSEHOLD_SYNC_VECTOR_MAX_SIZE + 1 +
+                                              HOUSEHOLD_SYNC_ITEMS * (HOUSEHOLD_SYNC_ITEM_HEADER_SIZE + HOUSEHOLD_SYNC_MAX_ITEM_SIZE) +
+                                              HOUSEHOLD_SYNC_TAG_SIZE;
+
+// the windows open every period, phase seconds after a multiple of the
+// period in UTC, away from the hour changes of the time zones
+const uint32_t HOUSEHOLD_SYNC_PERIOD_S = 6 * 3600;
+const uint32_t HOUSEHOLD_SYNC_PHASE_S = 3 * 3600 + 20 * 60;
+
+enum HouseholdSyncPacket : uint8_t
+{
+    HOUSEHOLD_SYNC_SUMMARY = 1,
+    HOUSEHOLD_SYNC_DELTA = 2,
+    HOUSEHOLD_SYNC_RETRY = 3,
+    HOUSEHOLD_SYNC_PROBE = 4,
+};
+
+// HouseholdSyncResult is what a received packet showed
+enum HouseholdSyncResult : uint8_t
+{
+    HOUSEHOLD_SYNC_IGNORED = 0,   // malformed, with a wrong tag, from another household or from this node
+    HOUSEHOLD_SYNC_IN_SYNC = 1,   // the sender knows what this node knows
+    HOUSEHOLD_SYNC_DIFFERENT = 2, // one of them misses changes; the reply, if any, is made
+    HOUSEHOLD_SYNC_ANSWERED = 3,  // the sender misses changes another node answers with
+};
+
+struct HouseholdSyncStamp
+{
+    uint32_t counter;
+    uint32_t node;
+};
+
+// HouseholdSyncVector holds, per node, the highest counter known
+struct HouseholdSyncVector
+{
+    uint8_t count;
+    uint8_t reserved[3];
+    HouseholdSyncStamp entries[HOUSEHOLD_SYNC_MAX_NODES];
+};
+
+// HouseholdSyncItem is the stamp of the last change of an item, and the
+// crc of its content then
+struct HouseholdSyncItem
+{
+    HouseholdSyncStamp stamp;
+    uint32_t crc;
+};
+
+// HouseholdSync has a fixed layout so it can be stored as a binary blob.
+// clock is the Lamport clock: the highest counter seen, and key the key
+// of the household, all zeros until one is set.
+struct HouseholdSync
+{
+    uint8_t version;
+    uint8_t enabled;
+    uint8_t reserved[2];
+    uint32_t node;
+    uint32_t clock;
+    HouseholdSyncVector known;
+    HouseholdSyncItem items[HOUSEHOLD_SYNC_ITEMS];
+    uint8_t key[HOUSEHOLD_SYNC_KEY_SIZE];
+    uint32_t crc;
+};
+
+// HouseholdSyncStats count what happened in a window
+struct HouseholdSyncStats
+{
+    uint32_t localChanges;
+    uint32_t packetsReceived;
+    uint32_t packetsIgnored;
+    uint32_t summariesMade;
+    uint32_t deltasMade;
+    uint32_t itemsSent;
+    uint32_t itemsApplied;
+    uint32_t itemsRejected;
+};
+
+// HouseholdSyncPeer is another node heard in the window: the vector it
+// sent last, and the one it should have learned since from the deltas
+// multicast
+struct HouseholdSyncPeer
+{
+    uint32_t node;
+    HouseholdSyncVector vector;
+    HouseholdSyncVector learned;
+};
+
+// HouseholdSyncSession is a window of a node: sync is its state, kept
+// across windows, and household the id the packets must carry. readItem
+// writes the content of an item as it is now, returning its length, and
+// writeItem stores the content received for an item, returning false if
+// it is not valid. opening is the vector known before the changes made
+// here since the last window, and peers the vectors heard in the window.
+struct HouseholdSyncSession
+{
+    HouseholdSync *sync;
+    uint32_t household;
+    size_t (*readItem)(uint8_t item, uint8_t *buffer, size_t size);
+    bool (*writeItem)(uint8_t item, const uint8_t *content, size_t length);
+    HouseholdSyncVector opening;
+    bool sentDelta;
+    uint8_t peerCount;
+    HouseholdSyncPeer peers[HOUSEHOLD_SYNC_MAX_NODES];
+    HouseholdSyncStats stats;
+};
+
+void householdSyncReset(HouseholdSync *sync, uint32_t node);
+
+bool householdSyncHasKey(const HouseholdSync *sync);
+
+uint32_t householdSyncHousehold(const char *ssid, const char *password);
+
+uint32_t householdSyncNextWindow(uint32_t epoch);
+
+uint32_t householdSyncKnown(const HouseholdSyncVector *vector, uint32_t node);
+
+bool householdSyncCovers(const HouseholdSyncVector *vector, const HouseholdSyncVector *other);
+
+void householdSyncBegin(HouseholdSyncSession *session, HouseholdSync *sync, uint32_t household,
+                        size_t (*readItem)(uint8_t item, uint8_t *buffer, size_t size),
+                        bool (*writeItem)(uint8_t item, const uint8_t *content, size_t length));
+
+size_t householdSyncAnnounce(HouseholdSyncSession *session, uint8_t *buffer, size_t size);
+
+size_t householdSyncRetry(HouseholdSyncSession *session, uint8_t *buffer, size_t size);
+
+bool householdSyncWantsRetry(const HouseholdSyncSession *session);
+
+HouseholdSyncResult householdSyncReceive(HouseholdSyncSession *session, const uint8_t *packet, size_t length,
+                                         uint8_t *reply, size_t size, size_t *replyLength);
+
+#endif
@@ -0,0 +1,559 @@
+#include "HttpServer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Hal.h"
+#include "Logger.h"
+
+// what the server waits for on the current connection
+enum HttpPhase : uint8_t
+{
+  HTTP_PHASE_HEAD = 0,
+  HTTP_PHASE_BODY,
+  HTTP_PHASE_RESPONSE,
+};
+
+// the response body is written after room for the head, which is written
+// just before it once the length of the body is known
+const size_t HTTP_HEAD_RESERVE = 160;
+
+// how many steps a poll makes at most, so a client sending pipelined
+// requests without pause does not keep the poll from returning
+const uint16_t HTTP_STEPS_PER_POLL = 64;
+
+const char HTTP_CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+const char *httpReason(uint16_t status)
+{
+  switch (status)
+  {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
+  case 431:
+    return "Request Header Fields Too Large";
+  case 500:
+    return "Internal Server Error";
+  case 501:
+    return "Not Implemented";
+  default:
+    return "";
+  }
+}
+
+// httpEquals compares a piece of the head to a string, ignoring the case
+bool httpEquals(const char *text, size_t length, const char *expected)
+{
+  return strlen(expected) == length && strncasecmp(text, expected, length) == 0;
+}
+
+// httpContains looks for a token in a header value, ignoring the case
+bool httpContains(const char *value, size_t length, const char *token)
+{
+  size_t tokenLength = strlen(token);
+  for (size_t i = 0; i + tokenLength <= length; i++)
+  {
+    if (strncasecmp(value + i, token, tokenLength) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// httpRefuse makes the server answer the request itself, with an error;
+// the connection is closed after if what follows the head cannot be trusted,
+// whatever the headers after say, so it is never read as a request
+void httpRefuse(HttpServer *server, uint16_t status, const char *error, bool close)
+{
+  if (close)
+  {
+    server->closeForced = true;
+    server->keepAlive = false;
+    server->bodyLeft = 0;
+  }
+  if (server->errorStatus != 0)
+  {
+    return;
+  }
+  server->errorStatus = status;
+  server->error = error;
+}
+
+void httpResetRequest(HttpServer *server)
+{
+  server->phase = HTTP_PHASE_HEAD;
+  server->route = nullptr;
+  server->errorStatus = 0;
+  server->error = nullptr;
+  server->keepAlive = true;
+  server->closeForced = false;
+  server->continueWanted = false;
+  server->authorization = nullptr;
+  server->authorizationLength = 0;
+  server->bodyLeft = 0;
+}
+
+// httpCloseConnection closes a connection, and drops its request if it
+// is the current one
+void httpCloseConnection(HttpServer *server, int index)
+{
+  halTcpClose(server->connections[index].socket);
+  server->connections[index].socket = -1;
+  if (server->current == index)
+  {
+    server->current = -1;
+    server->inputStart = 0;
+    server->inputLength = 0;
+    httpResetRequest(server);
+  }
+}
+
+// httpFindHeadEnd returns the length of the head of the request in the
+// input, blank line included, or 0 if it is not all there yet
+size_t httpFindHeadEnd(const HttpServer *server)
+{
+  const uint8_t *input = server->input + server->inputStart;
+  size_t length = server->inputLength - server->inputStart;
+  for (size_t i = 3; i < length; i++)
+  {
+    if (input[i] == '\n' && input[i - 1] == '\r' && input[i - 2] == '\n' && input[i - 3] == '\r')
+    {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// httpParseHeader reads a header line, keeping what the server needs
+void httpParseHeader(HttpServer *server, const char *line, size_t length)
+{
+  const char *colon = (const char *)memchr(line, ':', length);
+  if (colon == NULL)
+  {
+    httpRefuse(server, 400, "malformed header", true);
+    return;
+  }
+  size_t nameLength = colon - line;
+  const char *value = colon + 1;
+  size_t valueLength = length - nameLength - 1;
+  while (valueLength > 0 && (*value == ' ' || *value == '\t'))
+  {
+    value++;
+    valueLength--;
+  }
+
+  if (httpEquals(line, nameLength, "content-length"))
+  {
+    uint32_t bodyLength = 0;
+    for (size_t i = 0; i < valueLength && value[i] != ' '; i++)
+    {
+      if (value[i] < '0' || value[i] > '9' || bodyLength > HTTP_MAX_BODY_SIZE)
+      {
+        httpRefuse(server, value[i] < '0' || value[i] > '9' ? 400 : 413, "invalid content length", true);
+        return;
+      }
+      bodyLength = bodyLength * 10 + (value[i] - '0');
+    }
+    if (bodyLength > HTTP_MAX_BODY_SIZE)
+    {
+      httpRefuse(server, 413, "body too large", true);
+      return;
+    }
+    server->bodyLeft = bodyLength;
+  }
+  else if (httpEquals(line, nameLength, "connection"))
+  {
+    if (httpContains(value, valueLength, "close"))
+    {
+      server->keepAlive = false;
+    }
+    else if (httpContains(value, valueLength, "keep-alive") && !server->closeForced)
+    {
+      server->keepAlive = true;
+    }
+  }
+  else if (httpEquals(line, nameLength, "transfer-encoding"))
+  {
+    httpRefuse(server, 501, "only bodies with a content length are supported", true);
+  }
+  else if (httpEquals(line, nameLength, "expect") && httpContains(value, valueLength, "100-continue"))
+  {
+    server->continueWanted = true;
+  }
+  else if (httpEquals(line, nameLength, "authorization"))
+  {
+    server->authorization = value;
+    server->authorizationLength = valueLength;
+  }
+}
+
+// httpParseHead reads the request line and the headers, and finds the
+// route of the request, which may refuse it
+void httpParseHead(HttpServer *server, const char *head, size_t length)
+{
+  const char *end = head + length - 2;
+  const char *lineEnd = (const char *)memchr(head, '\r', end - head);
+  const char *methodEnd = (const char *)memchr(head, ' ', lineEnd - head);
+  const char *targetEnd = methodEnd != NULL ? (const char *)memchr(methodEnd + 1, ' ', lineEnd - methodEnd - 1) : NULL;
+  if (targetEnd == NULL || lineEnd - targetEnd - 1 != 8 || strncmp(targetEnd + 1, "HTTP/1.", 7) != 0)
+  {
+    httpRefuse(server, 400, "malformed request line", true);
+    return;
+  }
+  server->keepAlive = targetEnd[8] != '0';
+
+  const char *line = lineEnd + 2;
+  while (line < end)
+  {
+    const char *next = (const char *)memchr(line, '\r', end - line + 1);
+    httpParseHeader(server, line, next - line);
+    line = next + 2;
+  }
+
+  const char *method = head;
+  size_t methodLength = methodEnd - head;
+  const char *path = methodEnd + 1;
+  const char *query = (const char *)memchr(path, '?', targetEnd - path);
+  size_t pathLength = (query != NULL ? query : targetEnd) - path;
+  bool pathFound = false;
+  for (uint8_t i = 0; i < server->routeCount; i++)
+  {
+    const HttpRoute *route = &server->routes[i];
+    if (strlen(route->path) != pathLength || strncmp(route->path, path, pathLength) != 0)
+    {
+      continue;
+    }
+    pathFound = true;
+    if (strlen(route->method) == methodLength && strncmp(route->method, method, methodLength) == 0)
+    {
+      server->route = route;
+      if (server->errorStatus == 0 && route->authorize != nullptr &&
+          !route->authorize(server->authorization, server->authorizationLength))
+      {
+        httpRefuse(server, 401, "unauthorized", false);
+      }
+      return;
+    }
+  }
+  httpRefuse(server, pathFound ? 405 : 404, pathFound ? "method not allowed" : "not found", false);
+}
+
+// httpPrepareResponse writes the response to the output: the route
+// writes the body, unless the server refused the request
+void httpPrepareResponse(HttpServer *server)
+{
+  JsonOutput body;
+  jsonOutputBegin(&body, server->output + HTTP_HEAD_RESERVE, HTTP_OUTPUT_SIZE - HTTP_HEAD_RESERVE);
+  uint16_t status = server->errorStatus;
+  if (status == 0)
+  {
+    status = server->route->end(&body);
+    if (body.overflow)
+    {
+      jsonOutputBegin(&body, server->output + HTTP_HEAD_RESERVE, HTTP_OUTPUT_SIZE - HTTP_HEAD_RESERVE);
+      httpRefuse(server, 500, "response too large", false);
+      status = server->errorStatus;
+    }
+  }
+  if (server->errorStatus != 0)
+  {
+    LOG_WARNING("http request refused: %d %s\n", server->errorStatus, server->error);
+    server->stats.errors++;
+    jsonWriteBeginObject(&body, nullptr);
+    jsonWriteString(&body, "error", server->error);
+    jsonWriteEndObject(&body);
+  }
+
+  char head[HTTP_HEAD_RESERVE];
+  int headLength = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %u %s\r\nContent-Type: application/json\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+                            status, httpReason(status), (unsigned int)body.length, server->keepAlive ? "keep-alive" : "close");
+  server->outputStart = HTTP_HEAD_RESERVE - headLength;
+  server->outputEnd = HTTP_HEAD_RESERVE + body.length;
+  memcpy(server->output + server->outputStart, head, headLength);
+}
+
+// httpReadMore reads what arrived on the current connection after the
+// input. Returns false if nothing did, or the connection closed.
+bool httpReadMore(HttpServer *server)
+{
+  HttpConnection *connection = &server->connections[server->current];
+  int received = halTcpRead(connection->socket, server->input + server->inputLength, HTTP_INPUT_SIZE - server->inputLength);
+  if (received < 0)
+  {
+    httpCloseConnection(server, server->current);
+    return false;
+  }
+  if (received > 0)
+  {
+    connection->activeAt = halMillis();
+    server->inputLength += received;
+  }
+  return received > 0;
+}
+
+// httpReadHead waits for the whole head of the request, then reads it.
+// A request pipelined after others starts inside the input, which is only
+// moved to its start when the head needs the room.
+bool httpReadHead(HttpServer *server)
+{
+  size_t headLength = httpFindHeadEnd(server);
+  if (headLength == 0)
+  {
+    if (server->inputLength == HTTP_INPUT_SIZE && server->inputStart > 0)
+    {
+      server->inputLength -= server->inputStart;
+      memmove(server->input, server->input + server->inputStart, server->inputLength);
+      server->inputStart = 0;
+    }
+    if (server->inputLength < HTTP_INPUT_SIZE)
+    {
+      return httpReadMore(server) || server->current < 0;
+    }
+    httpRefuse(server, 431, "request head too large", true);
+  }
+  else
+  {
+    httpParseHead(server, (const char *)server->input + server->inputStart, headLength);
+    server->inputStart += headLength;
+    if (server->errorStatus != 0 && !server->keepAlive)
+    {
+      server->bodyLeft = 0;
+    }
+    if (server->errorStatus == 0 && server->route->begin != nullptr)
+    {
+      server->route->begin();
+    }
+    if (server->errorStatus == 0 && server->continueWanted && server->bodyLeft > 0)
+    {
+      halTcpWrite(server->connections[server->current].socket, (const uint8_t *)HTTP_CONTINUE, sizeof(HTTP_CONTINUE) - 1);
+    }
+  }
+  server->phase = HTTP_PHASE_BODY;
+  return true;
+}
+
+// httpReadBody hands the body to the route as it arrives, then prepares
+// the response; what follows the body in the input is the next request
+bool httpReadBody(HttpServer *server)
+{
+  size_t available = server->inputLength - server->inputStart;
+  size_t length = available < server->bodyLeft ? available : server->bodyLeft;
+  if (length > 0)
+  {
+    if (server->errorStatus == 0 && server->route->body != nullptr)
+    {
+      server->route->body(server->input + server->inputStart, length);
+    }
+    server->inputStart += length;
+    server->bodyLeft -= length;
+  }
+  if (server->bodyLeft > 0)
+  {
+    server->inputStart = 0;
+    server->inputLength = 0;
+    return httpReadMore(server) || server->current < 0;
+  }
+
+  httpPrepareResponse(server);
+  server->phase = HTTP_PHASE_RESPONSE;
+  return true;
+}
+
+// httpWriteResponse writes what the socket takes of the response; once
+// it is all written, the connection waits for its next request
+bool httpWriteResponse(HttpServer *server)
+{
+  HttpConnection *connection = &server->connections[server->current];
+  int sent = halTcpWrite(connection->socket, (const uint8_t *)server->output + server->outputStart,
+                         server->outputEnd - server->outputStart);
+  if (sent < 0)
+  {
+    httpCloseConnection(server, server->current);
+    return true;
+  }
+  if (sent > 0)
+  {
+    connection->activeAt = halMillis();
+    server->outputStart += sent;
+  }
+  if (server->outputStart < server->outputEnd)
+  {
+    return false;
+  }
+
+  server->stats.requests++;
+  if (connection->served++ > 0)
+  {
+    server->stats.keepAliveRequests++;
+  }
+  if (!server->keepAlive)
+  {
+    httpCloseConnection(server, server->current);
+    return true;
+  }
+
+  httpResetRequest(server);
+  if (server->inputStart == server->inputLength)
+  {
+    server->inputStart = 0;
+    server->inputLength = 0;
+    server->current = -1;
+  }
+  return true;
+}
+
+// httpPickConnection makes the next connection a request arrived on the
+// current one, in turn
+bool httpPickConnection(HttpServer *server)
+{
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+  {
+    uint8_t index = (server->next + i) % HTTP_MAX_CONNECTIONS;
+    HttpConnection *connection = &server->connections[index];
+    if (connection->socket < 0)
+    {
+      continue;
+    }
+    int received = halTcpRead(connection->socket, server->input, HTTP_INPUT_SIZE);
+    if (received < 0)
+    {
+      httpCloseConnection(server, index);
+      continue;
+    }
+    if (received > 0)
+    {
+      connection->activeAt = halMillis();
+      server->current = index;
+      server->next = (index + 1) % HTTP_MAX_CONNECTIONS;
+      server->inputStart = 0;
+      server->inputLength = received;
+      httpResetRequest(server);
+      return true;
+    }
+  }
+  return false;
+}
+
+// httpAcceptConnections takes the new connections, closing the one idle
+// the longest when all the slots are taken
+void httpAcceptConnections(HttpServer *server)
+{
+  int socket;
+  while ((socket = halTcpAccept()) >= 0)
+  {
+    int slot = -1;
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    {
+      HttpConnection *connection = &server->connections[i];
+      if (connection->socket < 0)
+      {
+        slot = i;
+        break;
+      }
+      if (i != server->current && (slot < 0 || connection->activeAt - server->connections[slot].activeAt > INT32_MAX))
+      {
+        slot = i;
+      }
+    }
+    if (server->connections[slot].socket >= 0)
+    {
+      httpCloseConnection(server, slot);
+    }
+    server->connections[slot] = HttpConnection{socket, halMillis(), 0};
+    server->stats.connections++;
+  }
+}
+
+// httpCloseIdle closes the connections idle for too long, including the
+// current one if its client stalled
+void httpCloseIdle(HttpServer *server)
+{
+  uint32_t now = halMillis();
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+  {
+    if (server->connections[i].socket >= 0 && now - server->connections[i].activeAt >= HTTP_IDLE_TIMEOUT_MS)
+    {
+      httpCloseConnection(server, i);
+      server->stats.timeouts++;
+    }
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// httpServerBegin starts listening on the port, for the routes given
+bool httpServerBegin(HttpServer *server, uint16_t port, const HttpRoute *routes, uint8_t routeCount)
+{
+  memset(server, 0, sizeof(HttpServer));
+  server->routes = routes;
+  server->routeCount = routeCount;
+  server->current = -1;
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+  {
+    server->connections[i].socket = -1;
+  }
+  httpResetRequest(server);
+  server->listening = halTcpListen(port);
+  return server->listening;
+}
+
+// httpServerPoll serves what it can without waiting: it returns as soon
+// as no connection has anything to read or its socket takes no more
+void httpServerPoll(HttpServer *server)
+{
+  if (!server->listening)
+  {
+    return;
+  }
+  httpAcceptConnections(server);
+  httpCloseIdle(server);
+
+  for (uint16_t step = 0; step < HTTP_STEPS_PER_POLL; step++)
+  {
+    if (server->current < 0 && !httpPickConnection(server))
+    {
+      return;
+    }
+    bool progressed;
+    switch (server->phase)
+    {
+    case HTTP_PHASE_HEAD:
+      progressed = httpReadHead(server);
+      break;
+    case HTTP_PHASE_BODY:
+      progressed = httpReadBody(server);
+      break;
+    default:
+      progressed = httpWriteResponse(server);
+      break;
+    }
+    if (!progressed)
+    {
+      return;
+    }
+  }
+}
+
+// httpServerIdle tells whether no request is being served
+bool httpServerIdle(const HttpServer *server)
+{
+  return server->current < 0;
+}
@@ -0,0 +1,98 @@
+#ifndef HttpServer_h
+#define HttpServer_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "JsonStream.h"
+
+// HttpServer serves HTTP/1.1 requests with JSON responses without ever
+// blocking: httpServerPoll accepts the connections, reads what arrived on
+// them and writes what their sockets take, and returns.
+//
+// One request is served at a time, through a single input buffer and a
+// single output buffer, so the memory used does not depend on how many
+// connections are open: the requests of the other connections wait in
+// their sockets meanwhile. The body of a request goes to its route as it
+// arrives, never held whole. A connection stays open for the next
+// requests, which may be pipelined, unless the client asks otherwise
+// (keep-alive) or stays idle for HTTP_IDLE_TIMEOUT_MS.
+const uint8_t HTTP_MAX_CONNECTIONS = 4;
+
+// the head of a request (request line and headers) must fit the input
+const size_t HTTP_INPUT_SIZE = 512;
+const size_t HTTP_OUTPUT_SIZE = 1024;
+const uint32_t HTTP_MAX_BODY_SIZE = 4096;
+const uint32_t HTTP_IDLE_TIMEOUT_MS = 15000;
+
+// HttpRoute handles the requests with a method to a path (without the
+// query). begin is called once the head is read, body with each piece of
+// the body and end once it is all read, to write the response body,
+// returning its status code. authorize, if any, is given the value of the
+// Authorization header first (nullptr if there is none), and the request
+// is refused with 401 unless it returns true. authorize, begin and body
+// may be nullptr.
+struct HttpRoute
+{
+    const char *method;
+    const char *path;
+    void (*begin)();
+    void (*body)(const uint8_t *data, size_t length);
+    uint16_t (*end)(JsonOutput *response);
+    bool (*authorize)(const char *credentials, size_t length);
+};
+
+struct HttpServerStats
+{
+    uint32_t connections;
+    uint32_t requests;
+    uint32_t keepAliveRequests; // served on a connection that had served one before
+    uint32_t errors;            // answered by the server itself: 4xx and 5xx
+    uint32_t timeouts;
+};
+
+struct HttpConnection
+{
+    int socket;
+    uint32_t activeAt;
+    uint32_t served;
+};
+
+// HttpServer is the whole state of the server; current is the connection
+// whose request is served, -1 if none
+struct HttpServer
+{
+    const HttpRoute *routes;
+    uint8_t routeCount;
+    bool listening;
+    HttpConnection connections[HTTP_MAX_CONNECTIONS];
+    int8_t current;
+    uint8_t next;
+    uint8_t phase;
+    const HttpRoute *route;
+    uint16_t errorStatus;
+    const char *error;
+    bool keepAlive;
+    // set once the request is refused with the connection closed
+    bool closeForced;
+    bool continueWanted;
+    // the Authorization header in the input, while the head is parsed
+    const char *authorization;
+    size_t authorizationLength;
+    uint32_t bodyLeft;
+    uint8_t input[HTTP_INPUT_SIZE];
+    size_t inputStart;
+    size_t inputLength;
+    char output[HTTP_OUTPUT_SIZE];
+    size_t outputStart;
+    size_t outputEnd;
+    HttpServerStats stats;
+};
+
+bool httpServerBegin(HttpServer *server, uint16_t port, const HttpRoute *routes, uint8_t routeCount);
+
+void httpServerPoll(HttpServer *server);
+
+bool httpServerIdle(const HttpServer *server);
+
+#endif
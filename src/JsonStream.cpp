@@ -0,0 +1,667 @@
+#include "JsonStream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// the states of the parser, between two bytes
+enum JsonState : uint8_t
+{
+    JSON_STATE_VALUE = 0,     // a value
+    JSON_STATE_FIRST_ELEMENT, // a value or the end of the array
+    JSON_STATE_FIRST_KEY,     // a key or the end of the object
+    JSON_STATE_KEY,           // a key
+    JSON_STATE_COLON,         // the colon after a key
+    JSON_STATE_AFTER_VALUE,   // a comma or the end of the container
+    JSON_STATE_STRING,        // in a key or a string value
+    JSON_STATE_ESCAPE,        // after a backslash in a string
+    JSON_STATE_UNICODE,       // in the hex digits of a \u escape
+    JSON_STATE_NUMBER,        // in a number, which only ends with the next byte
+    JSON_STATE_LITERAL,       // in true, false or null
+    JSON_STATE_DONE,          // after the document; only spaces may follow
+};
+
+static const uint16_t JSON_HIGH_SURROGATE_FIRST = 0xD800;
+static const uint16_t JSON_LOW_SURROGATE_FIRST = 0xDC00;
+static const uint16_t JSON_LOW_SURROGATE_LAST = 0xDFFF;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static JsonStreamStatus fail(JsonStream *stream, JsonStreamStatus status)
+{
+    stream->status = status;
+    return status;
+}
+
+// inArray tells whether the container the parser is in is an array
+static bool inArray(const JsonStream *stream)
+{
+    return stream->depth > 0 && (stream->arrays >> (stream->depth - 1)) & 1;
+}
+
+// emit hands a token to the handler; the key is only given to the values
+// and the starts of the containers held by an object
+static bool emit(JsonStream *stream, JsonEvent event, const char *value, size_t length)
+{
+    if (stream->handler == NULL)
+    {
+        return true;
+    }
+    bool keyed = stream->depth > 0 && !inArray(stream) && event != JSON_OBJECT_END && event != JSON_ARRAY_END;
+    JsonToken token = {event, stream->depth, keyed ? stream->key : "", value, length};
+    return stream->handler(stream->context, &token);
+}
+
+// appendChar adds a byte to the key or the value being read
+static bool appendChar(JsonStream *stream, char c)
+{
+    if (stream->readingKey)
+    {
+        if (stream->keyLength + 1u >= JSON_STREAM_KEY_SIZE)
+        {
+            return false;
+        }
+        stream->key[stream->keyLength++] = c;
+        stream->key[stream->keyLength] = '\0';
+        return true;
+    }
+    if (stream->valueLength + 1u >= JSON_STREAM_VALUE_SIZE)
+    {
+        return false;
+    }
+    stream->value[stream->valueLength++] = c;
+    stream->value[stream->valueLength] = '\0';
+    return true;
+}
+
+// appendCodePoint adds a code point decoded from \u escapes, in UTF-8
+static bool appendCodePoint(JsonStream *stream, uint32_t codePoint)
+{
+    char bytes[4];
+    size_t count;
+    if (codePoint < 0x80)
+    {
+        bytes[0] = codePoint;
+        count = 1;
+    }
+    else if (codePoint < 0x800)
+    {
+        bytes[0] = 0xC0 | codePoint >> 6;
+        bytes[1] = 0x80 | (codePoint & 0x3F);
+        count = 2;
+    }
+    else if (codePoint < 0x10000)
+    {
+        bytes[0] = 0xE0 | codePoint >> 12;
+        bytes[1] = 0x80 | (codePoint >> 6 & 0x3F);
+        bytes[2] = 0x80 | (codePoint & 0x3F);
+        count = 3;
+    }
+    else
+    {
+        bytes[0] = 0xF0 | codePoint >> 18;
+        bytes[1] = 0x80 | (codePoint >> 12 & 0x3F);
+        bytes[2] = 0x80 | (codePoint >> 6 & 0x3F);
+        bytes[3] = 0x80 | (codePoint & 0x3F);
+        count = 4;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!appendChar(stream, bytes[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// isNumber checks the grammar of a number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool isNumber(const char *text, size_t length)
+{
+    size_t i = 0;
+    if (i < length && text[i] == '-')
+    {
+        i++;
+    }
+    if (i == length || !isDigit(text[i]))
+    {
+        return false;
+    }
+    if (text[i++] != '0')
+    {
+        while (i < length && isDigit(text[i]))
+        {
+            i++;
+        }
+    }
+    if (i < length && text[i] == '.')
+    {
+        size_t first = ++i;
+        while (i < length && isDigit(text[i]))
+        {
+            i++;
+        }
+        if (i == first)
+        {
+            return false;
+        }
+    }
+    if (i < length && (text[i] == 'e' || text[i] == 'E'))
+    {
+        i++;
+        if (i < length && (text[i] == '+' || text[i] == '-'))
+        {
+            i++;
+        }
+        size_t first = i;
+        while (i < length && isDigit(text[i]))
+        {
+            i++;
+        }
+        if (i == first)
+        {
+            return false;
+        }
+    }
+    return i == length;
+}
+
+// endValue moves on after a value, ending the document at depth 0
+static JsonStreamStatus endValue(JsonStream *stream)
+{
+    if (stream->depth == 0)
+    {
+        stream->state = JSON_STATE_DONE;
+        stream->status = JSON_STREAM_COMPLETE;
+        return JSON_STREAM_COMPLETE;
+    }
+    stream->state = JSON_STATE_AFTER_VALUE;
+    return JSON_STREAM_IN_PROGRESS;
+}
+
+static JsonStreamStatus endNumber(JsonStream *stream)
+{
+    if (!isNumber(stream->value, stream->valueLength))
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    if (!emit(stream, JSON_NUMBER, stream->value, stream->valueLength))
+    {
+        return fail(stream, JSON_STREAM_REJECTED);
+    }
+    return endValue(stream);
+}
+
+static JsonStreamStatus beginContainer(JsonStream *stream, bool array)
+{
+    if (stream->depth == JSON_STREAM_MAX_DEPTH)
+    {
+        return fail(stream, JSON_STREAM_TOO_DEEP);
+    }
+    if (!emit(stream, array ? JSON_ARRAY_BEGIN : JSON_OBJECT_BEGIN, NULL, 0))
+    {
+        return fail(stream, JSON_STREAM_REJECTED);
+    }
+    uint8_t bit = 1 << stream->depth;
+    stream->arrays = array ? stream->arrays | bit : stream->arrays & ~bit;
+    stream->depth++;
+    stream->state = array ? JSON_STATE_FIRST_ELEMENT : JSON_STATE_FIRST_KEY;
+    return JSON_STREAM_IN_PROGRESS;
+}
+
+static JsonStreamStatus endContainer(JsonStream *stream, bool array)
+{
+    if (stream->depth == 0 || inArray(stream) != array)
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    stream->depth--;
+    if (!emit(stream, array ? JSON_ARRAY_END : JSON_OBJECT_END, NULL, 0))
+    {
+        return fail(stream, JSON_STREAM_REJECTED);
+    }
+    return endValue(stream);
+}
+
+static JsonStreamStatus beginValue(JsonStream *stream, char c)
+{
+    switch (c)
+    {
+    case '{':
+        return beginContainer(stream, false);
+    case '[':
+        return beginContainer(stream, true);
+    case '"':
+        stream->readingKey = false;
+        stream->valueLength = 0;
+        stream->value[0] = '\0';
+        stream->state = JSON_STATE_STRING;
+        return JSON_STREAM_IN_PROGRESS;
+    case 't':
+        stream->literal = "true";
+        break;
+    case 'f':
+        stream->literal = "false";
+        break;
+    case 'n':
+        stream->literal = "null";
+        break;
+    default:
+        if (c != '-' && !isDigit(c))
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        stream->readingKey = false;
+        stream->valueLength = 0;
+        appendChar(stream, c);
+        stream->state = JSON_STATE_NUMBER;
+        return JSON_STREAM_IN_PROGRESS;
+    }
+    stream->literalIndex = 1;
+    stream->state = JSON_STATE_LITERAL;
+    return JSON_STREAM_IN_PROGRESS;
+}
+
+static JsonStreamStatus beginKey(JsonStream *stream)
+{
+    stream->readingKey = true;
+    stream->keyLength = 0;
+    stream->key[0] = '\0';
+    stream->state = JSON_STATE_STRING;
+    return JSON_STREAM_IN_PROGRESS;
+}
+
+static JsonStreamStatus endString(JsonStream *stream)
+{
+    if (stream->highSurrogate != 0)
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    if (stream->readingKey)
+    {
+        stream->state = JSON_STATE_COLON;
+        return JSON_STREAM_IN_PROGRESS;
+    }
+    if (!emit(stream, JSON_STRING, stream->value, stream->valueLength))
+    {
+        return fail(stream, JSON_STREAM_REJECTED);
+    }
+    return endValue(stream);
+}
+
+// endUnicode adds the code point of a \u escape, pairing the surrogates
+static JsonStreamStatus endUnicode(JsonStream *stream)
+{
+    uint16_t unit = stream->unicode;
+    stream->state = JSON_STATE_STRING;
+    if (unit >= JSON_HIGH_SURROGATE_FIRST && unit < JSON_LOW_SURROGATE_FIRST)
+    {
+        if (stream->highSurrogate != 0)
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        stream->highSurrogate = unit;
+        return JSON_STREAM_IN_PROGRESS;
+    }
+
+    uint32_t codePoint = unit;
+    if (unit >= JSON_LOW_SURROGATE_FIRST && unit <= JSON_LOW_SURROGATE_LAST)
+    {
+        if (stream->highSurrogate == 0)
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        codePoint = 0x10000 + ((uint32_t)(stream->highSurrogate - JSON_HIGH_SURROGATE_FIRST) << 10) +
+                    (unit - JSON_LOW_SURROGATE_FIRST);
+        stream->highSurrogate = 0;
+    }
+    else if (stream->highSurrogate != 0 || unit == 0)
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    return appendCodePoint(stream, codePoint) ? JSON_STREAM_IN_PROGRESS : fail(stream, JSON_STREAM_TOO_LONG);
+}
+
+static JsonStreamStatus readEscape(JsonStream *stream, char c)
+{
+    static const char ESCAPED[] = "\"\\/bfnrt";
+    static const char UNESCAPED[] = "\"\\/\b\f\n\r\t";
+
+    if (c == 'u')
+    {
+        stream->unicode = 0;
+        stream->unicodeDigits = 0;
+        stream->state = JSON_STATE_UNICODE;
+        return JSON_STREAM_IN_PROGRESS;
+    }
+    const char *escaped = c != '\0' ? strchr(ESCAPED, c) : NULL;
+    if (escaped == NULL || stream->highSurrogate != 0)
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    stream->state = JSON_STATE_STRING;
+    return appendChar(stream, UNESCAPED[escaped - ESCAPED]) ? JSON_STREAM_IN_PROGRESS : fail(stream, JSON_STREAM_TOO_LONG);
+}
+
+static JsonStreamStatus readHexDigit(JsonStream *stream, char c)
+{
+    uint8_t digit;
+    if (isDigit(c))
+    {
+        digit = c - '0';
+    }
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+    {
+        digit = (c | 0x20) - 'a' + 10;
+    }
+    else
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    stream->unicode = stream->unicode << 4 | digit;
+    if (++stream->unicodeDigits < 4)
+    {
+        return JSON_STREAM_IN_PROGRESS;
+    }
+    return endUnicode(stream);
+}
+
+// step reads one byte of the document
+static JsonStreamStatus step(JsonStream *stream, char c)
+{
+    switch (stream->state)
+    {
+    case JSON_STATE_STRING:
+        if (c == '"')
+        {
+            return endString(stream);
+        }
+        if (c == '\\')
+        {
+            stream->state = JSON_STATE_ESCAPE;
+            return JSON_STREAM_IN_PROGRESS;
+        }
+        if ((uint8_t)c < 0x20 || stream->highSurrogate != 0)
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        return appendChar(stream, c) ? JSON_STREAM_IN_PROGRESS : fail(stream, JSON_STREAM_TOO_LONG);
+    case JSON_STATE_ESCAPE:
+        return readEscape(stream, c);
+    case JSON_STATE_UNICODE:
+        return readHexDigit(stream, c);
+    case JSON_STATE_NUMBER:
+        if (isDigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+        {
+            return appendChar(stream, c) ? JSON_STREAM_IN_PROGRESS : fail(stream, JSON_STREAM_TOO_LONG);
+        }
+        if (endNumber(stream) != JSON_STREAM_IN_PROGRESS && stream->status != JSON_STREAM_COMPLETE)
+        {
+            return stream->status;
+        }
+        return step(stream, c);
+    case JSON_STATE_LITERAL:
+        if (c != stream->literal[stream->literalIndex])
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        if (stream->literal[++stream->literalIndex] != '\0')
+        {
+            return JSON_STREAM_IN_PROGRESS;
+        }
+        if (!emit(stream, stream->literal[0] == 'n' ? JSON_NULL : JSON_BOOL, stream->literal, stream->literalIndex))
+        {
+            return fail(stream, JSON_STREAM_REJECTED);
+        }
+        return endValue(stream);
+    default:
+        break;
+    }
+
+    if (isSpace(c))
+    {
+        return stream->status;
+    }
+    switch (stream->state)
+    {
+    case JSON_STATE_VALUE:
+        return beginValue(stream, c);
+    case JSON_STATE_FIRST_ELEMENT:
+        return c == ']' ? endContainer(stream, true) : beginValue(stream, c);
+    case JSON_STATE_FIRST_KEY:
+        if (c == '}')
+        {
+            return endContainer(stream, false);
+        }
+        return c == '"' ? beginKey(stream) : fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    case JSON_STATE_KEY:
+        return c == '"' ? beginKey(stream) : fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    case JSON_STATE_COLON:
+        if (c != ':')
+        {
+            return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+        }
+        stream->state = JSON_STATE_VALUE;
+        return JSON_STREAM_IN_PROGRESS;
+    case JSON_STATE_AFTER_VALUE:
+        if (c == ',')
+        {
+            stream->state = inArray(stream) ? JSON_STATE_VALUE : JSON_STATE_KEY;
+            return JSON_STREAM_IN_PROGRESS;
+        }
+        if (c == '}' || c == ']')
+        {
+            return endContainer(stream, c == ']');
+        }
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    default:
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+}
+
+static void writeRaw(JsonOutput *output, const char *text, size_t length)
+{
+    if (output->overflow)
+    {
+        return;
+    }
+    if (output->length + length >= output->size)
+    {
+        output->overflow = true;
+        return;
+    }
+    memcpy(output->buffer + output->length, text, length);
+    output->length += length;
+    output->buffer[output->length] = '\0';
+}
+
+// writeEscaped writes a string between quotes, escaping what JSON requires
+static void writeEscaped(JsonOutput *output, const char *text)
+{
+    static const char HEX[] = "0123456789abcdef";
+
+    writeRaw(output, "\"", 1);
+    const char *run = text;
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c != '"' && *c != '\\' && (uint8_t)*c >= 0x20)
+        {
+            continue;
+        }
+        writeRaw(output, run, c - run);
+        run = c + 1;
+        if (*c == '"' || *c == '\\')
+        {
+            char escape[2] = {'\\', *c};
+            writeRaw(output, escape, sizeof(escape));
+            continue;
+        }
+        char escape[6] = {'\\', 'u', '0', '0', HEX[(uint8_t)*c >> 4], HEX[*c & 0xF]};
+        writeRaw(output, escape, sizeof(escape));
+    }
+    writeRaw(output, run, strlen(run));
+    writeRaw(output, "\"", 1);
+}
+
+// writeKey writes what comes before a value: the comma after the
+// previous one and the key, in an object
+static void writeKey(JsonOutput *output, const char *key)
+{
+    if (output->needsComma)
+    {
+        writeRaw(output, ",", 1);
+    }
+    if (key != NULL)
+    {
+        writeEscaped(output, key);
+        writeRaw(output, ":", 1);
+    }
+    output->needsComma = true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// jsonStreamReset gets the stream ready for a new document, whose tokens
+// go to the handler
+void jsonStreamReset(JsonStream *stream, bool (*handler)(void *context, const JsonToken *token), void *context)
+{
+    memset(stream, 0, sizeof(JsonStream));
+    stream->handler = handler;
+    stream->context = context;
+    stream->status = JSON_STREAM_IN_PROGRESS;
+    stream->state = JSON_STATE_VALUE;
+}
+
+// jsonStreamFeed parses the next piece of the document. Returns
+// JSON_STREAM_IN_PROGRESS until the document is complete, and
+// JSON_STREAM_COMPLETE after, as long as only spaces follow. An error
+// stops the parse: the stream then returns it until it is reset.
+JsonStreamStatus jsonStreamFeed(JsonStream *stream, const char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (stream->status != JSON_STREAM_IN_PROGRESS && stream->status != JSON_STREAM_COMPLETE)
+        {
+            break;
+        }
+        step(stream, data[i]);
+    }
+    return stream->status;
+}
+
+// jsonStreamFinish ends the document: a number alone is only complete
+// then, and a document not complete yet is truncated
+JsonStreamStatus jsonStreamFinish(JsonStream *stream)
+{
+    if (stream->status == JSON_STREAM_IN_PROGRESS && stream->state == JSON_STATE_NUMBER && stream->depth == 0)
+    {
+        endNumber(stream);
+    }
+    if (stream->status == JSON_STREAM_IN_PROGRESS)
+    {
+        return fail(stream, JSON_STREAM_SYNTAX_ERROR);
+    }
+    return stream->status;
+}
+
+// jsonTokenInteger reads a number token without fraction nor exponent,
+// returning false if it has any or is out of range
+bool jsonTokenInteger(const JsonToken *token, int64_t *value)
+{
+    if (token->event != JSON_NUMBER)
+    {
+        return false;
+    }
+    const char *digits = token->value[0] == '-' ? token->value + 1 : token->value;
+    size_t count = token->length - (digits - token->value);
+    if (count == 0 || count > 18)
+    {
+        return false;
+    }
+    int64_t result = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!isDigit(digits[i]))
+        {
+            return false;
+        }
+        result = result * 10 + (digits[i] - '0');
+    }
+    *value = digits == token->value ? result : -result;
+    return true;
+}
+
+// jsonOutputBegin starts a document in the buffer, kept zero terminated
+void jsonOutputBegin(JsonOutput *output, char *buffer, size_t size)
+{
+    output->buffer = buffer;
+    output->size = size;
+    output->length = 0;
+    output->overflow = size == 0;
+    output->needsComma = false;
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+}
+
+// jsonWriteBeginObject starts an object; key is NULL unless it is
+// held by an object, as for all the values written
+void jsonWriteBeginObject(JsonOutput *output, const char *key)
+{
+    writeKey(output, key);
+    writeRaw(output, "{", 1);
+    output->needsComma = false;
+}
+
+void jsonWriteEndObject(JsonOutput *output)
+{
+    writeRaw(output, "}", 1);
+    output->needsComma = true;
+}
+
+void jsonWriteBeginArray(JsonOutput *output, const char *key)
+{
+    writeKey(output, key);
+    writeRaw(output, "[", 1);
+    output->needsComma = false;
+}
+
+void jsonWriteEndArray(JsonOutput *output)
+{
+    writeRaw(output, "]", 1);
+    output->needsComma = true;
+}
+
+void jsonWriteString(JsonOutput *output, const char *key, const char *value)
+{
+    writeKey(output, key);
+    writeEscaped(output, value);
+}
+
+void jsonWriteInteger(JsonOutput *output, const char *key, int64_t value)
+{
+    writeKey(output, key);
+    char text[24];
+    int length = snprintf(text, sizeof(text), "%lld", (long long)value);
+    writeRaw(output, text, length);
+}
+
+void jsonWriteBool(JsonOutput *output, const char *key, bool value)
+{
+    writeKey(output, key);
+    writeRaw(output, value ? "true" : "false", value ? 4 : 5);
+}
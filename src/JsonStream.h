@@ -0,0 +1,116 @@
+#ifndef JsonStream_h
+#define JsonStream_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// JsonStream parses a JSON document (RFC 8259) as its bytes arrive, in
+// pieces of any size, with a fixed memory budget: the stream itself.
+// Nothing of the document is kept but the key and the value being read,
+// each scalar value being handed to the handler as soon as it is complete,
+// with the key it has in its object, and so are the starts and ends of
+// the objects and arrays. The same stream is reset for every document.
+//
+// Strings are handed decoded, as UTF-8 C strings, so a \u0000 escape is
+// refused; numbers are handed as they are written (see jsonTokenInteger).
+const uint8_t JSON_STREAM_MAX_DEPTH = 8;
+
+// the longest key and value accepted, with their terminating zero
+const size_t JSON_STREAM_KEY_SIZE = 24;
+const size_t JSON_STREAM_VALUE_SIZE = 72;
+
+// JsonStreamStatus values are reported as the status of a configuration
+// request, after the ConfigBundleStatus values
+enum JsonStreamStatus : uint8_t
+{
+    JSON_STREAM_COMPLETE = 0,
+    JSON_STREAM_IN_PROGRESS = 40,
+    JSON_STREAM_SYNTAX_ERROR = 41,
+    JSON_STREAM_TOO_DEEP = 42,
+    JSON_STREAM_TOO_LONG = 43, // a key or a value does not fit its buffer
+    JSON_STREAM_REJECTED = 44, // the handler refused a token
+};
+
+enum JsonEvent : uint8_t
+{
+    JSON_OBJECT_BEGIN = 1,
+    JSON_OBJECT_END = 2,
+    JSON_ARRAY_BEGIN = 3,
+    JSON_ARRAY_END = 4,
+    JSON_STRING = 5,
+    JSON_NUMBER = 6,
+    JSON_BOOL = 7,
+    JSON_NULL = 8,
+};
+
+// JsonToken is what the handler gets: depth is the number of objects and
+// arrays holding the token, 0 for the document itself, and key its key in
+// the object holding it, empty in an array and for the ends. value is the
+// string, the number or "true"/"false", length its length.
+struct JsonToken
+{
+    JsonEvent event;
+    uint8_t depth;
+    const char *key;
+    const char *value;
+    size_t length;
+};
+
+// JsonStream holds the state of the parser between the pieces; handler
+// returns false to refuse a token, which stops the parse
+struct JsonStream
+{
+    bool (*handler)(void *context, const JsonToken *token);
+    void *context;
+    JsonStreamStatus status;
+    uint8_t state;
+    uint8_t depth;
+    uint8_t arrays; // a bit per depth, set when the container there is an array
+    bool readingKey;
+    uint8_t literalIndex;
+    const char *literal;
+    uint8_t unicodeDigits;
+    uint16_t unicode;
+    uint16_t highSurrogate;
+    uint8_t keyLength;
+    uint8_t valueLength;
+    char key[JSON_STREAM_KEY_SIZE];
+    char value[JSON_STREAM_VALUE_SIZE];
+};
+
+// JsonOutput writes a JSON document into a fixed buffer, adding the
+// commas; overflow is set, and nothing more written, once it is full
+struct JsonOutput
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+    bool needsComma;
+};
+
+void jsonStreamReset(JsonStream *stream, bool (*handler)(void *context, const JsonToken *token), void *context);
+
+JsonStreamStatus jsonStreamFeed(JsonStream *stream, const char *data, size_t length);
+
+JsonStreamStatus jsonStreamFinish(JsonStream *stream);
+
+bool jsonTokenInteger(const JsonToken *token, int64_t *value);
+
+void jsonOutputBegin(JsonOutput *output, char *buffer, size_t size);
+
+void jsonWriteBeginObject(JsonOutput *output, const char *key);
+
+void jsonWriteEndObject(JsonOutput *output);
+
+void jsonWriteBeginArray(JsonOutput *output, const char *key);
+
+void jsonWriteEndArray(JsonOutput *output);
+
+void jsonWriteString(JsonOutput *output, const char *key, const char *value);
+
+void jsonWriteInteger(JsonOutput *output, const char *key, int64_t value);
+
+void jsonWriteBool(JsonOutput *output, const char *key, bool value);
+
+#endif
@@ -0,0 +1,184 @@
+#include "LedRender.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+#include "Hal.h"
+
+const uint32_t LED_RENDER_PERIOD_MS = 1000 / LED_RENDER_FPS;
+const uint64_t LED_RENDER_PERIOD_US = LED_RENDER_PERIOD_MS * 1000ULL;
+
+// above the loop, on its core, so the radios do not delay the frames
+const uint8_t LED_RENDER_TASK_PRIORITY = 2;
+
+// the frames submitted by the state machine. The generation counts the
+// submitted frames; the last one is in frames[generation % 2], and the
+// next one is written to the other buffer.
+SunriseColor renderFrames[2][HAL_LED_COUNT];
+std::atomic<uint32_t> renderGeneration(0);
+bool renderStarted = false;
+
+// owned by the render task: the frame being shown, the generation it
+// was taken from and what the dithering has not shown yet of each channel
+SunriseColor renderFrame[HAL_LED_COUNT];
+uint32_t renderFrameGeneration = 0;
+uint16_t renderDitherError[HAL_LED_COUNT][3];
+bool renderShown = false;
+uint64_t renderLastStepUs = 0;
+
+volatile LedRenderStats renderStats;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// takeFrame copies the last submitted frame, if it changed, returning
+// false if there is none or it was replaced while being copied (then
+// the next step takes it)
+bool takeFrame()
+{
+  uint32_t generation = renderGeneration.load(std::memory_order_acquire);
+  if (generation == renderFrameGeneration)
+  {
+    return false;
+  }
+
+  SunriseColor copy[HAL_LED_COUNT];
+  memcpy(copy, renderFrames[generation % 2], sizeof(copy));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (renderGeneration.load(std::memory_order_relaxed) != generation)
+  {
+    return false;
+  }
+
+  memcpy(renderFrame, copy, sizeof(copy));
+  renderFrameGeneration = generation;
+  return true;
+}
+
+// ditherChannel returns the 8-bit level to show for a 16-bit channel,
+// keeping what is left out for the next frames, so over a few frames
+// the average is the 16-bit level
+uint8_t ditherChannel(uint16_t level, uint16_t *error)
+{
+  uint32_t value = (uint32_t)level + *error;
+  uint32_t shown = value >> 8;
+  if (shown > 255)
+  {
+    shown = 255;
+  }
+  *error = value - (shown << 8);
+  return shown;
+}
+
+// isExact returns true if the frame shows the same without dithering
+bool isExact()
+{
+  for (uint8_t i = 0; i < HAL_LED_COUNT; i++)
+  {
+    if ((renderFrame[i].r | renderFrame[i].g | renderFrame[i].b) & 0xFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// countMissedDeadlines counts the frames that were not shown on time
+void countMissedDeadlines(uint64_t now)
+{
+  if (renderLastStepUs != 0)
+  {
+    uint64_t periods = (now - renderLastStepUs + LED_RENDER_PERIOD_US / 2) / LED_RENDER_PERIOD_US;
+    if (periods > 1)
+    {
+      renderStats.missedDeadlines += periods - 1;
+    }
+  }
+  renderLastStepUs = now;
+}
+
+// renderStep shows the next frame; it is the step of the render task
+void renderStep()
+{
+  uint64_t startedUs = halMicros();
+  countMissedDeadlines(startedUs);
+
+  if (takeFrame())
+  {
+    renderShown = false;
+  }
+  if (renderShown)
+  {
+    renderStats.framesIdle++;
+    return;
+  }
+
+  HalLedColor output[HAL_LED_COUNT];
+  for (uint8_t i = 0; i < HAL_LED_COUNT; i++)
+  {
+    output[i].r = ditherChannel(renderFrame[i].r, &renderDitherError[i][0]);
+    output[i].g = ditherChannel(renderFrame[i].g, &renderDitherError[i][1]);
+    output[i].b = ditherChannel(renderFrame[i].b, &renderDitherError[i][2]);
+  }
+  halLedShow(output, HAL_LED_COUNT);
+
+  // an exact frame needs to be shown once, a dithered one every period
+  renderShown = isExact();
+
+  uint64_t shownUs = halMicros();
+  uint32_t frameUs = shownUs - startedUs;
+  if (renderStats.framesShown == 0)
+  {
+    renderStats.firstFrameUs = shownUs;
+  }
+  renderStats.framesShown++;
+  renderStats.lastFrameUs = frameUs;
+  if (frameUs > renderStats.maxFrameUs)
+  {
+    renderStats.maxFrameUs = frameUs;
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// ledRenderStart sets up the led strip and starts the task sending the
+// submitted frames to it, LED_RENDER_FPS times per second. The task
+// starts with the last frame submitted, so submitting the first frame
+// before gets it to the leds on the first step.
+void ledRenderStart()
+{
+  if (renderStarted)
+  {
+    return;
+  }
+  halLedInit();
+  renderStarted = halTaskStart("leds", renderStep, LED_RENDER_PERIOD_MS, LED_RENDER_TASK_PRIORITY, HAL_TASK_LOOP_CORE,
+                               HAL_TASK_STACK_SIZE);
+}
+
+// ledRenderSubmit hands a frame over to the render task without waiting
+// for it; the task shows the last frame submitted until the next one
+void ledRenderSubmit(const SunriseColor frame[], uint8_t count)
+{
+  uint32_t next = renderGeneration.load(std::memory_order_relaxed) + 1;
+  SunriseColor *buffer = renderFrames[next % 2];
+  for (uint8_t i = 0; i < HAL_LED_COUNT; i++)
+  {
+    buffer[i] = i < count ? frame[i] : SunriseColor{0, 0, 0};
+  }
+  renderGeneration.store(next, std::memory_order_release);
+}
+
+// ledRenderGetStats copies the counters of the render task
+void ledRenderGetStats(LedRenderStats *stats)
+{
+  stats->framesShown = renderStats.framesShown;
+  stats->framesIdle = renderStats.framesIdle;
+  stats->missedDeadlines = renderStats.missedDeadlines;
+  stats->lastFrameUs = renderStats.lastFrameUs;
+  stats->maxFrameUs = renderStats.maxFrameUs;
+  stats->firstFrameUs = renderStats.firstFrameUs;
+}
@@ -0,0 +1,32 @@
+#ifndef LedRender_h
+#define LedRender_h
+
+#include <stdint.h>
+
+#include "SunriseCurve.h"
+
+// frames per second sent to the led strip; may be set with a build flag
+#ifndef LED_RENDER_FPS
+#define LED_RENDER_FPS 100
+#endif
+
+// LedRenderStats are the counters of the render task since the boot;
+// firstFrameUs is when the first frame was sent to the leds, in
+// microseconds since the boot, once framesShown is not 0
+struct LedRenderStats
+{
+    uint32_t framesShown;
+    uint32_t framesIdle;
+    uint32_t missedDeadlines;
+    uint32_t lastFrameUs;
+    uint32_t maxFrameUs;
+    uint32_t firstFrameUs;
+};
+
+void ledRenderStart();
+
+void ledRenderSubmit(const SunriseColor frame[], uint8_t count);
+
+void ledRenderGetStats(LedRenderStats *stats);
+
+#endif
@@ -0,0 +1,325 @@
+#include "Logger.h"
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "Hal.h"
+
+// the ring size must be a power of two
+const uint32_t LOGGER_RING_SIZE = 64;
+const uint32_t LOGGER_LINE_SIZE = 192;
+
+const uint32_t LOGGER_DRAIN_PERIOD_MS = 50;
+const uint8_t LOGGER_TASK_PRIORITY = 1;
+
+static const char LOGGER_LEVEL_NAMES[] = "?FEWNTV";
+
+// the ring is a bounded multi producer, multi consumer queue: a record
+// may be written from any task and the records are drained by the logger
+// task, or by whoever flushes. A slot whose sequence equals the write
+// position is free; once written its sequence is one past it, and once
+// read it is one lap ahead.
+LogRecord loggerRing[LOGGER_RING_SIZE];
+std::atomic<uint32_t> loggerWritePosition(0);
+std::atomic<uint32_t> loggerReadPosition(0);
+std::atomic<uint32_t> loggerDropped(0);
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// LogLine is a line being formatted, truncated when full
+struct LogLine
+{
+    char text[LOGGER_LINE_SIZE];
+    size_t length;
+};
+
+// appendText appends formatted text to a line
+void appendText(LogLine *line, const char *format, ...)
+{
+    if (line->length >= LOGGER_LINE_SIZE - 1)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line->text + line->length, LOGGER_LINE_SIZE - line->length, format, args);
+    va_end(args);
+    if (written > 0)
+    {
+        line->length += written;
+        if (line->length > LOGGER_LINE_SIZE - 1)
+        {
+            line->length = LOGGER_LINE_SIZE - 1;
+        }
+    }
+}
+
+// appendChar appends a character to a line
+void appendChar(LogLine *line, char c)
+{
+    if (line->length < LOGGER_LINE_SIZE - 1)
+    {
+        line->text[line->length++] = c;
+    }
+}
+
+// appendPrefix starts a line with the level and the milliseconds since the boot
+void appendPrefix(LogLine *line, uint8_t level, uint32_t timestampMs)
+{
+    line->length = 0;
+    appendText(line, "%c %lu.%03lu: ", LOGGER_LEVEL_NAMES[level],
+               (unsigned long)(timestampMs / 1000), (unsigned long)(timestampMs % 1000));
+}
+
+// endLine makes sure a line ends with a newline, marking it if it was truncated
+void endLine(LogLine *line, bool truncated)
+{
+    if (line->length > 0 && line->text[line->length - 1] == '\n')
+    {
+        line->length--;
+    }
+    if (truncated)
+    {
+        appendText(line, " (truncated)");
+    }
+    if (line->length == LOGGER_LINE_SIZE - 1)
+    {
+        line->length--;
+    }
+    line->text[line->length++] = '\n';
+}
+
+// readWord reads the next 32 bits argument of a record, returning
+// false if there are no more
+bool readWord(const LogRecord *record, size_t *offset, uint32_t *value)
+{
+    if (*offset + sizeof(uint32_t) > record->length)
+    {
+        return false;
+    }
+    memcpy(value, record->args + *offset, sizeof(uint32_t));
+    *offset += sizeof(uint32_t);
+    return true;
+}
+
+// formatRecord formats a record like ArduinoLog would
+void formatRecord(const LogRecord *record, LogLine *line)
+{
+    appendPrefix(line, record->level, record->timestampMs);
+
+    size_t offset = 0;
+    for (const char *c = record->format; *c != '\0'; c++)
+    {
+        if (*c != '%' || c[1] == '\0')
+        {
+            appendChar(line, *c);
+            continue;
+        }
+
+        c++;
+        uint32_t word = 0;
+        if (*c == 's')
+        {
+            if (offset >= record->length)
+            {
+                appendChar(line, '?');
+                continue;
+            }
+            uint8_t length = record->args[offset];
+            if (offset + 1 + length > record->length)
+            {
+                length = record->length - offset - 1;
+            }
+            appendText(line, "%.*s", (int)length, (const char *)record->args + offset + 1);
+            offset += 1 + length;
+            continue;
+        }
+        if (*c == '%')
+        {
+            appendChar(line, '%');
+            continue;
+        }
+        if (!readWord(record, &offset, &word))
+        {
+            appendChar(line, '?');
+            continue;
+        }
+
+        switch (*c)
+        {
+        case 'c':
+            appendChar(line, (char)word);
+            break;
+        case 'd':
+        case 'i':
+        case 'l':
+            appendText(line, "%ld", (long)(int32_t)word);
+            break;
+        case 'u':
+            appendText(line, "%lu", (unsigned long)word);
+            break;
+        case 'x':
+            appendText(line, "%lx", (unsigned long)word);
+            break;
+        case 'X':
+            appendText(line, "0x%lX", (unsigned long)word);
+            break;
+        case 'b':
+        case 'B':
+        {
+            if (*c == 'B')
+            {
+                appendText(line, "0b");
+            }
+            bool started = false;
+            for (int bit = 31; bit >= 0; bit--)
+            {
+                started |= (word >> bit) & 1;
+                if (started || bit == 0)
+                {
+                    appendChar(line, '0' + ((word >> bit) & 1));
+                }
+            }
+            break;
+        }
+        case 't':
+            appendChar(line, word ? 'T' : 'F');
+            break;
+        case 'T':
+            appendText(line, "%s", word ? "true" : "false");
+            break;
+        case 'D':
+        case 'F':
+        {
+            float value;
+            memcpy(&value, &word, sizeof(value));
+            appendText(line, "%.2f", (double)value);
+            break;
+        }
+        default:
+            appendChar(line, *c);
+            break;
+        }
+    }
+    endLine(line, record->truncated);
+}
+
+// takeRecord formats the oldest written record, if any, and frees its slot
+bool takeRecord(LogLine *line, uint8_t *level)
+{
+    uint32_t position = loggerReadPosition.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        LogRecord *record = &loggerRing[position & (LOGGER_RING_SIZE - 1)];
+        int32_t difference = (int32_t)(record->sequence.load(std::memory_order_acquire) - (position + 1));
+        if (difference < 0)
+        {
+            return false;
+        }
+        if (difference > 0)
+        {
+            position = loggerReadPosition.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (loggerReadPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        {
+            formatRecord(record, line);
+            *level = record->level;
+            record->sequence.store(position + LOGGER_RING_SIZE, std::memory_order_release);
+            return true;
+        }
+    }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// loggerInit prepares the ring and starts the task writing the records
+// to the console; it needs to be called first thing in setup, records
+// written before are dropped
+void loggerInit()
+{
+    for (uint32_t i = 0; i < LOGGER_RING_SIZE; i++)
+    {
+        loggerRing[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    loggerWritePosition.store(0, std::memory_order_relaxed);
+    loggerReadPosition.store(0, std::memory_order_release);
+
+    halTaskStart("logger", loggerDrain, LOGGER_DRAIN_PERIOD_MS, LOGGER_TASK_PRIORITY, HAL_TASK_RADIO_CORE,
+                 HAL_TASK_STACK_SIZE);
+}
+
+// loggerReserve claims a free slot of the ring for a record, returning
+// NULL if the console does not show its level or the ring is full.
+// The record must be committed right after.
+LogRecord *loggerReserve(uint8_t level, const char *format)
+{
+    if (level > halConsoleLevel())
+    {
+        return nullptr;
+    }
+
+    uint32_t position = loggerWritePosition.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        LogRecord *record = &loggerRing[position & (LOGGER_RING_SIZE - 1)];
+        int32_t difference = (int32_t)(record->sequence.load(std::memory_order_acquire) - position);
+        if (difference < 0)
+        {
+            loggerDropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (difference > 0)
+        {
+            position = loggerWritePosition.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (loggerWritePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        {
+            record->format = format;
+            record->timestampMs = halMillis();
+            record->level = level;
+            record->length = 0;
+            record->truncated = false;
+            return record;
+        }
+    }
+}
+
+// loggerCommit hands a reserved record over to the logger task
+void loggerCommit(LogRecord *record)
+{
+    record->sequence.store(record->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// loggerDrain writes the pending records to the console; it is the step
+// of the logger task
+void loggerDrain()
+{
+    LogLine line;
+    uint8_t level;
+    while (takeRecord(&line, &level))
+    {
+        halConsoleWrite(level, line.text, line.length);
+    }
+
+    uint32_t dropped = loggerDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+    {
+        appendPrefix(&line, LOG_LEVEL_WARNING, halMillis());
+        appendText(&line, "%lu log records dropped\n", (unsigned long)dropped);
+        halConsoleWrite(LOG_LEVEL_WARNING, line.text, line.length);
+    }
+}
+
+// loggerFlush writes the pending records to the console right away;
+// it needs to be called before entering deep sleep
+void loggerFlush()
+{
+    loggerDrain();
+}
@@ -0,0 +1,163 @@
+#ifndef Logger_h
+#define Logger_h
+
+#include <WString.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// Logger is the logging front end. The level is fixed at compile time
+// with LOGGER_LEVEL, so the calls above it compile to nothing, arguments
+// included. The enabled calls do not format anything: they copy the
+// format (its address is its id) and the raw arguments into a record of a
+// lock-free ring, and a low priority task formats the records to the
+// console later. Takes the ArduinoLog format specifiers:
+// %s %c %d %i %l %u %x %X %b %B %t %T %D %F and %%.
+// Integers are kept as 32 bits, floating point as float and strings are
+// copied, truncated to fit the record.
+
+#define LOG_LEVEL_SILENT 0
+#define LOG_LEVEL_FATAL 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_NOTICE 4
+#define LOG_LEVEL_TRACE 5
+#define LOG_LEVEL_VERBOSE 6
+
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL LOG_LEVEL_TRACE
+#endif
+
+const size_t LOGGER_ARGS_SIZE = 48;
+
+// LogRecord is a slot of the ring; sequence tells whose turn it is
+// (see loggerReserve in Logger.cpp)
+struct LogRecord
+{
+    std::atomic<uint32_t> sequence;
+    const char *format;
+    uint32_t timestampMs;
+    uint8_t level;
+    uint8_t length;
+    bool truncated;
+    uint8_t args[LOGGER_ARGS_SIZE];
+};
+
+void loggerInit();
+
+LogRecord *loggerReserve(uint8_t level, const char *format);
+
+void loggerCommit(LogRecord *record);
+
+void loggerDrain();
+
+void loggerFlush();
+
+// loggerPut appends an argument to a record. Once an argument does not
+// fit, the record is truncated and the following ones are dropped.
+inline void loggerPutBytes(LogRecord *record, const void *value, size_t length)
+{
+    if (record->truncated || record->length + length > LOGGER_ARGS_SIZE)
+    {
+        record->truncated = true;
+        return;
+    }
+    memcpy(record->args + record->length, value, length);
+    record->length += length;
+}
+
+inline void loggerPut(LogRecord *record, const char *value)
+{
+    size_t length = value != nullptr ? strlen(value) : 0;
+    size_t room = record->length < LOGGER_ARGS_SIZE ? LOGGER_ARGS_SIZE - record->length - 1 : 0;
+    if (length > room)
+    {
+        length = room;
+    }
+    uint8_t prefix = length;
+    loggerPutBytes(record, &prefix, 1);
+    loggerPutBytes(record, value, length);
+}
+
+inline void loggerPut(LogRecord *record, char *value)
+{
+    loggerPut(record, (const char *)value);
+}
+
+inline void loggerPut(LogRecord *record, const String &value)
+{
+    loggerPut(record, value.c_str());
+}
+
+inline void loggerPut(LogRecord *record, double value)
+{
+    float stored = value;
+    loggerPutBytes(record, &stored, sizeof(stored));
+}
+
+inline void loggerPut(LogRecord *record, float value)
+{
+    loggerPutBytes(record, &value, sizeof(value));
+}
+
+template <typename T>
+inline void loggerPut(LogRecord *record, T value)
+{
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "unsupported log argument");
+    uint32_t stored = (uint32_t)value;
+    loggerPutBytes(record, &stored, sizeof(stored));
+}
+
+// loggerWrite queues a log record, or counts it as dropped if the ring is full
+template <typename... Args>
+void loggerWrite(uint8_t level, const char *format, const Args &...args)
+{
+    LogRecord *record = loggerReserve(level, format);
+    if (record == nullptr)
+    {
+        return;
+    }
+    int expand[] = {0, (loggerPut(record, args), 0)...};
+    (void)expand;
+    loggerCommit(record);
+}
+
+#if LOGGER_LEVEL >= LOG_LEVEL_FATAL
+#define LOG_FATAL(...) loggerWrite(LOG_LEVEL_FATAL, __VA_ARGS__)
+#else
+#define LOG_FATAL(...) ((void)0)
+#endif
+
+#if LOGGER_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) loggerWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#if LOGGER_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) loggerWrite(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) ((void)0)
+#endif
+
+#if LOGGER_LEVEL >= LOG_LEVEL_NOTICE
+#define LOG_NOTICE(...) loggerWrite(LOG_LEVEL_NOTICE, __VA_ARGS__)
+#else
+#define LOG_NOTICE(...) ((void)0)
+#endif
+
+#if LOGGER_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) loggerWrite(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+#if LOGGER_LEVEL >= LOG_LEVEL_VERBOSE
+#define LOG_VERBOSE(...) loggerWrite(LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#else
+#define LOG_VERBOSE(...) ((void)0)
+#endif
+
+#endif
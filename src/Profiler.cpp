@@ -0,0 +1,121 @@
+#include "Profiler.h"
+
+#include <Arduino.h>
+
+#include "Hal.h"
+
+const uint32_t PROFILE_TRACE_MAGIC = 0x50524F46;
+
+struct ProfileRecord
+{
+  uint32_t timestampUs;
+  uint16_t boot;
+  uint8_t phase;
+  uint8_t reserved;
+};
+
+// ProfileTrace is a ring of the last records, kept in RTC memory
+// so the records of previous wakes survive the deep sleep
+struct ProfileTrace
+{
+  uint32_t magic;
+  uint16_t boot;
+  uint8_t head;
+  uint8_t count;
+  ProfileRecord records[PROFILE_TRACE_SIZE];
+};
+
+RTC_DATA_ATTR ProfileTrace profileTrace;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// appendRecord appends a record to the ring, overwriting the oldest when full
+void appendRecord(uint8_t phase, uint32_t timestampUs)
+{
+  ProfileRecord &entry = profileTrace.records[profileTrace.head];
+  entry.timestampUs = timestampUs;
+  entry.boot = profileTrace.boot;
+  entry.phase = phase;
+  entry.reserved = 0;
+
+  profileTrace.head = (profileTrace.head + 1) % PROFILE_TRACE_SIZE;
+  if (profileTrace.count < PROFILE_TRACE_SIZE)
+  {
+    profileTrace.count++;
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// profilerInit needs to be called first thing in setup; it starts the
+// records of a new boot, clearing the ring after a cold boot
+void profilerInit()
+{
+  if (profileTrace.magic != PROFILE_TRACE_MAGIC || profileTrace.head >= PROFILE_TRACE_SIZE || profileTrace.count > PROFILE_TRACE_SIZE)
+  {
+    memset(&profileTrace, 0, sizeof(ProfileTrace));
+    profileTrace.magic = PROFILE_TRACE_MAGIC;
+  }
+  profileTrace.boot++;
+  appendRecord(PROFILE_PHASE_BOOT, halMicros());
+}
+
+// profilerBegin records the start of a phase
+void profilerBegin(ProfilePhase phase)
+{
+  appendRecord(phase, halMicros());
+}
+
+// profilerEnd records the end of a phase
+void profilerEnd(ProfilePhase phase)
+{
+  appendRecord(phase | PROFILE_PHASE_END, halMicros());
+}
+
+// profilerMark records an instant
+void profilerMark(ProfilePhase phase)
+{
+  appendRecord(phase, halMicros());
+}
+
+// profilerMarkAt records an instant that happened earlier, measured by
+// another task: the records must only be written from the loop task
+void profilerMarkAt(ProfilePhase phase, uint32_t timestampUs)
+{
+  appendRecord(phase, timestampUs);
+}
+
+// profilerEncode writes the trace (see Profiler.h), returning
+// its size, or 0 if the buffer is too small
+size_t profilerEncode(uint8_t *buffer, size_t size)
+{
+  size_t length = 2 + profileTrace.count * PROFILE_RECORD_SIZE;
+  if (size < length)
+  {
+    return 0;
+  }
+
+  buffer[0] = PROFILE_TRACE_VERSION;
+  buffer[1] = profileTrace.count;
+
+  uint8_t *data = buffer + 2;
+  uint8_t oldest = (profileTrace.head + PROFILE_TRACE_SIZE - profileTrace.count) % PROFILE_TRACE_SIZE;
+  for (uint8_t i = 0; i < profileTrace.count; i++)
+  {
+    const ProfileRecord &entry = profileTrace.records[(oldest + i) % PROFILE_TRACE_SIZE];
+    data[0] = entry.timestampUs;
+    data[1] = entry.timestampUs >> 8;
+    data[2] = entry.timestampUs >> 16;
+    data[3] = entry.timestampUs >> 24;
+    data[4] = entry.boot;
+    data[5] = entry.boot >> 8;
+    data[6] = entry.phase;
+    data[7] = 0;
+    data += PROFILE_RECORD_SIZE;
+  }
+  return length;
+}
@@ -0,0 +1,50 @@
+#ifndef Profiler_h
+#define Profiler_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ProfilePhase identifies what the firmware was doing. Phases are
+// recorded as a begin and an end record, instants as a single record.
+// The values are decoded by scripts/profile-decode.py, so they must not change.
+enum ProfilePhase : uint8_t
+{
+    PROFILE_PHASE_BOOT = 1,         // instant: setup() started
+    PROFILE_PHASE_SETUP = 2,
+    PROFILE_PHASE_SETTINGS_INIT = 3,
+    PROFILE_PHASE_FIRST_STATE = 4,  // instant: the first state is about to run
+    PROFILE_PHASE_DEVICE_NAME = 5,
+    PROFILE_PHASE_WIFI_INIT = 6,
+    PROFILE_PHASE_BLE_INIT = 7,
+    PROFILE_PHASE_NTP_SYNC = 8,
+    PROFILE_PHASE_DEEP_SLEEP = 9,   // instant: about to enter deep sleep
+    PROFILE_PHASE_FIRST_FRAME = 10, // instant: the first sunrise frame was sent to the leds
+    PROFILE_PHASE_HOUSEHOLD_SYNC = 11,
+};
+
+// set in the phase of the record that ends a phase
+const uint8_t PROFILE_PHASE_END = 0x80;
+
+// the encoded trace, little endian:
+// version (1) | record count (1) | records, oldest first
+// where each record is: microseconds since boot (4) | boot number (2) | phase (1) | 0 (1)
+const uint8_t PROFILE_TRACE_VERSION = 1;
+const size_t PROFILE_RECORD_SIZE = 8;
+
+// records kept in RTC memory, so the encoded trace fits a 512 bytes attribute
+const uint8_t PROFILE_TRACE_SIZE = 60;
+const size_t PROFILE_TRACE_ENCODED_SIZE = 2 + PROFILE_TRACE_SIZE * PROFILE_RECORD_SIZE;
+
+void profilerInit();
+
+void profilerBegin(ProfilePhase phase);
+
+void profilerEnd(ProfilePhase phase);
+
+void profilerMark(ProfilePhase phase);
+
+void profilerMarkAt(ProfilePhase phase, uint32_t timestampUs);
+
+size_t profilerEncode(uint8_t *buffer, size_t size);
+
+#endif
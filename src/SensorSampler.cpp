@@ -0,0 +1,238 @@
+#include "SensorSampler.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <math.h>
+
+#include "Hal.h"
+#include "Logger.h"
+
+// how much a new reading weighs in the averages
+const float SENSOR_AVERAGE_WEIGHT = 0.25f;
+
+// as low as the loop, on its core: reading the DHT11 is timing sensitive
+// and must not get in the way of the radios
+const uint8_t SENSOR_TASK_PRIORITY = 1;
+
+struct SensorRecord
+{
+  uint32_t epoch;
+  int16_t temperature;
+  uint16_t humidity;
+};
+
+// SensorState is all the sampler shares with its readers. It is written
+// by the sampler task only; sequence is odd while it is being written, so
+// the readers copy it again if it changed meanwhile (see readState).
+struct SensorState
+{
+  SensorSample latest;
+  bool hasSample;
+  uint16_t failures;
+  uint8_t head;
+  uint8_t count;
+  SensorRecord history[SENSOR_HISTORY_SIZE];
+};
+
+const HalSensorDriver *sensorDriver = nullptr;
+uint32_t sensorPeriodMs = SENSOR_SAMPLE_PERIOD_MS;
+std::atomic<uint32_t> sensorSequence(0);
+SensorState sensorState;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// heatIndex returns the apparent temperature, with the NOAA formula
+float heatIndex(float temperature, float humidity)
+{
+  float t = temperature * 1.8f + 32;
+  float index = 0.5f * (t + 61.0f + (t - 68.0f) * 1.2f + humidity * 0.094f);
+  if ((index + t) / 2 >= 80)
+  {
+    index = -42.379f + 2.04901523f * t + 10.14333127f * humidity - 0.22475541f * t * humidity -
+            0.00683783f * t * t - 0.05481717f * humidity * humidity + 0.00122874f * t * t * humidity +
+            0.00085282f * t * humidity * humidity - 0.00000199f * t * t * humidity * humidity;
+    if (humidity < 13 && t >= 80 && t <= 112)
+    {
+      index -= ((13 - humidity) / 4) * sqrtf((17 - fabsf(t - 95)) / 17);
+    }
+    else if (humidity > 85 && t >= 80 && t <= 87)
+    {
+      index += ((humidity - 85) / 10) * ((87 - t) / 5);
+    }
+  }
+  return (index - 32) / 1.8f;
+}
+
+// dewPoint returns the dew point, with the Magnus formula
+float dewPoint(float temperature, float humidity)
+{
+  if (humidity < 1)
+  {
+    humidity = 1;
+  }
+  float gamma = logf(humidity / 100) + 17.62f * temperature / (243.12f + temperature);
+  return 243.12f * gamma / (17.62f - gamma);
+}
+
+// beginWrite and endWrite enclose the changes to the shared state
+void beginWrite()
+{
+  sensorSequence.store(sensorSequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void endWrite()
+{
+  sensorSequence.store(sensorSequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// readState copies the shared state, consistently, without blocking the sampler
+void readState(SensorState *state)
+{
+  for (;;)
+  {
+    uint32_t sequence = sensorSequence.load(std::memory_order_acquire);
+    if (sequence % 2 == 0)
+    {
+      memcpy(state, &sensorState, sizeof(SensorState));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sensorSequence.load(std::memory_order_relaxed) == sequence)
+      {
+        return;
+      }
+    }
+  }
+}
+
+// addReading adds a reading to the history and updates the averages
+// and what is derived from them
+void addReading(float temperature, float humidity)
+{
+  SensorSample &latest = sensorState.latest;
+  latest.epoch = halWallClockMs() / 1000;
+  latest.temperature = temperature;
+  latest.humidity = humidity;
+  if (!sensorState.hasSample)
+  {
+    latest.averageTemperature = temperature;
+    latest.averageHumidity = humidity;
+    sensorState.hasSample = true;
+  }
+  else
+  {
+    latest.averageTemperature += SENSOR_AVERAGE_WEIGHT * (temperature - latest.averageTemperature);
+    latest.averageHumidity += SENSOR_AVERAGE_WEIGHT * (humidity - latest.averageHumidity);
+  }
+  latest.heatIndex = heatIndex(latest.averageTemperature, latest.averageHumidity);
+  latest.dewPoint = dewPoint(latest.averageTemperature, latest.averageHumidity);
+
+  SensorRecord &record = sensorState.history[sensorState.head];
+  record.epoch = latest.epoch;
+  record.temperature = lroundf(temperature * 100);
+  record.humidity = lroundf(humidity * 100);
+  sensorState.head = (sensorState.head + 1) % SENSOR_HISTORY_SIZE;
+  if (sensorState.count < SENSOR_HISTORY_SIZE)
+  {
+    sensorState.count++;
+  }
+}
+
+// sampleStep reads the sensor; it is the step of the sampler task
+void sampleStep()
+{
+  float temperature;
+  float humidity;
+  bool valid = sensorDriver->read(&temperature, &humidity) && !isnan(temperature) && !isnan(humidity);
+
+  beginWrite();
+  if (valid)
+  {
+    addReading(temperature, humidity);
+  }
+  else
+  {
+    sensorState.failures++;
+  }
+  endWrite();
+}
+
+// putInt16 writes a little endian 16 bits value
+uint8_t *putInt16(uint8_t *data, uint16_t value)
+{
+  data[0] = value;
+  data[1] = value >> 8;
+  return data + 2;
+}
+
+// centi returns a value in hundredths, as written to the history
+int16_t centi(float value)
+{
+  return isnan(value) ? 0 : (int16_t)lroundf(value * 100);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// sensorSamplerStart sets up the sensor and starts the task sampling it
+// every SENSOR_SAMPLE_PERIOD_MS, or as often as the sensor allows
+void sensorSamplerStart()
+{
+  if (sensorDriver != nullptr)
+  {
+    return;
+  }
+  sensorDriver = halSensorDriver();
+  sensorDriver->begin();
+  sensorPeriodMs = sensorDriver->minIntervalMs > SENSOR_SAMPLE_PERIOD_MS ? sensorDriver->minIntervalMs : SENSOR_SAMPLE_PERIOD_MS;
+  if (!halTaskStart("sensor", sampleStep, sensorPeriodMs, SENSOR_TASK_PRIORITY, HAL_TASK_LOOP_CORE, HAL_TASK_STACK_SIZE))
+  {
+    LOG_ERROR("could not start the %s sensor sampler\n", sensorDriver->name);
+  }
+}
+
+// sensorSamplerLatest copies the latest sample without waiting for the
+// sensor, returning false if there is none yet
+bool sensorSamplerLatest(SensorSample *sample)
+{
+  SensorState state;
+  readState(&state);
+  *sample = state.latest;
+  return state.hasSample;
+}
+
+// sensorSamplerEncodeHistory writes the history (see SensorSampler.h),
+// returning its size, or 0 if the buffer is too small
+size_t sensorSamplerEncodeHistory(uint8_t *buffer, size_t size)
+{
+  SensorState state;
+  readState(&state);
+
+  size_t length = 14 + state.count * SENSOR_HISTORY_RECORD_SIZE;
+  if (size < length)
+  {
+    return 0;
+  }
+
+  buffer[0] = SENSOR_HISTORY_VERSION;
+  buffer[1] = state.count;
+  uint8_t *data = putInt16(buffer + 2, sensorPeriodMs / 1000);
+  data = putInt16(data, state.failures);
+  data = putInt16(data, centi(state.latest.averageTemperature));
+  data = putInt16(data, centi(state.latest.averageHumidity));
+  data = putInt16(data, centi(state.latest.heatIndex));
+  data = putInt16(data, centi(state.latest.dewPoint));
+
+  uint8_t oldest = (state.head + SENSOR_HISTORY_SIZE - state.count) % SENSOR_HISTORY_SIZE;
+  for (uint8_t i = 0; i < state.count; i++)
+  {
+    const SensorRecord &record = state.history[(oldest + i) % SENSOR_HISTORY_SIZE];
+    data = putInt16(data, record.epoch);
+    data = putInt16(data, record.epoch >> 16);
+    data = putInt16(data, record.temperature);
+    data = putInt16(data, record.humidity);
+  }
+  return length;
+}
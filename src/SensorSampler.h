@@ -0,0 +1,38 @@
+#ifndef SensorSampler_h
+#define SensorSampler_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// how often the sensor is sampled and how many samples are kept
+const uint32_t SENSOR_SAMPLE_PERIOD_MS = 30000;
+const uint8_t SENSOR_HISTORY_SIZE = 60;
+
+// SensorSample is the latest reading with the smoothed values derived from it
+struct SensorSample
+{
+    uint32_t epoch;
+    float temperature;
+    float humidity;
+    float averageTemperature;
+    float averageHumidity;
+    float heatIndex;
+    float dewPoint;
+};
+
+// the encoded history, little endian, temperatures in hundredths of a
+// celsius degree (signed) and humidities in hundredths of a % (unsigned):
+// version (1) | count (1) | sample period in seconds (2) | failed reads (2) |
+// average temperature (2) | average humidity (2) | heat index (2) | dew point (2) |
+// per sample, oldest first: unix time (4) | temperature (2) | humidity (2)
+const uint8_t SENSOR_HISTORY_VERSION = 1;
+const size_t SENSOR_HISTORY_RECORD_SIZE = 8;
+const size_t SENSOR_HISTORY_ENCODED_SIZE = 14 + SENSOR_HISTORY_SIZE * SENSOR_HISTORY_RECORD_SIZE;
+
+void sensorSamplerStart();
+
+bool sensorSamplerLatest(SensorSample *sample);
+
+size_t sensorSamplerEncodeHistory(uint8_t *buffer, size_t size);
+
+#endif
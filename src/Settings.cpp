@@ -1,12 +1,23 @@
-#include <Preferences.h>
 #include "Settings.h"
 
-const int MAX_ALARMS = 4;
+#include "Crc.h"
+#include "Hal.h"
+#include "Logger.h"
+#include "WakeContext.h"
 
 const String DEVICE_NAME = "device-name";
 const String WIFI_SSI = "wifi-ssid";
 const String WIFI_PASSWORD = "wifi-password";
 
+const String ALARM_TABLE = "alarm-table";
+
+const String TIME_ZONE = "time-zone";
+const String TIME_ZONE_TABLE = "time-zone-table";
+
+const String HOUSEHOLD_SYNC = "household-sync";
+
+// per alarm keys used before the alarm table was introduced,
+// only read to migrate existing settings
 const String ALARM_NUMBER = "alarm-number-";
 const String ALARM_WHEN = "alarm-when-";
 const String ALARM_SONG = "alarm-song-";
@@ -14,72 +25,630 @@ const String ALARM_ACTIVE = "alarm-active-";
 
 const String IN_DEEP_SLEEP = "in-deep-sleep";
 
-Preferences preferences;
+const String HTTP_TOKEN = "http-token";
+
+const uint32_t SETTINGS_STATS_MAGIC = 0x53544154;
+
+// the string settings, read from the flash on first use and written
+// back by settingsFlush if they changed
+enum CachedSetting
+{
+    CACHED_DEVICE_NAME = 0,
+    CACHED_WIFI_SSID,
+    CACHED_WIFI_PASSWORD,
+    CACHED_TIME_ZONE,
+    CACHED_HTTP_TOKEN,
+    CACHED_SETTINGS,
+};
+
+const String CACHED_KEYS[CACHED_SETTINGS] = {DEVICE_NAME, WIFI_SSI, WIFI_PASSWORD, TIME_ZONE, HTTP_TOKEN};
+
+String cachedValues[CACHED_SETTINGS];
+bool cachedLoaded[CACHED_SETTINGS] = {};
+bool cachedDirty[CACHED_SETTINGS] = {};
+
+// the alarm table, the time zone table, the household sync state and
+// the deep sleep flag are cached in the wake context
+bool alarmTableDirty = false;
+bool timeZoneTableDirty = false;
+bool householdSyncDirty = false;
+
+// set while the per alarm keys of older firmware versions wait for the
+// alarm table built from them to be written
+bool legacyAlarmKeys = false;
+
+// SettingsSnapshot is the cache as a change found it (see
+// settingsBeginChange), to roll the change back
+struct SettingsSnapshot
+{
+    String values[CACHED_SETTINGS];
+    bool dirty[CACHED_SETTINGS];
+    AlarmTable alarms;
+    TimeZoneTable timeZone;
+    HouseholdSync householdSync;
+    bool alarmTableDirty;
+    bool timeZoneTableDirty;
+    bool householdSyncDirty;
+};
+
+SettingsSnapshot changeSnapshot;
+
+// taken by every public function, as the loop, BLE and HTTP tasks all
+// use the settings; created by settingsInit
+HalLock settingsMutex = NULL;
+
+// SettingsStatsRecord is kept in RTC memory, so the counters add up
+// across deep sleeps until the next cold boot
+struct SettingsStatsRecord
+{
+    uint32_t magic;
+    SettingsStats stats;
+};
+
+RTC_DATA_ATTR SettingsStatsRecord settingsStats;
+
+bool preferencesStarted = false;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// countFlashRead and countFlashWrite count a flash access started at the
+// given halMicros() time
+void countFlashRead(uint64_t startedUs)
+{
+    settingsStats.stats.flashReads++;
+    settingsStats.stats.flashReadUs += halMicros() - startedUs;
+}
+
+void countFlashWrite(uint64_t startedUs)
+{
+    settingsStats.stats.flashWrites++;
+    settingsStats.stats.flashWriteUs += halMicros() - startedUs;
+}
+
+// alarmTableCrc returns the checksum of everything in the table but the crc itself
+uint32_t alarmTableCrc(const AlarmTable *table)
+{
+    return crc32(table, offsetof(AlarmTable, crc));
+}
+
+// readAlarmTable reads all the alarms stored in the preferences
+// with a single read. Returns false, and an empty table, if the stored
+// table is missing, from another version or corrupted.
+bool readAlarmTable(AlarmTable *table)
+{
+    uint64_t startedUs = halMicros();
+    size_t length = halKvGetBytes(ALARM_TABLE.c_str(), table, sizeof(AlarmTable));
+    countFlashRead(startedUs);
+    if (length != sizeof(AlarmTable) || table->version != ALARM_TABLE_VERSION || table->crc != alarmTableCrc(table))
+    {
+        memset(table, 0, sizeof(AlarmTable));
+        return false;
+    }
+    return true;
+}
+
+// timeZoneTableCrc returns the checksum of everything in the table but the crc itself
+uint32_t timeZoneTableCrc(const TimeZoneTable *table)
+{
+    return crc32(table, offsetof(TimeZoneTable, crc));
+}
+
+// readTimeZoneTable reads the compiled time zone stored in the
+// preferences. Returns false, and a zeroed table (UTC), if the stored
+// table is missing, from another version or corrupted.
+bool readTimeZoneTable(TimeZoneTable *table)
+{
+    uint64_t startedUs = halMicros();
+    size_t length = halKvGetBytes(TIME_ZONE_TABLE.c_str(), table, sizeof(TimeZoneTable));
+    countFlashRead(startedUs);
+    if (length != sizeof(TimeZoneTable) || table->version != TIME_ZONE_TABLE_VERSION ||
+        table->crc != timeZoneTableCrc(table))
+    {
+        memset(table, 0, sizeof(TimeZoneTable));
+        return false;
+    }
+    return true;
+}
+
+// householdSyncCrc returns the checksum of everything in the state but the crc itself
+uint32_t householdSyncCrc(const HouseholdSync *sync)
+{
+    return crc32(sync, offsetof(HouseholdSync, crc));
+}
+
+// readHouseholdSync reads the household sync state stored in the
+// preferences. Returns false, and a zeroed state (sync disabled), if the
+// stored state is missing, from another version or corrupted.
+bool readHouseholdSync(HouseholdSync *sync)
+{
+    uint64_t startedUs = halMicros();
+    size_t length = halKvGetBytes(HOUSEHOLD_SYNC.c_str(), sync, sizeof(HouseholdSync));
+    countFlashRead(startedUs);
+    if (length != sizeof(HouseholdSync) || sync->version != HOUSEHOLD_SYNC_STATE_VERSION ||
+        sync->crc != householdSyncCrc(sync))
+    {
+        memset(sync, 0, sizeof(HouseholdSync));
+        return false;
+    }
+    return true;
+}
+
+// removeLegacyAlarmKeys removes the per alarm keys of older firmware
+// versions, once the alarm table built from them is written
+void removeLegacyAlarmKeys()
+{
+    for (uint number = 1; number <= MAX_ALARMS; number++)
+    {
+        halKvRemove((ALARM_NUMBER + String(number)).c_str());
+        halKvRemove((ALARM_WHEN + String(number)).c_str());
+        halKvRemove((ALARM_SONG + String(number)).c_str());
+        halKvRemove((ALARM_ACTIVE + String(number)).c_str());
+    }
+    legacyAlarmKeys = false;
+}
+
+// migrateAlarmTable builds the alarm table from the per alarm keys of
+// older firmware versions and writes it; the keys are only removed once
+// the table is written, so a failed write leaves them to the next flush.
+// A song name too long for the table is dropped, the alarm is kept:
+// the song store could not hold that song anyway.
+// Returns false if the table could not be written.
+bool migrateAlarmTable()
+{
+    AlarmTable table = {};
+    for (uint number = 1; number <= MAX_ALARMS; number++)
+    {
+        if (halKvGetUInt((ALARM_NUMBER + String(number)).c_str()) != number)
+        {
+            continue;
+        }
+
+        Alarm &alarm = table.alarms[number - 1];
+        alarm.number = number;
+        alarm.when = halKvGetUInt((ALARM_WHEN + String(number)).c_str());
+        String song = halKvGetString((ALARM_SONG + String(number)).c_str());
+        if (song.length() < ALARM_SONG_SIZE)
+        {
+            strlcpy(alarm.song, song.c_str(), ALARM_SONG_SIZE);
+        }
+        else
+        {
+            LOG_WARNING("alarm %d: song %s too long, dropped\n", number, song);
+        }
+        alarm.activeMatrix = halKvGetUInt((ALARM_ACTIVE + String(number)).c_str());
+        legacyAlarmKeys = true;
+    }
+
+    if (!settingsSaveAlarmTable(&table) || !settingsFlush())
+    {
+        // kept in the wake context and dirty, for the next flush to write
+        LOG_ERROR("could not write the migrated alarm table\n");
+        return false;
+    }
+    return true;
+}
+
+// beginPreferences opens the preferences on first use, so a wake
+// served from the wake context does not touch the flash at all
+void beginPreferences()
+{
+    if (preferencesStarted)
+    {
+        return;
+    }
+
+    halKvBegin("settings");
+    preferencesStarted = true;
+
+    uint64_t startedUs = halMicros();
+    size_t length = halKvGetBytesLength(ALARM_TABLE.c_str());
+    countFlashRead(startedUs);
+    if (length == 0)
+    {
+        migrateAlarmTable();
+    }
+}
+
+// getCached returns a string setting, reading it from the flash on first use
+const String &getCached(CachedSetting setting)
+{
+    if (!cachedLoaded[setting])
+    {
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        cachedValues[setting] = halKvGetString(CACHED_KEYS[setting].c_str());
+        countFlashRead(startedUs);
+        cachedLoaded[setting] = true;
+    }
+    return cachedValues[setting];
+}
+
+// putCached changes a string setting, to be written by settingsFlush;
+// setting the value it already has does nothing
+void putCached(CachedSetting setting, const String &value)
+{
+    if (getCached(setting) == value)
+    {
+        settingsStats.stats.skippedWrites++;
+        return;
+    }
+    cachedValues[setting] = value;
+    cachedDirty[setting] = true;
+}
+
+// readCached returns a copy of a string setting, for the other tasks to
+// change it meanwhile
+String readCached(CachedSetting setting)
+{
+    settingsLock();
+    String value = getCached(setting);
+    settingsUnlock();
+    return value;
+}
+
+// writeCached changes a string setting, to be written by settingsFlush
+bool writeCached(CachedSetting setting, const String &value)
+{
+    settingsLock();
+    putCached(setting, value);
+    settingsUnlock();
+    return true;
+}
+
+// restoreSnapshot rolls the cache back to the snapshot of the change.
+// Once flushed, what the change wrote is in the flash: what it changed is
+// left dirty, for the next flush to write the value of the snapshot back.
+void restoreSnapshot(bool flushed)
+{
+    for (int setting = 0; setting < CACHED_SETTINGS; setting++)
+    {
+        bool changed = cachedValues[setting] != changeSnapshot.values[setting];
+        cachedValues[setting] = changeSnapshot.values[setting];
+        cachedDirty[setting] = changeSnapshot.dirty[setting] || (flushed && changed);
+    }
+
+    bool changed = memcmp(&wakeContext.alarms, &changeSnapshot.alarms, sizeof(AlarmTable)) != 0;
+    wakeContext.alarms = changeSnapshot.alarms;
+    alarmTableDirty = changeSnapshot.alarmTableDirty || (flushed && changed);
+
+    changed = memcmp(&wakeContext.timeZone, &changeSnapshot.timeZone, sizeof(TimeZoneTable)) != 0;
+    wakeContext.timeZone = changeSnapshot.timeZone;
+    timeZoneTableDirty = changeSnapshot.timeZoneTableDirty || (flushed && changed);
+
+    changed = memcmp(&wakeContext.householdSync, &changeSnapshot.householdSync, sizeof(HouseholdSync)) != 0;
+    wakeContext.householdSync = changeSnapshot.householdSync;
+    householdSyncDirty = changeSnapshot.householdSyncDirty || (flushed && changed);
+    wakeContextCommit();
+}
 
-// settingsInit needs to be called (maybe in setup)
-// to allow settings to be used
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// settingsInit needs to be called (maybe in setup), before the tasks
+// using the settings start, to allow settings to be used.
+// After a deep sleep wake the settings kept in the wake context are used;
+// after a cold boot (or a corrupted context) they are read from the flash.
 void settingsInit()
 {
-    preferences.begin("settings");
+    if (settingsMutex == NULL)
+    {
+        settingsMutex = halLockCreate();
+    }
+    settingsLock();
+    if (settingsStats.magic != SETTINGS_STATS_MAGIC)
+    {
+        memset(&settingsStats, 0, sizeof(SettingsStatsRecord));
+        settingsStats.magic = SETTINGS_STATS_MAGIC;
+    }
+
+    if (!wakeContextIsValid())
+    {
+        // cleared first, as migrating the alarm table writes to the context
+        wakeContextInvalidate();
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        wakeContext.inDeepSleep = halKvGetBool(IN_DEEP_SLEEP.c_str());
+        countFlashRead(startedUs);
+        wakeContext.flashInDeepSleep = wakeContext.inDeepSleep;
+        if (!alarmTableDirty)
+        {
+            readAlarmTable(&wakeContext.alarms);
+        }
+        readTimeZoneTable(&wakeContext.timeZone);
+        readHouseholdSync(&wakeContext.householdSync);
+        wakeContextCommit();
+    }
+    settingsUnlock();
+}
+
+// settingsLock keeps the other tasks out of the settings, their flash and
+// the wake context they are kept in, until settingsUnlock; the task
+// holding them may lock them again. The modules keeping more in the wake
+// context hold it while they change it.
+void settingsLock()
+{
+    halLockTake(settingsMutex);
+}
+
+void settingsUnlock()
+{
+    halLockGive(settingsMutex);
+}
+
+// settingsFlush writes the settings changed since the last flush to the
+// flash, returning false if any write failed; those stay changed, for the
+// next flush to write again. The changes are kept in RAM and RTC memory
+// until then, so it needs to be called after a configuration change and
+// before entering deep sleep.
+bool settingsFlush()
+{
+    settingsLock();
+    bool result = true;
+    for (int setting = 0; setting < CACHED_SETTINGS; setting++)
+    {
+        if (!cachedDirty[setting])
+        {
+            continue;
+        }
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        bool written = halKvPutString(CACHED_KEYS[setting].c_str(), cachedValues[setting]) > 0;
+        countFlashWrite(startedUs);
+        cachedDirty[setting] = !written;
+        result &= written;
+    }
+
+    if (alarmTableDirty)
+    {
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        bool written =
+            halKvPutBytes(ALARM_TABLE.c_str(), &wakeContext.alarms, sizeof(AlarmTable)) == sizeof(AlarmTable);
+        countFlashWrite(startedUs);
+        alarmTableDirty = !written;
+        if (written && legacyAlarmKeys)
+        {
+            removeLegacyAlarmKeys();
+        }
+        result &= written;
+    }
+
+    if (timeZoneTableDirty)
+    {
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        bool written = halKvPutBytes(TIME_ZONE_TABLE.c_str(), &wakeContext.timeZone, sizeof(TimeZoneTable)) ==
+                       sizeof(TimeZoneTable);
+        countFlashWrite(startedUs);
+        timeZoneTableDirty = !written;
+        result &= written;
+    }
+
+    if (householdSyncDirty)
+    {
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        bool written = halKvPutBytes(HOUSEHOLD_SYNC.c_str(), &wakeContext.householdSync, sizeof(HouseholdSync)) ==
+                       sizeof(HouseholdSync);
+        countFlashWrite(startedUs);
+        householdSyncDirty = !written;
+        result &= written;
+    }
+
+    if (wakeContext.inDeepSleep != wakeContext.flashInDeepSleep)
+    {
+        beginPreferences();
+        uint64_t startedUs = halMicros();
+        bool written = halKvPutBool(IN_DEEP_SLEEP.c_str(), wakeContext.inDeepSleep) > 0;
+        countFlashWrite(startedUs);
+        if (written)
+        {
+            wakeContext.flashInDeepSleep = wakeContext.inDeepSleep;
+            wakeContextCommit();
+        }
+        result &= written;
+    }
+    settingsUnlock();
+    return result;
+}
+
+// settingsBeginChange starts a change of several settings, made with the
+// other functions by the task calling it: the other tasks wait for the
+// settings until settingsCommitChange or settingsCancelChange ends it, so
+// they never see it half made. A change can not begin within another.
+void settingsBeginChange()
+{
+    settingsLock();
+    for (int setting = 0; setting < CACHED_SETTINGS; setting++)
+    {
+        changeSnapshot.values[setting] = getCached((CachedSetting)setting);
+        changeSnapshot.dirty[setting] = cachedDirty[setting];
+    }
+    changeSnapshot.alarms = wakeContext.alarms;
+    changeSnapshot.timeZone = wakeContext.timeZone;
+    changeSnapshot.householdSync = wakeContext.householdSync;
+    changeSnapshot.alarmTableDirty = alarmTableDirty;
+    changeSnapshot.timeZoneTableDirty = timeZoneTableDirty;
+    changeSnapshot.householdSyncDirty = householdSyncDirty;
+}
+
+// settingsCommitChange ends the change, writing it to the flash as
+// settingsFlush does. If any write fails, the change is rolled back and
+// false is returned.
+bool settingsCommitChange()
+{
+    bool written = settingsFlush();
+    if (!written)
+    {
+        restoreSnapshot(true);
+    }
+    settingsUnlock();
+    return written;
+}
+
+// settingsCancelChange ends the change, rolling it back
+void settingsCancelChange()
+{
+    restoreSnapshot(false);
+    settingsUnlock();
+}
+
+// settingsGetStats copies the flash access counters
+void settingsGetStats(SettingsStats *stats)
+{
+    settingsLock();
+    *stats = settingsStats.stats;
+    settingsUnlock();
 }
 
 // settingsGetDeviceName returns the device name stored in the preferences
 String settingsGetDeviceName()
 {
-    return preferences.getString(DEVICE_NAME.c_str());
+    return readCached(CACHED_DEVICE_NAME);
 }
 
 // settingsGetWifiSsid returns the wifi ssid stored in the preferences
 String settingsGetWifiSsid()
 {
-    return preferences.getString(WIFI_SSI.c_str());
+    return readCached(CACHED_WIFI_SSID);
 }
 
 // settingsGetWifiPassword returns the wifi password stored in the preferences
 String settingsGetWifiPassword()
 {
-    return preferences.getString(WIFI_PASSWORD.c_str());
+    return readCached(CACHED_WIFI_PASSWORD);
+}
+
+// settingsGetAlarmTable returns all the alarms, as loaded by settingsInit.
+// Returns false, and an empty table, if no valid table is stored.
+bool settingsGetAlarmTable(AlarmTable *table)
+{
+    settingsLock();
+    *table = wakeContext.alarms;
+    settingsUnlock();
+    return table->version == ALARM_TABLE_VERSION;
 }
 
 // settingsGetAlarm returns an alarm stored in the preferences
 Alarm settingsGetAlarm(uint number)
 {
-    Alarm alarm;
+    Alarm alarm = {};
     if (number > MAX_ALARMS || number <= 0)
     {
         return alarm;
     }
 
-    alarm.number = preferences.getUInt((ALARM_NUMBER + String(number)).c_str());
-    alarm.when = preferences.getULong((ALARM_WHEN + String(number)).c_str());
-    alarm.song = preferences.getString((ALARM_WHEN + String(number)).c_str());
-    alarm.activeMatrix = preferences.getUInt((ALARM_ACTIVE + String(number)).c_str());
+    AlarmTable table;
+    settingsGetAlarmTable(&table);
+    return table.alarms[number - 1];
+}
+
+// settingsGetAlarmSchedule indexes all the alarms stored in the preferences
+// by weekday, returning the number of alarms scheduled
+uint8_t settingsGetAlarmSchedule(AlarmSchedule *schedule)
+{
+    AlarmTable table;
+    settingsGetAlarmTable(&table);
 
-    return alarm;
+    alarmSchedulerClear(schedule);
+    for (uint number = 1; number <= MAX_ALARMS; number++)
+    {
+        const Alarm &alarm = table.alarms[number - 1];
+        if (alarm.number == number)
+        {
+            alarmSchedulerAdd(schedule, alarm.number, alarm.when, alarm.activeMatrix);
+        }
+    }
+    alarmSchedulerBuild(schedule);
+
+    return schedule->count;
+}
+
+// settingsGetTimeZoneRule returns the TZ rule stored in the preferences
+String settingsGetTimeZoneRule()
+{
+    return readCached(CACHED_TIME_ZONE);
+}
+
+// settingsGetTimeZone returns the time zone compiled from the rule, as
+// loaded by settingsInit. Returns false, and UTC, if no valid table is stored.
+bool settingsGetTimeZone(TimeZoneTable *table)
+{
+    settingsLock();
+    *table = wakeContext.timeZone;
+    settingsUnlock();
+    return table->version == TIME_ZONE_TABLE_VERSION;
+}
+
+// settingsGetHouseholdSync returns the household sync state, as loaded
+// by settingsInit. Returns false, and a zeroed state, if none is stored.
+bool settingsGetHouseholdSync(HouseholdSync *sync)
+{
+    settingsLock();
+    *sync = wakeContext.householdSync;
+    settingsUnlock();
+    return sync->version == HOUSEHOLD_SYNC_STATE_VERSION;
 }
 
 // settingsGetInDeepSleep returns the value of the flag indicating if the current status is deep sleep
 bool settingsGetInDeepSleep()
 {
-    return preferences.getBool(IN_DEEP_SLEEP.c_str());
+    settingsLock();
+    bool value = wakeContext.inDeepSleep;
+    settingsUnlock();
+    return value;
+}
+
+// settingsGetHttpToken returns the token the configuration changes by
+// HTTP must carry, empty while they are refused
+String settingsGetHttpToken()
+{
+    return readCached(CACHED_HTTP_TOKEN);
 }
 
 // settingsSaveDeviceName stores the device name in the preferences
+// on the next flush
 bool settingsSaveDeviceName(String name)
 {
-    return preferences.putString(DEVICE_NAME.c_str(), name) > 0;
+    return writeCached(CACHED_DEVICE_NAME, name);
 }
 
 // settingsSaveWifiSsid stores the wifi ssid in the preferences
+// on the next flush
 bool settingsSaveWifiSsid(String ssid)
 {
-    return preferences.putString(WIFI_SSI.c_str(), ssid) > 0;
+    return writeCached(CACHED_WIFI_SSID, ssid);
 }
 
 // settingsSaveWifiPassword stores the wifi password in the preferences
+// on the next flush
 bool settingsSaveWifiPassword(String password)
 {
-    return preferences.putString(WIFI_PASSWORD.c_str(), password) > 0;
+    return writeCached(CACHED_WIFI_PASSWORD, password);
+}
+
+// settingsSaveAlarmTable stores all the alarms in the preferences with a
+// single write on the next flush, so either all or none of the alarms change
+bool settingsSaveAlarmTable(AlarmTable *table)
+{
+    table->version = ALARM_TABLE_VERSION;
+    table->crc = alarmTableCrc(table);
+    settingsLock();
+    if (memcmp(table, &wakeContext.alarms, sizeof(AlarmTable)) == 0)
+    {
+        settingsStats.stats.skippedWrites++;
+    }
+    else
+    {
+        wakeContext.alarms = *table;
+        wakeContextCommit();
+        alarmTableDirty = true;
+    }
+    settingsUnlock();
+    return true;
 }
 
 // settingsSaveAlarm stores an alarm in the preferences
@@ -91,11 +660,88 @@ bool settingsSaveAlarm(Alarm alarm)
         return false;
     }
 
-    return preferences.putUInt((ALARM_NUMBER + String(number)).c_str(), alarm.number) > 0 && preferences.putULong((ALARM_WHEN + String(number)).c_str(), alarm.when) > 0 && preferences.putString((ALARM_SONG + String(number)).c_str(), alarm.song) > 0 && preferences.putUInt((ALARM_ACTIVE + String(number)).c_str(), alarm.activeMatrix) > 0;
+    settingsLock();
+    AlarmTable table;
+    settingsGetAlarmTable(&table);
+    table.alarms[number - 1] = alarm;
+    bool saved = settingsSaveAlarmTable(&table);
+    settingsUnlock();
+    return saved;
 }
 
-// settingsSaveInDeepSleep stores a flag indicating if the current  status is deep sleep
+// settingsSaveTimeZone compiles a TZ rule from the first of January of
+// firstYear on (see TimeZone.h) and stores the rule and its table in the
+// preferences on the next flush. Nothing is stored if the rule is invalid.
+// The rule is compiled before the settings are locked.
+TimeZoneStatus settingsSaveTimeZone(String rule, uint16_t firstYear)
+{
+    TimeZoneTable table;
+    TimeZoneStatus status = timeZoneCompile(rule.c_str(), rule.length(), firstYear, &table);
+    if (status != TIME_ZONE_SUCCESS)
+    {
+        return status;
+    }
+
+    table.crc = timeZoneTableCrc(&table);
+    settingsLock();
+    putCached(CACHED_TIME_ZONE, rule);
+    if (memcmp(&table, &wakeContext.timeZone, sizeof(TimeZoneTable)) == 0)
+    {
+        settingsStats.stats.skippedWrites++;
+    }
+    else
+    {
+        wakeContext.timeZone = table;
+        wakeContextCommit();
+        timeZoneTableDirty = true;
+    }
+    settingsUnlock();
+    return TIME_ZONE_SUCCESS;
+}
+
+// settingsSaveHouseholdSync stores the household sync state in the
+// preferences on the next flush
+bool settingsSaveHouseholdSync(HouseholdSync *sync)
+{
+    sync->version = HOUSEHOLD_SYNC_STATE_VERSION;
+    sync->crc = householdSyncCrc(sync);
+    settingsLock();
+    if (memcmp(sync, &wakeContext.householdSync, sizeof(HouseholdSync)) == 0)
+    {
+        settingsStats.stats.skippedWrites++;
+    }
+    else
+    {
+        wakeContext.householdSync = *sync;
+        wakeContextCommit();
+        householdSyncDirty = true;
+    }
+    settingsUnlock();
+    return true;
+}
+
+// settingsSaveInDeepSleep stores a flag indicating if the current status is
+// deep sleep; it reaches the flash on the next flush, if it changed by then
 bool settingsSaveInDeepSleep(bool value)
 {
-    return preferences.putBool(IN_DEEP_SLEEP.c_str(), value) > 0;
+    settingsLock();
+    if (wakeContext.inDeepSleep == value)
+    {
+        settingsStats.stats.skippedWrites++;
+    }
+    else
+    {
+        wakeContext.inDeepSleep = value;
+        wakeContextCommit();
+    }
+    settingsUnlock();
+    return true;
+}
+
+// settingsSaveHttpToken stores the token the configuration changes by
+// HTTP must carry in the preferences on the next flush; an empty token
+// refuses them all
+bool settingsSaveHttpToken(String token)
+{
+    return writeCached(CACHED_HTTP_TOKEN, token);
 }
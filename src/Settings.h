@@ -3,28 +3,88 @@
 
 #include <Arduino.h>
 
+#include "AlarmScheduler.h"
 #include "GlobalStatus.h"
+#include "HouseholdSync.h"
+#include "TimeZone.h"
+
+const uint8_t ALARM_TABLE_VERSION = 1;
+
+// AlarmTable is the layout of all the alarms stored in the preferences.
+// The alarm in slot N has number N + 1; number 0 marks an empty slot.
+struct AlarmTable
+{
+    uint8_t version;
+    uint8_t reserved[3];
+    Alarm alarms[MAX_ALARMS];
+    uint32_t crc;
+};
+
+// SettingsStats count the flash accesses since the last cold boot, and
+// the writes skipped because the value did not change
+struct SettingsStats
+{
+    uint32_t flashReads;
+    uint32_t flashWrites;
+    uint32_t skippedWrites;
+    uint32_t flashReadUs;
+    uint32_t flashWriteUs;
+};
 
 void settingsInit();
 
+void settingsLock();
+
+void settingsUnlock();
+
+bool settingsFlush();
+
+void settingsBeginChange();
+
+bool settingsCommitChange();
+
+void settingsCancelChange();
+
+void settingsGetStats(SettingsStats *stats);
+
 String settingsGetDeviceName();
 
 String settingsGetWifiSsid();
 
 String settingsGetWifiPassword();
 
+bool settingsGetAlarmTable(AlarmTable *table);
+
 Alarm settingsGetAlarm(uint number);
 
+uint8_t settingsGetAlarmSchedule(AlarmSchedule *schedule);
+
+String settingsGetTimeZoneRule();
+
+bool settingsGetTimeZone(TimeZoneTable *table);
+
+bool settingsGetHouseholdSync(HouseholdSync *sync);
+
 bool settingsGetInDeepSleep();
 
+String settingsGetHttpToken();
+
 bool settingsSaveWifiSsid(String ssid);
 
 bool settingsSaveWifiPassword(String password);
 
 bool settingsSaveDeviceName(String name);
 
+bool settingsSaveAlarmTable(AlarmTable *table);
+
 bool settingsSaveAlarm(Alarm alarm);
 
+TimeZoneStatus settingsSaveTimeZone(String rule, uint16_t firstYear);
+
+bool settingsSaveHouseholdSync(HouseholdSync *sync);
+
 bool settingsSaveInDeepSleep(bool value);
 
+bool settingsSaveHttpToken(String token);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include "Sha256.h"
+
+#include <string.h>
+
+static const uint32_t SHA256_INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint32_t rotateRight(uint32_t value, int bits)
+{
+    return value >> bits | value << (32 - bits);
+}
+
+// compress adds a 64 bytes block to the hash
+static void compress(uint32_t state[8], const uint8_t block[64])
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 |
+               block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) +
+                      SHA256_ROUND_CONSTANTS[i] + w[i];
+        uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// sha256Begin starts a SHA-256 computation
+void sha256Begin(Sha256 *sha)
+{
+    memcpy(sha->state, SHA256_INITIAL_STATE, sizeof(sha->state));
+    sha->length = 0;
+}
+
+// sha256Update adds data to the hash, in pieces of any size
+void sha256Update(Sha256 *sha, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t used = sha->length % sizeof(sha->block);
+    sha->length += length;
+    if (used > 0)
+    {
+        size_t taken = sizeof(sha->block) - used < length ? sizeof(sha->block) - used : length;
+        memcpy(sha->block + used, bytes, taken);
+        bytes += taken;
+        length -= taken;
+        if (used + taken < sizeof(sha->block))
+        {
+            return;
+        }
+        compress(sha->state, sha->block);
+    }
+    for (; length >= sizeof(sha->block); bytes += sizeof(sha->block), length -= sizeof(sha->block))
+    {
+        compress(sha->state, bytes);
+    }
+    memcpy(sha->block, bytes, length);
+}
+
+// sha256End pads the data and writes the hash
+void sha256End(Sha256 *sha, uint8_t digest[SHA256_SIZE])
+{
+    uint64_t bits = sha->length * 8;
+    size_t used = sha->length % sizeof(sha->block);
+    sha->block[used++] = 0x80;
+    if (used > sizeof(sha->block) - 8)
+    {
+        memset(sha->block + used, 0, sizeof(sha->block) - used);
+        compress(sha->state, sha->block);
+        used = 0;
+    }
+    memset(sha->block + used, 0, sizeof(sha->block) - 8 - used);
+    for (int i = 0; i < 8; i++)
+    {
+        sha->block[sizeof(sha->block) - 1 - i] = bits >> (8 * i);
+    }
+    compress(sha->state, sha->block);
+    for (int i = 0; i < 32; i++)
+    {
+        digest[i] = sha->state[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+// hmacSha256 writes the HMAC-SHA-256 of data (RFC 2104) under a key of
+// any length
+void hmacSha256(const void *key, size_t keyLength, const void *data, size_t length, uint8_t mac[SHA256_SIZE])
+{
+    Sha256 sha;
+    uint8_t pad[64] = {};
+    if (keyLength > sizeof(pad))
+    {
+        sha256Begin(&sha);
+        sha256Update(&sha, key, keyLength);
+        sha256End(&sha, pad);
+    }
+    else
+    {
+        memcpy(pad, key, keyLength);
+    }
+
+    for (size_t i = 0; i < sizeof(pad); i++)
+    {
+        pad[i] ^= 0x36;
+    }
+    sha256Begin(&sha);
+    sha256Update(&sha, pad, sizeof(pad));
+    sha256Update(&sha, data, length);
+    sha256End(&sha, mac);
+
+    for (size_t i = 0; i < sizeof(pad); i++)
+    {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    sha256Begin(&sha);
+    sha256Update(&sha, pad, sizeof(pad));
+    sha256Update(&sha, mac, SHA256_SIZE);
+    sha256End(&sha, mac);
+}
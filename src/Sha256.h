@@ -0,0 +1,26 @@
+#ifndef Sha256_h
+#define Sha256_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+const size_t SHA256_SIZE = 32;
+
+// Sha256 is a SHA-256 computation in progress: the hash of the blocks
+// done so far and the start of the next one
+struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+};
+
+void sha256Begin(Sha256 *sha);
+
+void sha256Update(Sha256 *sha, const void *data, size_t length);
+
+void sha256End(Sha256 *sha, uint8_t digest[SHA256_SIZE]);
+
+void hmacSha256(const void *key, size_t keyLength, const void *data, size_t length, uint8_t mac[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,167 @@
+#include "SongStore.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "Crc.h"
+#include "Hal.h"
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// roundUpToSector returns the length rounded up to whole flash sectors
+static uint32_t roundUpToSector(uint32_t length)
+{
+    return (length + SONG_STORE_SECTOR_SIZE - 1) / SONG_STORE_SECTOR_SIZE * SONG_STORE_SECTOR_SIZE;
+}
+
+// readDirectory reads the directory, returning false if it is not valid
+// (on a partition never written to, the flash is erased)
+static bool readDirectory(SongDirectory *directory)
+{
+    return halSongRead(0, directory, sizeof(SongDirectory)) == sizeof(SongDirectory) &&
+           directory->magic == SONG_STORE_MAGIC && directory->version == SONG_STORE_VERSION &&
+           directory->count <= SONG_STORE_MAX_SONGS && directory->crc == crc32(directory, offsetof(SongDirectory, crc));
+}
+
+// readDirectoryOrEmpty reads the directory, starting an empty one if
+// there is no valid directory
+static void readDirectoryOrEmpty(SongDirectory *directory)
+{
+    if (!readDirectory(directory))
+    {
+        memset(directory, 0, sizeof(SongDirectory));
+        directory->magic = SONG_STORE_MAGIC;
+        directory->version = SONG_STORE_VERSION;
+    }
+}
+
+// writeDirectory replaces the directory in the flash
+static bool writeDirectory(SongDirectory *directory)
+{
+    directory->crc = crc32(directory, offsetof(SongDirectory, crc));
+    return halSongErase(0, SONG_STORE_SECTOR_SIZE) && halSongWrite(0, directory, sizeof(SongDirectory));
+}
+
+// findSong returns the index of a song in the directory, -1 if not there
+static int findSong(const SongDirectory *directory, const char *name)
+{
+    for (uint8_t i = 0; i < directory->count; i++)
+    {
+        if (strncmp(directory->songs[i].name, name, ALARM_SONG_SIZE) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// findSpace finds the lowest sectors free for length bytes, taking the
+// space of the skipped song as free. Every overlap moves the candidate
+// past a song, so there are at most as many passes as songs.
+static bool findSpace(const SongDirectory *directory, int skip, uint32_t length, uint32_t *offset)
+{
+    uint32_t size = halSongStoreSize() / SONG_STORE_SECTOR_SIZE * SONG_STORE_SECTOR_SIZE;
+    uint32_t needed = roundUpToSector(length);
+    uint32_t candidate = SONG_STORE_SECTOR_SIZE;
+    bool moved = true;
+    while (moved)
+    {
+        moved = false;
+        for (uint8_t i = 0; i < directory->count; i++)
+        {
+            const SongEntry &song = directory->songs[i];
+            uint32_t end = roundUpToSector(song.offset + song.length);
+            if (i != skip && song.offset < candidate + needed && candidate < end)
+            {
+                candidate = end;
+                moved = true;
+            }
+        }
+    }
+    if (candidate > size || needed > size - candidate)
+    {
+        return false;
+    }
+    *offset = candidate;
+    return true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// songStoreFind looks a song up in the directory, returning false if it
+// is not there or the directory is not valid. The song itself is not
+// read: its CRC is checked when it is stored, not every time it plays.
+bool songStoreFind(const char *name, SongEntry *entry)
+{
+    SongDirectory directory;
+    if (!readDirectory(&directory))
+    {
+        return false;
+    }
+
+    int index = findSong(&directory, name);
+    if (index < 0)
+    {
+        return false;
+    }
+    const SongEntry &song = directory.songs[index];
+    uint32_t size = halSongStoreSize();
+    if (song.offset < SONG_STORE_SECTOR_SIZE || song.offset > size || song.length > size - song.offset)
+    {
+        return false;
+    }
+    *entry = song;
+    return true;
+}
+
+// songStoreAllocate finds the space to write a song of length bytes to,
+// returning false if it does not fit. The space of a song with the same
+// name is only taken if there is no other: that song is then removed
+// first, so it never plays half overwritten.
+bool songStoreAllocate(const char *name, uint32_t length, uint32_t *offset)
+{
+    SongDirectory directory;
+    readDirectoryOrEmpty(&directory);
+    int existing = findSong(&directory, name);
+    if (existing < 0 && directory.count == SONG_STORE_MAX_SONGS)
+    {
+        return false;
+    }
+    if (findSpace(&directory, -1, length, offset))
+    {
+        return true;
+    }
+    if (existing < 0 || !findSpace(&directory, existing, length, offset))
+    {
+        return false;
+    }
+
+    directory.count--;
+    memmove(&directory.songs[existing], &directory.songs[existing + 1],
+            (directory.count - existing) * sizeof(SongEntry));
+    memset(&directory.songs[directory.count], 0, sizeof(SongEntry));
+    return writeDirectory(&directory);
+}
+
+// songStoreAdd adds a song written to the flash to the directory,
+// replacing the song with the same name
+bool songStoreAdd(const SongEntry *entry)
+{
+    SongDirectory directory;
+    readDirectoryOrEmpty(&directory);
+    int index = findSong(&directory, entry->name);
+    if (index < 0)
+    {
+        if (directory.count == SONG_STORE_MAX_SONGS)
+        {
+            return false;
+        }
+        index = directory.count++;
+    }
+    directory.songs[index] = *entry;
+    return writeDirectory(&directory);
+}
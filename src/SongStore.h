@@ -0,0 +1,47 @@
+#ifndef SongStore_h
+#define SongStore_h
+
+#include <stdint.h>
+
+#include "Alarm.h"
+
+// The song store is the songs partition of the flash: a directory in its
+// first sector, naming the songs, then the songs, each a WAV file (see
+// AudioDecoder.h) starting on a sector of its own. An alarm plays the
+// song named by its song field. Songs are uploaded by BLE (see
+// SongTransfer.h) straight to the space songStoreAllocate finds them,
+// and only added to the directory once they are complete.
+
+const uint32_t SONG_STORE_MAGIC = 0x474E4F53; // "SONG"
+const uint8_t SONG_STORE_VERSION = 1;
+const uint8_t SONG_STORE_MAX_SONGS = 8;
+const uint32_t SONG_STORE_SECTOR_SIZE = 4096;
+
+// SongEntry is where a song is in the partition, and the CRC-32 of its file
+struct SongEntry
+{
+    char name[ALARM_SONG_SIZE];
+    uint32_t offset;
+    uint32_t length;
+    uint32_t crc;
+};
+
+// SongDirectory is the layout of the first sector of the partition;
+// crc covers everything before it
+struct SongDirectory
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t count;
+    uint8_t reserved[2];
+    SongEntry songs[SONG_STORE_MAX_SONGS];
+    uint32_t crc;
+};
+
+bool songStoreFind(const char *name, SongEntry *entry);
+
+bool songStoreAllocate(const char *name, uint32_t length, uint32_t *offset);
+
+bool songStoreAdd(const SongEntry *entry);
+
+#endif
@@ -0,0 +1,305 @@
+#include "SongTransfer.h"
+
+#include <string.h>
+
+#include "Crc.h"
+#include "Hal.h"
+#include "SongStore.h"
+
+// how much of the file is read back at a time to check its crc
+static const size_t SONG_TRANSFER_VERIFY_BLOCK = 256;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static uint16_t getUint16(const uint8_t *data)
+{
+    return data[0] | (uint16_t)data[1] << 8;
+}
+
+static uint32_t getUint32(const uint8_t *data)
+{
+    return getUint16(data) | (uint32_t)getUint16(data + 2) << 16;
+}
+
+static void putUint16(uint8_t *data, uint16_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+}
+
+static void putUint32(uint8_t *data, uint32_t value)
+{
+    putUint16(data, value);
+    putUint16(data + 2, value >> 16);
+}
+
+// reset ends the transfer, keeping the counters
+static void reset(SongTransfer *transfer)
+{
+    SongTransferStats stats = transfer->stats;
+    memset(transfer, 0, sizeof(SongTransfer));
+    transfer->stats = stats;
+}
+
+// fillAck sets the acknowledgement of the state of the transfer
+static void fillAck(SongTransfer *transfer, uint8_t status, SongTransferAck *ack)
+{
+    ack->status = status;
+    ack->next = transfer->next;
+    ack->mask = transfer->mask;
+    transfer->sinceAck = 0;
+    transfer->stats.acks++;
+}
+
+// fail ends the transfer with an error status
+static bool fail(SongTransfer *transfer, uint8_t status, SongTransferAck *ack)
+{
+    reset(transfer);
+    fillAck(transfer, status, ack);
+    return true;
+}
+
+// openTransfer starts a transfer, or resumes it if it is the same file
+static uint8_t openTransfer(SongTransfer *transfer, const uint8_t *command, size_t length)
+{
+    if (length <= SONG_TRANSFER_OPEN_SIZE || length - SONG_TRANSFER_OPEN_SIZE >= ALARM_SONG_SIZE)
+    {
+        return SONG_TRANSFER_BAD_COMMAND;
+    }
+    uint32_t fileLength = getUint32(command + 1);
+    uint32_t crc = getUint32(command + 5);
+    uint16_t chunkSize = getUint16(command + 9);
+    uint8_t window = command[11];
+    char name[ALARM_SONG_SIZE] = {};
+    memcpy(name, command + SONG_TRANSFER_OPEN_SIZE, length - SONG_TRANSFER_OPEN_SIZE);
+    if (fileLength == 0 || chunkSize == 0 || chunkSize > SONG_TRANSFER_MAX_CHUNK_SIZE || window == 0 ||
+        window > SONG_TRANSFER_MAX_WINDOW || strlen(name) != length - SONG_TRANSFER_OPEN_SIZE)
+    {
+        return SONG_TRANSFER_BAD_COMMAND;
+    }
+    uint32_t chunkCount = (fileLength + chunkSize - 1) / chunkSize;
+    if (chunkCount > UINT16_MAX)
+    {
+        return SONG_TRANSFER_BAD_COMMAND;
+    }
+
+    // the chunks received in sequence are kept, counted in the new chunk size
+    bool resume = transfer->active && strcmp(transfer->name, name) == 0 && transfer->length == fileLength &&
+                  transfer->crc == crc;
+    if (resume)
+    {
+        transfer->next = (uint32_t)transfer->next * transfer->chunkSize / chunkSize;
+        transfer->stats.resumes++;
+    }
+    else
+    {
+        uint32_t offset;
+        reset(transfer);
+        if (!songStoreAllocate(name, fileLength, &offset))
+        {
+            return SONG_TRANSFER_NO_SPACE;
+        }
+        memcpy(transfer->name, name, sizeof(name));
+        transfer->length = fileLength;
+        transfer->crc = crc;
+        transfer->offset = offset;
+        transfer->erasedUpTo = offset;
+        transfer->next = 0;
+        transfer->active = true;
+    }
+    transfer->chunkSize = chunkSize;
+    transfer->window = window;
+    transfer->chunkCount = chunkCount;
+    transfer->mask = 0;
+    return SONG_TRANSFER_IN_PROGRESS;
+}
+
+// writeChunk writes a payload to the flash, erasing the sectors it
+// reaches first. The chunks arrive about in order, so the sectors are
+// erased in order, each once.
+static bool writeChunk(SongTransfer *transfer, uint16_t sequence, const uint8_t *payload, size_t length)
+{
+    uint32_t offset = transfer->offset + (uint32_t)sequence * transfer->chunkSize;
+    while (transfer->erasedUpTo < offset + length)
+    {
+        if (!halSongErase(transfer->erasedUpTo, SONG_STORE_SECTOR_SIZE))
+        {
+            return false;
+        }
+        transfer->erasedUpTo += SONG_STORE_SECTOR_SIZE;
+        transfer->stats.sectorsErased++;
+    }
+    return halSongWrite(offset, payload, length);
+}
+
+// verify reads the file back from the flash to check its crc
+static bool verify(const SongTransfer *transfer)
+{
+    uint8_t block[SONG_TRANSFER_VERIFY_BLOCK];
+    uint32_t crc = 0;
+    for (uint32_t position = 0; position < transfer->length; position += sizeof(block))
+    {
+        size_t length = transfer->length - position < sizeof(block) ? transfer->length - position : sizeof(block);
+        if (halSongRead(transfer->offset + position, block, length) != length)
+        {
+            return false;
+        }
+        crc = crc32Update(crc, block, length);
+    }
+    return crc == transfer->crc;
+}
+
+// complete checks the file and adds it to the song store
+static bool complete(SongTransfer *transfer, SongTransferAck *ack)
+{
+    if (!verify(transfer))
+    {
+        return fail(transfer, SONG_TRANSFER_BAD_CRC, ack);
+    }
+    SongEntry entry = {};
+    memcpy(entry.name, transfer->name, sizeof(entry.name));
+    entry.offset = transfer->offset;
+    entry.length = transfer->length;
+    entry.crc = transfer->crc;
+    if (!songStoreAdd(&entry))
+    {
+        return fail(transfer, SONG_TRANSFER_FLASH_ERROR, ack);
+    }
+    // kept until the next command, to answer chunks sent again if this
+    // acknowledgement is lost
+    fillAck(transfer, SONG_TRANSFER_COMPLETE, ack);
+    transfer->active = false;
+    return true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// songTransferCommand handles a command of the client, setting the
+// acknowledgement to send back
+void songTransferCommand(SongTransfer *transfer, const uint8_t *command, size_t length, SongTransferAck *ack)
+{
+    uint8_t status = SONG_TRANSFER_BAD_COMMAND;
+    if (length >= 1 && command[0] == SONG_TRANSFER_OPEN)
+    {
+        status = openTransfer(transfer, command, length);
+    }
+    else if (length == 1 && command[0] == SONG_TRANSFER_CANCEL)
+    {
+        reset(transfer);
+        status = SONG_TRANSFER_IDLE;
+    }
+    fillAck(transfer, status, ack);
+}
+
+// songTransferWrite writes a chunk to the flash as it arrives, returning
+// true if an acknowledgement is due: every half window in sequence, on
+// the first chunk out of order (one was lost), on a duplicate (an
+// acknowledgement was lost) and at the end. Broken chunks are dropped,
+// and sent again by the client as if lost.
+bool songTransferWrite(SongTransfer *transfer, const uint8_t *chunk, size_t length, SongTransferAck *ack)
+{
+    if (!transfer->active)
+    {
+        bool completed = transfer->chunkCount > 0 && transfer->next == transfer->chunkCount;
+        fillAck(transfer, completed ? SONG_TRANSFER_COMPLETE : SONG_TRANSFER_IDLE, ack);
+        return true;
+    }
+    if (length < SONG_TRANSFER_CHUNK_HEADER_SIZE)
+    {
+        transfer->stats.badChunks++;
+        return false;
+    }
+
+    uint16_t sequence = getUint16(chunk);
+    const uint8_t *payload = chunk + SONG_TRANSFER_CHUNK_HEADER_SIZE;
+    size_t payloadLength = length - SONG_TRANSFER_CHUNK_HEADER_SIZE;
+    uint32_t expectedLength = sequence == transfer->chunkCount - 1
+                                  ? transfer->length - (uint32_t)sequence * transfer->chunkSize
+                                  : transfer->chunkSize;
+    if (sequence >= transfer->chunkCount || payloadLength != expectedLength ||
+        getUint32(chunk + 2) != crc32(payload, payloadLength))
+    {
+        transfer->stats.badChunks++;
+        return false;
+    }
+
+    uint32_t ahead = sequence - transfer->next;
+    if (sequence >= transfer->next && ahead >= transfer->window)
+    {
+        transfer->stats.badChunks++;
+        return false;
+    }
+    if (sequence < transfer->next || (ahead > 0 && (transfer->mask >> (ahead - 1)) & 1))
+    {
+        transfer->stats.duplicates++;
+        fillAck(transfer, SONG_TRANSFER_IN_PROGRESS, ack);
+        return true;
+    }
+
+    if (!writeChunk(transfer, sequence, payload, payloadLength))
+    {
+        return fail(transfer, SONG_TRANSFER_FLASH_ERROR, ack);
+    }
+    transfer->stats.chunks++;
+    transfer->sinceAck++;
+
+    bool ackDue = transfer->sinceAck >= (transfer->window + 1) / 2;
+    if (ahead > 0)
+    {
+        ackDue |= transfer->mask == 0;
+        transfer->mask |= 1UL << (ahead - 1);
+        transfer->stats.outOfOrder++;
+    }
+    else
+    {
+        // the chunks received ahead now in sequence are taken too
+        transfer->next++;
+        while (transfer->mask & 1)
+        {
+            transfer->next++;
+            transfer->mask >>= 1;
+        }
+        transfer->mask >>= 1;
+    }
+
+    if (transfer->next == transfer->chunkCount)
+    {
+        return complete(transfer, ack);
+    }
+    if (ackDue)
+    {
+        fillAck(transfer, SONG_TRANSFER_IN_PROGRESS, ack);
+    }
+    return ackDue;
+}
+
+// songTransferEncodeAck writes an acknowledgement as sent to the client,
+// returning its length, or 0 if the buffer is too small
+size_t songTransferEncodeAck(const SongTransferAck *ack, uint8_t *buffer, size_t size)
+{
+    if (size < SONG_TRANSFER_ACK_SIZE)
+    {
+        return 0;
+    }
+    buffer[0] = ack->status;
+    putUint16(buffer + 1, ack->next);
+    putUint32(buffer + 3, ack->mask);
+    return SONG_TRANSFER_ACK_SIZE;
+}
+
+// songTransferDecodeAck reads an acknowledgement, as the client does
+bool songTransferDecodeAck(const uint8_t *buffer, size_t length, SongTransferAck *ack)
+{
+    if (length != SONG_TRANSFER_ACK_SIZE)
+    {
+        return false;
+    }
+    ack->status = buffer[0];
+    ack->next = getUint16(buffer + 1);
+    ack->mask = getUint32(buffer + 3);
+    return true;
+}
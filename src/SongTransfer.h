@@ -0,0 +1,99 @@
+#ifndef SongTransfer_h
+#define SongTransfer_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Alarm.h"
+
+// A song is uploaded by BLE as a file in numbered chunks, straight to the
+// songs partition (see SongStore.h), without keeping the file in RAM.
+//
+// The client opens the transfer with a command, little endian:
+// SONG_TRANSFER_OPEN (1) | file length (4) | crc32 of the file (4) |
+// chunk size (2) | window (1) | song name
+// then writes the chunks without response:
+// sequence (2) | crc32 of the payload (4) | payload
+// where every payload but the last has chunk size bytes, and goes to
+// sequence * chunk size in the file. The device acknowledges with:
+// status (1) | next sequence expected (2) | received mask (4)
+// where bit i of the mask is set if chunk next + 1 + i was received.
+// The client keeps the chunks from next to next + window - 1 in flight:
+// it sends a chunk again when a later one is acknowledged without it, or
+// when the acknowledgements stop coming. Opening the same file again
+// (name, length and crc) resumes the transfer from next, even with
+// another chunk size or window; anything else starts over. Chunks sent
+// after the end are acknowledged as complete, until the next command.
+const size_t SONG_TRANSFER_OPEN_SIZE = 12;
+const size_t SONG_TRANSFER_CHUNK_HEADER_SIZE = 6;
+const size_t SONG_TRANSFER_ACK_SIZE = 7;
+const uint8_t SONG_TRANSFER_MAX_WINDOW = 32;
+// the largest chunk fitting in a write of the largest ATT value
+const uint16_t SONG_TRANSFER_MAX_CHUNK_SIZE = 512 - SONG_TRANSFER_CHUNK_HEADER_SIZE;
+
+enum SongTransferCommand : uint8_t
+{
+    SONG_TRANSFER_OPEN = 1,
+    SONG_TRANSFER_CANCEL = 2,
+};
+
+// SongTransferStatus values are reported in the acknowledgements, and as
+// the last operation status once a transfer ends
+enum SongTransferStatus : uint8_t
+{
+    SONG_TRANSFER_COMPLETE = 0,
+    SONG_TRANSFER_IN_PROGRESS = 40,
+    SONG_TRANSFER_IDLE = 41,
+    SONG_TRANSFER_BAD_COMMAND = 42,
+    SONG_TRANSFER_NO_SPACE = 43,
+    SONG_TRANSFER_BAD_CRC = 44,
+    SONG_TRANSFER_FLASH_ERROR = 45,
+};
+
+struct SongTransferAck
+{
+    uint8_t status;
+    uint16_t next;
+    uint32_t mask;
+};
+
+// SongTransferStats count the chunks received since the boot
+struct SongTransferStats
+{
+    uint32_t chunks;
+    uint32_t duplicates;
+    uint32_t outOfOrder;
+    uint32_t badChunks;
+    uint32_t acks;
+    uint32_t resumes;
+    uint32_t sectorsErased;
+};
+
+// SongTransfer is the state of the transfer; the file is written from
+// offset in the partition, which is erased up to erasedUpTo
+struct SongTransfer
+{
+    bool active;
+    char name[ALARM_SONG_SIZE];
+    uint32_t length;
+    uint32_t crc;
+    uint16_t chunkSize;
+    uint8_t window;
+    uint16_t chunkCount;
+    uint32_t offset;
+    uint32_t erasedUpTo;
+    uint16_t next;
+    uint32_t mask;
+    uint8_t sinceAck;
+    SongTransferStats stats;
+};
+
+void songTransferCommand(SongTransfer *transfer, const uint8_t *command, size_t length, SongTransferAck *ack);
+
+bool songTransferWrite(SongTransfer *transfer, const uint8_t *chunk, size_t length, SongTransferAck *ack);
+
+size_t songTransferEncodeAck(const SongTransferAck *ack, uint8_t *buffer, size_t size);
+
+bool songTransferDecodeAck(const uint8_t *buffer, size_t length, SongTransferAck *ack);
+
+#endif
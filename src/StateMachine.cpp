@@ -0,0 +1,147 @@
+#include "StateMachine.h"
+
+#include <Arduino.h>
+
+#include "Logger.h"
+
+const StateDefinition *machineStates = nullptr;
+const TransitionTable *machineTable = nullptr;
+StateId machineState = STATE_COUNT;
+
+// the events raised by the states, oldest first
+Event machineQueue[STATE_MACHINE_QUEUE_SIZE];
+uint8_t machineQueueHead = 0;
+uint8_t machineQueueCount = 0;
+
+StateMachineStats machineStats;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// enterState makes a state the current one and runs its enter action
+void enterState(StateId state)
+{
+  machineState = state;
+  LOG_NOTICE("=> entering state: %s\n", machineStates[state].name);
+  if (machineStates[state].enter != nullptr)
+  {
+    machineStates[state].enter();
+  }
+}
+
+// handleEvent moves to another state if the table has a transition for
+// the event and its guard allows it, otherwise updates the current state
+void handleEvent(Event event)
+{
+  machineStats.dispatched++;
+  if (event >= EVENT_COUNT)
+  {
+    LOG_ERROR("unknown event %d\n", event);
+    return;
+  }
+
+  const StateDefinition &current = machineStates[machineState];
+  uint8_t to = machineTable->to[machineState][event];
+  bool (*guard)() = machineTable->guard[machineState][event];
+  bool allowed = to != STATE_COUNT;
+  if (allowed && guard != nullptr)
+  {
+    machineStats.guardsEvaluated++;
+    allowed = guard();
+  }
+
+  if (!allowed)
+  {
+    machineStats.updates++;
+    if (current.update != nullptr)
+    {
+      current.update();
+    }
+    return;
+  }
+
+  LOG_TRACE("event %d moves from %s to %s\n", event, current.name, machineStates[to].name);
+  machineStats.transitions++;
+  if (current.exit != nullptr)
+  {
+    current.exit();
+  }
+  enterState((StateId)to);
+}
+
+// handleRaised handles the events raised while handling the last one
+void handleRaised()
+{
+  while (machineQueueCount > 0)
+  {
+    Event event = machineQueue[machineQueueHead];
+    machineQueueHead = (machineQueueHead + 1) % STATE_MACHINE_QUEUE_SIZE;
+    machineQueueCount--;
+    handleEvent(event);
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// stateMachineInit sets the states and the transitions of the state
+// machine; it needs to be called (maybe in setup) before it is started
+void stateMachineInit(const StateDefinition states[], const TransitionTable *table)
+{
+  machineStates = states;
+  machineTable = table;
+  machineState = STATE_COUNT;
+  machineQueueHead = 0;
+  machineQueueCount = 0;
+  machineStats = StateMachineStats{};
+}
+
+// stateMachineStart enters the first state
+void stateMachineStart(StateId state)
+{
+  enterState(state);
+  handleRaised();
+}
+
+// stateMachineDispatch handles an event, then the events the states
+// raised meanwhile. It takes a single table lookup per event and only
+// evaluates the guard of the transition found, if any.
+void stateMachineDispatch(Event event)
+{
+  if (machineState == STATE_COUNT)
+  {
+    return;
+  }
+  handleEvent(event);
+  handleRaised();
+}
+
+// stateMachineRaise queues an event to be handled once the current one
+// is; it is how the states leave themselves. Must only be called from
+// the state actions. Returns false if the queue is full.
+bool stateMachineRaise(Event event)
+{
+  if (machineQueueCount == STATE_MACHINE_QUEUE_SIZE)
+  {
+    machineStats.raisedDropped++;
+    LOG_ERROR("state machine queue full, event %d dropped\n", event);
+    return false;
+  }
+  machineQueue[(machineQueueHead + machineQueueCount) % STATE_MACHINE_QUEUE_SIZE] = event;
+  machineQueueCount++;
+  return true;
+}
+
+// stateMachineCurrent returns the current state, STATE_COUNT before the start
+StateId stateMachineCurrent()
+{
+  return machineState;
+}
+
+// stateMachineGetStats copies the counters of the state machine
+void stateMachineGetStats(StateMachineStats *stats)
+{
+  *stats = machineStats;
+}
@@ -0,0 +1,122 @@
+#ifndef StateMachine_h
+#define StateMachine_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Events.h"
+
+// StateId identifies a state of the firmware
+enum StateId : uint8_t
+{
+    STATE_CONFIGURATION,
+    STATE_DEEP_SLEEP,
+    STATE_SUNRISE,
+    STATE_SYNC,
+    STATE_COUNT,
+};
+
+// events raised by the states while handling an event, handled before
+// any posted event
+const uint8_t STATE_MACHINE_QUEUE_SIZE = 4;
+
+// StateDefinition is what a state does: enter runs when the state is
+// entered, exit when it is left, and update on every event that does
+// not move to another state. Any of them may be null.
+struct StateDefinition
+{
+    StateId id;
+    const char *name;
+    void (*enter)();
+    void (*update)();
+    void (*exit)();
+};
+
+// TransitionDefinition moves from a state to another on an event, if
+// the guard (when not null) returns true
+struct TransitionDefinition
+{
+    StateId from;
+    Event event;
+    StateId to;
+    bool (*guard)();
+};
+
+// TransitionTable is the transitions indexed by state and event, so an
+// event is dispatched with a single lookup; to is STATE_COUNT where there
+// is no transition. Build it with stateMachineBuildTable.
+struct TransitionTable
+{
+    uint8_t to[STATE_COUNT][EVENT_COUNT];
+    bool (*guard[STATE_COUNT][EVENT_COUNT])();
+    bool valid;
+};
+
+// StateMachineStats are the counters of the state machine since the boot
+struct StateMachineStats
+{
+    uint32_t dispatched;
+    uint32_t transitions;
+    uint32_t updates;
+    uint32_t guardsEvaluated;
+    uint32_t raisedDropped;
+};
+
+// stateMachineBuildTable indexes the transitions, at compile time. The
+// table is not valid if a transition is out of range, is on EVENT_NONE
+// or repeats a state and event pair.
+template <size_t N>
+constexpr TransitionTable stateMachineBuildTable(const TransitionDefinition (&transitions)[N])
+{
+    TransitionTable table{};
+    table.valid = true;
+    for (size_t state = 0; state < STATE_COUNT; state++)
+    {
+        for (size_t event = 0; event < EVENT_COUNT; event++)
+        {
+            table.to[state][event] = STATE_COUNT;
+            table.guard[state][event] = nullptr;
+        }
+    }
+    for (size_t i = 0; i < N; i++)
+    {
+        const TransitionDefinition &transition = transitions[i];
+        if (transition.from >= STATE_COUNT || transition.to >= STATE_COUNT || transition.event == EVENT_NONE ||
+            transition.event >= EVENT_COUNT || table.to[transition.from][transition.event] != STATE_COUNT)
+        {
+            table.valid = false;
+            continue;
+        }
+        table.to[transition.from][transition.event] = transition.to;
+        table.guard[transition.from][transition.event] = transition.guard;
+    }
+    return table;
+}
+
+// stateMachineStatesValid returns true if there is a definition per state,
+// in the order of the ids
+constexpr bool stateMachineStatesValid(const StateDefinition (&states)[STATE_COUNT])
+{
+    for (size_t i = 0; i < STATE_COUNT; i++)
+    {
+        if (states[i].id != i || states[i].name == nullptr)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void stateMachineInit(const StateDefinition states[], const TransitionTable *table);
+
+void stateMachineStart(StateId state);
+
+void stateMachineDispatch(Event event);
+
+bool stateMachineRaise(Event event);
+
+StateId stateMachineCurrent();
+
+void stateMachineGetStats(StateMachineStats *stats);
+
+#endif
@@ -0,0 +1,201 @@
+#include "SunriseCurve.h"
+
+/* =========================================================================
+   Definitions
+   ========================================================================= */
+
+// PaletteStop is a palette color expressed in perceptual lightness (0-255)
+struct PaletteStop
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+// sunrise palette, evenly spaced, from black to red, orange, yellow and white
+// (the same stops as the FastLED HeatColors_p palette)
+static constexpr PaletteStop SUNRISE_STOPS[] = {
+    {0x00, 0x00, 0x00}, {0x33, 0x00, 0x00}, {0x66, 0x00, 0x00}, {0x99, 0x00, 0x00},
+    {0xCC, 0x00, 0x00}, {0xFF, 0x00, 0x00}, {0xFF, 0x33, 0x00}, {0xFF, 0x66, 0x00},
+    {0xFF, 0x99, 0x00}, {0xFF, 0xCC, 0x00}, {0xFF, 0xFF, 0x00}, {0xFF, 0xFF, 0x33},
+    {0xFF, 0xFF, 0x66}, {0xFF, 0xFF, 0x99}, {0xFF, 0xFF, 0xCC}, {0xFF, 0xFF, 0xFF}};
+
+static const uint8_t SUNRISE_STOPS_COUNT = sizeof(SUNRISE_STOPS) / sizeof(PaletteStop);
+
+// how far ahead (in 1/65536 of the sunrise) the center leds are
+// compared with the leds on the edges of the strip
+static const uint16_t SUNRISE_MAX_LED_LEAD = 2048;
+
+// LightnessTable maps perceptual lightness to linear luminance;
+// the extra entry allows interpolating the last segment
+struct LightnessTable
+{
+    uint16_t values[257];
+};
+
+// LedLeadTable holds the progress lead of each normalized led position
+struct LedLeadTable
+{
+    uint16_t values[SUNRISE_MAX_LEDS];
+};
+
+// the curve is computed at compile time for every 1 << SUNRISE_CURVE_SHIFT
+// of progress, 4096 colors, so a frame only reads the table; consecutive
+// colors are under 0.1 of lightness apart
+static const uint8_t SUNRISE_CURVE_SHIFT = 4;
+static const uint32_t SUNRISE_CURVE_STEPS = 0x10000 >> SUNRISE_CURVE_SHIFT;
+
+// CurveTable holds the colors of the curve; the extra entry is the
+// end of the sunrise, full white
+struct CurveTable
+{
+    SunriseColor colors[SUNRISE_CURVE_STEPS + 1];
+};
+
+// cieLightnessToLuminance converts a CIE L* value (0-100) to a relative luminance (0-1)
+constexpr double cieLightnessToLuminance(double lightness)
+{
+    return lightness <= 8.0
+               ? lightness / 903.3
+               : ((lightness + 16.0) / 116.0) * ((lightness + 16.0) / 116.0) * ((lightness + 16.0) / 116.0);
+}
+
+// buildLightnessTable computes the lightness to luminance table at compile time
+constexpr LightnessTable buildLightnessTable()
+{
+    LightnessTable table = {};
+    for (int i = 0; i <= 256; i++)
+    {
+        table.values[i] = (uint16_t)(cieLightnessToLuminance(100.0 * i / 256.0) * 65535.0 + 0.5);
+    }
+    return table;
+}
+
+// buildLedLeadTable computes at compile time a triangular lead window,
+// so the sunrise starts in the middle of the strip and spreads to the edges
+constexpr LedLeadTable buildLedLeadTable()
+{
+    LedLeadTable table = {};
+    for (int i = 0; i < SUNRISE_MAX_LEDS; i++)
+    {
+        int distance = 2 * i + 1 - SUNRISE_MAX_LEDS;
+        if (distance < 0)
+        {
+            distance = -distance;
+        }
+        table.values[i] = (uint16_t)((uint32_t)SUNRISE_MAX_LED_LEAD * (SUNRISE_MAX_LEDS - distance) / SUNRISE_MAX_LEDS);
+    }
+    return table;
+}
+
+static constexpr LightnessTable LIGHTNESS_TABLE = buildLightnessTable();
+static constexpr LedLeadTable LED_LEAD_TABLE = buildLedLeadTable();
+
+// interpolateLightness returns the 16-bit lightness between two 8-bit
+// stops; fraction goes from 0 to 65536, where it is the second stop
+constexpr uint16_t interpolateLightness(uint8_t from, uint8_t to, uint32_t fraction)
+{
+    return (uint16_t)((int32_t)from * 257 + ((((int32_t)to - (int32_t)from) * 257 * (int32_t)(fraction >> 1)) >> 15));
+}
+
+// lightnessToLuminance maps a 16-bit lightness to a 16-bit linear
+// luminance; the fraction is stretched to 0-256 so 65535 is full white
+constexpr uint16_t lightnessToLuminance(uint16_t lightness)
+{
+    uint16_t fraction = (lightness & 0xFF) + ((lightness & 0xFF) >> 7);
+    uint16_t from = LIGHTNESS_TABLE.values[lightness >> 8];
+    uint16_t to = LIGHTNESS_TABLE.values[(lightness >> 8) + 1];
+    return from + (uint16_t)(((uint32_t)(to - from) * fraction) >> 8);
+}
+
+// curveColorAt computes the color of the curve at a progress stretched
+// to 0-65536, interpolating the lightness of the palette stops
+constexpr SunriseColor curveColorAt(uint32_t stretched)
+{
+    uint32_t position = stretched * (SUNRISE_STOPS_COUNT - 1);
+    uint8_t stop = position >> 16;
+    uint32_t fraction = position & 0xFFFF;
+    if (stop == SUNRISE_STOPS_COUNT - 1)
+    {
+        stop--;
+        fraction = 0x10000;
+    }
+    return SunriseColor{
+        lightnessToLuminance(interpolateLightness(SUNRISE_STOPS[stop].r, SUNRISE_STOPS[stop + 1].r, fraction)),
+        lightnessToLuminance(interpolateLightness(SUNRISE_STOPS[stop].g, SUNRISE_STOPS[stop + 1].g, fraction)),
+        lightnessToLuminance(interpolateLightness(SUNRISE_STOPS[stop].b, SUNRISE_STOPS[stop + 1].b, fraction))};
+}
+
+// buildCurveTable computes the colors of the curve at compile time
+constexpr CurveTable buildCurveTable()
+{
+    CurveTable table = {};
+    for (uint32_t i = 0; i <= SUNRISE_CURVE_STEPS; i++)
+    {
+        table.colors[i] = curveColorAt(i << SUNRISE_CURVE_SHIFT);
+    }
+    return table;
+}
+
+static constexpr CurveTable CURVE_TABLE = buildCurveTable();
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// ledPosition returns the position of a led in the lead table; the leds
+// of the second half mirror those of the first, so the strip is symmetric
+static inline uint8_t ledPosition(uint8_t led, uint8_t count)
+{
+    uint8_t mirror = count - 1 - led;
+    if (led > mirror)
+    {
+        return SUNRISE_MAX_LEDS - 1 - ledPosition(mirror, count);
+    }
+    return ((2 * (uint16_t)led + 1) * SUNRISE_MAX_LEDS) / (2 * (uint16_t)count);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// sunriseCurveProgress returns how far the sunrise is, from 0 to 65535
+uint16_t sunriseCurveProgress(uint32_t elapsedMs, uint32_t durationMs)
+{
+    if (durationMs == 0 || elapsedMs >= durationMs)
+    {
+        return 0xFFFF;
+    }
+    return (uint16_t)(((uint64_t)elapsedMs << 16) / durationMs);
+}
+
+// sunriseCurveColor returns the linear color of the sunrise for a given
+// progress, read from the table; the progress is stretched to 0-65536,
+// so 65535 is the last entry, full white
+SunriseColor sunriseCurveColor(uint16_t progress)
+{
+    return CURVE_TABLE.colors[((uint32_t)progress + (progress >> 15)) >> SUNRISE_CURVE_SHIFT];
+}
+
+// sunriseCurveFrame fills the frame with the color of each led after elapsedMs
+// since the sunrise start. It returns false once the sunrise is complete.
+// Every frame, the end included, is one table read per led and no memory
+// is allocated: the strip is symmetric, so only the first half is read and
+// mirrored.
+bool sunriseCurveFrame(uint32_t elapsedMs, uint32_t durationMs, SunriseColor frame[], uint8_t count)
+{
+    uint16_t progress = sunriseCurveProgress(elapsedMs, durationMs);
+
+    uint8_t half = (count + 1) / 2;
+    for (uint8_t i = 0; i < half; i++)
+    {
+        uint32_t ledProgress = (uint32_t)progress + LED_LEAD_TABLE.values[ledPosition(i, count)];
+        frame[i] = sunriseCurveColor(ledProgress > 0xFFFF ? 0xFFFF : ledProgress);
+    }
+    for (uint8_t i = half; i < count; i++)
+    {
+        frame[i] = frame[count - 1 - i];
+    }
+
+    return elapsedMs < durationMs;
+}
@@ -0,0 +1,26 @@
+#ifndef SunriseCurve_h
+#define SunriseCurve_h
+
+#include <stdint.h>
+
+// total sunrise length, in milliseconds
+const uint32_t SUNRISE_DURATION_MS = 30UL * 60UL * 1000UL;
+
+// maximum number of leds supported by the per-led frame function
+const uint8_t SUNRISE_MAX_LEDS = 64;
+
+// SunriseColor is a led color in linear light, with 16 bits per channel
+struct SunriseColor
+{
+    uint16_t r;
+    uint16_t g;
+    uint16_t b;
+};
+
+uint16_t sunriseCurveProgress(uint32_t elapsedMs, uint32_t durationMs);
+
+SunriseColor sunriseCurveColor(uint16_t progress);
+
+bool sunriseCurveFrame(uint32_t elapsedMs, uint32_t durationMs, SunriseColor frame[], uint8_t count);
+
+#endif
@@ -1,139 +1,143 @@
+#include "SunriseState.h"
+
 #include <Arduino.h>
-#include <ArduinoLog.h>
-#include <FastLED.h>
-#include <DHTesp.h>
 
-#include "GlobalStatus.h"
+#include "AudioDecoder.h"
+#include "AudioPlayer.h"
+#include "Energy.h"
+#include "Events.h"
+#include "Hal.h"
+#include "LedRender.h"
+#include "SensorSampler.h"
+#include "Logger.h"
+#include "Profiler.h"
+#include "Settings.h"
+#include "StateMachine.h"
+#include "SunriseCurve.h"
+#include "WakeContext.h"
 
 /* ========================================================================= 
    Definitions 
    ========================================================================= */
 
-#define BUTTON_INTERRUPT_PIN 13
-#define DHT_PIN 4
-#define NUM_LEDS 16
-#define LEDS_PIN 12
+// how often a new sunrise frame is computed, in milliseconds; the render
+// task dithers it to the leds meanwhile (see LedRender.h)
+const uint32_t SUNRISE_FRAME_INTERVAL_MS = 100;
 
-struct TemperatureAndHumidity
-{
-    float temperature;
-    float humidity;
-    float heatIndex;
-    float dewPoint;
-    ComfortState cf;
-};
+// the song of the alarm fades in over the last minutes of the sunrise
+const uint32_t SUNRISE_SONG_FADE_MS = 5UL * 60UL * 1000UL;
+
+// how often the alarm ringing after the sunrise checks its timeout; the
+// leds and the song do not change meanwhile
+const uint32_t SUNRISE_RING_INTERVAL_MS = 1000;
+
+// halMillis() value when the current sunrise started
+uint32_t sunriseStartedAt = 0;
 
-DHTesp dht;
-CRGB leds[NUM_LEDS];
+// unix time of the last sensor sample logged
+uint32_t sunriseSampleLoggedAt = 0;
+
+// true once the time of the first frame has been recorded
+bool sunriseFirstFrameRecorded = false;
+
+// true once the song has been started, or failed to
+bool sunriseSongStarted = false;
 
 /* ========================================================================= 
    Private functions 
    ========================================================================= */
 
 // buttonInterrupt handles the sunrise interruption by a button state change
-void buttonInterrupt()
+void IRAM_ATTR buttonInterrupt()
 {
-  globalStatus.goToConfig = true;
+  eventsPostFromISR(EVENT_BUTTON_PRESSED);
 }
 
-// getTemperatureAndHumidity reads the temperature from DHT and prints it to log
-TemperatureAndHumidity getTemperatureAndHumidity() {
-  // Reading temperature for humidity takes about 250 milliseconds!
-  // Sensor readings may also be up to 2 seconds 'old' (it's a very slow sensor)
-  TempAndHumidity newValues = dht.getTempAndHumidity();
-  // Check if any reads failed and exit early (to try again).
-  if (dht.getStatus() != 0) {
-    Log.error("DHT11 error status: %s\n", dht.getStatusString());
-    return TemperatureAndHumidity { };
+// logTemperatureAndHumidity prints the latest sensor sample to log, once;
+// it never waits for the sensor
+void logTemperatureAndHumidity() {
+  SensorSample sample;
+  if (!sensorSamplerLatest(&sample) || sample.epoch == sunriseSampleLoggedAt) {
+    return;
   }
+  sunriseSampleLoggedAt = sample.epoch;
 
-  ComfortState cf;
-
-  float heatIndex = dht.computeHeatIndex(newValues.temperature, newValues.humidity);
-  float dewPoint = dht.computeDewPoint(newValues.temperature, newValues.humidity);
-  dht.getComfortRatio(cf, newValues.temperature, newValues.humidity);
-
-  String comfortStatus;
-  switch (cf) {
-    case Comfort_OK:
-      comfortStatus = "Comfort_OK";
-      break;
-    case Comfort_TooHot:
-      comfortStatus = "Comfort_TooHot";
-      break;
-    case Comfort_TooCold:
-      comfortStatus = "Comfort_TooCold";
-      break;
-    case Comfort_TooDry:
-      comfortStatus = "Comfort_TooDry";
-      break;
-    case Comfort_TooHumid:
-      comfortStatus = "Comfort_TooHumid";
-      break;
-    case Comfort_HotAndHumid:
-      comfortStatus = "Comfort_HotAndHumid";
-      break;
-    case Comfort_HotAndDry:
-      comfortStatus = "Comfort_HotAndDry";
-      break;
-    case Comfort_ColdAndHumid:
-      comfortStatus = "Comfort_ColdAndHumid";
-      break;
-    case Comfort_ColdAndDry:
-      comfortStatus = "Comfort_ColdAndDry";
-      break;
-    default:
-      comfortStatus = "Unknown:";
-      break;
-  };
-
-  Log.trace("temperature: %s\n", String(newValues.temperature).c_str());
-  Log.trace("humidity: %s\n", String(newValues.humidity).c_str());
-  Log.trace("heat index: %s\n", String(heatIndex).c_str());
-  Log.trace("dew point: %s\n", String(dewPoint).c_str());
-  Log.trace("confort status: %s\n", comfortStatus.c_str());
-
-  return TemperatureAndHumidity { 
-    newValues.temperature, 
-    newValues.temperature,
-    heatIndex,
-    dewPoint,
-    cf };
+  LOG_TRACE("temperature: %F, humidity: %F, heat index: %F, dew point: %F\n",
+            sample.temperature, sample.humidity, sample.heatIndex, sample.dewPoint);
 }
 
 
-// sunrise simulstes the sunrise using leds.
-bool sunrise() {
+// logRenderStats logs how the render task kept up
+void logRenderStats()
+{
+  LedRenderStats stats;
+  ledRenderGetStats(&stats);
+  LOG_TRACE("led frames shown: %u, idle: %u, missed deadlines: %u, frame time: %u us (max %u us)\n",
+            stats.framesShown, stats.framesIdle, stats.missedDeadlines, stats.lastFrameUs, stats.maxFrameUs);
+}
 
-  static bool sunrising = true;
+// logAudioStats logs how the audio task kept up
+void logAudioStats()
+{
+  AudioPlayerStats stats;
+  audioPlayerGetStats(&stats);
+  LOG_TRACE("audio steps: %u, song loops: %u, step time: %u us (max %u us) every %u us\n",
+            stats.steps, stats.loops, stats.lastStepUs, stats.maxStepUs, stats.periodUs);
+}
 
-  // total sunrise length, in minutes
-  static const uint8_t sunriseLength = 30;
+// playSong starts the song of the alarm that woke the firmware when the
+// sunrise gets SUNRISE_SONG_FADE_MS from its end, then fades it in with
+// the light, to full volume when the sunrise is over, where it stays
+void playSong(uint32_t elapsedMs)
+{
+  uint32_t fadeStartMs = SUNRISE_DURATION_MS - SUNRISE_SONG_FADE_MS;
+  if (elapsedMs < fadeStartMs)
+  {
+    return;
+  }
+  if (!sunriseSongStarted)
+  {
+    sunriseSongStarted = true;
+    Alarm alarm = settingsGetAlarm(wakeContext.expectedAlarm);
+    if (alarm.number == 0)
+    {
+      LOG_WARNING("alarm %d not found, no song to play\n", wakeContext.expectedAlarm);
+      return;
+    }
+    audioPlayerStart(alarm.song);
+  }
+  audioPlayerSetGain(audioRampGain(sunriseCurveProgress(elapsedMs - fadeStartMs, SUNRISE_SONG_FADE_MS)));
+}
 
-  // how often (in seconds) should the heat color increase?
-  // for the default of 30 minutes, this should be about every 7 seconds
-  // 7 seconds x 256 gradient steps = 1,792 seconds = ~30 minutes
-  static const uint8_t interval = (sunriseLength * 60) / 256;
+// recordFirstFrame records, once, how long after the wake the first frame
+// reached the leds; the render task measures it, the record is written here
+void recordFirstFrame()
+{
+  LedRenderStats stats;
+  ledRenderGetStats(&stats);
+  if (sunriseFirstFrameRecorded || stats.framesShown == 0)
+  {
+    return;
+  }
+  sunriseFirstFrameRecorded = true;
+  profilerMarkAt(PROFILE_PHASE_FIRST_FRAME, stats.firstFrameUs);
+  LOG_NOTICE("wake to first led frame took %u us\n", stats.firstFrameUs);
+}
 
-  // current gradient palette color index
-  static uint8_t heatIndex = 0; // start out at 0
+// sunrise simulates the sunrise using leds, and the song of the alarm.
+// The led colors are a pure function of the time elapsed since the
+// sunrise started, so the fade does not depend on how often this runs.
+bool sunrise() {
 
-  // HeatColors_p is a gradient palette built in to FastLED
-  // that fades from black to red, orange, yellow, white
-  // feel free to use another palette or define your own custom one
-  CRGB color = ColorFromPalette(HeatColors_p, heatIndex, heatIndex);
+  static SunriseColor frame[HAL_LED_COUNT];
 
-  // fill the entire strip with the current color
-  fill_solid(leds, NUM_LEDS, color);
+  uint32_t elapsedMs = halMillis() - sunriseStartedAt;
+  bool sunrising = sunriseCurveFrame(elapsedMs, SUNRISE_DURATION_MS, frame, HAL_LED_COUNT);
+  ledRenderSubmit(frame, HAL_LED_COUNT);
+  energyLedFrame(frame, HAL_LED_COUNT);
+  playSong(elapsedMs);
 
-  // slowly increase the heat
-  EVERY_N_SECONDS(interval) {
-    Log.trace("sunrise heat index is %d\n", heatIndex);
-    heatIndex++;
-    if (heatIndex == 254) {
-      sunrising = false;
-    }
-  }
+  LOG_VERBOSE("sunrise elapsed time is %l ms\n", elapsedMs);
 
   return sunrising;
 }
@@ -143,41 +147,57 @@ bool sunrise() {
    Public functions 
    ========================================================================= */
 
-// sunriseStateLoop contains all the logic of the sunrise state
-void sunriseStateLoop()
+// sunriseStateEnter starts the sunrise. The leds come first: the first
+// frame is submitted before the render task starts, so it shows on its
+// first step, and the rest is set up after. The radios stay off.
+void sunriseStateEnter()
 {
-  Log.notice("=> entering state: Sunrise\n");
-  Log.trace("going to sunrise? %b\n", globalStatus.goToSunrise);
-
-  if (globalStatus.goToSunrise) {
-    Log.trace("initializing button interrupt\n");
-    pinMode(BUTTON_INTERRUPT_PIN, INPUT_PULLUP);
-    attachInterrupt(digitalPinToInterrupt(BUTTON_INTERRUPT_PIN), buttonInterrupt, CHANGE);
+  energyEnterState(ENERGY_CPU_SUNRISE);
 
-    Log.trace("initializing temperature sensor\n");
-    dht.setup(DHT_PIN, DHTesp::DHT11);
+  sunriseStartedAt = halMillis();
+  sunrise();
+  LOG_TRACE("initializing leds\n");
+  ledRenderStart();
 
-    Log.trace("initializing leds\n");
-    FastLED.addLeds<NEOPIXEL, LEDS_PIN>(leds, NUM_LEDS);
+  LOG_TRACE("initializing button interrupt\n");
+  halButtonAttach(buttonInterrupt);
 
-    getTemperatureAndHumidity();
-
-    globalStatus.goToSunrise = false;
-  }
+  LOG_TRACE("initializing temperature sensor\n");
+  sensorSamplerStart();
 
-  globalStatus.isAlarmTimeout = !sunrise();
+  eventsRequestWakeIn(SUNRISE_FRAME_INTERVAL_MS);
 }
 
-// sunriseStateButtonPress returns true if any button is pressed during sunrise
-bool sunriseStateButtonPress()
+// sunriseStateUpdate shows the next frame of the sunrise, then rings the
+// alarm at full light and volume, raising EVENT_SUNRISE_DONE once it has
+// rung for SUNRISE_ALARM_TIMEOUT_MS without the button being pressed
+void sunriseStateUpdate()
 {
-  Log.trace("going to config due to interrupt? %b\n", globalStatus.goToConfig);
-  return globalStatus.goToConfig;
+  recordFirstFrame();
+  logTemperatureAndHumidity();
+  if (sunrise())
+  {
+    eventsRequestWakeIn(SUNRISE_FRAME_INTERVAL_MS);
+    return;
+  }
+  if (halMillis() - sunriseStartedAt >= SUNRISE_DURATION_MS + SUNRISE_ALARM_TIMEOUT_MS)
+  {
+    LOG_NOTICE("alarm not stopped, giving up\n");
+    stateMachineRaise(EVENT_SUNRISE_DONE);
+    return;
+  }
+  eventsRequestWakeIn(SUNRISE_RING_INTERVAL_MS);
 }
 
-// sunriseStateAlarmTimeout returns true the alarm finishes
-bool sunriseStateAlarmTimeout()
+// sunriseStateExit ends the alarm, when the button is pressed or it timed
+// out; the song fades out meanwhile
+void sunriseStateExit()
 {
-  Log.trace("is alarm timeout? %b\n", globalStatus.isAlarmTimeout);
-  return globalStatus.isAlarmTimeout;
+  recordFirstFrame();
+  logRenderStats();
+  if (sunriseSongStarted)
+  {
+    audioPlayerStop();
+    logAudioStats();
+  }
 }
@@ -1,10 +1,16 @@
 #ifndef Sunrise_h
 #define Sunrise_h
 
-void sunriseStateLoop();
+#include <stdint.h>
 
-bool sunriseStateButtonPress();
+// how long the alarm rings once the sunrise is over, the song at full
+// volume and the leds at full light, unless the button is pressed first
+const uint32_t SUNRISE_ALARM_TIMEOUT_MS = 10UL * 60UL * 1000UL;
 
-bool sunriseStateAlarmTimeout();
+void sunriseStateEnter();
+
+void sunriseStateUpdate();
+
+void sunriseStateExit();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include "SyncState.h"
+
+#include <Arduino.h>
+
+#include "AlarmProtocol.h"
+#include "Energy.h"
+#include "Events.h"
+#include "Hal.h"
+#include "HouseholdSync.h"
+#include "Logger.h"
+#include "Profiler.h"
+#include "Settings.h"
+#include "StateMachine.h"
+#include "TimeKeeper.h"
+#include "WifiServices.h"
+
+/* =========================================================================
+   Definitions
+   ========================================================================= */
+
+// the multicast group and port the units of a household sync on
+const char *HOUSEHOLD_SYNC_GROUP = "239.255.72.83";
+const uint16_t HOUSEHOLD_SYNC_PORT = 4283;
+
+// how long a window stays open once wifi is connected, long enough for
+// the other units to wake too, whatever the error of their clocks
+const uint32_t SYNC_WINDOW_MS = 5000;
+
+// how long to wait for the wifi connection before giving up the window
+const uint32_t SYNC_WIFI_TIMEOUT_MS = 8000;
+
+// how often the received packets are handled
+const uint32_t SYNC_POLL_MS = 10;
+
+// how long to wait before sending the summary again, while it is wanted
+// in case a packet was lost (see householdSyncWantsRetry)
+const uint32_t SYNC_SUMMARY_RETRY_MS = 500;
+
+HouseholdSync householdSync;
+HouseholdSyncSession syncSession;
+uint8_t syncPacket[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+uint8_t syncReply[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+
+// halMillis() values when the state was entered, the window opened and the
+// summary was last sent
+uint32_t syncStartedAt = 0;
+uint32_t syncOpenedAt = 0;
+uint32_t syncSummarySentAt = 0;
+
+bool syncWindowOpen = false;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// syncButtonInterrupt ends the window for the configuration
+void IRAM_ATTR syncButtonInterrupt()
+{
+  eventsPostFromISR(EVENT_BUTTON_PRESSED);
+}
+
+// readSyncedItem writes an alarm slot as a binary alarm record, nothing
+// if the slot is empty, or the time zone rule
+size_t readSyncedItem(uint8_t item, uint8_t *buffer, size_t size)
+{
+  if (item == HOUSEHOLD_SYNC_ITEM_TIME_ZONE)
+  {
+    String rule = settingsGetTimeZoneRule();
+    size_t length = rule.length() < size ? rule.length() : size;
+    memcpy(buffer, rule.c_str(), length);
+    return length;
+  }
+
+  Alarm alarm = settingsGetAlarm(item + 1);
+  if (alarm.number == 0)
+  {
+    return 0;
+  }
+  return alarmProtocolEncode(&alarm, buffer, size);
+}
+
+// writeSyncedItem stores an item received from another unit, checked as
+// if it came by BLE; an empty alarm slot deletes the alarm
+bool writeSyncedItem(uint8_t item, const uint8_t *content, size_t length)
+{
+  if (item == HOUSEHOLD_SYNC_ITEM_TIME_ZONE)
+  {
+    char rule[TIME_ZONE_RULE_SIZE];
+    if (length >= TIME_ZONE_RULE_SIZE || memchr(content, '\0', length) != NULL)
+    {
+      return false;
+    }
+    memcpy(rule, content, length);
+    rule[length] = '\0';
+    uint16_t firstYear = timeKeeperIsValid() ? timeZoneYear(timeKeeperNow()) : TIME_ZONE_DEFAULT_FIRST_YEAR;
+    TimeZoneStatus status = settingsSaveTimeZone(rule, firstYear);
+    LOG_TRACE("household sync: time zone %s (status %d)\n", rule, status);
+    return status == TIME_ZONE_SUCCESS;
+  }
+
+  if (length == 0)
+  {
+    AlarmTable table;
+    settingsGetAlarmTable(&table);
+    memset(&table.alarms[item], 0, sizeof(Alarm));
+    LOG_TRACE("household sync: alarm %d deleted\n", item + 1);
+    return settingsSaveAlarmTable(&table);
+  }
+
+  Alarm alarm;
+  AlarmStatus status = alarmProtocolParseBinary(content, length, &alarm);
+  if (status != ALARM_STATUS_SUCCESS || alarm.number != item + 1u)
+  {
+    LOG_ERROR("household sync: invalid alarm %d (error %d)\n", item + 1, status);
+    return false;
+  }
+  LOG_TRACE("household sync: alarm saved: %d %l %s %d\n", alarm.number, alarm.when, alarm.song, alarm.activeMatrix);
+  return settingsSaveAlarm(alarm);
+}
+
+// sendSummary multicasts the packet opening the window, or else the
+// summary of this unit as a retry
+void sendSummary(bool announce)
+{
+  size_t length = announce ? householdSyncAnnounce(&syncSession, syncReply, sizeof(syncReply))
+                           : householdSyncRetry(&syncSession, syncReply, sizeof(syncReply));
+  if (!halUdpSend(syncReply, length))
+  {
+    LOG_WARNING("could not send the household sync summary\n");
+  }
+  syncSummarySentAt = halMillis();
+}
+
+// openWindow joins the household group and announces what changed here
+// since the last window, stamping it
+bool openWindow()
+{
+  settingsGetHouseholdSync(&householdSync);
+  uint32_t household = householdSyncHousehold(settingsGetWifiSsid().c_str(), settingsGetWifiPassword().c_str());
+  householdSyncBegin(&syncSession, &householdSync, household, readSyncedItem, writeSyncedItem);
+  if (!halUdpOpenMulticast(HOUSEHOLD_SYNC_GROUP, HOUSEHOLD_SYNC_PORT))
+  {
+    return false;
+  }
+
+  LOG_TRACE("household sync window open, %u local changes\n", syncSession.stats.localChanges);
+  syncWindowOpen = true;
+  syncOpenedAt = halMillis();
+  sendSummary(true);
+  return true;
+}
+
+// receivePackets handles the packets received since the last poll,
+// answering the ones showing a difference
+void receivePackets()
+{
+  int length;
+  while ((length = halUdpReceive(syncPacket, sizeof(syncPacket))) > 0)
+  {
+    size_t replyLength;
+    householdSyncReceive(&syncSession, syncPacket, length, syncReply, sizeof(syncReply), &replyLength);
+    if (replyLength > 0 && !halUdpSend(syncReply, replyLength))
+    {
+      LOG_WARNING("could not send the household sync reply\n");
+    }
+  }
+}
+
+// closeWindow leaves the group and keeps what was synced, stored with the
+// settings flushed before the deep sleep
+void closeWindow()
+{
+  if (!syncWindowOpen)
+  {
+    return;
+  }
+  syncWindowOpen = false;
+  halUdpClose();
+
+  const HouseholdSyncStats &stats = syncSession.stats;
+  LOG_TRACE("household sync: %u packets received, %u summaries and %u deltas sent (%u items), %u items applied, %u rejected\n",
+            stats.packetsReceived, stats.summariesMade, stats.deltasMade, stats.itemsSent, stats.itemsApplied,
+            stats.itemsRejected);
+  settingsSaveHouseholdSync(&householdSync);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// syncStateEnable turns the household sync on or off, on the next flush,
+// with the key of the household (HOUSEHOLD_SYNC_KEY_SIZE bytes), or NULL
+// to keep the one set before. A unit gets its node id the first time.
+// Returns false, changing nothing, if it would be on without a key.
+bool syncStateEnable(bool enabled, const uint8_t *key)
+{
+  HouseholdSync sync;
+  if (!settingsGetHouseholdSync(&sync) || sync.node == 0)
+  {
+    householdSyncReset(&sync, (uint32_t)random(INT32_MAX) + 1);
+  }
+  if (key != NULL)
+  {
+    memcpy(sync.key, key, HOUSEHOLD_SYNC_KEY_SIZE);
+  }
+  if (enabled && !householdSyncHasKey(&sync))
+  {
+    return false;
+  }
+  sync.enabled = enabled;
+  settingsSaveHouseholdSync(&sync);
+  return true;
+}
+
+// syncStateEnter starts a household sync window, after a timer wake at
+// the time all the units of the household wake for (see HouseholdSync.h)
+void syncStateEnter()
+{
+  energyEnterState(ENERGY_CPU_SYNC);
+  profilerBegin(PROFILE_PHASE_HOUSEHOLD_SYNC);
+  syncStartedAt = halMillis();
+  halButtonAttach(syncButtonInterrupt);
+
+  profilerBegin(PROFILE_PHASE_WIFI_INIT);
+  initWifi();
+  profilerEnd(PROFILE_PHASE_WIFI_INIT);
+
+  syncStateUpdate();
+}
+
+// syncStateUpdate opens the window once wifi is connected, then handles
+// the packets received until the window is over, raising EVENT_SYNC_DONE
+void syncStateUpdate()
+{
+  if (!syncWindowOpen)
+  {
+    if (!isWiFiConnected())
+    {
+      uint32_t waitedMs = halMillis() - syncStartedAt;
+      if (isWiFiConnecting() && waitedMs < SYNC_WIFI_TIMEOUT_MS)
+      {
+        eventsRequestWakeIn(SYNC_WIFI_TIMEOUT_MS - waitedMs);
+        return;
+      }
+      LOG_WARNING("wifi not connected, no household sync\n");
+      stateMachineRaise(EVENT_SYNC_DONE);
+      return;
+    }
+    if (!openWindow())
+    {
+      LOG_ERROR("could not join the household sync group\n");
+      stateMachineRaise(EVENT_SYNC_DONE);
+      return;
+    }
+  }
+
+  receivePackets();
+  uint32_t now = halMillis();
+  if (now - syncOpenedAt >= SYNC_WINDOW_MS)
+  {
+    stateMachineRaise(EVENT_SYNC_DONE);
+    return;
+  }
+  if (now - syncSummarySentAt >= SYNC_SUMMARY_RETRY_MS && householdSyncWantsRetry(&syncSession))
+  {
+    sendSummary(false);
+  }
+  eventsRequestWakeIn(SYNC_POLL_MS);
+}
+
+// syncStateExit closes the window, when it is over or the button is pressed
+void syncStateExit()
+{
+  closeWindow();
+  profilerEnd(PROFILE_PHASE_HOUSEHOLD_SYNC);
+}
@@ -0,0 +1,14 @@
+#ifndef SyncState_h
+#define SyncState_h
+
+#include <stdint.h>
+
+bool syncStateEnable(bool enabled, const uint8_t *key);
+
+void syncStateEnter();
+
+void syncStateUpdate();
+
+void syncStateExit();
+
+#endif
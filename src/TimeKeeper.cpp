@@ -0,0 +1,148 @@
+#include "TimeKeeper.h"
+
+
+#include "Hal.h"
+#include "Logger.h"
+#include "Settings.h"
+#include "TimeSync.h"
+#include "WakeContext.h"
+
+const char *NTP_SERVER = "pool.ntp.org";
+const uint16_t NTP_PORT = 123;
+const uint16_t NTP_LOCAL_PORT = 2390;
+
+// each sync sends up to NTP_SAMPLES requests and keeps the one with the
+// shortest round trip, so a sync takes at most NTP_SAMPLES x NTP_SAMPLE_TIMEOUT_MS
+const int NTP_SAMPLES = 4;
+const uint32_t NTP_SAMPLE_TIMEOUT_MS = 400;
+const int64_t NTP_MAX_DELAY_MS = 1000;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// requestNtpSample makes one bounded NTP request/response exchange
+bool requestNtpSample(NtpSample *sample)
+{
+  uint8_t packet[NTP_PACKET_SIZE];
+
+  int64_t transmitMs = halWallClockMs();
+  ntpBuildRequest(packet, transmitMs);
+  if (!halUdpSend(packet, NTP_PACKET_SIZE))
+  {
+    LOG_ERROR("could not send ntp request\n");
+    return false;
+  }
+
+  uint32_t startedAt = halMillis();
+  while (halMillis() - startedAt < NTP_SAMPLE_TIMEOUT_MS)
+  {
+    int length = halUdpReceive(packet, NTP_PACKET_SIZE);
+    if (length > 0)
+    {
+      int64_t receiveMs = halWallClockMs();
+      if (ntpParseResponse(packet, length, transmitMs, receiveMs, sample))
+      {
+        return true;
+      }
+      LOG_WARNING("ignoring invalid ntp response\n");
+    }
+    delay(1);
+  }
+
+  LOG_WARNING("ntp request timed out\n");
+  return false;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// timeKeeperIsValid returns true if the clock was synced since the last cold boot
+bool timeKeeperIsValid()
+{
+  return wakeContext.clock.lastSyncEpoch != 0;
+}
+
+// timeKeeperNowMs returns the current unix time in milliseconds,
+// corrected by the drift estimated from previous syncs
+int64_t timeKeeperNowMs()
+{
+  int64_t nowMs = halWallClockMs();
+  return nowMs + timeSyncDriftCorrectionMs(&wakeContext.clock, nowMs / 1000);
+}
+
+// timeKeeperNow returns the current unix time, corrected by the drift
+// estimated from previous syncs
+uint32_t timeKeeperNow()
+{
+  return (uint32_t)(timeKeeperNowMs() / 1000);
+}
+
+// timeKeeperSleepUs returns how long the deep sleep timer has to run to
+// wake at epoch. The timer runs on the local clock, so a clock that is
+// driftPpb slow needs that much less of it. Returns 0 if epoch is past.
+uint64_t timeKeeperSleepUs(uint32_t epoch)
+{
+  int64_t sleepMs = (int64_t)epoch * 1000 - timeKeeperNowMs();
+  if (sleepMs <= 0)
+  {
+    return 0;
+  }
+  return (uint64_t)sleepMs * (1000000000LL - wakeContext.clock.driftPpb) / 1000000;
+}
+
+// timeKeeperNeedsSync returns true if the predicted clock error is too big
+// to schedule alarms and the clock must be synced with NTP
+bool timeKeeperNeedsSync()
+{
+  uint32_t now = timeKeeperNow();
+  LOG_TRACE("predicted clock error is %l ms\n", timeSyncPredictedErrorMs(&wakeContext.clock, now));
+  return timeSyncNeeded(&wakeContext.clock, now);
+}
+
+// timeKeeperSync syncs the clock with NTP using the sample with the
+// shortest round trip. Requires a wifi connection.
+bool timeKeeperSync()
+{
+  if (!halUdpOpen(NTP_SERVER, NTP_PORT, NTP_LOCAL_PORT))
+  {
+    LOG_ERROR("could not open ntp socket\n");
+    return false;
+  }
+
+  NtpSample best = {};
+  bool found = false;
+  for (int i = 0; i < NTP_SAMPLES; i++)
+  {
+    NtpSample sample;
+    if (!requestNtpSample(&sample) || sample.delayMs > NTP_MAX_DELAY_MS)
+    {
+      continue;
+    }
+    LOG_VERBOSE("ntp sample: offset %l ms, delay %l ms\n", (long)sample.offsetMs, (long)sample.delayMs);
+    if (!found || sample.delayMs < best.delayMs)
+    {
+      best = sample;
+      found = true;
+    }
+  }
+  halUdpClose();
+
+  if (!found)
+  {
+    LOG_ERROR("ntp sync failed\n");
+    return false;
+  }
+
+  int64_t nowMs = halWallClockMs();
+  halSetWallClockMs(nowMs + best.offsetMs);
+
+  settingsLock();
+  timeSyncUpdate(&wakeContext.clock, nowMs / 1000, &best);
+  wakeContextCommit();
+  settingsUnlock();
+
+  LOG_TRACE("clock synced: offset %l ms, delay %l ms, drift %l ppb\n", (long)best.offsetMs, (long)best.delayMs, (long)wakeContext.clock.driftPpb);
+  return true;
+}
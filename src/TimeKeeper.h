@@ -0,0 +1,18 @@
+#ifndef TimeKeeper_h
+#define TimeKeeper_h
+
+#include <Arduino.h>
+
+bool timeKeeperIsValid();
+
+int64_t timeKeeperNowMs();
+
+uint32_t timeKeeperNow();
+
+uint64_t timeKeeperSleepUs(uint32_t epoch);
+
+bool timeKeeperNeedsSync();
+
+bool timeKeeperSync();
+
+#endif
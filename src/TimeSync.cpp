@@ -0,0 +1,162 @@
+#include "TimeSync.h"
+
+#include <string.h>
+
+// seconds between the NTP era (1900-01-01) and the unix epoch (1970-01-01)
+static const uint32_t NTP_UNIX_OFFSET_S = 2208988800UL;
+
+// NTP version 4, client mode
+static const uint8_t NTP_CLIENT_HEADER = (4 << 3) | 3;
+static const uint8_t NTP_MODE_SERVER = 4;
+
+static const size_t NTP_ORIGINATE_OFFSET = 24;
+static const size_t NTP_RECEIVE_OFFSET = 32;
+static const size_t NTP_TRANSMIT_OFFSET = 40;
+
+// drift uncertainty used before (and after) the drift is estimated
+static const uint32_t TIME_SYNC_UNKNOWN_DRIFT_PPB = 500000;
+static const uint32_t TIME_SYNC_KNOWN_DRIFT_PPB = 50000;
+
+// drift samples above this are treated as clock jumps, not drift
+static const int64_t TIME_SYNC_MAX_DRIFT_PPB = 50000000;
+
+// syncs closer than this are too short to estimate the drift
+static const uint32_t TIME_SYNC_MIN_DRIFT_INTERVAL_S = 600;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// writeTimestamp stores unix milliseconds as a big endian NTP timestamp
+static void writeTimestamp(uint8_t *buffer, int64_t unixMs)
+{
+    uint32_t seconds = (uint32_t)(unixMs / 1000) + NTP_UNIX_OFFSET_S;
+    uint32_t fraction = (uint32_t)(((uint64_t)(unixMs % 1000) << 32) / 1000);
+    for (int i = 0; i < 4; i++)
+    {
+        buffer[i] = seconds >> (24 - 8 * i);
+        buffer[4 + i] = fraction >> (24 - 8 * i);
+    }
+}
+
+// readTimestamp converts a big endian NTP timestamp to unix milliseconds
+static int64_t readTimestamp(const uint8_t *buffer)
+{
+    uint32_t seconds = 0;
+    uint32_t fraction = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        seconds = (seconds << 8) | buffer[i];
+        fraction = (fraction << 8) | buffer[4 + i];
+    }
+    return (int64_t)(seconds - NTP_UNIX_OFFSET_S) * 1000 + (int64_t)(((uint64_t)fraction * 1000) >> 32);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// ntpBuildRequest fills a NTP_PACKET_SIZE client request. The transmit
+// time is echoed back by the server, tying the response to this request.
+void ntpBuildRequest(uint8_t packet[], int64_t transmitMs)
+{
+    memset(packet, 0, NTP_PACKET_SIZE);
+    packet[0] = NTP_CLIENT_HEADER;
+    writeTimestamp(packet + NTP_TRANSMIT_OFFSET, transmitMs);
+}
+
+// ntpParseResponse computes the clock offset and round trip delay from a
+// server response, given the local send and receive times of the request.
+// Returns false if the packet is not a valid answer to that request.
+bool ntpParseResponse(const uint8_t packet[], size_t length, int64_t transmitMs, int64_t receiveMs, NtpSample *sample)
+{
+    if (length < NTP_PACKET_SIZE || (packet[0] & 0x07) != NTP_MODE_SERVER || packet[1] == 0)
+    {
+        return false;
+    }
+
+    uint8_t expected[8];
+    writeTimestamp(expected, transmitMs);
+    if (memcmp(packet + NTP_ORIGINATE_OFFSET, expected, sizeof(expected)) != 0)
+    {
+        return false;
+    }
+
+    int64_t serverReceiveMs = readTimestamp(packet + NTP_RECEIVE_OFFSET);
+    int64_t serverTransmitMs = readTimestamp(packet + NTP_TRANSMIT_OFFSET);
+
+    sample->offsetMs = ((serverReceiveMs - transmitMs) + (serverTransmitMs - receiveMs)) / 2;
+    sample->delayMs = (receiveMs - transmitMs) - (serverTransmitMs - serverReceiveMs);
+    return sample->delayMs >= 0;
+}
+
+// timeSyncDriftCorrectionMs returns how much the local clock is expected
+// to be behind the real time at epoch, based on the estimated drift
+int64_t timeSyncDriftCorrectionMs(const ClockModel *model, uint32_t epoch)
+{
+    if (model->lastSyncEpoch == 0 || epoch <= model->lastSyncEpoch)
+    {
+        return 0;
+    }
+    return (int64_t)model->driftPpb * (epoch - model->lastSyncEpoch) / 1000000;
+}
+
+// timeSyncPredictedErrorMs returns the worst expected error of the drift
+// corrected clock at epoch
+uint32_t timeSyncPredictedErrorMs(const ClockModel *model, uint32_t epoch)
+{
+    if (model->lastSyncEpoch == 0)
+    {
+        return UINT32_MAX;
+    }
+
+    uint32_t elapsed = epoch > model->lastSyncEpoch ? epoch - model->lastSyncEpoch : 0;
+    uint32_t uncertaintyPpb = model->driftSamples > 0 ? TIME_SYNC_KNOWN_DRIFT_PPB : TIME_SYNC_UNKNOWN_DRIFT_PPB;
+    uint64_t errorMs = model->lastSyncErrorMs + (uint64_t)uncertaintyPpb * elapsed / 1000000;
+    return errorMs > UINT32_MAX ? UINT32_MAX : (uint32_t)errorMs;
+}
+
+// timeSyncNeeded returns true when the clock must be synced with NTP
+// before it can be trusted to schedule an alarm
+bool timeSyncNeeded(const ClockModel *model, uint32_t epoch)
+{
+    return model->lastSyncEpoch == 0 ||
+           epoch - model->lastSyncEpoch > TIME_SYNC_MAX_INTERVAL_S ||
+           timeSyncPredictedErrorMs(model, epoch) > TIME_SYNC_MAX_ERROR_MS;
+}
+
+// timeSyncUpdate records a sync made when the uncorrected local clock read
+// epoch, refining the drift estimate with the offset measured since the
+// previous sync. The local clock is expected to be set to the NTP time.
+void timeSyncUpdate(ClockModel *model, uint32_t epoch, const NtpSample *sample)
+{
+    if (model->lastSyncEpoch != 0 && epoch > model->lastSyncEpoch + TIME_SYNC_MIN_DRIFT_INTERVAL_S)
+    {
+        int64_t driftPpb = sample->offsetMs * 1000000 / (epoch - model->lastSyncEpoch);
+        if (driftPpb > TIME_SYNC_MAX_DRIFT_PPB || driftPpb < -TIME_SYNC_MAX_DRIFT_PPB)
+        {
+            // the clock jumped, start estimating the drift again
+            model->driftPpb = 0;
+            model->driftSamples = 0;
+        }
+        else
+        {
+            if (model->driftSamples == 0)
+            {
+                model->driftPpb = (int32_t)driftPpb;
+            }
+            else
+            {
+                // exponential moving average, weighting the new sample by 1/4
+                model->driftPpb += (int32_t)((driftPpb - model->driftPpb) / 4);
+            }
+            if (model->driftSamples < UINT8_MAX)
+            {
+                model->driftSamples++;
+            }
+        }
+    }
+
+    model->lastSyncEpoch = epoch + (int32_t)(sample->offsetMs / 1000);
+    model->lastSyncErrorMs = (uint32_t)(sample->delayMs / 2);
+}
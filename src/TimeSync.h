@@ -0,0 +1,45 @@
+#ifndef TimeSync_h
+#define TimeSync_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+const size_t NTP_PACKET_SIZE = 48;
+
+// resync when the predicted clock error goes above this value
+const uint32_t TIME_SYNC_MAX_ERROR_MS = 2000;
+
+// resync at least once in this period, even if the clock looks stable
+const uint32_t TIME_SYNC_MAX_INTERVAL_S = 7UL * 24UL * 60UL * 60UL;
+
+// NtpSample is the result of one NTP request/response exchange
+struct NtpSample
+{
+    int64_t offsetMs;
+    int64_t delayMs;
+};
+
+// ClockModel tracks how the local clock drifts between NTP syncs.
+// Drift is in parts per billion: positive means the local clock is slow.
+struct ClockModel
+{
+    uint32_t lastSyncEpoch;
+    uint32_t lastSyncErrorMs;
+    int32_t driftPpb;
+    uint8_t driftSamples;
+    uint8_t reserved[3];
+};
+
+void ntpBuildRequest(uint8_t packet[], int64_t transmitMs);
+
+bool ntpParseResponse(const uint8_t packet[], size_t length, int64_t transmitMs, int64_t receiveMs, NtpSample *sample);
+
+int64_t timeSyncDriftCorrectionMs(const ClockModel *model, uint32_t epoch);
+
+uint32_t timeSyncPredictedErrorMs(const ClockModel *model, uint32_t epoch);
+
+bool timeSyncNeeded(const ClockModel *model, uint32_t epoch);
+
+void timeSyncUpdate(ClockModel *model, uint32_t epoch, const NtpSample *sample);
+
+#endif
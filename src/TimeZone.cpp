@@ -0,0 +1,464 @@
+#include "TimeZone.h"
+
+#include <string.h>
+
+static const int32_t SECONDS_PER_HOUR = 3600;
+static const int64_t SECONDS_PER_DAY = 86400;
+static const int32_t MAX_OFFSET_HOURS = 24;
+static const int32_t MAX_RULE_TIME_HOURS = 167;
+static const int32_t DEFAULT_RULE_TIME = 2 * SECONDS_PER_HOUR;
+static const uint16_t EPOCH_YEAR = 1970;
+static const uint16_t LAST_EPOCH_YEAR = 2105;
+static const size_t MIN_NAME_LENGTH = 3;
+
+// the unix epoch (1970-01-01) was a Thursday
+static const int64_t EPOCH_WEEKDAY = 4;
+
+enum RuleDateKind : uint8_t
+{
+    RULE_DATE_JULIAN,     // Jn, February 29 never counted
+    RULE_DATE_ZERO_BASED, // n, February 29 counted
+    RULE_DATE_MONTH,      // Mm.w.d
+};
+
+// RuleDate is when the offset changes in a year, at time seconds after
+// the start of the day, local time before the change
+struct RuleDate
+{
+    RuleDateKind kind;
+    uint16_t day;
+    uint8_t month;
+    uint8_t week;
+    uint8_t weekday;
+    int32_t time;
+};
+
+// Rule is a parsed TZ rule, offsets in seconds east of UTC
+struct Rule
+{
+    int32_t stdOffset;
+    bool hasDst;
+    int32_t dstOffset;
+    RuleDate start;
+    RuleDate end;
+};
+
+// RuleReader is the part of the rule left to parse
+struct RuleReader
+{
+    const char *at;
+    const char *end;
+};
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool isAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// accept consumes the next character if it is the one given
+static bool accept(RuleReader *reader, char c)
+{
+    if (reader->at < reader->end && *reader->at == c)
+    {
+        reader->at++;
+        return true;
+    }
+    return false;
+}
+
+// parseNumber parses up to maxDigits decimal digits, at least one
+static bool parseNumber(RuleReader *reader, int maxDigits, uint32_t *value)
+{
+    int digits = 0;
+    *value = 0;
+    while (reader->at < reader->end && isDigit(*reader->at) && digits < maxDigits)
+    {
+        *value = *value * 10 + (*reader->at - '0');
+        reader->at++;
+        digits++;
+    }
+    return digits > 0;
+}
+
+// parseName parses a zone abbreviation: at least three letters, or
+// letters, digits and signs between angle brackets
+static bool parseName(RuleReader *reader)
+{
+    const char *start = reader->at;
+    if (accept(reader, '<'))
+    {
+        while (reader->at < reader->end && (isAlpha(*reader->at) || isDigit(*reader->at) || *reader->at == '+' ||
+                                            *reader->at == '-'))
+        {
+            reader->at++;
+        }
+        size_t length = reader->at - start - 1;
+        return accept(reader, '>') && length >= MIN_NAME_LENGTH;
+    }
+
+    while (reader->at < reader->end && isAlpha(*reader->at))
+    {
+        reader->at++;
+    }
+    return (size_t)(reader->at - start) >= MIN_NAME_LENGTH;
+}
+
+// parseTime parses [+|-]hh[:mm[:ss]] into seconds, hours up to maxHours
+static bool parseTime(RuleReader *reader, int32_t maxHours, int32_t *seconds)
+{
+    int32_t sign = 1;
+    if (accept(reader, '-'))
+    {
+        sign = -1;
+    }
+    else
+    {
+        accept(reader, '+');
+    }
+
+    uint32_t hours;
+    uint32_t minutes = 0;
+    uint32_t secs = 0;
+    if (!parseNumber(reader, 3, &hours) || hours > (uint32_t)maxHours)
+    {
+        return false;
+    }
+    if (accept(reader, ':') && (!parseNumber(reader, 2, &minutes) || minutes > 59))
+    {
+        return false;
+    }
+    if (accept(reader, ':') && (!parseNumber(reader, 2, &secs) || secs > 59))
+    {
+        return false;
+    }
+
+    *seconds = sign * (int32_t)(hours * SECONDS_PER_HOUR + minutes * 60 + secs);
+    return true;
+}
+
+// parseDate parses a date with its optional time
+static bool parseDate(RuleReader *reader, RuleDate *date)
+{
+    uint32_t value;
+    memset(date, 0, sizeof(RuleDate));
+    if (accept(reader, 'J'))
+    {
+        date->kind = RULE_DATE_JULIAN;
+        if (!parseNumber(reader, 3, &value) || value < 1 || value > 365)
+        {
+            return false;
+        }
+        date->day = value;
+    }
+    else if (accept(reader, 'M'))
+    {
+        date->kind = RULE_DATE_MONTH;
+        if (!parseNumber(reader, 2, &value) || value < 1 || value > 12)
+        {
+            return false;
+        }
+        date->month = value;
+        if (!accept(reader, '.') || !parseNumber(reader, 1, &value) || value < 1 || value > 5)
+        {
+            return false;
+        }
+        date->week = value;
+        if (!accept(reader, '.') || !parseNumber(reader, 1, &value) || value > 6)
+        {
+            return false;
+        }
+        date->weekday = value;
+    }
+    else
+    {
+        date->kind = RULE_DATE_ZERO_BASED;
+        if (!parseNumber(reader, 3, &value) || value > 365)
+        {
+            return false;
+        }
+        date->day = value;
+    }
+
+    date->time = DEFAULT_RULE_TIME;
+    return !accept(reader, '/') || parseTime(reader, MAX_RULE_TIME_HOURS, &date->time);
+}
+
+
+// parseDates parses ,start[/time],end[/time]
+static bool parseDates(RuleReader *reader, Rule *rule)
+{
+    return accept(reader, ',') && parseDate(reader, &rule->start) && accept(reader, ',') &&
+           parseDate(reader, &rule->end);
+}
+
+// parseRule parses a whole TZ rule
+static TimeZoneStatus parseRule(RuleReader *reader, Rule *rule)
+{
+    memset(rule, 0, sizeof(Rule));
+    int32_t west;
+    if (!parseName(reader))
+    {
+        return TIME_ZONE_INVALID_NAME;
+    }
+    if (!parseTime(reader, MAX_OFFSET_HOURS, &west))
+    {
+        return TIME_ZONE_INVALID_OFFSET;
+    }
+    rule->stdOffset = -west;
+    if (reader->at == reader->end)
+    {
+        return TIME_ZONE_SUCCESS;
+    }
+
+    if (!parseName(reader))
+    {
+        return TIME_ZONE_INVALID_NAME;
+    }
+    rule->hasDst = true;
+    rule->dstOffset = rule->stdOffset + SECONDS_PER_HOUR;
+    if (reader->at < reader->end && *reader->at != ',')
+    {
+        if (!parseTime(reader, MAX_OFFSET_HOURS, &west))
+        {
+            return TIME_ZONE_INVALID_OFFSET;
+        }
+        rule->dstOffset = -west;
+    }
+
+    if (reader->at == reader->end)
+    {
+        static const char US_DATES[] = ",M3.2.0,M11.1.0";
+        RuleReader dates = {US_DATES, US_DATES + sizeof(US_DATES) - 1};
+        parseDates(&dates, rule);
+        return TIME_ZONE_SUCCESS;
+    }
+    if (!parseDates(reader, rule))
+    {
+        return TIME_ZONE_INVALID_DATE;
+    }
+    return reader->at == reader->end ? TIME_ZONE_SUCCESS : TIME_ZONE_TRAILING_DATA;
+}
+
+static bool isLeapYear(int64_t year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// daysFromCivil returns the number of days from the epoch to a date of
+// the proleptic Gregorian calendar
+static int64_t daysFromCivil(int64_t year, uint32_t month, uint32_t day)
+{
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t yearOfEra = (uint32_t)(year - era * 400);
+    uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+// ruleDay returns the day, from the epoch, a date of the rule falls on in a year
+static int64_t ruleDay(const RuleDate *date, uint16_t year)
+{
+    int64_t first = daysFromCivil(year, 1, 1);
+    switch (date->kind)
+    {
+    case RULE_DATE_JULIAN:
+        return first + date->day - 1 + (isLeapYear(year) && date->day >= 60 ? 1 : 0);
+    case RULE_DATE_ZERO_BASED:
+        return first + date->day;
+    default:
+        break;
+    }
+
+    int64_t monthStart = daysFromCivil(year, date->month, 1);
+    int64_t monthEnd = date->month == 12 ? daysFromCivil(year + 1, 1, 1) : daysFromCivil(year, date->month + 1, 1);
+    int64_t weekday = (monthStart + EPOCH_WEEKDAY) % 7;
+    int64_t day = monthStart + (date->weekday - weekday + 7) % 7 + 7 * (date->week - 1);
+    while (day >= monthEnd)
+    {
+        day -= 7;
+    }
+    return day;
+}
+
+// addTransition appends a transition to the table, if it fits the epoch
+// and comes more than shortest seconds after the previous one, so the
+// local times of the transitions are in order too
+static bool addTransition(TimeZoneTable *table, int64_t epoch, int64_t shortest)
+{
+    if (epoch < 0 || epoch > UINT32_MAX)
+    {
+        return false;
+    }
+    if (table->count > 0 && epoch - table->transitions[table->count - 1] <= shortest)
+    {
+        return false;
+    }
+    table->transitions[table->count++] = (uint32_t)epoch;
+    return true;
+}
+
+// compileTransitions fills the table with the transitions of the rule,
+// from the first year on
+static TimeZoneStatus compileTransitions(const Rule *rule, uint16_t firstYear, TimeZoneTable *table)
+{
+    if (firstYear < EPOCH_YEAR || firstYear + TIME_ZONE_YEARS - 1 > LAST_EPOCH_YEAR)
+    {
+        return TIME_ZONE_OUT_OF_RANGE;
+    }
+
+    int64_t shortest = rule->dstOffset - rule->stdOffset;
+    if (shortest < 0)
+    {
+        shortest = -shortest;
+    }
+    bool startFirst = true;
+    for (uint8_t i = 0; i < TIME_ZONE_YEARS; i++)
+    {
+        uint16_t year = firstYear + i;
+        // the times of the dates are local times before the change
+        int64_t start = ruleDay(&rule->start, year) * SECONDS_PER_DAY + rule->start.time - rule->stdOffset;
+        int64_t end = ruleDay(&rule->end, year) * SECONDS_PER_DAY + rule->end.time - rule->dstOffset;
+        if (i == 0)
+        {
+            // in the southern hemisphere the year starts in summer time
+            startFirst = start < end;
+            table->offsets[0] = startFirst ? rule->stdOffset : rule->dstOffset;
+            table->offsets[1] = startFirst ? rule->dstOffset : rule->stdOffset;
+        }
+        if (!addTransition(table, startFirst ? start : end, shortest) ||
+            !addTransition(table, startFirst ? end : start, shortest))
+        {
+            return TIME_ZONE_OUT_OF_RANGE;
+        }
+    }
+    return TIME_ZONE_SUCCESS;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// timeZoneCompile parses a TZ rule and compiles its transitions from the
+// first of January of firstYear on. An empty rule is UTC. The table is
+// only meaningful when TIME_ZONE_SUCCESS is returned.
+TimeZoneStatus timeZoneCompile(const char *rule, size_t length, uint16_t firstYear, TimeZoneTable *table)
+{
+    memset(table, 0, sizeof(TimeZoneTable));
+    if (length >= TIME_ZONE_RULE_SIZE)
+    {
+        return TIME_ZONE_RULE_TOO_LONG;
+    }
+
+    Rule parsed = {};
+    RuleReader reader = {rule, rule + length};
+    TimeZoneStatus status = length == 0 ? TIME_ZONE_SUCCESS : parseRule(&reader, &parsed);
+    if (status == TIME_ZONE_SUCCESS && parsed.hasDst)
+    {
+        status = compileTransitions(&parsed, firstYear, table);
+    }
+    else
+    {
+        table->offsets[0] = parsed.stdOffset;
+    }
+    if (status != TIME_ZONE_SUCCESS)
+    {
+        memset(table, 0, sizeof(TimeZoneTable));
+        return status;
+    }
+
+    table->version = TIME_ZONE_TABLE_VERSION;
+    table->firstYear = firstYear;
+    return TIME_ZONE_SUCCESS;
+}
+
+// timeZoneOffset returns the offset from UTC in force at epoch, in seconds
+int32_t timeZoneOffset(const TimeZoneTable *table, uint32_t epoch)
+{
+    // count the transitions at or before epoch
+    uint8_t low = 0;
+    uint8_t high = table->count;
+    while (low < high)
+    {
+        uint8_t middle = (low + high) / 2;
+        if (table->transitions[middle] <= epoch)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return table->offsets[low % 2];
+}
+
+// timeZoneToLocal returns the local time at epoch, as seconds from the
+// local 1970-01-01 00:00:00
+uint32_t timeZoneToLocal(const TimeZoneTable *table, uint32_t epoch)
+{
+    return (uint32_t)((int64_t)epoch + timeZoneOffset(table, epoch));
+}
+
+// timeZoneToUtc returns the epoch of a local time. A local time skipped
+// when the clocks go forward is the moment they do, and one repeated when
+// they go back is its first occurrence, so local times after the first
+// occurrence never map to an earlier epoch.
+uint32_t timeZoneToUtc(const TimeZoneTable *table, uint32_t local)
+{
+    // count the transitions whose local time before them is at or before local
+    uint8_t low = 0;
+    uint8_t high = table->count;
+    while (low < high)
+    {
+        uint8_t middle = (low + high) / 2;
+        if ((int64_t)table->transitions[middle] + table->offsets[middle % 2] <= local)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    int64_t epoch = (int64_t)local - table->offsets[low % 2];
+    if (low > 0 && epoch < table->transitions[low - 1])
+    {
+        epoch = table->transitions[low - 1];
+    }
+    if (epoch < 0)
+    {
+        return 0;
+    }
+    return epoch > UINT32_MAX ? UINT32_MAX : (uint32_t)epoch;
+}
+
+// timeZoneCovers returns true if the table has all the transitions up to
+// epoch, false if the rule needs to be compiled again from a later year
+bool timeZoneCovers(const TimeZoneTable *table, uint32_t epoch)
+{
+    return table->count == 0 || epoch < table->transitions[table->count - 1];
+}
+
+// timeZoneYear returns the year of an epoch, in UTC
+uint16_t timeZoneYear(uint32_t epoch)
+{
+    // civil from days, with the era starting on 0000-03-01
+    int64_t days = epoch / SECONDS_PER_DAY + 719468;
+    int64_t era = days / 146097;
+    uint32_t dayOfEra = (uint32_t)(days - era * 146097);
+    uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32_t monthFromMarch = (5 * dayOfYear + 2) / 153;
+    return (uint16_t)(era * 400 + yearOfEra + (monthFromMarch >= 10 ? 1 : 0));
+}
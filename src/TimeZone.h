@@ -0,0 +1,68 @@
+#ifndef TimeZone_h
+#define TimeZone_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A time zone is given as a POSIX TZ rule, the last line of the tz
+// database file of the zone, e.g. "WET0WEST,M3.5.0/1,M10.5.0" for
+// Europe/Lisbon:
+// std offset [dst [offset] [,start[/time],end[/time]]]
+// where offsets are [+|-]hh[:mm[:ss]] west of Greenwich, dst defaults to
+// an hour ahead of std, and dates are Jn (1 to 365, February 29 never
+// counted), n (0 to 365) or Mm.w.d (day d of week w of month m, 5 being
+// the last). Times default to 02:00:00 and may go from -167 to 167 hours.
+// A rule with dst but no dates follows the US dates, "M3.2.0,M11.1.0".
+//
+// The rule is compiled once into a table of the UTC times the offset
+// changes at, for TIME_ZONE_YEARS years, so converting a time is a binary
+// search. The changes alternate between the two offsets of the rule.
+const uint8_t TIME_ZONE_TABLE_VERSION = 1;
+const uint8_t TIME_ZONE_YEARS = 16;
+const uint8_t TIME_ZONE_MAX_TRANSITIONS = 2 * TIME_ZONE_YEARS;
+
+// the longest rule accepted, with its terminating zero
+const size_t TIME_ZONE_RULE_SIZE = 64;
+
+// the first year compiled while the clock is not set
+const uint16_t TIME_ZONE_DEFAULT_FIRST_YEAR = 2026;
+
+// TimeZoneStatus values are reported as the last operation status
+enum TimeZoneStatus : uint8_t
+{
+    TIME_ZONE_SUCCESS = 0,
+    TIME_ZONE_RULE_TOO_LONG = 60,
+    TIME_ZONE_INVALID_NAME = 61,
+    TIME_ZONE_INVALID_OFFSET = 62,
+    TIME_ZONE_INVALID_DATE = 63,
+    TIME_ZONE_TRAILING_DATA = 64,
+    TIME_ZONE_OUT_OF_RANGE = 65, // changes too close together, or outside the 32 bits epoch
+};
+
+// TimeZoneTable has a fixed layout so it can be stored as a binary blob.
+// offsets[0], in seconds east of UTC, is in force before the first
+// transition, and each transition switches to the other offset. A zeroed
+// table is UTC.
+struct TimeZoneTable
+{
+    uint8_t version;
+    uint8_t count;
+    uint16_t firstYear;
+    int32_t offsets[2];
+    uint32_t transitions[TIME_ZONE_MAX_TRANSITIONS];
+    uint32_t crc;
+};
+
+TimeZoneStatus timeZoneCompile(const char *rule, size_t length, uint16_t firstYear, TimeZoneTable *table);
+
+int32_t timeZoneOffset(const TimeZoneTable *table, uint32_t epoch);
+
+uint32_t timeZoneToLocal(const TimeZoneTable *table, uint32_t epoch);
+
+uint32_t timeZoneToUtc(const TimeZoneTable *table, uint32_t local);
+
+bool timeZoneCovers(const TimeZoneTable *table, uint32_t epoch);
+
+uint16_t timeZoneYear(uint32_t epoch);
+
+#endif
@@ -0,0 +1,38 @@
+#include "WakeContext.h"
+
+#include "Crc.h"
+
+const uint32_t WAKE_CONTEXT_MAGIC = 0x414C524D;
+
+RTC_DATA_ATTR WakeContext wakeContext;
+
+// wakeContextChecksum returns the checksum of everything in the context but the checksum itself
+uint32_t wakeContextChecksum()
+{
+  return crc32(&wakeContext, offsetof(WakeContext, checksum));
+}
+
+// wakeContextIsValid returns true if the context survived a deep sleep
+// intact; after a cold boot the RTC memory holds garbage.
+bool wakeContextIsValid()
+{
+  return wakeContext.magic == WAKE_CONTEXT_MAGIC && wakeContext.checksum == wakeContextChecksum();
+}
+
+// wakeContextCommit needs to be called after the context is changed
+// to mark it as valid. The tasks commit it concurrently, so the checksum
+// is computed under the settings lock, which the change is made under too.
+void wakeContextCommit()
+{
+  settingsLock();
+  wakeContext.magic = WAKE_CONTEXT_MAGIC;
+  wakeContext.checksum = wakeContextChecksum();
+  settingsUnlock();
+}
+
+// wakeContextInvalidate clears the context, forcing the next boot
+// to read everything from the flash
+void wakeContextInvalidate()
+{
+  memset(&wakeContext, 0, sizeof(WakeContext));
+}
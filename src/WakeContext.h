@@ -0,0 +1,39 @@
+#ifndef WakeContext_h
+#define WakeContext_h
+
+#include <Arduino.h>
+
+#include "Settings.h"
+#include "TimeSync.h"
+#include "WifiServices.h"
+
+// WakeContext keeps in RTC slow memory what the firmware needs after a
+// deep sleep wake, so the wake path does not need to read the flash
+struct WakeContext
+{
+    uint32_t magic;
+    uint8_t inDeepSleep;
+    uint8_t flashInDeepSleep;
+    // what the timer is set for: the alarm numbered expectedAlarm, or the
+    // household sync window when syncWake is set; both are 0 once the
+    // context is lost, and the wake has to be worked out again
+    uint8_t expectedAlarm;
+    uint8_t syncWake;
+    AlarmTable alarms;
+    TimeZoneTable timeZone;
+    HouseholdSync householdSync;
+    ClockModel clock;
+    uint32_t expectedWakeEpoch;
+    WifiFastConnect wifi;
+    uint32_t checksum;
+};
+
+extern WakeContext wakeContext;
+
+bool wakeContextIsValid();
+
+void wakeContextCommit();
+
+void wakeContextInvalidate();
+
+#endif
@@ -1,17 +1,277 @@
-
 #include <WifiServices.h>
 
 #include <Arduino.h>
 #include <WiFi.h>
-#include <ArduinoLog.h>
+#include <atomic>
+#include <Ticker.h>
 
+#include <Crc.h>
+#include <Energy.h>
+#include <Events.h>
 #include <GlobalStatus.h>
+#include <Logger.h>
 #include <Settings.h>
+#include <TimeKeeper.h>
+#include <WakeContext.h>
+
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+#define WIFI_EVENT_STA_CONNECTED ARDUINO_EVENT_WIFI_STA_CONNECTED
+#define WIFI_EVENT_STA_GOT_IP ARDUINO_EVENT_WIFI_STA_GOT_IP
+#define WIFI_EVENT_STA_DISCONNECTED ARDUINO_EVENT_WIFI_STA_DISCONNECTED
+#else
+#define WIFI_EVENT_STA_CONNECTED SYSTEM_EVENT_STA_CONNECTED
+#define WIFI_EVENT_STA_GOT_IP SYSTEM_EVENT_STA_GOT_IP
+#define WIFI_EVENT_STA_DISCONNECTED SYSTEM_EVENT_STA_DISCONNECTED
+#endif
 
 const String WIFI_STATUS_UNDEFINED = "not configured";
 const String WIFI_STATUS_DISCONNECTED = "disconnected";
+const String WIFI_STATUS_CONNECTING = "connecting";
 const String WIFI_STATUS_CONNECTED = "connected";
 
+// how long to wait for the targeted connection before scanning
+const uint32_t WIFI_FAST_CONNECT_TIMEOUT_MS = 1500;
+
+// how long to wait for a connection after a full scan
+const uint32_t WIFI_CONNECT_TIMEOUT_MS = 10000;
+
+// how long to wait before retrying after a connection attempt failed
+const uint32_t WIFI_RETRY_INTERVAL_MS = 30000;
+
+// how long a cached DHCP lease is reused as a static configuration
+const uint32_t WIFI_LEASE_REUSE_S = 12UL * 60UL * 60UL;
+
+// the work the wifi event and timer tasks, and the configuration by BLE
+// and HTTP, leave to the loop task, as the bits of wifiPending (see
+// updateWifi)
+const uint8_t WIFI_PENDING_GOT_IP = 0x01;
+const uint8_t WIFI_PENDING_DISCONNECTED = 0x02;
+const uint8_t WIFI_PENDING_TIMEOUT = 0x04;
+const uint8_t WIFI_PENDING_RECONNECT = 0x08;
+
+enum WifiPhase
+{
+  WIFI_PHASE_IDLE,
+  WIFI_PHASE_FAST_CONNECTING,
+  WIFI_PHASE_CONNECTING,
+  WIFI_PHASE_CONNECTED,
+};
+
+// owned by the loop task
+WifiPhase wifiPhase = WIFI_PHASE_IDLE;
+WifiConnectTimings wifiTimings = {};
+uint32_t wifiConnectStartedAt = 0;
+uint32_t wifiFailedAt = 0;
+uint32_t wifiAttempt = 0;
+bool wifiFailed = false;
+bool wifiEventsRegistered = false;
+Ticker wifiTimeoutTicker;
+void (*wifiStatusCallback)() = NULL;
+
+// written by the wifi event and timer tasks
+std::atomic<uint8_t> wifiPending(0);
+std::atomic<uint32_t> wifiAssociatedAt(0);
+std::atomic<uint32_t> wifiGotIpAt(0);
+std::atomic<uint32_t> wifiTimedOutAttempt(0);
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// wifiStatusChanged tells the registered callback that the
+// verbose wifi status may have changed
+void wifiStatusChanged()
+{
+  if (wifiStatusCallback != NULL)
+  {
+    wifiStatusCallback();
+  }
+}
+
+// ssidCrc identifies the network a fast connect cache belongs to
+uint32_t ssidCrc()
+{
+  return crc32(globalStatus.wifiSsid.c_str(), globalStatus.wifiSsid.length());
+}
+
+// isFastConnectCached returns true if the cached access point
+// belongs to the configured network
+bool isFastConnectCached()
+{
+  const WifiFastConnect &cache = wakeContext.wifi;
+  return cache.valid && cache.ssidCrc == ssidCrc();
+}
+
+// isLeaseFresh returns true if the cached DHCP lease is recent enough
+// to be reused without asking the DHCP server again
+bool isLeaseFresh()
+{
+  const WifiFastConnect &cache = wakeContext.wifi;
+  return cache.ip != 0 && timeKeeperIsValid() && timeKeeperNow() - cache.leaseEpoch < WIFI_LEASE_REUSE_S;
+}
+
+// saveFastConnect caches the current access point and lease
+void saveFastConnect()
+{
+  settingsLock();
+  WifiFastConnect &cache = wakeContext.wifi;
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.ssidCrc = ssidCrc();
+  if (!wifiTimings.usedCachedLease)
+  {
+    cache.ip = (uint32_t)WiFi.localIP();
+    cache.gateway = (uint32_t)WiFi.gatewayIP();
+    cache.subnet = (uint32_t)WiFi.subnetMask();
+    cache.dns = (uint32_t)WiFi.dnsIP();
+    cache.leaseEpoch = timeKeeperIsValid() ? timeKeeperNow() : 0;
+  }
+  cache.valid = true;
+  wakeContextCommit();
+  settingsUnlock();
+}
+
+// postWifiWork leaves work to the loop task and wakes it up; the bit
+// stays set if the event queue is full, for the next event to carry
+void postWifiWork(uint8_t work)
+{
+  wifiPending.fetch_or(work);
+  eventsPost(EVENT_WIFI_WORK);
+}
+
+// onWifiTimeout runs in the timer task, for the attempt it was armed for
+void onWifiTimeout(uint32_t attempt)
+{
+  wifiTimedOutAttempt.store(attempt);
+  postWifiWork(WIFI_PENDING_TIMEOUT);
+}
+
+// onWifiEvent runs in the wifi event task: it only records when the
+// phases ended, the loop task tracks them (see updateWifi)
+void onWifiEvent(WiFiEvent_t event)
+{
+  switch (event)
+  {
+  case WIFI_EVENT_STA_CONNECTED:
+    wifiAssociatedAt.store(millis());
+    break;
+  case WIFI_EVENT_STA_GOT_IP:
+    wifiGotIpAt.store(millis());
+    postWifiWork(WIFI_PENDING_GOT_IP);
+    break;
+  case WIFI_EVENT_STA_DISCONNECTED:
+    postWifiWork(WIFI_PENDING_DISCONNECTED);
+    break;
+  default:
+    break;
+  }
+}
+
+// armWifiTimeout starts a new attempt, timing out after that long
+void armWifiTimeout(uint32_t milliseconds)
+{
+  wifiAttempt++;
+  wifiTimeoutTicker.once_ms(milliseconds, onWifiTimeout, wifiAttempt);
+}
+
+// beginScanConnect connects to the configured network with a full scan
+// and DHCP; used when there is no cache or the fast connect failed
+void beginScanConnect()
+{
+  LOG_TRACE("connecting to %s with a full scan\n", globalStatus.wifiSsid.c_str());
+  wifiPhase = WIFI_PHASE_CONNECTING;
+  wifiTimings.fastConnect = false;
+  wifiTimings.usedCachedLease = false;
+  wifiTimings.attempts++;
+
+  WiFi.disconnect();
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  WiFi.begin(globalStatus.wifiSsid.c_str(), globalStatus.wifiPassword.c_str());
+  armWifiTimeout(WIFI_CONNECT_TIMEOUT_MS);
+}
+
+// fallBackToScan forgets the cached access point and scans, when the
+// fast connect failed
+void fallBackToScan()
+{
+  wifiTimeoutTicker.detach();
+  settingsLock();
+  wakeContext.wifi.valid = false;
+  wakeContextCommit();
+  settingsUnlock();
+  beginScanConnect();
+}
+
+// handleTimeout falls back to a full scan when the fast connect takes
+// too long, and gives up when the full scan does too
+void handleTimeout()
+{
+  if (wifiPhase == WIFI_PHASE_FAST_CONNECTING)
+  {
+    LOG_TRACE("fast connect timed out\n");
+    fallBackToScan();
+    return;
+  }
+
+  if (wifiPhase == WIFI_PHASE_CONNECTING)
+  {
+    LOG_TRACE("wifi connection timed out\n");
+    wifiPhase = WIFI_PHASE_IDLE;
+    wifiFailed = true;
+    wifiFailedAt = millis();
+    WiFi.disconnect();
+    eventsPost(EVENT_WIFI_DISCONNECTED);
+    wifiStatusChanged();
+  }
+}
+
+// handleGotIp ends the attempt once the station has an address; a
+// renewal of the lease while connected changes nothing
+void handleGotIp()
+{
+  if (wifiPhase == WIFI_PHASE_CONNECTED || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  wifiTimeoutTicker.detach();
+  wifiTimings.associatedMs = wifiAssociatedAt.load() - wifiConnectStartedAt;
+  wifiTimings.gotIpMs = wifiGotIpAt.load() - wifiConnectStartedAt;
+  wifiPhase = WIFI_PHASE_CONNECTED;
+  wifiFailed = false;
+  saveFastConnect();
+  LOG_TRACE("wifi connected in %l ms (associated in %l ms, fast connect %T), ip address is %s\n",
+            wifiTimings.gotIpMs, wifiTimings.associatedMs, wifiTimings.fastConnect, WiFi.localIP().toString().c_str());
+  eventsPost(EVENT_WIFI_CONNECTED);
+  wifiStatusChanged();
+}
+
+// handleDisconnected falls back to a full scan when the fast connect
+// fails, and reports a connection lost; a connection made with the
+// cached lease that is lost drops the lease, the next one asks DHCP
+void handleDisconnected()
+{
+  if (wifiPhase == WIFI_PHASE_FAST_CONNECTING)
+  {
+    LOG_TRACE("fast connect failed\n");
+    fallBackToScan();
+  }
+  else if (wifiPhase == WIFI_PHASE_CONNECTED)
+  {
+    LOG_TRACE("wifi connection lost\n");
+    if (wifiTimings.usedCachedLease)
+    {
+      forgetWifiLease();
+    }
+    wifiPhase = WIFI_PHASE_IDLE;
+    eventsPost(EVENT_WIFI_DISCONNECTED);
+    wifiStatusChanged();
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
 // isWiFiConnected returns true if the a WiFi connection is established;
 // returns false otherwise
 bool isWiFiConnected()
@@ -19,6 +279,18 @@ bool isWiFiConnected()
   return WiFi.status() == WL_CONNECTED;
 }
 
+// isWiFiConnecting returns true while a connection attempt is in progress
+bool isWiFiConnecting()
+{
+  return wifiPhase == WIFI_PHASE_FAST_CONNECTING || wifiPhase == WIFI_PHASE_CONNECTING;
+}
+
+// getWifiConnectTimings returns the timings of the last connection attempt
+WifiConnectTimings getWifiConnectTimings()
+{
+  return wifiTimings;
+}
+
 // getVerboseWifiStatus returns a description of the current wifi status
 String getVerboseWifiStatus()
 {
@@ -27,6 +299,11 @@ String getVerboseWifiStatus()
     return WIFI_STATUS_CONNECTED;
   }
 
+  if (isWiFiConnecting())
+  {
+    return WIFI_STATUS_CONNECTING;
+  }
+
   if (globalStatus.wifiSsid != "" && globalStatus.wifiPassword != "")
   {
     return WIFI_STATUS_DISCONNECTED;
@@ -35,67 +312,170 @@ String getVerboseWifiStatus()
   return WIFI_STATUS_UNDEFINED;
 }
 
-// disconnectWifi terminates an wifi connection if
-// it's currently connected.
+// disconnectWifi ends a wifi connection, or the attempt in progress,
+// and turns the radio off until the next connectWifi.
 void disconnectWifi()
 {
-  if (WiFi.status() != WL_CONNECTED)
+  wifiTimeoutTicker.detach();
+  wifiAttempt++;
+  wifiPhase = WIFI_PHASE_IDLE;
+  wifiFailed = false;
+
+  bool connected = WiFi.status() == WL_CONNECTED;
+  bool result = WiFi.disconnect(true);
+  energyRadio(ENERGY_WIFI, false);
+  if (!connected)
   {
-    Log.trace("wifi not connected\n");
+    LOG_TRACE("wifi not connected, radio off\n");
     return;
   }
 
-  bool result = WiFi.disconnect();
-  Log.trace("wifi disconnected: %b\n", result);
+  LOG_TRACE("wifi disconnected: %b\n", result);
+  wifiStatusChanged();
+}
+
+// setWifiStatusCallback registers a function called whenever the verbose
+// wifi status may have changed; it runs in the loop task
+void setWifiStatusCallback(void (*callback)())
+{
+  wifiStatusCallback = callback;
+}
+
+// updateWifi does the work the other tasks left, in the loop task, on
+// EVENT_WIFI_WORK: a connection lost before the address of the next, a
+// timeout only for the attempt it was armed for, and a reconnection last,
+// once the events of the connection it ends are handled
+void updateWifi()
+{
+  uint8_t pending = wifiPending.exchange(0);
+  if (pending & WIFI_PENDING_DISCONNECTED)
+  {
+    handleDisconnected();
+  }
+  if (pending & WIFI_PENDING_GOT_IP)
+  {
+    handleGotIp();
+  }
+  if ((pending & WIFI_PENDING_TIMEOUT) && wifiTimedOutAttempt.load() == wifiAttempt)
+  {
+    handleTimeout();
+  }
+  if (pending & WIFI_PENDING_RECONNECT)
+  {
+    LOG_TRACE("reconnecting to wifi with the new credentials\n");
+    disconnectWifi();
+    initWifi();
+  }
+}
+
+// requestWifiReconnect has the loop task connect again, with the wifi
+// credentials saved since the connection; for the BLE and HTTP tasks,
+// which must not touch the wifi themselves
+void requestWifiReconnect()
+{
+  postWifiWork(WIFI_PENDING_RECONNECT);
+}
+
+// forgetWifiLease drops the cached DHCP lease, so the next connection
+// asks the DHCP server again; for when the network did not work with it.
+// The lease time is not known, the lease is otherwise reused for
+// WIFI_LEASE_REUSE_S at most.
+void forgetWifiLease()
+{
+  if (wakeContext.wifi.ip == 0)
+  {
+    return;
+  }
+  LOG_TRACE("forgetting the cached lease\n");
+  settingsLock();
+  wakeContext.wifi.ip = 0;
+  wakeContextCommit();
+  settingsUnlock();
 }
 
 // loadWifiCredentials reads wifi credentials from persistent storage
 // and sets the global status.
 void loadWifiCredentials()
 {
-  Log.trace("reading wifi credentials from persistent storage\n");
+  LOG_TRACE("reading wifi credentials from persistent storage\n");
   globalStatus.wifiSsid = settingsGetWifiSsid();
   globalStatus.wifiPassword = settingsGetWifiPassword();
-  Log.verbose("wifi ssid is %s\n", globalStatus.wifiSsid.c_str());
-  Log.verbose("wifi password is %s\n", globalStatus.wifiPassword.c_str());
+  LOG_VERBOSE("wifi ssid is %s\n", globalStatus.wifiSsid.c_str());
+  LOG_VERBOSE("wifi password is %s\n", globalStatus.wifiPassword.c_str());
 }
 
-// connectWifi establishes the wifi connection with timeout support.
+// connectWifi starts the wifi connection without blocking.
+// When the last access point is cached it connects straight to its
+// bssid and channel, reusing the last lease when it is fresh; otherwise
+// (or if that fails) it scans. EVENT_WIFI_CONNECTED or
+// EVENT_WIFI_DISCONNECTED is posted when the attempt finishes.
 void connectWifi()
 {
-  Log.trace("connecting to %s\n", globalStatus.wifiSsid.c_str());
-  WiFi.begin(globalStatus.wifiSsid.c_str(), globalStatus.wifiPassword.c_str());
-  int maxTries = 0;
-  while (!isWiFiConnected() && maxTries++ < 20)
+  if (!wifiEventsRegistered)
   {
-    delay(500);
-    Log.trace("connecting to %s (check #%d)\n", globalStatus.wifiSsid.c_str(), maxTries);
+    WiFi.persistent(false);
+    WiFi.onEvent(onWifiEvent);
+    wifiEventsRegistered = true;
   }
+  // disconnectWifi turns the radio off
+  WiFi.mode(WIFI_STA);
+  energyRadio(ENERGY_WIFI, true);
+
+  wifiConnectStartedAt = millis();
+  wifiTimings = {};
+
+  if (!isFastConnectCached())
+  {
+    beginScanConnect();
+    wifiStatusChanged();
+    return;
+  }
+
+  const WifiFastConnect &cache = wakeContext.wifi;
+  LOG_TRACE("fast connecting to %s on channel %d\n", globalStatus.wifiSsid.c_str(), cache.channel);
+  wifiPhase = WIFI_PHASE_FAST_CONNECTING;
+  wifiTimings.fastConnect = true;
+  wifiTimings.attempts++;
+
+  if (isLeaseFresh())
+  {
+    wifiTimings.usedCachedLease = true;
+    WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+  }
+  WiFi.begin(globalStatus.wifiSsid.c_str(), globalStatus.wifiPassword.c_str(), cache.channel, cache.bssid);
+  armWifiTimeout(WIFI_FAST_CONNECT_TIMEOUT_MS);
+  wifiStatusChanged();
 }
 
-// initWifi established a wifi connection using the
-// global status configurations.
+// initWifi starts a wifi connection using the
+// global status configurations, unless one is already
+// established or in progress.
 void initWifi()
 {
   loadWifiCredentials();
   if (isWiFiConnected())
   {
-    Log.trace("connected to wifi, ip address is %s\n", WiFi.localIP().toString().c_str());
+    LOG_TRACE("connected to wifi, ip address is %s\n", WiFi.localIP().toString().c_str());
+    return;
+  }
+
+  if (isWiFiConnecting())
+  {
+    LOG_TRACE("wifi connection in progress\n");
     return;
   }
 
   if (globalStatus.wifiSsid == "" || globalStatus.wifiPassword == "")
   {
-    Log.trace("wifi not configured\n");
+    LOG_TRACE("wifi not configured\n");
     return;
   }
 
-  connectWifi();
-  if (WiFi.status() != WL_CONNECTED)
+  if (wifiFailed && millis() - wifiFailedAt < WIFI_RETRY_INTERVAL_MS)
   {
-    Log.trace("wifi not connected\n");
+    LOG_TRACE("last wifi connection failed, waiting to retry\n");
     return;
   }
 
-  Log.trace("wifi connected\n");
+  connectWifi();
 }
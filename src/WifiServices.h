@@ -3,10 +3,41 @@
 
 #include <WString.h>
 
+// WifiFastConnect caches what is needed to reconnect to the last access
+// point without scanning and, while the lease is fresh, without DHCP
+struct WifiFastConnect
+{
+    uint32_t ssidCrc;
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t valid;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint32_t leaseEpoch;
+};
+
+// WifiConnectTimings holds how long each phase of the last connection took
+struct WifiConnectTimings
+{
+    bool fastConnect;
+    bool usedCachedLease;
+    uint8_t attempts;
+    uint32_t associatedMs;
+    uint32_t gotIpMs;
+};
+
 String getVerboseWifiStatus();
 bool isWiFiConnected();
+bool isWiFiConnecting();
+WifiConnectTimings getWifiConnectTimings();
 void disconnectWifi();
 void connectWifi();
 void initWifi();
+void setWifiStatusCallback(void (*callback)());
+void updateWifi();
+void requestWifiReconnect();
+void forgetWifiLease();
 
-#endif
\ No newline at end of file
+#endif
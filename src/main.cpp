@@ -1,44 +1,81 @@
 #include <Arduino.h>
-#include <ArduinoLog.h>
-#include <StateMachine.h>
 
+#include "Energy.h"
+#include "Events.h"
+#include "Hal.h"
+#include "Logger.h"
+#include "Profiler.h"
 #include "Settings.h"
+#include "StateMachine.h"
+#include "ConfigurationBLE.h"
 #include "ConfigurationState.h"
 #include "DeepSleepState.h"
 #include "SunriseState.h"
+#include "SyncState.h"
+#include "WifiServices.h"
 
-const int STATE_DELAY = 1000;
+// the states, in the order of their ids
+constexpr StateDefinition STATES[STATE_COUNT] = {
+    {STATE_CONFIGURATION, "Configuration", configurationStateEnter, configurationStateUpdate, nullptr},
+    {STATE_DEEP_SLEEP, "DeepSleep", deepSleepStateEnter, deepSleepStateUpdate, nullptr},
+    {STATE_SUNRISE, "Sunrise", sunriseStateEnter, sunriseStateUpdate, sunriseStateExit},
+    {STATE_SYNC, "Sync", syncStateEnter, syncStateUpdate, syncStateExit},
+};
+static_assert(stateMachineStatesValid(STATES), "a state is missing or out of order");
 
-StateMachine machine = StateMachine();
-State *configurationState = machine.addState(&configurationStateLoop);
-State *deepSleepState = machine.addState(&deepSleepStateLoop);
-State *sunriseState = machine.addState(&sunriseStateLoop);
+// the transitions between the states; any other event updates the
+// current state
+constexpr TransitionDefinition TRANSITIONS[] = {
+    {STATE_CONFIGURATION, EVENT_GO_TO_SLEEP, STATE_DEEP_SLEEP, configurationStateCanSleep},
+    {STATE_DEEP_SLEEP, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_DEEP_SLEEP, EVENT_SLEEP_ABORTED, STATE_CONFIGURATION, nullptr},
+    {STATE_SUNRISE, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_SUNRISE, EVENT_SUNRISE_DONE, STATE_CONFIGURATION, nullptr},
+    {STATE_SYNC, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_SYNC, EVENT_SYNC_DONE, STATE_DEEP_SLEEP, nullptr},
+};
+constexpr TransitionTable TRANSITION_TABLE = stateMachineBuildTable(TRANSITIONS);
+static_assert(TRANSITION_TABLE.valid, "a transition is out of range or repeated");
 
 void setup()
 {
+  profilerInit();
+  energyInit();
+  profilerBegin(PROFILE_PHASE_SETUP);
   Serial.begin(115200);
+  loggerInit();
+  LOG_NOTICE("running global setup\n");
 
-  Log.begin(LOG_LEVEL_TRACE, &Serial, true);
-  Log.notice("running global setup\n");
-
+  profilerBegin(PROFILE_PHASE_SETTINGS_INIT);
   settingsInit();
+  profilerEnd(PROFILE_PHASE_SETTINGS_INIT);
+  eventsInit();
+  stateMachineInit(STATES, &TRANSITION_TABLE);
+  profilerEnd(PROFILE_PHASE_SETUP);
 
-  configurationState->addTransition(&configurationStateActivateSleep, deepSleepState);
-  deepSleepState->addTransition(&deepSleepStateButtonInterrupt, configurationState);
-  deepSleepState->addTransition(&deepSleepStateTimerInterrupt, sunriseState);
-  sunriseState->addTransition(&sunriseStateButtonPress, configurationState);
-  sunriseState->addTransition(&sunriseStateAlarmTimeout, configurationState);
+  // the first state depends on the wake cause, so a timer wake goes
+  // straight to the sunrise, or to the household sync
+  StateId firstState = deepSleepStateWake();
+  profilerMark(PROFILE_PHASE_FIRST_STATE);
+  LOG_NOTICE("wake to first state took %l us\n", (long)halMicros());
+  stateMachineStart(firstState);
 }
 
 void loop()
 {
-  globalStatus.inDeepSleep = settingsGetInDeepSleep();
-  if (globalStatus.inDeepSleep)
+  // block until an event is posted or a state deadline is reached
+  Event event = eventsWait();
+  // the wifi callbacks and a new wifi configuration only post
+  // EVENT_WIFI_WORK and the firmware update EVENT_FIRMWARE_WORK, the work
+  // is done here; the state is still updated,
+  // for the deadline the wait was cut short of
+  if (event == EVENT_WIFI_WORK)
   {
-    Log.trace("waking up from deep sleep\n");
-    machine.transitionTo(deepSleepState);
+    updateWifi();
   }
-
-  machine.run();
-  delay(STATE_DELAY);
+  else if (event == EVENT_FIRMWARE_WORK)
+  {
+    updateFirmware();
+  }
+  stateMachineDispatch(event);
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Arduino core functions used by the firmware, for the native simulation.
+// Time goes through the HAL, so it follows the simulation virtual clock.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "WString.h"
+#include "../Hal.h"
+
+#define IRAM_ATTR
+
+// RTC slow memory is a section of its own, kept by the simulation
+// across deep sleeps (see simBoot)
+#define RTC_DATA_ATTR __attribute__((section("rtc_data")))
+
+inline uint32_t millis()
+{
+    return halMillis();
+}
+
+inline unsigned long micros()
+{
+    return (unsigned long)halMicros();
+}
+
+inline void delay(uint32_t milliseconds)
+{
+    halDelay(milliseconds);
+}
+
+inline long random(long max)
+{
+    return max > 0 ? rand() % max : 0;
+}
+
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+inline size_t strlcpy(char *destination, const char *source, size_t size)
+{
+    size_t length = strlen(source);
+    if (size > 0)
+    {
+        size_t copied = length < size - 1 ? length : size - 1;
+        memcpy(destination, source, copied);
+        destination[copied] = '\0';
+    }
+    return length;
+}
+#endif
+
+// SimSerial stands for the serial port; the simulation logs to stdout
+struct SimSerial
+{
+    void begin(unsigned long /* baud */) {}
+};
+
+extern SimSerial Serial;
+
+void setup();
+
+void loop();
+
+#endif
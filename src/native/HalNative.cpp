@@ -0,0 +1,876 @@
+#include "../Hal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "Simulation.h"
+#include "../Logger.h"
+#include "../WifiServices.h"
+
+// start and end of the RTC slow memory section, see RTC_DATA_ATTR
+extern char __start_rtc_data[];
+extern char __stop_rtc_data[];
+
+SimWorld *simWorld = nullptr;
+SimSerial Serial;
+
+const int SIM_TASKS = 8;
+
+// SimTask is a task started by halTaskStart; its step runs whenever the
+// virtual clock goes past its next run
+struct SimTask
+{
+  void (*step)();
+  uint64_t periodUs;
+  uint64_t nextUs;
+};
+
+// SimLock is a lock made by halLockCreate: there is no concurrency to wait
+// for, the takes are only counted, to stall on a give without its take
+struct SimLock
+{
+  uint32_t depth;
+};
+
+void (*buttonHandler)() = nullptr;
+SimTask simTasks[SIM_TASKS];
+int simTaskCount = 0;
+bool simTasksRunning = false;
+bool simFrameShown = false;
+
+// the UDP socket is in the household sync group rather than talking to
+// the NTP stand-in, on the socket connected to it
+bool simUdpMulticast = false;
+int simUdpSocket = -1;
+
+// the TCP server listens on loopback, on a port of the host's choosing
+// rather than the one asked for (see simTcpPort)
+int simTcpListener = -1;
+uint16_t simTcpPort = 0;
+
+uint32_t simChecks = 0;
+uint32_t simFailures = 0;
+
+// the audio output: the DMA plays the queued samples at the sample rate,
+// in virtual time, since they were last drained
+uint32_t simAudioRate = 0;
+uint32_t simAudioQueued = 0;
+uint64_t simAudioDrainedUs = 0;
+bool simAudioFed = false;
+
+// the firmware update being written to the slot not running
+bool simFirmwareStarted = false;
+uint32_t simFirmwareLength = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// pressButton runs the button handler, as the interrupt would, if a
+// button press is due before the given virtual time
+bool pressButton(uint64_t until)
+{
+  if (simWorld->buttonPressUs == 0 || simWorld->buttonPressUs > until)
+  {
+    return false;
+  }
+  if (simWorld->buttonPressUs > simWorld->nowUs)
+  {
+    simWorld->nowUs = simWorld->buttonPressUs;
+  }
+  simWorld->buttonPressUs = 0;
+  if (buttonHandler == nullptr)
+  {
+    return false;
+  }
+  simWorld->stats.buttonPresses++;
+  buttonHandler();
+  return true;
+}
+
+// runTasks runs, in order, the task steps due until the given virtual
+// time, moving the clock to each. Stops early, returning true, if a step
+// makes something pending.
+bool runTasks(uint64_t until, const volatile uint32_t *pending)
+{
+  if (simTasksRunning)
+  {
+    return false;
+  }
+  simTasksRunning = true;
+  for (;;)
+  {
+    SimTask *next = nullptr;
+    for (int i = 0; i < simTaskCount; i++)
+    {
+      if (simTasks[i].nextUs <= until && (next == nullptr || simTasks[i].nextUs < next->nextUs))
+      {
+        next = &simTasks[i];
+      }
+    }
+    if (next == nullptr)
+    {
+      break;
+    }
+    if (next->nextUs > simWorld->nowUs)
+    {
+      simWorld->nowUs = next->nextUs;
+    }
+    next->nextUs += next->periodUs;
+    next->step();
+    if (pending != nullptr && *pending > 0)
+    {
+      simTasksRunning = false;
+      return true;
+    }
+  }
+  simTasksRunning = false;
+  return false;
+}
+
+// beforeButtonPress returns when the next button press is due, if it is
+// before the given virtual time, or else the given time
+uint64_t beforeButtonPress(uint64_t until)
+{
+  return simWorld->buttonPressUs != 0 && simWorld->buttonPressUs < until ? simWorld->buttonPressUs : until;
+}
+
+// simSensorBegin has nothing to set up
+void simSensorBegin()
+{
+}
+
+// simSensorRead reads a bedroom that warms up and dries a little
+// over the hours
+bool simSensorRead(float *temperature, float *humidity)
+{
+  float hours = simWorld->nowUs / 3600e6;
+  *temperature = 21.5 + sinf(hours * 0.26f);
+  *humidity = 45.0 - 5.0 * sinf(hours * 0.26f);
+  return true;
+}
+
+const HalSensorDriver SIM_SENSOR_DRIVER = {"simulated", 1000, simSensorBegin, simSensorRead};
+
+// findKvEntry returns the entry of a key, or NULL if it is not stored
+SimKvEntry *findKvEntry(const char *key)
+{
+  for (int i = 0; i < SIM_KV_ENTRIES; i++)
+  {
+    SimKvEntry *entry = &simWorld->kv[i];
+    if (entry->used && strncmp(entry->key, key, SIM_KV_KEY_SIZE) == 0)
+    {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+// putKvEntry stores the value of a key, returning the bytes stored
+size_t putKvEntry(const char *key, const void *value, size_t length)
+{
+  if (simWorld->kvWritesFail || strlen(key) >= SIM_KV_KEY_SIZE || length > SIM_KV_VALUE_SIZE)
+  {
+    return 0;
+  }
+
+  SimKvEntry *entry = findKvEntry(key);
+  for (int i = 0; entry == nullptr && i < SIM_KV_ENTRIES; i++)
+  {
+    if (!simWorld->kv[i].used)
+    {
+      entry = &simWorld->kv[i];
+      strncpy(entry->key, key, SIM_KV_KEY_SIZE);
+      entry->used = 1;
+    }
+  }
+  if (entry == nullptr)
+  {
+    return 0;
+  }
+
+  simWorld->stats.kvWrites++;
+  simAdvance(SIM_KV_WRITE_US);
+  memcpy(entry->value, value, length);
+  entry->length = length;
+  return length;
+}
+
+/* =========================================================================
+   Public functions: simulation
+   ========================================================================= */
+
+// simBoot restores what the device keeps across a deep sleep; it needs
+// to be called at the start of every boot, before setup
+void simBoot()
+{
+  size_t rtcLength = __stop_rtc_data - __start_rtc_data;
+  if (rtcLength > SIM_RTC_SIZE)
+  {
+    simStall("the RTC data does not fit the RTC memory");
+  }
+  memcpy(__start_rtc_data, simWorld->rtc, rtcLength);
+
+  simWorld->bootUs = simWorld->nowUs;
+  simWorld->stats.boots++;
+}
+
+// simAdvance moves the virtual clock forward, running the tasks due
+// meanwhile; a task step may move it further itself (e.g. writing the
+// settings), never back
+void simAdvance(uint64_t microseconds)
+{
+  uint64_t until = simWorld->nowUs + microseconds;
+  runTasks(until, nullptr);
+  if (simWorld->nowUs < until)
+  {
+    simWorld->nowUs = until;
+  }
+}
+
+// simIdle moves the virtual clock forward while the firmware waits,
+// stopping early if a simulated interrupt or a task makes something pending
+void simIdle(uint32_t milliseconds, const volatile uint32_t *pending)
+{
+  uint64_t until = milliseconds == SIM_IDLE_FOREVER ? UINT64_MAX : simWorld->nowUs + (uint64_t)milliseconds * 1000;
+  if (until == UINT64_MAX && simWorld->buttonPressUs == 0)
+  {
+    simStall("waiting for an event that can never be posted");
+  }
+
+  uint64_t tasksUntil = beforeButtonPress(until);
+  if (runTasks(tasksUntil, pending))
+  {
+    return;
+  }
+  if (pressButton(until) && *pending > 0)
+  {
+    return;
+  }
+  if (until == UINT64_MAX)
+  {
+    simStall("waiting for an event that can never be posted");
+  }
+  if (runTasks(until, pending))
+  {
+    return;
+  }
+  simWorld->nowUs = until;
+}
+
+// simStall ends the current boot when the firmware cannot make progress
+void simStall(const char *reason)
+{
+  loggerFlush();
+  fprintf(stderr, "simulation stalled: %s\n", reason);
+  fflush(stdout);
+  _exit(SIM_EXIT_STALLED);
+}
+
+// simExpect counts a check of a suite, describing it on stderr if it
+// failed and is one of the first few failures. Returns ok.
+bool simExpect(bool ok, const char *suite, const char *what)
+{
+  simChecks++;
+  if (!ok && ++simFailures <= SIM_EXPECT_MAX_REPORTS)
+  {
+    fprintf(stderr, "FAIL %s: %s\n", suite, what);
+  }
+  return ok;
+}
+
+/* =========================================================================
+   Public functions: clock
+   ========================================================================= */
+
+uint32_t halMillis()
+{
+  return (simWorld->nowUs - simWorld->bootUs) / 1000;
+}
+
+uint64_t halMicros()
+{
+  return simWorld->nowUs - simWorld->bootUs;
+}
+
+void halDelay(uint32_t milliseconds)
+{
+  uint64_t until = simWorld->nowUs + (uint64_t)milliseconds * 1000;
+  uint64_t tasksUntil = beforeButtonPress(until);
+  runTasks(tasksUntil, nullptr);
+  pressButton(until);
+  runTasks(until, nullptr);
+  simWorld->nowUs = until;
+}
+
+// halWallClockMs returns the drifting device clock in unix milliseconds
+int64_t halWallClockMs()
+{
+  int64_t nowMs = simWorld->nowUs / 1000;
+  return SIM_START_EPOCH_MS + nowMs + nowMs * simWorld->clockDriftPpm / 1000000 + simWorld->wallClockOffsetMs;
+}
+
+void halSetWallClockMs(int64_t unixMs)
+{
+  simWorld->wallClockOffsetMs += unixMs - halWallClockMs();
+}
+
+/* =========================================================================
+   Public functions: sleep and wake
+   ========================================================================= */
+
+HalWakeCause halWakeCause()
+{
+  return simWorld->wakeCause;
+}
+
+// halDeepSleep saves the RTC memory and ends the boot; the simulation
+// boots the firmware again when the sleep is over
+bool halDeepSleep(uint64_t microseconds)
+{
+  if (microseconds == 0)
+  {
+    return false;
+  }
+
+  memcpy(simWorld->rtc, __start_rtc_data, __stop_rtc_data - __start_rtc_data);
+  simWorld->sleeping = 1;
+  simWorld->sleepUs = microseconds;
+  simWorld->stats.deepSleeps++;
+  simWorld->stats.awakeUs += simWorld->nowUs - simWorld->bootUs;
+  fflush(stdout);
+  _exit(0);
+}
+
+void halButtonAttach(void (*handler)())
+{
+  buttonHandler = handler;
+}
+
+/* =========================================================================
+   Public functions: tasks
+   ========================================================================= */
+
+// halTaskStart runs the step function as soon as the virtual clock moves
+// and then every period, from whatever is waiting at the time; there is
+// no concurrency. Creating the task takes SIM_TASK_START_US.
+bool halTaskStart(const char * /* name */, void (*step)(), uint32_t periodMs, uint8_t /* priority */, int8_t /* core */,
+                  uint32_t /* stackSize */)
+{
+  if (simTaskCount == SIM_TASKS)
+  {
+    return false;
+  }
+  uint64_t periodUs = (uint64_t)periodMs * 1000;
+  simTasks[simTaskCount++] = SimTask{step, periodUs, simWorld->nowUs};
+  simAdvance(SIM_TASK_START_US);
+  return true;
+}
+
+/* =========================================================================
+   Public functions: locks
+   ========================================================================= */
+
+HalLock halLockCreate()
+{
+  return new SimLock{0};
+}
+
+void halLockTake(HalLock lock)
+{
+  if (lock == nullptr)
+  {
+    simStall("a lock taken before it was created");
+  }
+  ((SimLock *)lock)->depth++;
+}
+
+void halLockGive(HalLock lock)
+{
+  SimLock *simLock = (SimLock *)lock;
+  if (simLock == nullptr || simLock->depth == 0)
+  {
+    simStall("a lock given without being taken");
+  }
+  simLock->depth--;
+}
+
+/* =========================================================================
+   Public functions: console
+   ========================================================================= */
+
+// halConsoleLevel returns the simulation log level, silent unless verbose
+uint8_t halConsoleLevel()
+{
+  return simWorld->logLevel;
+}
+
+// halConsoleWrite prints log lines to stdout
+void halConsoleWrite(uint8_t /* level */, const char *text, size_t length)
+{
+  fwrite(text, 1, length, stdout);
+}
+
+/* =========================================================================
+   Public functions: key-value store
+   ========================================================================= */
+
+void halKvBegin(const char * /* name */)
+{
+}
+
+size_t halKvGetBytesLength(const char *key)
+{
+  SimKvEntry *entry = findKvEntry(key);
+  return entry != nullptr ? entry->length : 0;
+}
+
+size_t halKvGetBytes(const char *key, void *buffer, size_t length)
+{
+  simWorld->stats.kvReads++;
+  simAdvance(SIM_KV_READ_US);
+  SimKvEntry *entry = findKvEntry(key);
+  if (entry == nullptr || entry->length > length)
+  {
+    return 0;
+  }
+  memcpy(buffer, entry->value, entry->length);
+  return entry->length;
+}
+
+size_t halKvPutBytes(const char *key, const void *value, size_t length)
+{
+  return putKvEntry(key, value, length);
+}
+
+String halKvGetString(const char *key)
+{
+  simWorld->stats.kvReads++;
+  simAdvance(SIM_KV_READ_US);
+  SimKvEntry *entry = findKvEntry(key);
+  if (entry == nullptr)
+  {
+    return String();
+  }
+  return String(std::string((const char *)entry->value, entry->length));
+}
+
+size_t halKvPutString(const char *key, const String &value)
+{
+  return putKvEntry(key, value.c_str(), value.length());
+}
+
+bool halKvGetBool(const char *key)
+{
+  uint8_t value = 0;
+  halKvGetBytes(key, &value, sizeof(value));
+  return value != 0;
+}
+
+size_t halKvPutBool(const char *key, bool value)
+{
+  uint8_t stored = value;
+  return putKvEntry(key, &stored, sizeof(stored));
+}
+
+uint32_t halKvGetUInt(const char *key)
+{
+  uint32_t value = 0;
+  halKvGetBytes(key, &value, sizeof(value));
+  return value;
+}
+
+bool halKvRemove(const char *key)
+{
+  SimKvEntry *entry = findKvEntry(key);
+  if (entry == nullptr)
+  {
+    return false;
+  }
+  entry->used = 0;
+  return true;
+}
+
+/* =========================================================================
+   Public functions: radio
+   ========================================================================= */
+
+// halUdpOpen opens a socket on the loopback interface to the host and
+// port asked for, where only the NTP stand-in answers (see SimNtp.cpp):
+// any other host fails as an unknown one would. The local port is left
+// to the host, as several simulations may run at once. Requires a wifi
+// connection.
+bool halUdpOpen(const char *host, uint16_t port, uint16_t /* localPort */)
+{
+  halUdpClose();
+  if (!isWiFiConnected())
+  {
+    return false;
+  }
+  uint16_t serverPort = simNtpResolve(host, port);
+  if (serverPort == 0)
+  {
+    return false;
+  }
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  if (client < 0)
+  {
+    return false;
+  }
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(serverPort);
+  if (connect(client, (struct sockaddr *)&address, sizeof(address)) != 0 || fcntl(client, F_SETFL, O_NONBLOCK) != 0)
+  {
+    close(client);
+    return false;
+  }
+  simUdpSocket = client;
+  return true;
+}
+
+// halUdpOpenMulticast joins the group of the household sync, where the
+// simulated peer opens its window with the device (see SimSync.cpp);
+// requires a wifi connection
+bool halUdpOpenMulticast(const char * /* group */, uint16_t /* port */)
+{
+  halUdpClose();
+  if (!isWiFiConnected())
+  {
+    return false;
+  }
+  simUdpMulticast = true;
+  simSyncPeerOpen();
+  return true;
+}
+
+// halUdpSend sends a datagram to the NTP stand-in, which takes it in
+// right away, or hands the packets sent to the group to the simulated
+// peer after SIM_NETWORK_DELAY_MS
+bool halUdpSend(const uint8_t *data, size_t length)
+{
+  if (simUdpMulticast)
+  {
+    simWorld->stats.syncPacketsSent++;
+    simWorld->stats.syncBytesSent += length;
+    simAdvance(SIM_NETWORK_DELAY_MS * 1000);
+    simSyncPeerReceive(data, length);
+    return true;
+  }
+  if (simUdpSocket < 0 || send(simUdpSocket, data, length, 0) != (ssize_t)length)
+  {
+    return false;
+  }
+  simNtpServe();
+  return true;
+}
+
+// halUdpReceive returns a datagram the NTP stand-in sent by now, in
+// virtual time, or a packet of the simulated peer
+int halUdpReceive(uint8_t *buffer, size_t length)
+{
+  if (simUdpMulticast)
+  {
+    int received = simSyncPeerSend(buffer, length);
+    if (received > 0)
+    {
+      simWorld->stats.syncPacketsReceived++;
+      simWorld->stats.syncBytesReceived += received;
+    }
+    return received;
+  }
+  if (simUdpSocket < 0)
+  {
+    return 0;
+  }
+  simNtpServe();
+  ssize_t received = recv(simUdpSocket, buffer, length, 0);
+  return received > 0 ? received : 0;
+}
+
+void halUdpClose()
+{
+  simUdpMulticast = false;
+  if (simUdpSocket >= 0)
+  {
+    close(simUdpSocket);
+    simUdpSocket = -1;
+  }
+}
+
+// halTcpListen listens on a loopback port the host picks, kept in
+// simTcpPort for the clients of the simulation; requires a wifi
+// connection. The sockets are non-blocking, as on the device.
+bool halTcpListen(uint16_t /* port */)
+{
+  if (simTcpListener >= 0)
+  {
+    return true;
+  }
+  if (!isWiFiConnected())
+  {
+    return false;
+  }
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+  {
+    return false;
+  }
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0 ||
+      fcntl(listener, F_SETFL, O_NONBLOCK) != 0 || getsockname(listener, (struct sockaddr *)&address, &length) != 0)
+  {
+    close(listener);
+    return false;
+  }
+  simTcpListener = listener;
+  simTcpPort = ntohs(address.sin_port);
+  return true;
+}
+
+int halTcpAccept()
+{
+  if (simTcpListener < 0)
+  {
+    return -1;
+  }
+  int connection = accept(simTcpListener, NULL, NULL);
+  if (connection < 0)
+  {
+    return -1;
+  }
+  int noDelay = 1;
+  setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  fcntl(connection, F_SETFL, O_NONBLOCK);
+  return connection;
+}
+
+int halTcpRead(int connection, uint8_t *buffer, size_t length)
+{
+  ssize_t received = recv(connection, buffer, length, 0);
+  if (received > 0)
+  {
+    return received;
+  }
+  return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+int halTcpWrite(int connection, const uint8_t *data, size_t length)
+{
+  ssize_t sent = send(connection, data, length, MSG_NOSIGNAL);
+  if (sent >= 0)
+  {
+    return sent;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+void halTcpClose(int connection)
+{
+  close(connection);
+}
+
+/* =========================================================================
+   Public functions: leds
+   ========================================================================= */
+
+void halLedInit()
+{
+}
+
+// halLedShow takes as long as sending the frame to the strip, counts the
+// frames, and measures how long after a timer wake the first one is shown
+void halLedShow(const HalLedColor /* frame */[], uint8_t count)
+{
+  simAdvance((uint64_t)count * 24 * SIM_LED_BIT_NS / 1000 + SIM_LED_LATCH_US);
+  SimStats &stats = simWorld->stats;
+  stats.framesShown++;
+  if (simFrameShown || simWorld->wakeCause != HAL_WAKE_TIMER)
+  {
+    return;
+  }
+  simFrameShown = true;
+  uint64_t latencyUs = simWorld->nowUs - simWorld->bootUs;
+  stats.firstFrames++;
+  stats.firstFrameUs += latencyUs;
+  if (latencyUs > stats.maxFirstFrameUs)
+  {
+    stats.maxFirstFrameUs = latencyUs;
+  }
+}
+
+/* =========================================================================
+   Public functions: audio
+   ========================================================================= */
+
+// drainAudio takes out of the queue what the DMA played since last time,
+// counting an underrun if it ran dry after being fed
+void drainAudio()
+{
+  uint64_t played = (simWorld->nowUs - simAudioDrainedUs) * simAudioRate / 1000000;
+  simAudioDrainedUs += played * 1000000 / simAudioRate;
+  if (played <= simAudioQueued)
+  {
+    simAudioQueued -= played;
+    return;
+  }
+  if (simAudioFed)
+  {
+    simWorld->stats.audioUnderruns++;
+  }
+  simAudioQueued = 0;
+  simAudioDrainedUs = simWorld->nowUs;
+}
+
+bool halAudioBegin(uint32_t sampleRate)
+{
+  simAudioRate = sampleRate;
+  simAudioQueued = 0;
+  simAudioDrainedUs = simWorld->nowUs;
+  simAudioFed = false;
+  simWorld->stats.songsPlayed++;
+  return true;
+}
+
+// halAudioWrite queues as many samples as fit in the DMA buffers
+size_t halAudioWrite(const int16_t * /* samples */, size_t count)
+{
+  if (simAudioRate == 0)
+  {
+    return 0;
+  }
+  drainAudio();
+  uint32_t space = HAL_AUDIO_DMA_BUFFERS * HAL_AUDIO_DMA_SAMPLES - simAudioQueued;
+  uint32_t taken = count < space ? count : space;
+  simAudioQueued += taken;
+  simAudioFed |= taken > 0;
+  if (taken > 0)
+  {
+    simWorld->audioWrittenUs = simWorld->nowUs;
+  }
+  simWorld->stats.audioUs += (uint64_t)taken * 1000000 / simAudioRate;
+  return taken;
+}
+
+void halAudioStop()
+{
+  simAudioRate = 0;
+}
+
+size_t halSongRead(uint32_t offset, void *buffer, size_t length)
+{
+  if (offset > SIM_SONGS_SIZE || length > SIM_SONGS_SIZE - offset)
+  {
+    return 0;
+  }
+  memcpy(buffer, simWorld->songs + offset, length);
+  return length;
+}
+
+bool halSongErase(uint32_t offset, uint32_t length)
+{
+  if (offset % SIM_FLASH_SECTOR_SIZE != 0 || length % SIM_FLASH_SECTOR_SIZE != 0 || offset > SIM_SONGS_SIZE || length > SIM_SONGS_SIZE - offset)
+  {
+    return false;
+  }
+  memset(simWorld->songs + offset, 0xFF, length);
+  simWorld->stats.flashErases += length / SIM_FLASH_SECTOR_SIZE;
+  return true;
+}
+
+// halSongWrite writes as NOR flash does: bits can only be cleared
+bool halSongWrite(uint32_t offset, const void *data, size_t length)
+{
+  if (offset > SIM_SONGS_SIZE || length > SIM_SONGS_SIZE - offset)
+  {
+    return false;
+  }
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < length; i++)
+  {
+    simWorld->songs[offset + i] &= bytes[i];
+  }
+  return true;
+}
+
+uint32_t halSongStoreSize()
+{
+  return SIM_SONGS_SIZE;
+}
+
+/* =========================================================================
+   Public functions: firmware update
+   ========================================================================= */
+
+size_t halFirmwareRead(uint32_t offset, void *buffer, size_t length)
+{
+  if (offset > SIM_FIRMWARE_SLOT_SIZE || length > SIM_FIRMWARE_SLOT_SIZE - offset)
+  {
+    return 0;
+  }
+  memcpy(buffer, simWorld->firmware[simWorld->runningSlot] + offset, length);
+  return length;
+}
+
+bool halFirmwareBegin()
+{
+  memset(simWorld->firmware[1 - simWorld->runningSlot], 0xFF, SIM_FIRMWARE_SLOT_SIZE);
+  simFirmwareStarted = true;
+  simFirmwareLength = 0;
+  return true;
+}
+
+bool halFirmwareWrite(const void *data, size_t length)
+{
+  if (!simFirmwareStarted || length > SIM_FIRMWARE_SLOT_SIZE - simFirmwareLength)
+  {
+    return false;
+  }
+  memcpy(simWorld->firmware[1 - simWorld->runningSlot] + simFirmwareLength, data, length);
+  simFirmwareLength += length;
+  return true;
+}
+
+// halFirmwareEnd boots the new image next if asked to, and if it starts
+// as an image does, as the device checks
+bool halFirmwareEnd(bool activate)
+{
+  if (!simFirmwareStarted)
+  {
+    return false;
+  }
+  simFirmwareStarted = false;
+  if (!activate)
+  {
+    return true;
+  }
+  uint8_t slot = 1 - simWorld->runningSlot;
+  if (simFirmwareLength == 0 || simWorld->firmware[slot][0] != SIM_FIRMWARE_IMAGE_MAGIC)
+  {
+    return false;
+  }
+  simWorld->bootSlot = slot;
+  return true;
+}
+
+/* =========================================================================
+   Public functions: sensor
+   ========================================================================= */
+
+// halSensorDriver returns the simulated sensor
+const HalSensorDriver *halSensorDriver()
+{
+  return &SIM_SENSOR_DRIVER;
+}
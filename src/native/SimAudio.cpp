@@ -0,0 +1,567 @@
+// The audio side of the native simulation. It installs the song of the
+// simulated alarm in the songs partition, and checks the audio decoder
+// (see AudioDecoder.h) against files it writes itself: PCM decoded
+// exactly, IMA-ADPCM decoded as its encoder reconstructs it, broken files
+// rejected, streaming in odd pieces, the gain ramp and looping. Then it
+// benchmarks the decoding, to show how far from real time it is.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../AudioDecoder.h"
+#include "../Crc.h"
+#include "../SongStore.h"
+#include "Simulation.h"
+
+// the song of the simulated alarm (see SimRadio.cpp): a melody of a few
+// seconds, at a low rate to keep the simulation fast. The checks and the
+// benchmark use the same melody at the rate of a real song.
+const char *SIM_SONG_NAME = "sunrise";
+const uint32_t SIM_SONG_RATE = 8000;
+const uint32_t SIM_CHECK_RATE = 16000;
+const uint32_t SIM_SONG_NOTE_MS = 250;
+const float SIM_SONG_NOTES_HZ[] = {523.25f, 587.33f, 659.25f, 783.99f, 880.00f, 783.99f, 659.25f, 587.33f,
+                                   523.25f, 659.25f, 783.99f, 1046.50f, 783.99f, 659.25f, 587.33f, 523.25f};
+const uint16_t SIM_SONG_BLOCK_SIZE = 256;
+
+// the ADPCM decoding must be as good as this, in dB of signal to noise;
+// 4 bits per sample get about 20 dB on the melody
+const double SIM_MIN_ADPCM_SNR_DB = 18;
+
+const size_t SIM_WAV_HEADER_SIZE = 60;
+
+// the encoder side of IMA-ADPCM, as in AudioDecoder.cpp
+const int16_t SIM_IMA_STEPS[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80,
+    88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544,
+    598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749,
+    3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635,
+    13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+const int8_t SIM_IMA_INDEX_ADJUST[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+// the file the checks decode, read through readCheckFile
+const uint8_t *checkFile = nullptr;
+uint32_t checkFileLength = 0;
+bool checkReadFails = false;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+void putUint16(uint8_t *data, uint16_t value)
+{
+  data[0] = value;
+  data[1] = value >> 8;
+}
+
+void putUint32(uint8_t *data, uint32_t value)
+{
+  putUint16(data, value);
+  putUint16(data + 2, value >> 16);
+}
+
+// makeMelody writes count samples of the melody, each note fading out
+void makeMelody(int16_t *samples, size_t count, uint32_t sampleRate)
+{
+  uint32_t noteSamples = sampleRate * SIM_SONG_NOTE_MS / 1000;
+  size_t notes = sizeof(SIM_SONG_NOTES_HZ) / sizeof(SIM_SONG_NOTES_HZ[0]);
+  for (size_t i = 0; i < count; i++)
+  {
+    float hz = SIM_SONG_NOTES_HZ[(i / noteSamples) % notes];
+    float t = (float)(i % noteSamples) / sampleRate;
+    float envelope = expf(-4.0f * t * 1000 / SIM_SONG_NOTE_MS);
+    samples[i] = (int16_t)(12000 * envelope * (sinf(2 * (float)M_PI * hz * t) + 0.3f * sinf(4 * (float)M_PI * hz * t)));
+  }
+}
+
+// encodeNibble encodes a sample as an IMA-ADPCM code, updating the
+// predictor and the step index as the decoder does
+uint8_t encodeNibble(int16_t sample, int32_t *predictor, int8_t *stepIndex)
+{
+  int32_t step = SIM_IMA_STEPS[*stepIndex];
+  int32_t difference = sample - *predictor;
+  uint8_t code = 0;
+  if (difference < 0)
+  {
+    code = 8;
+    difference = -difference;
+  }
+  if (difference >= step)
+  {
+    code |= 4;
+    difference -= step;
+  }
+  if (difference >= step >> 1)
+  {
+    code |= 2;
+    difference -= step >> 1;
+  }
+  if (difference >= step >> 2)
+  {
+    code |= 1;
+  }
+
+  int32_t quantized = step >> 3;
+  quantized += (code & 4) ? step : 0;
+  quantized += (code & 2) ? step >> 1 : 0;
+  quantized += (code & 1) ? step >> 2 : 0;
+  int32_t next = *predictor + ((code & 8) ? -quantized : quantized);
+  *predictor = next < -32768 ? -32768 : next > 32767 ? 32767 : next;
+  int8_t index = *stepIndex + SIM_IMA_INDEX_ADJUST[code];
+  *stepIndex = index < 0 ? 0 : index > 88 ? 88 : index;
+  return code;
+}
+
+// writeWavHeader writes the RIFF header and the format chunk, with an odd
+// sized chunk before the data to be skipped, returning the data offset
+size_t writeWavHeader(uint8_t *file, uint16_t encoding, uint16_t channels, uint32_t sampleRate, uint16_t blockSize,
+                      uint16_t samplesPerBlock, uint32_t dataLength)
+{
+  bool adpcm = encoding == AUDIO_ENCODING_IMA_ADPCM;
+  uint32_t formatSize = adpcm ? 20 : 16;
+  uint8_t *chunk = file + 12;
+  memcpy(chunk, "fmt ", 4);
+  putUint32(chunk + 4, formatSize);
+  putUint16(chunk + 8, encoding);
+  putUint16(chunk + 10, channels);
+  putUint32(chunk + 12, sampleRate);
+  putUint32(chunk + 16, sampleRate * blockSize / samplesPerBlock);
+  putUint16(chunk + 20, blockSize);
+  putUint16(chunk + 22, adpcm ? 4 : 16);
+  if (adpcm)
+  {
+    putUint16(chunk + 24, 2);
+    putUint16(chunk + 26, samplesPerBlock);
+  }
+  chunk += 8 + formatSize;
+
+  memcpy(chunk, "note", 4);
+  putUint32(chunk + 4, 3);
+  memcpy(chunk + 8, "sim\0", 4);
+  chunk += 12;
+
+  memcpy(chunk, "data", 4);
+  putUint32(chunk + 4, dataLength);
+  chunk += 8;
+
+  size_t dataOffset = chunk - file;
+  memcpy(file, "RIFF", 4);
+  putUint32(file + 4, dataOffset - 8 + dataLength);
+  memcpy(file + 8, "WAVE", 4);
+  return dataOffset;
+}
+
+// writePcmWav writes a 16 bits PCM file of count frames, returning its length
+size_t writePcmWav(uint8_t *file, const int16_t *samples, size_t count, uint16_t channels, uint32_t sampleRate)
+{
+  uint32_t dataLength = count * channels * 2;
+  size_t offset = writeWavHeader(file, AUDIO_ENCODING_PCM16, channels, sampleRate, 2 * channels, 1, dataLength);
+  for (size_t i = 0; i < count * channels; i++)
+  {
+    putUint16(file + offset + 2 * i, samples[i]);
+  }
+  return offset + dataLength;
+}
+
+// writeAdpcmWav encodes count samples in an IMA-ADPCM file, returning its
+// length; decoded holds the samples as the decoder must reconstruct them
+size_t writeAdpcmWav(uint8_t *file, const int16_t *samples, size_t count, uint32_t sampleRate, uint16_t blockSize,
+                     int16_t *decoded)
+{
+  uint16_t samplesPerBlock = (blockSize - 4) * 2 + 1;
+  uint8_t *data = file + SIM_WAV_HEADER_SIZE;
+  size_t length = 0;
+  int8_t stepIndex = 0;
+  for (size_t first = 0; first < count; first += samplesPerBlock)
+  {
+    int32_t predictor = samples[first];
+    decoded[first] = samples[first];
+    uint8_t *block = data + length;
+    putUint16(block, samples[first]);
+    block[2] = stepIndex;
+    block[3] = 0;
+    length += 4;
+
+    size_t last = first + samplesPerBlock < count ? first + samplesPerBlock : count;
+    for (size_t i = first + 1; i < last; i++)
+    {
+      uint8_t code = encodeNibble(samples[i], &predictor, &stepIndex);
+      decoded[i] = predictor;
+      if ((i - first) % 2 == 1)
+      {
+        data[length] = code;
+        length++;
+      }
+      else
+      {
+        data[length - 1] |= code << 4;
+      }
+    }
+  }
+
+  size_t offset = writeWavHeader(file, AUDIO_ENCODING_IMA_ADPCM, 1, sampleRate, blockSize, samplesPerBlock, length);
+  memmove(file + offset, data, length);
+  return offset + length;
+}
+
+size_t readCheckFile(uint32_t offset, void *buffer, size_t length)
+{
+  if (checkReadFails || offset > checkFileLength || length > checkFileLength - offset)
+  {
+    return 0;
+  }
+  memcpy(buffer, checkFile + offset, length);
+  return length;
+}
+
+// openCheckFile opens a file of the checks, returning the decoder status
+AudioStatus openCheckFile(AudioDecoder *decoder, const uint8_t *file, size_t length)
+{
+  checkFile = file;
+  checkFileLength = length;
+  AudioSource source = {readCheckFile, 0, (uint32_t)length};
+  return audioDecoderOpen(decoder, &source);
+}
+
+// decodeInPieces decodes a file in pieces of odd sizes, returning the samples decoded
+size_t decodeInPieces(AudioDecoder *decoder, int16_t *samples, size_t capacity)
+{
+  static const size_t PIECES[] = {1, 7, 13, 255, 256, 300, 2};
+  size_t count = 0;
+  for (size_t i = 0; count < capacity; i++)
+  {
+    size_t piece = PIECES[i % (sizeof(PIECES) / sizeof(PIECES[0]))];
+    size_t decoded = audioDecoderRead(decoder, samples + count, piece < capacity - count ? piece : capacity - count);
+    count += decoded;
+    if (decoded < piece)
+    {
+      break;
+    }
+  }
+  return count;
+}
+
+// the output of the stream checks: it takes up to pumpOutputSpace samples per pump
+int16_t *pumpOutput = nullptr;
+size_t pumpOutputLength = 0;
+size_t pumpOutputCapacity = 0;
+size_t pumpOutputSpace = 0;
+
+size_t writePumpOutput(const int16_t *samples, size_t count)
+{
+  size_t taken = count < pumpOutputSpace ? count : pumpOutputSpace;
+  if (taken > pumpOutputCapacity - pumpOutputLength)
+  {
+    taken = pumpOutputCapacity - pumpOutputLength;
+  }
+  memcpy(pumpOutput + pumpOutputLength, samples, taken * sizeof(int16_t));
+  pumpOutputLength += taken;
+  pumpOutputSpace -= taken;
+  return taken;
+}
+
+void checkPcm(const int16_t *melody, size_t count, uint8_t *file, int16_t *decoded)
+{
+  AudioDecoder decoder;
+  size_t length = writePcmWav(file, melody, count, 1, 8000);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_OK, "audio", "mono PCM opens");
+  simExpect(decoder.format.sampleRate == 8000 && decoder.format.encoding == AUDIO_ENCODING_PCM16, "audio",
+            "mono PCM format");
+  simExpect(audioDecoderRead(&decoder, decoded, count + 10) == count, "audio", "mono PCM decodes every sample");
+  simExpect(memcmp(decoded, melody, count * sizeof(int16_t)) == 0, "audio", "mono PCM decodes exactly");
+
+  audioDecoderRewind(&decoder);
+  simExpect(decodeInPieces(&decoder, decoded, count + 10) == count &&
+                memcmp(decoded, melody, count * sizeof(int16_t)) == 0,
+            "audio", "mono PCM decodes the same in pieces");
+
+  // the stereo file has the melody on the left and its inverse, halved, on the right
+  int16_t *stereo = (int16_t *)calloc(count * 2, sizeof(int16_t));
+  if (stereo == NULL)
+  {
+    perror("malloc");
+    return;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    stereo[2 * i] = melody[i];
+    stereo[2 * i + 1] = -melody[i] / 2;
+  }
+  length = writePcmWav(file, stereo, count, 2, 8000);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_OK, "audio", "stereo PCM opens");
+  bool mixed = audioDecoderRead(&decoder, decoded, count) == count;
+  for (size_t i = 0; i < count && mixed; i++)
+  {
+    mixed = decoded[i] == ((int32_t)stereo[2 * i] + stereo[2 * i + 1]) >> 1;
+  }
+  simExpect(mixed, "audio", "stereo PCM is mixed down to mono");
+  free(stereo);
+}
+
+void checkAdpcm(const int16_t *melody, size_t count, uint8_t *file, int16_t *expected, int16_t *decoded)
+{
+  AudioDecoder decoder;
+  size_t length = writeAdpcmWav(file, melody, count, SIM_CHECK_RATE, SIM_SONG_BLOCK_SIZE, expected);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_OK, "audio", "ADPCM opens");
+  simExpect(decoder.format.samplesPerBlock == (SIM_SONG_BLOCK_SIZE - 4) * 2 + 1, "audio", "ADPCM samples per block");
+  simExpect(audioDecoderRead(&decoder, decoded, count + 10) == count, "audio", "ADPCM decodes every sample");
+  simExpect(memcmp(decoded, expected, count * sizeof(int16_t)) == 0, "audio", "ADPCM decodes as encoded");
+
+  double signal = 0;
+  double noise = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    signal += (double)melody[i] * melody[i];
+    noise += (double)(decoded[i] - melody[i]) * (decoded[i] - melody[i]);
+  }
+  double snrDb = 10 * log10(signal / (noise > 0 ? noise : 1));
+  printf("adpcm snr:           %.1f dB\n", snrDb);
+  simExpect(snrDb >= SIM_MIN_ADPCM_SNR_DB, "audio", "ADPCM signal to noise");
+
+  audioDecoderRewind(&decoder);
+  simExpect(decodeInPieces(&decoder, decoded, count + 10) == count &&
+                memcmp(decoded, expected, count * sizeof(int16_t)) == 0,
+            "audio", "ADPCM decodes the same in pieces");
+
+  // a broken step index in the second block stops the decoding there
+  file[SIM_WAV_HEADER_SIZE + SIM_SONG_BLOCK_SIZE + 2] = 89;
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_OK, "audio", "broken ADPCM opens");
+  simExpect(audioDecoderRead(&decoder, decoded, count) < count && decoder.status == AUDIO_STATUS_BAD_FORMAT, "audio",
+            "broken ADPCM block is rejected");
+}
+
+void checkBadFiles(const int16_t *melody, uint8_t *file, int16_t *decoded)
+{
+  AudioDecoder decoder;
+  size_t length = writePcmWav(file, melody, 100, 1, 8000);
+  simExpect(openCheckFile(&decoder, file, 8) == AUDIO_STATUS_NOT_WAV, "audio", "a short file is not a WAV");
+
+  memcpy(file, "RIFX", 4);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_NOT_WAV, "audio", "a big endian file is not a WAV");
+  memcpy(file, "RIFF", 4);
+
+  checkReadFails = true;
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_READ_FAILED, "audio", "a failed read is reported");
+  checkReadFails = false;
+
+  putUint16(file + 34, 8);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_UNSUPPORTED, "audio", "8 bits PCM is not supported");
+  putUint16(file + 34, 16);
+
+  putUint16(file + 32, 4);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_BAD_FORMAT, "audio",
+            "a wrong block size is rejected");
+  putUint16(file + 32, 2);
+
+  memcpy(file + 12, "junk", 4);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_BAD_FORMAT, "audio",
+            "data without format is rejected");
+  memcpy(file + 12, "fmt ", 4);
+
+  // the data chunk claims more than the file has: only what is there is decoded
+  simExpect(openCheckFile(&decoder, file, length - 11) == AUDIO_STATUS_OK, "audio", "a truncated file opens");
+  simExpect(audioDecoderRead(&decoder, decoded, 100) == 94, "audio", "a truncated file decodes its whole frames");
+
+  int16_t expected[100];
+  length = writeAdpcmWav(file, melody, 100, 8000, 36, expected);
+  putUint16(file + 38, 99);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_BAD_FORMAT, "audio",
+            "wrong ADPCM samples per block are rejected");
+  putUint16(file + 38, 65);
+  putUint16(file + 32, 2000);
+  simExpect(openCheckFile(&decoder, file, length) == AUDIO_STATUS_UNSUPPORTED, "audio",
+            "too large ADPCM blocks are not supported");
+}
+
+void checkGain()
+{
+  int16_t samples[256];
+  for (size_t i = 0; i < 256; i++)
+  {
+    samples[i] = 32767;
+  }
+  audioApplyGain(samples, 256, 0, AUDIO_GAIN_UNITY);
+  simExpect(samples[0] < 256 && samples[255] == 32767, "audio", "the gain ramps from 0 to unity");
+
+  bool rising = true;
+  for (size_t i = 1; i < 256; i++)
+  {
+    rising &= samples[i] > samples[i - 1];
+  }
+  simExpect(rising, "audio", "the gain ramp rises on every sample");
+
+  samples[0] = 30000;
+  samples[1] = -30000;
+  audioApplyGain(samples, 2, 0xFFFF, 0xFFFF);
+  simExpect(samples[0] == 32767 && samples[1] == -32768, "audio", "a gain above unity saturates");
+
+  samples[0] = -1234;
+  audioApplyGain(samples, 1, AUDIO_GAIN_UNITY, AUDIO_GAIN_UNITY);
+  simExpect(samples[0] == -1234, "audio", "unity gain keeps the samples");
+
+  simExpect(audioRampGain(0) == 0 && audioRampGain(0xFFFF) >= AUDIO_GAIN_UNITY - 1, "audio",
+            "the ramp goes from silence to unity");
+  simExpect(audioRampGain(0x8000) == AUDIO_GAIN_UNITY / 4, "audio", "the ramp is quadratic");
+}
+
+void checkStream(uint8_t *file, size_t length, const int16_t *expected, size_t count)
+{
+  AudioStream stream;
+  checkFile = file;
+  checkFileLength = length;
+  AudioSource source = {readCheckFile, 0, (uint32_t)length};
+  int16_t *output = (int16_t *)malloc(3 * count * sizeof(int16_t));
+  pumpOutput = output;
+  pumpOutputLength = 0;
+  pumpOutputCapacity = 3 * count;
+
+  // played once at unity gain, through an output taking odd amounts
+  simExpect(audioStreamOpen(&stream, &source, false) == AUDIO_STATUS_OK, "audio", "the stream opens");
+  stream.gain = AUDIO_GAIN_UNITY;
+  stream.targetGain = AUDIO_GAIN_UNITY;
+  bool playing = true;
+  for (uint32_t pumps = 0; playing && pumps < count; pumps++)
+  {
+    pumpOutputSpace = 97 + pumps % 300;
+    playing = audioStreamPump(&stream, writePumpOutput);
+  }
+  simExpect(!playing && pumpOutputLength == count && memcmp(output, expected, count * sizeof(int16_t)) == 0, "audio",
+            "the stream plays the file once");
+
+  // looped, it starts over seamlessly
+  pumpOutputLength = 0;
+  simExpect(audioStreamOpen(&stream, &source, true) == AUDIO_STATUS_OK, "audio", "the looping stream opens");
+  stream.gain = AUDIO_GAIN_UNITY;
+  stream.targetGain = AUDIO_GAIN_UNITY;
+  while (pumpOutputLength < 3 * count)
+  {
+    pumpOutputSpace = 1000;
+    if (!audioStreamPump(&stream, writePumpOutput))
+    {
+      break;
+    }
+  }
+  bool looped = pumpOutputLength == 3 * count && stream.loops >= 2;
+  for (int i = 0; i < 3 && looped; i++)
+  {
+    looped = memcmp(output + i * count, expected, count * sizeof(int16_t)) == 0;
+  }
+  simExpect(looped, "audio", "the stream loops");
+  free(output);
+}
+
+// benchmark decodes benchSeconds of the song through a stream with a gain
+// ramp, as the audio task does, and reports how fast it went
+void benchmark(uint8_t *file, size_t length, uint32_t benchSeconds)
+{
+  AudioStream stream;
+  checkFile = file;
+  checkFileLength = length;
+  AudioSource source = {readCheckFile, 0, (uint32_t)length};
+  audioStreamOpen(&stream, &source, true);
+  int16_t *output = (int16_t *)malloc(AUDIO_BLOCK_SAMPLES * sizeof(int16_t));
+  pumpOutput = output;
+  pumpOutputCapacity = AUDIO_BLOCK_SAMPLES;
+
+  uint64_t samples = (uint64_t)benchSeconds * SIM_CHECK_RATE;
+  uint64_t decoded = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (decoded < samples)
+  {
+    stream.targetGain = audioRampGain(decoded * 0xFFFF / samples);
+    pumpOutputLength = 0;
+    pumpOutputSpace = AUDIO_BLOCK_SAMPLES;
+    audioStreamPump(&stream, writePumpOutput);
+    decoded += pumpOutputLength;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(output);
+
+  double elapsedS = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double perSecond = decoded / elapsedS;
+  printf("decoded:             %.1f s of audio, %u loops\n", (double)decoded / SIM_CHECK_RATE, stream.loops);
+  printf("decode time:         %.1f ns per sample, %.2f us per block\n", elapsedS * 1e9 / decoded,
+         elapsedS * 1e6 * AUDIO_BLOCK_SAMPLES / decoded);
+  printf("decode speed:        %.0f samples per second (%.0fx real time at %u Hz)\n", perSecond,
+         perSecond / SIM_CHECK_RATE, SIM_CHECK_RATE);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simAudioInstallSongs writes the song of the simulated alarm, IMA-ADPCM
+// encoded, and the directory naming it to the songs partition
+bool simAudioInstallSongs()
+{
+  size_t notes = sizeof(SIM_SONG_NOTES_HZ) / sizeof(SIM_SONG_NOTES_HZ[0]);
+  size_t count = notes * SIM_SONG_RATE * SIM_SONG_NOTE_MS / 1000;
+  int16_t *melody = (int16_t *)malloc(2 * count * sizeof(int16_t));
+  if (melody == NULL)
+  {
+    return false;
+  }
+  makeMelody(melody, count, SIM_SONG_RATE);
+  uint8_t *file = simWorld->songs + SONG_STORE_SECTOR_SIZE;
+  if (SIM_WAV_HEADER_SIZE + count / 2 + count / SIM_SONG_BLOCK_SIZE * 4 > SIM_SONGS_SIZE - SONG_STORE_SECTOR_SIZE)
+  {
+    free(melody);
+    return false;
+  }
+  size_t length = writeAdpcmWav(file, melody, count, SIM_SONG_RATE, SIM_SONG_BLOCK_SIZE, melody + count);
+  free(melody);
+
+  SongDirectory directory = {};
+  directory.magic = SONG_STORE_MAGIC;
+  directory.version = SONG_STORE_VERSION;
+  directory.count = 1;
+  SongEntry &song = directory.songs[0];
+  strncpy(song.name, SIM_SONG_NAME, ALARM_SONG_SIZE - 1);
+  song.offset = SONG_STORE_SECTOR_SIZE;
+  song.length = length;
+  song.crc = crc32(file, length);
+  directory.crc = crc32(&directory, offsetof(SongDirectory, crc));
+  memcpy(simWorld->songs, &directory, sizeof(directory));
+  return true;
+}
+
+// simAudioCheck runs the checks of the audio decoder, then the benchmark
+// for benchSeconds of audio. Returns false if any check failed.
+bool simAudioCheck(uint32_t benchSeconds)
+{
+  size_t notes = sizeof(SIM_SONG_NOTES_HZ) / sizeof(SIM_SONG_NOTES_HZ[0]);
+  // an odd count, so the last ADPCM block is short
+  size_t count = notes * SIM_CHECK_RATE * SIM_SONG_NOTE_MS / 1000 + 123;
+  int16_t *melody = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *expected = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *decoded = (int16_t *)malloc((count + 10) * sizeof(int16_t));
+  uint8_t *file = (uint8_t *)malloc(SIM_WAV_HEADER_SIZE + count * 4);
+  if (melody == NULL || expected == NULL || decoded == NULL || file == NULL)
+  {
+    perror("malloc");
+    return false;
+  }
+  makeMelody(melody, count, SIM_CHECK_RATE);
+
+  checkPcm(melody, count, file, decoded);
+  checkBadFiles(melody, file, decoded);
+  checkGain();
+  checkAdpcm(melody, count, file, expected, decoded);
+  size_t length = writeAdpcmWav(file, melody, count, SIM_CHECK_RATE, SIM_SONG_BLOCK_SIZE, expected);
+  checkStream(file, length, expected, count);
+  if (benchSeconds > 0)
+  {
+    benchmark(file, length, benchSeconds);
+  }
+
+  free(melody);
+  free(expected);
+  free(decoded);
+  free(file);
+  printf("audio checks failed: %u\n", simFailures);
+  return simFailures == 0;
+}
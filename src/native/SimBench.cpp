@@ -0,0 +1,138 @@
+// The state machine benchmark of the native simulation: it dispatches
+// random events through the transitions of the firmware (see main.cpp),
+// with actions and guards that only count their calls, and reports the
+// cost of a dispatch and how many guards ran, next to how many
+// predicates a polled state machine would have evaluated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../StateMachine.h"
+#include "Simulation.h"
+
+uint32_t benchActionCalls = 0;
+uint32_t benchGuardCalls = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+void benchAction()
+{
+  benchActionCalls++;
+}
+
+// benchGuard allows every other transition
+bool benchGuard()
+{
+  benchGuardCalls++;
+  return benchGuardCalls % 2 == 0;
+}
+
+constexpr StateDefinition BENCH_STATES[STATE_COUNT] = {
+    {STATE_CONFIGURATION, "Configuration", benchAction, benchAction, nullptr},
+    {STATE_DEEP_SLEEP, "DeepSleep", benchAction, benchAction, nullptr},
+    {STATE_SUNRISE, "Sunrise", benchAction, benchAction, benchAction},
+    {STATE_SYNC, "Sync", benchAction, benchAction, benchAction},
+};
+static_assert(stateMachineStatesValid(BENCH_STATES), "a state is missing or out of order");
+
+constexpr TransitionDefinition BENCH_TRANSITIONS[] = {
+    {STATE_CONFIGURATION, EVENT_GO_TO_SLEEP, STATE_DEEP_SLEEP, benchGuard},
+    {STATE_DEEP_SLEEP, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_DEEP_SLEEP, EVENT_SLEEP_ABORTED, STATE_CONFIGURATION, nullptr},
+    {STATE_SUNRISE, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_SUNRISE, EVENT_SUNRISE_DONE, STATE_CONFIGURATION, nullptr},
+    {STATE_SYNC, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+    {STATE_SYNC, EVENT_SYNC_DONE, STATE_DEEP_SLEEP, nullptr},
+};
+constexpr TransitionTable BENCH_TABLE = stateMachineBuildTable(BENCH_TRANSITIONS);
+static_assert(BENCH_TABLE.valid, "a transition is out of range or repeated");
+
+// benchNanos returns a monotonic real time, in nanoseconds
+uint64_t benchNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// transitionsFrom returns how many transitions leave a state, the
+// predicates a polled state machine evaluates there on every pass
+uint32_t transitionsFrom(StateId state)
+{
+  uint32_t count = 0;
+  for (const TransitionDefinition &transition : BENCH_TRANSITIONS)
+  {
+    count += transition.from == state;
+  }
+  return count;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simBenchStateMachine runs the benchmark, returning false if a guard
+// ran when no transition was found for an event
+bool simBenchStateMachine(uint32_t dispatches)
+{
+  Event *events = (Event *)malloc(dispatches);
+  if (events == NULL)
+  {
+    perror("malloc");
+    return false;
+  }
+  uint32_t random = 1;
+  for (uint32_t i = 0; i < dispatches; i++)
+  {
+    random = random * 1103515245 + 12345;
+    events[i] = (Event)((random >> 16) % EVENT_COUNT);
+  }
+
+  stateMachineInit(BENCH_STATES, &BENCH_TABLE);
+  stateMachineStart(STATE_CONFIGURATION);
+  uint64_t startedAt = benchNanos();
+  for (uint32_t i = 0; i < dispatches; i++)
+  {
+    stateMachineDispatch(events[i]);
+  }
+  uint64_t elapsedNs = benchNanos() - startedAt;
+  StateMachineStats stats;
+  stateMachineGetStats(&stats);
+
+  // replays the events, untimed, counting the guards the table holds
+  // for them and the predicates a polled state machine would evaluate
+  uint32_t guardCalls = benchGuardCalls;
+  benchGuardCalls = 0;
+  uint64_t expectedGuards = 0;
+  uint64_t polledPredicates = 0;
+  stateMachineInit(BENCH_STATES, &BENCH_TABLE);
+  stateMachineStart(STATE_CONFIGURATION);
+  for (uint32_t i = 0; i < dispatches; i++)
+  {
+    StateId state = stateMachineCurrent();
+    expectedGuards += BENCH_TABLE.guard[state][events[i]] != nullptr;
+    polledPredicates += transitionsFrom(state);
+    stateMachineDispatch(events[i]);
+  }
+  free(events);
+
+  printf("dispatches:          %u\n", stats.dispatched);
+  printf("dispatch time:       %.1f ns\n", (double)elapsedNs / dispatches);
+  printf("transitions:         %u\n", stats.transitions);
+  printf("updates:             %u\n", stats.updates);
+  printf("actions run:         %u\n", benchActionCalls);
+  printf("guards evaluated:    %u (%llu expected)\n", guardCalls, (unsigned long long)expectedGuards);
+  printf("polled predicates:   %llu (%.2f per dispatch)\n", (unsigned long long)polledPredicates,
+         (double)polledPredicates / dispatches);
+  printf("transition table:    %u bytes\n", (unsigned)sizeof(TransitionTable));
+
+  if (guardCalls != expectedGuards || stats.guardsEvaluated != expectedGuards)
+  {
+    fprintf(stderr, "the guards ran %u times for %llu guarded events\n", guardCalls, (unsigned long long)expectedGuards);
+    return false;
+  }
+  return true;
+}
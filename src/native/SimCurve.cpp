@@ -0,0 +1,265 @@
+// The sunrise curve on the host. simCurveCheck checks the curve the
+// leds follow (see SunriseCurve.h): the progress over the duration, the
+// colors at its ends, every channel never dimming as the progress goes,
+// the lightness step from a frame to the next and the leds of the middle
+// of the strip leading the edges. Then it compares the curve with the
+// palette path it replaced, FastLED ColorFromPalette(HeatColors_p,
+// index, index) stepped every 7 seconds, reimplemented below: the levels
+// shown over a sunrise, the largest lightness step, and the cost of a
+// frame.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Hal.h"
+#include "../LedRender.h"
+#include "../SunriseCurve.h"
+#include "Simulation.h"
+
+// the colors of FastLED HeatColors_p, and how often the palette path
+// stepped its index: 256 steps over the sunrise
+const uint32_t SIM_HEAT_COLORS[16] = {0x000000, 0x330000, 0x660000, 0x990000, 0xCC0000, 0xFF0000,
+                                      0xFF3300, 0xFF6600, 0xFF9900, 0xFFCC00, 0xFFFF00, 0xFFFF33,
+                                      0xFFFF66, 0xFFFF99, 0xFFFFCC, 0xFFFFFF};
+const uint32_t SIM_PALETTE_STEP_MS = (SUNRISE_DURATION_MS / 1000 / 256) * 1000;
+
+// the largest change of CIE lightness (0-100) from a frame to the next
+// the curve may make, well under what the eye notices on a dim led
+const double SIM_CURVE_MAX_LIGHTNESS_STEP = 0.5;
+
+const uint32_t SIM_CURVE_FRAME_MS = 1000 / LED_RENDER_FPS;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint64_t curveNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// paletteScale8 is the FastLED scale8
+uint8_t paletteScale8(uint8_t value, uint8_t scale)
+{
+  return ((uint16_t)value * (1 + (uint16_t)scale)) >> 8;
+}
+
+// paletteColor is FastLED ColorFromPalette with LINEARBLEND, for a
+// 16 entries palette; the last entry blends with the first, as there
+void paletteColor(const uint32_t palette[16], uint8_t index, uint8_t brightness, uint8_t rgb[3])
+{
+  uint8_t high = index >> 4;
+  uint8_t low = index & 0x0F;
+  uint32_t from = palette[high];
+  uint32_t to = palette[high == 15 ? 0 : high + 1];
+  uint8_t toScale = low << 4;
+  uint8_t fromScale = 255 - toScale;
+  for (int channel = 0; channel < 3; channel++)
+  {
+    uint8_t a = from >> (16 - 8 * channel);
+    uint8_t b = to >> (16 - 8 * channel);
+    uint8_t value = low > 0 ? paletteScale8(a, fromScale) + paletteScale8(b, toScale) : a;
+    if (brightness == 0)
+    {
+      value = 0;
+    }
+    else if (brightness != 255 && value > 0)
+    {
+      value = paletteScale8(value, brightness + 1) + 1;
+    }
+    rgb[channel] = value;
+  }
+}
+
+// paletteFrame is the frame of the palette path: the whole strip in the
+// color of the index reached after elapsedMs
+void paletteFrame(uint32_t elapsedMs, uint8_t frame[][3], uint8_t count)
+{
+  uint32_t index = elapsedMs / SIM_PALETTE_STEP_MS;
+  uint8_t heatIndex = index > 254 ? 254 : index;
+  uint8_t rgb[3];
+  paletteColor(SIM_HEAT_COLORS, heatIndex, heatIndex, rgb);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    memcpy(frame[i], rgb, 3);
+  }
+}
+
+// lightnessOf returns the CIE lightness (0-100) of a linear color, each
+// channel from 0 to 1
+double lightnessOf(double r, double g, double b)
+{
+  double luminance = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+  return luminance <= 216.0 / 24389.0 ? luminance * 24389.0 / 27.0 : 116.0 * cbrt(luminance) - 16.0;
+}
+
+void checkProgress()
+{
+  simExpect(sunriseCurveProgress(0, SUNRISE_DURATION_MS) == 0, "sunrise curve", "the sunrise starts at 0");
+  simExpect(sunriseCurveProgress(SUNRISE_DURATION_MS, SUNRISE_DURATION_MS) == 0xFFFF &&
+                sunriseCurveProgress(UINT32_MAX, SUNRISE_DURATION_MS) == 0xFFFF,
+            "sunrise curve", "the sunrise ends at 65535 and stays there");
+  simExpect(sunriseCurveProgress(0, 0) == 0xFFFF, "sunrise curve", "a sunrise without duration is over");
+  bool monotonic = true;
+  uint16_t last = 0;
+  for (uint32_t elapsedMs = 0; elapsedMs <= SUNRISE_DURATION_MS; elapsedMs++)
+  {
+    uint16_t progress = sunriseCurveProgress(elapsedMs, SUNRISE_DURATION_MS);
+    monotonic = monotonic && progress >= last;
+    last = progress;
+  }
+  simExpect(monotonic, "sunrise curve", "the progress never goes back");
+}
+
+void checkColors()
+{
+  SunriseColor first = sunriseCurveColor(0);
+  SunriseColor last = sunriseCurveColor(0xFFFF);
+  simExpect(first.r == 0 && first.g == 0 && first.b == 0, "sunrise curve", "the sunrise starts black");
+  simExpect(last.r == 0xFFFF && last.g == 0xFFFF && last.b == 0xFFFF, "sunrise curve", "the sunrise ends white");
+
+  bool neverDims = true;
+  SunriseColor previous = first;
+  for (uint32_t progress = 1; progress <= 0xFFFF; progress++)
+  {
+    SunriseColor color = sunriseCurveColor(progress);
+    neverDims = neverDims && color.r >= previous.r && color.g >= previous.g && color.b >= previous.b;
+    previous = color;
+  }
+  simExpect(neverDims, "sunrise curve", "no channel dims as the sunrise goes");
+}
+
+void checkFrames()
+{
+  SunriseColor frame[SUNRISE_MAX_LEDS];
+  const uint8_t counts[] = {1, 2, HAL_LED_COUNT, SUNRISE_MAX_LEDS};
+  for (uint8_t count : counts)
+  {
+    bool symmetric = true;
+    bool centerLeads = true;
+    for (uint32_t elapsedMs = 0; elapsedMs < SUNRISE_DURATION_MS; elapsedMs += 997)
+    {
+      sunriseCurveFrame(elapsedMs, SUNRISE_DURATION_MS, frame, count);
+      for (uint8_t i = 0; i < count; i++)
+      {
+        const SunriseColor &mirror = frame[count - 1 - i];
+        symmetric = symmetric && memcmp(&frame[i], &mirror, sizeof(SunriseColor)) == 0;
+        centerLeads = centerLeads && (2 * i + 2 > count || frame[i].r <= frame[i + 1].r);
+      }
+    }
+    simExpect(symmetric, "sunrise curve", "the frame is the same on both halves of the strip");
+    simExpect(centerLeads, "sunrise curve", "the middle of the strip leads its edges");
+
+    bool sunrising = sunriseCurveFrame(SUNRISE_DURATION_MS - 1, SUNRISE_DURATION_MS, frame, count);
+    bool over = !sunriseCurveFrame(SUNRISE_DURATION_MS, SUNRISE_DURATION_MS, frame, count);
+    bool white = true;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      white = white && frame[i].r == 0xFFFF && frame[i].g == 0xFFFF && frame[i].b == 0xFFFF;
+    }
+    simExpect(sunrising && over && white, "sunrise curve", "the frame is all white once the sunrise is over");
+  }
+  simExpect(!sunriseCurveFrame(SUNRISE_DURATION_MS, SUNRISE_DURATION_MS, frame, 0), "sunrise curve", "an empty frame");
+}
+
+// compareSteps follows a sunrise frame by frame along both paths,
+// counting the levels shown and the largest lightness step of a led
+void compareSteps()
+{
+  SunriseColor frame[HAL_LED_COUNT];
+  uint8_t palette[HAL_LED_COUNT][3];
+  uint32_t curveLevels = 0;
+  uint32_t paletteLevels = 0;
+  double curveStep = 0;
+  double paletteStep = 0;
+  double curveLast = 0;
+  double paletteLast = 0;
+  SunriseColor curvePrevious = {};
+  uint8_t palettePrevious[3] = {};
+  for (uint32_t elapsedMs = 0; elapsedMs <= SUNRISE_DURATION_MS; elapsedMs += SIM_CURVE_FRAME_MS)
+  {
+    sunriseCurveFrame(elapsedMs, SUNRISE_DURATION_MS, frame, HAL_LED_COUNT);
+    const SunriseColor &led = frame[0];
+    double lightness = lightnessOf(led.r / 65535.0, led.g / 65535.0, led.b / 65535.0);
+    if (elapsedMs > 0 && fabs(lightness - curveLast) > curveStep)
+    {
+      curveStep = fabs(lightness - curveLast);
+    }
+    curveLast = lightness;
+    curveLevels += elapsedMs == 0 || memcmp(&led, &curvePrevious, sizeof(SunriseColor)) != 0;
+    curvePrevious = led;
+
+    paletteFrame(elapsedMs, palette, HAL_LED_COUNT);
+    lightness = lightnessOf(palette[0][0] / 255.0, palette[0][1] / 255.0, palette[0][2] / 255.0);
+    if (elapsedMs > 0 && fabs(lightness - paletteLast) > paletteStep)
+    {
+      paletteStep = fabs(lightness - paletteLast);
+    }
+    paletteLast = lightness;
+    paletteLevels += elapsedMs == 0 || memcmp(palette[0], palettePrevious, 3) != 0;
+    memcpy(palettePrevious, palette[0], 3);
+  }
+  simExpect(curveStep <= SIM_CURVE_MAX_LIGHTNESS_STEP, "sunrise curve", "the lightness step from a frame to the next");
+
+  printf("%-16s %10s %16s\n", "path", "levels", "max step (L*)");
+  printf("%-16s %10u %16.3f\n", "sunrise curve", curveLevels, curveStep);
+  printf("%-16s %10u %16.3f\n", "palette", paletteLevels, paletteStep);
+}
+
+// benchmark times frames of the strip along both paths, through the
+// whole sunrise, for the cost of a frame at its start, middle and end too
+void benchmarkFrames(uint32_t frames)
+{
+  SunriseColor frame[HAL_LED_COUNT];
+  uint8_t palette[HAL_LED_COUNT][3];
+  volatile uint32_t sink = 0;
+
+  printf("%-16s %14s %14s %14s %14s\n", "path", "frame (ns)", "start (ns)", "middle (ns)", "end (ns)");
+  const uint32_t atMs[] = {0, SUNRISE_DURATION_MS / 2, SUNRISE_DURATION_MS - 1};
+  for (int path = 0; path < 2; path++)
+  {
+    double costs[4];
+    for (int phase = 0; phase < 4; phase++)
+    {
+      uint64_t startedAt = curveNanos();
+      for (uint32_t i = 0; i < frames; i++)
+      {
+        uint32_t elapsedMs = phase == 0 ? (uint32_t)((uint64_t)i * SUNRISE_DURATION_MS / frames) : atMs[phase - 1];
+        if (path == 0)
+        {
+          sunriseCurveFrame(elapsedMs, SUNRISE_DURATION_MS, frame, HAL_LED_COUNT);
+          sink = sink + frame[i % HAL_LED_COUNT].r;
+        }
+        else
+        {
+          paletteFrame(elapsedMs, palette, HAL_LED_COUNT);
+          sink = sink + palette[i % HAL_LED_COUNT][0];
+        }
+      }
+      costs[phase] = (double)(curveNanos() - startedAt) / frames;
+    }
+    printf("%-16s %14.1f %14.1f %14.1f %14.1f\n", path == 0 ? "sunrise curve" : "palette", costs[0], costs[1],
+           costs[2], costs[3]);
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simCurveCheck checks the sunrise curve, then benchmarks that many
+// frames of each path
+bool simCurveCheck(uint32_t frames)
+{
+  checkProgress();
+  checkColors();
+  checkFrames();
+  compareSteps();
+  benchmarkFrames(frames);
+  printf("sunrise curve checks: %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
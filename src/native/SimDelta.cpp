@@ -0,0 +1,928 @@
+// The delta firmware update on the host. deltaDiff makes a patch (see
+// DeltaPatch.h) from an old and a new image, as the build machine does
+// before an update, and simDeltaDiff and simDeltaApply make and apply
+// patches between image files. simDeltaCheck runs a corpus of synthetic
+// images, from one version to the next, through the firmware update (see
+// FirmwareUpdate.h) into the simulated OTA slots, checks broken, foreign
+// and interrupted patches are handled, and compares the size and apply
+// time of each patch with those of the full image.
+//
+// The patches are made in two passes: the operations, matching the new
+// image against the old one through hash chains and extending each
+// match over the bytes that differ, as long as most of them match; then
+// the LZSS compression of the operations, with the window and lengths
+// of the applier.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Crc.h"
+#include "../DeltaPatch.h"
+#include "../FirmwareUpdate.h"
+#include "../Sha256.h"
+#include "Simulation.h"
+
+// the matching of the new image against the old one: bytes hashed, chain
+// steps tried, shortest match, and how far the score of an extended match
+// may fall below its best before it ends
+const uint32_t SIM_DIFF_HASH_BITS = 20;
+const uint32_t SIM_DIFF_KEY_SIZE = 8;
+const uint32_t SIM_DIFF_CHAIN_STEPS = 64;
+const uint32_t SIM_DIFF_MIN_MATCH = 16;
+const int32_t SIM_DIFF_SLACK = 16;
+// bytes that did not change are copied rather than added to, from this many
+const uint32_t SIM_DIFF_MIN_COPY = 16;
+
+const uint32_t SIM_LZ_HASH_BITS = 15;
+const uint32_t SIM_LZ_CHAIN_STEPS = 32;
+const uint32_t SIM_LZ_WINDOW = 1 << DELTA_LZ_WINDOW_BITS;
+const uint32_t SIM_LZ_MAX_MATCH = DELTA_LZ_MIN_MATCH + (1 << DELTA_LZ_LENGTH_BITS) - 1;
+
+// the synthetic images: functions of code, with literal pointers to
+// other functions, then strings, as a linker lays them out
+const uint32_t SIM_IMAGE_FUNCTIONS = 3000;
+const uint32_t SIM_IMAGE_MAX_FUNCTIONS = 4096;
+const uint32_t SIM_IMAGE_BASE_ADDRESS = 0x400D0020;
+const uint32_t SIM_IMAGE_HEADER_SIZE = 24;
+const uint32_t SIM_IMAGE_STRINGS_SIZE = 64 * 1024;
+const uint8_t SIM_IMAGE_OPCODES[16] = {0x0c, 0x1d, 0x22, 0x31, 0x41, 0x65, 0x81, 0x91,
+                                       0xa2, 0xc0, 0xe0, 0xf0, 0x06, 0x16, 0x26, 0x36};
+
+// pieces the client writes the patch in, as a BLE write with response
+// carries them, and about how fast such writes go: one every two
+// connection events of 15 ms
+const uint32_t SIM_DELTA_WRITE_SIZE = 512 - 3 - FIRMWARE_UPDATE_DATA_HEADER_SIZE;
+const double SIM_DELTA_LINK_BYTES_PER_S = SIM_DELTA_WRITE_SIZE / 0.030;
+
+// SimBuffer is a byte buffer growing as it is appended to
+struct SimBuffer
+{
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+};
+
+// SimFunction is a function of a synthetic image: its code comes from
+// seed, and its literals point to other functions by id
+struct SimFunction
+{
+  uint32_t id;
+  uint32_t seed;
+  uint32_t length;
+};
+
+// SimDeltaCase is a new version of the base image
+struct SimDeltaCase
+{
+  const char *name;
+  SimFunction *functions;
+  uint32_t count;
+  bool editConstant;
+};
+
+// the image applied on the host by simDeltaApply
+const uint8_t *applyOld = nullptr;
+size_t applyOldLength = 0;
+SimBuffer applyNew = {};
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+void append(SimBuffer *buffer, const void *data, size_t length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length)
+    {
+      capacity *= 2;
+    }
+    buffer->data = (uint8_t *)realloc(buffer->data, capacity);
+    if (buffer->data == nullptr)
+    {
+      perror("realloc");
+      exit(1);
+    }
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+void appendByte(SimBuffer *buffer, uint8_t value)
+{
+  append(buffer, &value, 1);
+}
+
+void appendVarint(SimBuffer *buffer, uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    appendByte(buffer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  appendByte(buffer, value);
+}
+
+void appendUint32(SimBuffer *buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    appendByte(buffer, value >> (8 * i));
+  }
+}
+
+void sha256(const void *data, size_t length, uint8_t digest[SHA256_SIZE])
+{
+  Sha256 sha;
+  sha256Begin(&sha);
+  sha256Update(&sha, data, length);
+  sha256End(&sha, digest);
+}
+
+double elapsedMs(const struct timespec &start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// hashKey hashes the bytes a match starts with
+uint32_t hashKey(const uint8_t *data, uint32_t bits)
+{
+  uint64_t key;
+  memcpy(&key, data, sizeof(key));
+  return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+uint32_t matchLength(const uint8_t *a, const uint8_t *b, uint32_t limit)
+{
+  uint32_t length = 0;
+  while (length < limit && a[length] == b[length])
+  {
+    length++;
+  }
+  return length;
+}
+
+// appendBytes adds an operation followed by its bytes: the bytes no match
+// covered, inserted, or the differences of a match, added
+void appendBytes(SimBuffer *ops, DeltaOp op, const uint8_t *bytes, uint32_t length)
+{
+  if (length == 0)
+  {
+    return;
+  }
+  appendByte(ops, op);
+  appendVarint(ops, length);
+  append(ops, bytes, length);
+}
+
+// appendMatch adds the operations of a match from its differences: the
+// runs without any are copied, the rest added
+void appendMatch(SimBuffer *ops, const uint8_t *differences, uint32_t length)
+{
+  uint32_t added = 0;
+  uint32_t i = 0;
+  while (i < length)
+  {
+    if (differences[i] != 0)
+    {
+      i++;
+      continue;
+    }
+    uint32_t run = i;
+    while (run < length && differences[run] == 0)
+    {
+      run++;
+    }
+    if (run - i >= SIM_DIFF_MIN_COPY)
+    {
+      appendBytes(ops, DELTA_OP_ADD, differences + added, i - added);
+      appendByte(ops, DELTA_OP_COPY);
+      appendVarint(ops, run - i);
+      added = run;
+    }
+    i = run;
+  }
+  appendBytes(ops, DELTA_OP_ADD, differences + added, length - added);
+}
+
+// diffOps writes the operations turning the old image into the new one
+void diffOps(const uint8_t *oldImage, uint32_t oldLength, const uint8_t *newImage, uint32_t newLength, SimBuffer *ops)
+{
+  int32_t *head = (int32_t *)malloc(sizeof(int32_t) << SIM_DIFF_HASH_BITS);
+  int32_t *previous = (int32_t *)malloc(sizeof(int32_t) * (oldLength + 1));
+  uint8_t *add = (uint8_t *)malloc(newLength + 1);
+  if (head == nullptr || previous == nullptr || add == nullptr)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memset(head, 0xFF, sizeof(int32_t) << SIM_DIFF_HASH_BITS);
+  for (uint32_t i = 0; i + SIM_DIFF_KEY_SIZE <= oldLength; i++)
+  {
+    uint32_t hash = hashKey(oldImage + i, SIM_DIFF_HASH_BITS);
+    previous[i] = head[hash];
+    head[hash] = i;
+  }
+
+  uint32_t position = 0;
+  uint32_t oldPosition = 0;
+  uint32_t insertStart = 0;
+  while (position < newLength)
+  {
+    // the old position the last match leads to is tried first, so an
+    // edit in place costs no seek
+    uint32_t bestLength = 0;
+    uint32_t bestOld = 0;
+    uint32_t aligned = oldPosition + (position - insertStart);
+    if (aligned < oldLength)
+    {
+      bestLength = matchLength(oldImage + aligned, newImage + position,
+                               oldLength - aligned < newLength - position ? oldLength - aligned : newLength - position);
+      bestOld = aligned;
+    }
+    if (bestLength < SIM_DIFF_MIN_MATCH && position + SIM_DIFF_KEY_SIZE <= newLength)
+    {
+      int32_t candidate = head[hashKey(newImage + position, SIM_DIFF_HASH_BITS)];
+      for (uint32_t step = 0; candidate >= 0 && step < SIM_DIFF_CHAIN_STEPS; step++, candidate = previous[candidate])
+      {
+        uint32_t limit = oldLength - candidate < newLength - position ? oldLength - candidate : newLength - position;
+        uint32_t length = matchLength(oldImage + candidate, newImage + position, limit);
+        if (length > bestLength)
+        {
+          bestLength = length;
+          bestOld = candidate;
+        }
+      }
+    }
+    if (bestLength < SIM_DIFF_MIN_MATCH)
+    {
+      position++;
+      continue;
+    }
+
+    // the match goes on over the bytes that differ, as long as most match
+    uint32_t end = position + bestLength;
+    uint32_t limit = newLength - position < oldLength - bestOld ? newLength : position + oldLength - bestOld;
+    int32_t score = 0;
+    int32_t bestScore = 0;
+    for (uint32_t i = end; i < limit && score > bestScore - SIM_DIFF_SLACK; i++)
+    {
+      score += newImage[i] == oldImage[bestOld + i - position] ? 1 : -1;
+      if (score > bestScore)
+      {
+        bestScore = score;
+        end = i + 1;
+      }
+    }
+
+    appendBytes(ops, DELTA_OP_INSERT, newImage + insertStart, position - insertStart);
+    if (bestOld != oldPosition)
+    {
+      int32_t distance = (int32_t)(bestOld - oldPosition);
+      appendByte(ops, DELTA_OP_SEEK);
+      appendVarint(ops, (uint32_t)(distance << 1) ^ (uint32_t)(distance >> 31));
+    }
+    for (uint32_t i = position; i < end; i++)
+    {
+      add[i - position] = newImage[i] - oldImage[bestOld + i - position];
+    }
+    appendMatch(ops, add, end - position);
+    oldPosition = bestOld + end - position;
+    position = end;
+    insertStart = end;
+  }
+  appendBytes(ops, DELTA_OP_INSERT, newImage + insertStart, newLength - insertStart);
+  free(head);
+  free(previous);
+  free(add);
+}
+
+// SimBitWriter packs the compressed stream, most significant bit first
+struct SimBitWriter
+{
+  SimBuffer *out;
+  uint32_t bits;
+  uint8_t count;
+};
+
+void putBits(SimBitWriter *writer, uint32_t value, uint8_t count)
+{
+  for (int i = count - 1; i >= 0; i--)
+  {
+    writer->bits = writer->bits << 1 | ((value >> i) & 1);
+    if (++writer->count == 8)
+    {
+      appendByte(writer->out, writer->bits);
+      writer->bits = 0;
+      writer->count = 0;
+    }
+  }
+}
+
+// compress writes the operations as the LZSS stream the applier decodes
+void compress(const uint8_t *data, uint32_t length, SimBuffer *out)
+{
+  int32_t *head = (int32_t *)malloc(sizeof(int32_t) << SIM_LZ_HASH_BITS);
+  int32_t *previous = (int32_t *)malloc(sizeof(int32_t) * (length + 1));
+  if (head == nullptr || previous == nullptr)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memset(head, 0xFF, sizeof(int32_t) << SIM_LZ_HASH_BITS);
+  SimBitWriter writer = {out, 0, 0};
+
+  uint32_t position = 0;
+  uint32_t hashed = 0;
+  while (position < length)
+  {
+    uint32_t bestLength = 0;
+    uint32_t bestDistance = 0;
+    if (position + DELTA_LZ_MIN_MATCH <= length)
+    {
+      uint32_t hash = (data[position] << 16 | data[position + 1] << 8 | data[position + 2]) * 2654435761U >>
+                      (32 - SIM_LZ_HASH_BITS);
+      uint32_t limit = length - position < SIM_LZ_MAX_MATCH ? length - position : SIM_LZ_MAX_MATCH;
+      int32_t candidate = head[hash];
+      for (uint32_t step = 0; candidate >= 0 && position - candidate <= SIM_LZ_WINDOW && step < SIM_LZ_CHAIN_STEPS;
+           step++, candidate = previous[candidate])
+      {
+        uint32_t matched = matchLength(data + candidate, data + position, limit);
+        if (matched > bestLength)
+        {
+          bestLength = matched;
+          bestDistance = position - candidate;
+        }
+      }
+    }
+
+    uint32_t advance = 1;
+    if (bestLength >= DELTA_LZ_MIN_MATCH)
+    {
+      putBits(&writer, 0, 1);
+      putBits(&writer, bestDistance - 1, DELTA_LZ_WINDOW_BITS);
+      putBits(&writer, bestLength - DELTA_LZ_MIN_MATCH, DELTA_LZ_LENGTH_BITS);
+      advance = bestLength;
+    }
+    else
+    {
+      putBits(&writer, 1, 1);
+      putBits(&writer, data[position], 8);
+    }
+    position += advance;
+    for (; hashed < position && hashed + DELTA_LZ_MIN_MATCH <= length; hashed++)
+    {
+      uint32_t hash = (data[hashed] << 16 | data[hashed + 1] << 8 | data[hashed + 2]) * 2654435761U >>
+                      (32 - SIM_LZ_HASH_BITS);
+      previous[hashed] = head[hash];
+      head[hash] = hashed;
+    }
+  }
+  if (writer.count > 0)
+  {
+    putBits(&writer, 0, 8 - writer.count);
+  }
+  free(head);
+  free(previous);
+}
+
+// deltaDiff makes the patch turning the old image into the new one
+void deltaDiff(const uint8_t *oldImage, uint32_t oldLength, const uint8_t *newImage, uint32_t newLength,
+               SimBuffer *patch)
+{
+  uint8_t hash[SHA256_SIZE];
+  appendUint32(patch, DELTA_PATCH_MAGIC);
+  appendByte(patch, DELTA_PATCH_VERSION);
+  appendByte(patch, DELTA_LZ_WINDOW_BITS);
+  appendByte(patch, DELTA_LZ_LENGTH_BITS);
+  appendByte(patch, 0);
+  appendUint32(patch, oldLength);
+  appendUint32(patch, newLength);
+  sha256(oldImage, oldLength, hash);
+  append(patch, hash, SHA256_SIZE);
+  sha256(newImage, newLength, hash);
+  append(patch, hash, SHA256_SIZE);
+
+  SimBuffer ops = {};
+  diffOps(oldImage, oldLength, newImage, newLength, &ops);
+  compress(ops.data, ops.length, patch);
+  free(ops.data);
+}
+
+uint32_t nextSeed(uint32_t *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+// baseFunctions sets the functions of the base image
+void baseFunctions(SimFunction *functions)
+{
+  for (uint32_t i = 0; i < SIM_IMAGE_FUNCTIONS; i++)
+  {
+    uint32_t seed = i * 2654435761U + 1;
+    functions[i] = {i, seed, 64 + nextSeed(&seed) % 672};
+  }
+}
+
+// buildImage lays the functions out and writes the image, returning its length
+uint32_t buildImage(const SimFunction *functions, uint32_t count, uint8_t *image)
+{
+  static uint32_t addresses[SIM_IMAGE_MAX_FUNCTIONS];
+  memset(addresses, 0, sizeof(addresses));
+  uint32_t length = SIM_IMAGE_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    addresses[functions[i].id] = SIM_IMAGE_BASE_ADDRESS + length;
+    length += (functions[i].length + 3) & ~3;
+  }
+
+  memset(image, 0, SIM_IMAGE_HEADER_SIZE);
+  image[0] = SIM_FIRMWARE_IMAGE_MAGIC;
+  image[1] = 4;
+  uint32_t position = SIM_IMAGE_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t seed = functions[i].seed;
+    uint32_t end = position + ((functions[i].length + 3) & ~3);
+    while (position < end)
+    {
+      uint32_t random = nextSeed(&seed);
+      if (position % 4 == 0 && position + 4 <= end && random % 12 == 0)
+      {
+        uint32_t target = addresses[(random >> 4) % SIM_IMAGE_FUNCTIONS];
+        for (int j = 0; j < 4; j++)
+        {
+          image[position++] = target >> (8 * j);
+        }
+      }
+      else
+      {
+        image[position++] = random % 8 == 0 ? random >> 8 : SIM_IMAGE_OPCODES[(random >> 4) % 16];
+      }
+    }
+  }
+
+  uint32_t seed = 7;
+  static const char *WORDS[] = {"alarm ", "sunrise ", "error ", "wifi ", "ble ", "%d ", "song ", "the ", "\n"};
+  while (position < length + SIM_IMAGE_STRINGS_SIZE)
+  {
+    const char *word = WORDS[nextSeed(&seed) % 9];
+    size_t wordLength = strlen(word);
+    memcpy(image + position, word, wordLength);
+    position += wordLength;
+  }
+  return position;
+}
+
+// installRunning makes an image the firmware running
+void installRunning(const uint8_t *image, uint32_t length)
+{
+  simWorld->runningSlot = 0;
+  simWorld->bootSlot = 0;
+  memset(simWorld->firmware[0], 0xFF, SIM_FIRMWARE_SLOT_SIZE);
+  memcpy(simWorld->firmware[0], image, length);
+}
+
+// sendPatch sends the patch from offset to end to the firmware update in
+// writes of odd sizes, returning the last notification. Once the header is
+// in, the update is prepared, as the loop task does, and the writes go on
+// from what was received.
+FirmwareUpdateAck sendPatch(FirmwareUpdate *update, const SimBuffer *patch, uint32_t offset, uint32_t end)
+{
+  uint8_t write[FIRMWARE_UPDATE_DATA_HEADER_SIZE + SIM_DELTA_WRITE_SIZE];
+  FirmwareUpdateAck ack = {FIRMWARE_UPDATE_IN_PROGRESS, offset};
+  uint32_t seed = offset + 1;
+  while (offset < end && ack.status == FIRMWARE_UPDATE_IN_PROGRESS)
+  {
+    uint32_t length = 1 + nextSeed(&seed) % SIM_DELTA_WRITE_SIZE;
+    length = end - offset < length ? end - offset : length;
+    for (int i = 0; i < 4; i++)
+    {
+      write[i] = offset >> (8 * i);
+    }
+    memcpy(write + FIRMWARE_UPDATE_DATA_HEADER_SIZE, patch->data + offset, length);
+    firmwareUpdateWrite(update, write, FIRMWARE_UPDATE_DATA_HEADER_SIZE + length, &ack);
+    offset += length;
+    if (ack.status == FIRMWARE_UPDATE_PREPARING)
+    {
+      simExpect(!firmwareUpdateWrite(update, write, FIRMWARE_UPDATE_DATA_HEADER_SIZE + length, &ack), "delta",
+                "the writes are dropped while the update is prepared");
+      firmwareUpdatePrepare(update, &ack);
+      offset = ack.received;
+    }
+  }
+  return ack;
+}
+
+FirmwareUpdateAck openUpdate(FirmwareUpdate *update, const SimBuffer *patch)
+{
+  uint8_t command[FIRMWARE_UPDATE_OPEN_SIZE];
+  uint32_t crc = crc32(patch->data, patch->length);
+  command[0] = FIRMWARE_UPDATE_OPEN;
+  for (int i = 0; i < 4; i++)
+  {
+    command[1 + i] = patch->length >> (8 * i);
+    command[5 + i] = crc >> (8 * i);
+  }
+  FirmwareUpdateAck ack;
+  firmwareUpdateCommand(update, command, sizeof(command), &ack);
+  return ack;
+}
+
+// applyUpdate runs a whole update, returning its last notification
+FirmwareUpdateAck applyUpdate(FirmwareUpdate *update, const SimBuffer *patch)
+{
+  FirmwareUpdateAck ack = openUpdate(update, patch);
+  if (ack.status != FIRMWARE_UPDATE_IN_PROGRESS)
+  {
+    return ack;
+  }
+  return sendPatch(update, patch, 0, patch->length);
+}
+
+// writeFull writes a full image to the slot not running, as an update
+// without a patch would
+bool writeFull(const uint8_t *image, uint32_t length)
+{
+  bool written = halFirmwareBegin();
+  for (uint32_t offset = 0; written && offset < length; offset += SIM_DELTA_WRITE_SIZE)
+  {
+    written = halFirmwareWrite(image + offset, length - offset < SIM_DELTA_WRITE_SIZE ? length - offset
+                                                                                       : SIM_DELTA_WRITE_SIZE);
+  }
+  return halFirmwareEnd(written) && written;
+}
+
+// checkSha256 checks the hash against the FIPS 180-2 examples, and the
+// HMAC built on it
+void checkSha256()
+{
+  static const uint8_t ABC[SHA256_SIZE] = {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+                                           0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+                                           0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+  static const uint8_t TWO_BLOCKS[SHA256_SIZE] = {0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26,
+                                                  0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff,
+                                                  0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1};
+  const char *twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  uint8_t digest[SHA256_SIZE];
+  sha256("abc", 3, digest);
+  simExpect(memcmp(digest, ABC, SHA256_SIZE) == 0, "delta", "sha-256 of abc");
+
+  // fed a byte at a time, across the block boundaries
+  Sha256 sha;
+  sha256Begin(&sha);
+  for (size_t i = 0; i < strlen(twoBlocks); i++)
+  {
+    sha256Update(&sha, twoBlocks + i, 1);
+  }
+  sha256End(&sha, digest);
+  simExpect(memcmp(digest, TWO_BLOCKS, SHA256_SIZE) == 0, "delta", "sha-256 of two blocks, a byte at a time");
+
+  // the HMAC against RFC 4231, test cases 2 and 6
+  static const uint8_t JEFE[SHA256_SIZE] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24,
+                                            0x26, 0x08, 0x95, 0x75, 0xc7, 0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27,
+                                            0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43};
+  static const uint8_t LONG_KEY[SHA256_SIZE] = {0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26,
+                                                0xaa, 0xcb, 0xf5, 0xb7, 0x7f, 0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28,
+                                                0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54};
+  const char *question = "what do ya want for nothing?";
+  hmacSha256("Jefe", 4, question, strlen(question), digest);
+  simExpect(memcmp(digest, JEFE, SHA256_SIZE) == 0, "delta", "hmac-sha-256 of a short key");
+  uint8_t key[131];
+  memset(key, 0xaa, sizeof(key));
+  const char *longKey = "Test Using Larger Than Block-Size Key - Hash Key First";
+  hmacSha256(key, sizeof(key), longKey, strlen(longKey), digest);
+  simExpect(memcmp(digest, LONG_KEY, SHA256_SIZE) == 0, "delta", "hmac-sha-256 of a key longer than a block");
+}
+
+// checkFailures checks broken, foreign and interrupted patches: nothing
+// is activated unless the new image is the right one
+void checkFailures(FirmwareUpdate *update, const uint8_t *base, uint32_t baseLength, const uint8_t *other,
+                   uint32_t otherLength, const SimBuffer *patch)
+{
+  // corrupted on the way: the crc of the patch does not match
+  SimBuffer broken = {};
+  append(&broken, patch->data, patch->length);
+  broken.data[DELTA_PATCH_HEADER_SIZE + (broken.length - DELTA_PATCH_HEADER_SIZE) / 2] ^= 0x10;
+  installRunning(base, baseLength);
+  FirmwareUpdateAck ack = openUpdate(update, patch);
+  ack = sendPatch(update, &broken, 0, broken.length);
+  simExpect(ack.status != FIRMWARE_UPDATE_ACTIVATED && ack.status != FIRMWARE_UPDATE_IN_PROGRESS, "delta",
+            "a patch corrupted on the way fails");
+  simExpect(simWorld->bootSlot == 0, "delta", "a patch corrupted on the way is not activated");
+
+  // made wrong: the new image does not match its hash
+  memcpy(broken.data, patch->data, patch->length);
+  broken.data[DELTA_PATCH_HEADER_SIZE - 1] ^= 1;
+  ack = applyUpdate(update, &broken);
+  simExpect(ack.status == FIRMWARE_UPDATE_BAD_HASH && simWorld->bootSlot == 0, "delta",
+            "a wrong new image is not activated");
+
+  broken.data[DELTA_PATCH_HEADER_SIZE - 1] ^= 1;
+  broken.data[0] ^= 1;
+  ack = applyUpdate(update, &broken);
+  simExpect(ack.status == FIRMWARE_UPDATE_BAD_PATCH, "delta", "a patch with a bad header fails");
+
+  free(broken.data);
+
+  // a length past 32 bits, which would wrap to an insert of nothing in
+  // front of a patch that is otherwise right
+  const uint8_t overlong[] = {DELTA_OP_INSERT, 0x80, 0x80, 0x80, 0x80, 0x10};
+  SimBuffer ops = {};
+  append(&ops, overlong, sizeof(overlong));
+  diffOps(base, baseLength, base, baseLength, &ops);
+  broken = {};
+  deltaDiff(base, baseLength, base, baseLength, &broken);
+  broken.length = DELTA_PATCH_HEADER_SIZE;
+  compress(ops.data, ops.length, &broken);
+  ack = applyUpdate(update, &broken);
+  simExpect(ack.status == FIRMWARE_UPDATE_BAD_PATCH && simWorld->bootSlot == 0, "delta",
+            "a patch with a length past 32 bits fails");
+  free(ops.data);
+  free(broken.data);
+
+  installRunning(other, otherLength);
+  ack = applyUpdate(update, patch);
+  simExpect(ack.status == FIRMWARE_UPDATE_BAD_BASE && ack.received <= SIM_DELTA_WRITE_SIZE, "delta",
+            "a patch for another image fails as soon as its header is in");
+  simExpect(simWorld->bootSlot == 0, "delta", "a patch for another image is not activated");
+
+  // the link drops halfway; the writes already received come again, then
+  // one past what was received
+  installRunning(base, baseLength);
+  uint32_t half = patch->length / 2;
+  ack = openUpdate(update, patch);
+  sendPatch(update, patch, 0, half);
+  ack = openUpdate(update, patch);
+  simExpect(ack.status == FIRMWARE_UPDATE_IN_PROGRESS && ack.received > 0 && ack.received <= half, "delta",
+            "the same patch resumes");
+  uint32_t received = ack.received;
+  ack = sendPatch(update, patch, received / 2, received);
+  simExpect(ack.status == FIRMWARE_UPDATE_IN_PROGRESS && update->received == received, "delta",
+            "writes received are ignored");
+  uint8_t ahead[FIRMWARE_UPDATE_DATA_HEADER_SIZE + 1] = {(uint8_t)(received + 1), (uint8_t)((received + 1) >> 8),
+                                                         (uint8_t)((received + 1) >> 16), 0, 0};
+  simExpect(firmwareUpdateWrite(update, ahead, sizeof(ahead), &ack) && ack.received == received, "delta",
+            "a write past what was received is dropped");
+  ack = sendPatch(update, patch, received, patch->length);
+  simExpect(ack.status == FIRMWARE_UPDATE_ACTIVATED && simWorld->bootSlot == 1, "delta",
+            "the resumed update is activated");
+
+  // cancelled halfway, nothing more is written
+  installRunning(base, baseLength);
+  openUpdate(update, patch);
+  sendPatch(update, patch, 0, half);
+  uint8_t cancel = FIRMWARE_UPDATE_CANCEL;
+  firmwareUpdateCommand(update, &cancel, 1, &ack);
+  simExpect(ack.status == FIRMWARE_UPDATE_IDLE, "delta", "the update is cancelled");
+  firmwareUpdateWrite(update, ahead, sizeof(ahead), &ack);
+  simExpect(ack.status == FIRMWARE_UPDATE_IDLE && simWorld->bootSlot == 0, "delta",
+            "nothing is written once cancelled");
+}
+
+bool readFile(const char *path, SimBuffer *buffer)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr)
+  {
+    perror(path);
+    return false;
+  }
+  uint8_t block[4096];
+  size_t length;
+  while ((length = fread(block, 1, sizeof(block), file)) > 0)
+  {
+    append(buffer, block, length);
+  }
+  fclose(file);
+  return true;
+}
+
+bool writeFile(const char *path, const SimBuffer *buffer)
+{
+  FILE *file = fopen(path, "wb");
+  if (file == nullptr || fwrite(buffer->data, 1, buffer->length, file) != buffer->length)
+  {
+    perror(path);
+    return false;
+  }
+  return fclose(file) == 0;
+}
+
+size_t readApplyOld(uint32_t offset, void *buffer, size_t length)
+{
+  if (offset > applyOldLength || length > applyOldLength - offset)
+  {
+    return 0;
+  }
+  memcpy(buffer, applyOld + offset, length);
+  return length;
+}
+
+bool writeApplyNew(const void *data, size_t length)
+{
+  append(&applyNew, data, length);
+  return true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simDeltaCheck updates the base image of the corpus to each of its new
+// versions, reporting patch size and apply time against the full image,
+// the best of repeats runs. Returns false if any check failed.
+bool simDeltaCheck(uint32_t repeats)
+{
+  static SimFunction base[SIM_IMAGE_MAX_FUNCTIONS];
+  static SimFunction added[SIM_IMAGE_MAX_FUNCTIONS];
+  static SimFunction removed[SIM_IMAGE_MAX_FUNCTIONS];
+  static SimFunction edited[SIM_IMAGE_MAX_FUNCTIONS];
+  static SimFunction upgraded[SIM_IMAGE_MAX_FUNCTIONS];
+  static SimFunction unrelated[SIM_IMAGE_MAX_FUNCTIONS];
+  baseFunctions(base);
+  uint32_t count = SIM_IMAGE_FUNCTIONS;
+
+  // a function of 2 KB added in the middle, moving everything after it
+  memcpy(added, base, sizeof(base));
+  memmove(added + 1001, added + 1000, (count - 1000) * sizeof(SimFunction));
+  added[1000] = {SIM_IMAGE_FUNCTIONS, 0xC0FFEE, 2048};
+  // a function removed
+  memcpy(removed, base, sizeof(base));
+  memmove(removed + 2000, removed + 2001, (count - 2001) * sizeof(SimFunction));
+  // ten functions rewritten
+  memcpy(edited, base, sizeof(base));
+  for (uint32_t i = 0; i < 10; i++)
+  {
+    edited[150 + i * 280].seed ^= 0x5A5A5A5A;
+    edited[150 + i * 280].length += 40;
+  }
+  // a library of 200 functions upgraded
+  memcpy(upgraded, base, sizeof(base));
+  for (uint32_t i = 1500; i < 1700; i++)
+  {
+    upgraded[i].seed ^= 0xA5A5A5A5;
+    upgraded[i].length = 64 + upgraded[i].seed % 700;
+  }
+  // the same layout, all code different
+  memcpy(unrelated, base, sizeof(base));
+  for (uint32_t i = 0; i < count; i++)
+  {
+    unrelated[i].seed += 0x10001;
+  }
+
+  const SimDeltaCase cases[] = {
+      {"unchanged", base, count, false},       {"constant edited", base, count, true},
+      {"function added", added, count + 1, false}, {"function removed", removed, count - 1, false},
+      {"10 functions edited", edited, count, false}, {"library upgraded", upgraded, count, false},
+      {"unrelated image", unrelated, count, false},
+  };
+
+  uint8_t *baseImage = (uint8_t *)malloc(SIM_FIRMWARE_SLOT_SIZE);
+  uint8_t *newImage = (uint8_t *)malloc(SIM_FIRMWARE_SLOT_SIZE);
+  uint8_t *otherImage = (uint8_t *)malloc(SIM_FIRMWARE_SLOT_SIZE);
+  FirmwareUpdate *update = (FirmwareUpdate *)calloc(1, sizeof(FirmwareUpdate));
+  if (baseImage == nullptr || newImage == nullptr || otherImage == nullptr || update == nullptr)
+  {
+    perror("malloc");
+    return false;
+  }
+  uint32_t baseLength = buildImage(base, count, baseImage);
+
+  checkSha256();
+  printf("firmware update state: %zu bytes\n", sizeof(FirmwareUpdate));
+  printf("base image:            %u bytes\n", baseLength);
+  printf("%-20s %9s %9s %6s %10s %10s %10s %10s\n", "new image", "bytes", "patch", "ratio", "diff (ms)", "apply (ms)",
+         "full (ms)", "upload (s)");
+  SimBuffer patch = {};
+  for (const SimDeltaCase &deltaCase : cases)
+  {
+    uint32_t newLength = buildImage(deltaCase.functions, deltaCase.count, newImage);
+    if (deltaCase.editConstant)
+    {
+      newImage[newLength / 2] ^= 0x5A;
+      newImage[newLength / 2 + 1] ^= 0x01;
+    }
+
+    patch.length = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deltaDiff(baseImage, baseLength, newImage, newLength, &patch);
+    double diffMs = elapsedMs(start);
+
+    double applyMs = 1e9;
+    double fullMs = 1e9;
+    for (uint32_t run = 0; run < repeats; run++)
+    {
+      installRunning(baseImage, baseLength);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      FirmwareUpdateAck ack = applyUpdate(update, &patch);
+      double ms = elapsedMs(start);
+      applyMs = ms < applyMs ? ms : applyMs;
+      simExpect(ack.status == FIRMWARE_UPDATE_ACTIVATED && simWorld->bootSlot == 1, "delta", deltaCase.name);
+      simExpect(memcmp(simWorld->firmware[1], newImage, newLength) == 0, "delta",
+                "the new image is the one the patch makes");
+
+      installRunning(baseImage, baseLength);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      simExpect(writeFull(newImage, newLength), "delta", "the full image is written");
+      ms = elapsedMs(start);
+      fullMs = ms < fullMs ? ms : fullMs;
+    }
+    printf("%-20s %9u %9zu %5.1f%% %10.1f %10.2f %10.2f %4.1f/%5.1f\n", deltaCase.name, newLength, patch.length,
+           100.0 * patch.length / newLength, diffMs, applyMs, fullMs, patch.length / SIM_DELTA_LINK_BYTES_PER_S,
+           newLength / SIM_DELTA_LINK_BYTES_PER_S);
+  }
+  printf("upload: patch/full image, over writes with response of %u bytes\n", SIM_DELTA_WRITE_SIZE);
+
+  uint32_t otherLength = buildImage(edited, count, otherImage);
+  uint32_t newLength = buildImage(added, count + 1, newImage);
+  patch.length = 0;
+  deltaDiff(baseImage, baseLength, newImage, newLength, &patch);
+  checkFailures(update, baseImage, baseLength, otherImage, otherLength, &patch);
+
+  free(patch.data);
+  free(baseImage);
+  free(newImage);
+  free(otherImage);
+  free(update);
+  printf("delta checks:          %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
+
+// simDeltaDiff writes the patch from the old image file to the new one
+bool simDeltaDiff(const char *oldPath, const char *newPath, const char *patchPath)
+{
+  SimBuffer oldImage = {};
+  SimBuffer newImage = {};
+  SimBuffer patch = {};
+  if (!readFile(oldPath, &oldImage) || !readFile(newPath, &newImage))
+  {
+    return false;
+  }
+  if (newImage.length == 0)
+  {
+    fprintf(stderr, "%s is empty\n", newPath);
+    return false;
+  }
+  deltaDiff(oldImage.data, oldImage.length, newImage.data, newImage.length, &patch);
+  printf("patch of %zu bytes for an image of %zu bytes (%.1f%%)\n", patch.length, newImage.length,
+         100.0 * patch.length / newImage.length);
+  bool written = writeFile(patchPath, &patch);
+  free(oldImage.data);
+  free(newImage.data);
+  free(patch.data);
+  return written;
+}
+
+// simDeltaApply applies a patch to the old image file, as the device
+// does, and writes the new image if it matches its hash
+bool simDeltaApply(const char *oldPath, const char *patchPath, const char *newPath)
+{
+  SimBuffer oldImage = {};
+  SimBuffer patch = {};
+  if (!readFile(oldPath, &oldImage) || !readFile(patchPath, &patch))
+  {
+    return false;
+  }
+  applyOld = oldImage.data;
+  applyOldLength = oldImage.length;
+  applyNew.length = 0;
+  DeltaPatch *delta = (DeltaPatch *)malloc(sizeof(DeltaPatch));
+  deltaPatchBegin(delta, readApplyOld, writeApplyNew);
+  DeltaStatus status = deltaPatchFeed(delta, patch.data, patch.length);
+  if (status == DELTA_STATUS_CHECK_BASE)
+  {
+    status = deltaPatchCheckBase(delta);
+  }
+  if (status == DELTA_STATUS_OK && patch.length > DELTA_PATCH_HEADER_SIZE)
+  {
+    status = deltaPatchFeed(delta, patch.data + DELTA_PATCH_HEADER_SIZE, patch.length - DELTA_PATCH_HEADER_SIZE);
+  }
+  if (status == DELTA_STATUS_OK)
+  {
+    status = deltaPatchFinish(delta);
+  }
+  bool applied = status == DELTA_STATUS_DONE;
+  if (applied)
+  {
+    applied = writeFile(newPath, &applyNew);
+  }
+  else
+  {
+    fprintf(stderr, "the patch failed (status %d)\n", status);
+  }
+  free(delta);
+  free(oldImage.data);
+  free(patch.data);
+  free(applyNew.data);
+  applyNew = {};
+  return applied;
+}
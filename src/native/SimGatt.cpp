@@ -0,0 +1,332 @@
+// The configuration over BLE on the host. simGattCheck plays a phone
+// configuring the wifi and the alarms, as one bundle (see ConfigBundle.h)
+// sent in chunks the size of the MTU, and as the writes of the
+// characteristics of each setting the bundle replaced, each followed by a
+// read of the last operation status. It counts the GATT operations and
+// the bytes of both, for MTUs from the default to the largest, and the
+// time they take on a link where a request and its response take a
+// connection interval, and SIM_GATT_COMMANDS_PER_EVENT writes without
+// response fit in one. A setting longer than the MTU allows goes as a
+// long write: prepare writes and an execute, each a request. The chunks
+// are fed to the reader of the firmware, which must rebuild the bundle,
+// reject it whole when a chunk is lost, repeated or corrupted, or a field
+// is wrong, and take it again from its first chunk.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../AlarmProtocol.h"
+#include "../ConfigBundle.h"
+#include "../Crc.h"
+#include "Simulation.h"
+
+// the MTUs checked: the default one, the largest of common phones, and
+// the one the firmware asks for
+const uint16_t SIM_GATT_MTUS[] = {23, 185, 247, 517};
+
+// the link: how long a connection interval lasts, and how many writes
+// without response a connection event carries
+const uint32_t SIM_GATT_INTERVAL_MS = 30;
+const uint32_t SIM_GATT_COMMANDS_PER_EVENT = 4;
+
+// the ATT headers: of a write, of a prepare write, and the bytes of a
+// read of the last operation status and its response
+const uint32_t SIM_GATT_WRITE_HEADER = 3;
+const uint32_t SIM_GATT_PREPARE_HEADER = 5;
+const uint32_t SIM_GATT_STATUS_READ_BYTES = 6;
+
+// SimGattConfig is what the phone configures
+struct SimGattConfig
+{
+  const char *wifiSsid;
+  const char *wifiPassword;
+  const char *deviceName;
+  uint8_t alarms;
+};
+
+// SimGattCost is what a way of configuring takes
+struct SimGattCost
+{
+  uint32_t requests;
+  uint32_t commands;
+  uint32_t bytes;
+};
+
+const SimGattConfig SIM_GATT_CONFIG = {"home-network", "correct horse battery", nullptr, MAX_ALARMS};
+
+ConfigBundleReader gattReader;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// gattAlarm returns the alarm of a slot the phone configures
+Alarm gattAlarm(uint8_t slot)
+{
+  const char *songs[] = {"sunrise", "birds-in-the-morning", "", "rain"};
+  Alarm alarm = {};
+  alarm.number = slot + 1;
+  alarm.when = 6 * 3600 + slot * 1800;
+  alarm.activeMatrix = slot % 2 == 0 ? 0x3E : 0x41;
+  strcpy(alarm.song, songs[slot % 4]);
+  return alarm;
+}
+
+size_t putField(uint8_t *at, uint8_t type, const void *value, size_t length)
+{
+  at[0] = type;
+  at[1] = length;
+  memcpy(at + 2, value, length);
+  return 2 + length;
+}
+
+// finishBundle writes the header and the checksum of a bundle around its
+// fields, returning its length
+size_t finishBundle(uint8_t *bundle, size_t fieldsLength)
+{
+  size_t length = 3 + fieldsLength;
+  bundle[0] = CONFIG_BUNDLE_VERSION;
+  bundle[1] = fieldsLength & 0xFF;
+  bundle[2] = fieldsLength >> 8;
+  uint32_t crc = crc32(bundle, length);
+  for (int i = 0; i < 4; i++)
+  {
+    bundle[length++] = crc >> (8 * i);
+  }
+  return length;
+}
+
+// encodeBundle writes a configuration as a bundle, as the phone does
+size_t encodeBundle(const SimGattConfig &config, uint8_t *bundle)
+{
+  size_t length = 3;
+  if (config.wifiSsid != nullptr)
+  {
+    length += putField(bundle + length, CONFIG_FIELD_WIFI_SSID, config.wifiSsid, strlen(config.wifiSsid));
+  }
+  if (config.wifiPassword != nullptr)
+  {
+    length += putField(bundle + length, CONFIG_FIELD_WIFI_PASSWORD, config.wifiPassword, strlen(config.wifiPassword));
+  }
+  if (config.deviceName != nullptr)
+  {
+    length += putField(bundle + length, CONFIG_FIELD_DEVICE_NAME, config.deviceName, strlen(config.deviceName));
+  }
+  for (uint8_t slot = 0; slot < config.alarms; slot++)
+  {
+    Alarm alarm = gattAlarm(slot);
+    uint8_t record[ALARM_RECORD_MAX_SIZE];
+    size_t recordLength = alarmProtocolEncode(&alarm, record, sizeof(record));
+    length += putField(bundle + length, CONFIG_FIELD_ALARM, record, recordLength);
+  }
+  return finishBundle(bundle, length - 3);
+}
+
+// sendChunks sends a bundle in chunks the size of the MTU to the reader,
+// as writes without response, skipping or repeating a chunk if asked,
+// then reads the status. Returns the first status that ended the bundle,
+// the one notified to the phone.
+uint8_t sendChunks(const uint8_t *bundle, size_t length, uint16_t mtu, SimGattCost *cost, int skip = -1,
+                   int repeat = -1)
+{
+  size_t payload = mtu - SIM_GATT_WRITE_HEADER - CONFIG_CHUNK_HEADER_SIZE;
+  uint8_t status = CONFIG_BUNDLE_IN_PROGRESS;
+  uint8_t chunk[CONFIG_CHUNK_HEADER_SIZE + CONFIG_BUNDLE_MAX_SIZE];
+  int sequence = 0;
+  for (size_t at = 0; at < length; at += payload, sequence++)
+  {
+    size_t size = length - at < payload ? length - at : payload;
+    chunk[0] = sequence;
+    chunk[1] = (at == 0 ? CONFIG_CHUNK_FIRST : 0) | (at + size == length ? CONFIG_CHUNK_LAST : 0);
+    memcpy(chunk + CONFIG_CHUNK_HEADER_SIZE, bundle + at, size);
+    for (int times = sequence == repeat ? 2 : 1; times > 0 && sequence != skip; times--)
+    {
+      cost->commands++;
+      cost->bytes += SIM_GATT_WRITE_HEADER + CONFIG_CHUNK_HEADER_SIZE + size;
+      uint8_t added = configBundleAddChunk(&gattReader, chunk, CONFIG_CHUNK_HEADER_SIZE + size);
+      if (status == CONFIG_BUNDLE_IN_PROGRESS)
+      {
+        status = added;
+      }
+    }
+  }
+  cost->requests++;
+  cost->bytes += SIM_GATT_STATUS_READ_BYTES;
+  return status;
+}
+
+// decodeSent decodes the bundle the reader rebuilt, once complete
+uint8_t decodeSent(uint8_t status, ConfigBundle *decoded)
+{
+  if (status != CONFIG_BUNDLE_COMPLETE)
+  {
+    return status;
+  }
+  status = configBundleDecode(&gattReader, decoded);
+  configBundleReset(&gattReader);
+  return status;
+}
+
+// writeSetting counts the write of a setting to its own characteristic,
+// a long write if it does not fit the MTU, and the read of the status
+void writeSetting(size_t length, uint16_t mtu, SimGattCost *cost)
+{
+  if (length <= (size_t)mtu - SIM_GATT_WRITE_HEADER)
+  {
+    cost->requests++;
+    cost->bytes += SIM_GATT_WRITE_HEADER + length + 1;
+  }
+  else
+  {
+    // each prepare write is echoed in its response, then executed
+    uint32_t prepares = (length + mtu - SIM_GATT_PREPARE_HEADER - 1) / (mtu - SIM_GATT_PREPARE_HEADER);
+    cost->requests += prepares + 1;
+    cost->bytes += 2 * (prepares * SIM_GATT_PREPARE_HEADER + length) + 2 + 1;
+  }
+  cost->requests++;
+  cost->bytes += SIM_GATT_STATUS_READ_BYTES;
+}
+
+// gattMs returns how long a way of configuring takes on the link
+uint32_t gattMs(const SimGattCost &cost)
+{
+  uint32_t events = (cost.commands + SIM_GATT_COMMANDS_PER_EVENT - 1) / SIM_GATT_COMMANDS_PER_EVENT + cost.requests;
+  return events * SIM_GATT_INTERVAL_MS;
+}
+
+// legacyCost counts the settings written one by one: the ssid, the
+// password, the wifi init and each alarm in the CSV format
+SimGattCost legacyCost(const SimGattConfig &config, uint16_t mtu)
+{
+  SimGattCost cost = {};
+  writeSetting(strlen(config.wifiSsid), mtu, &cost);
+  writeSetting(strlen(config.wifiPassword), mtu, &cost);
+  writeSetting(1, mtu, &cost);
+  for (uint8_t slot = 0; slot < config.alarms; slot++)
+  {
+    Alarm alarm = gattAlarm(slot);
+    char csv[64];
+    writeSetting(snprintf(csv, sizeof(csv), "%u,%d,%s,%u", alarm.number, alarm.when, alarm.song, alarm.activeMatrix),
+                 mtu, &cost);
+  }
+  return cost;
+}
+
+// checkDecoded checks the bundle the firmware decoded holds the
+// configuration, and only it
+bool checkDecoded(const SimGattConfig &config, const ConfigBundle &decoded)
+{
+  bool ok = decoded.hasWifiSsid == (config.wifiSsid != nullptr) &&
+            decoded.hasWifiPassword == (config.wifiPassword != nullptr) &&
+            decoded.hasDeviceName == (config.deviceName != nullptr) &&
+            decoded.alarmsMask == (1 << config.alarms) - 1;
+  ok = ok && (config.wifiSsid == nullptr || strcmp(decoded.wifiSsid, config.wifiSsid) == 0);
+  ok = ok && (config.wifiPassword == nullptr || strcmp(decoded.wifiPassword, config.wifiPassword) == 0);
+  ok = ok && (config.deviceName == nullptr || strcmp(decoded.deviceName, config.deviceName) == 0);
+  for (uint8_t slot = 0; slot < config.alarms; slot++)
+  {
+    Alarm alarm = gattAlarm(slot);
+    ok = ok && memcmp(&decoded.alarms[slot], &alarm, sizeof(Alarm)) == 0;
+  }
+  return ok;
+}
+
+// checkFaults sends broken bundles and chunks, each to be rejected
+// whole, then the bundle again, to be taken
+void checkFaults(uint16_t mtu)
+{
+  SimGattConfig config = SIM_GATT_CONFIG;
+  config.deviceName = "bedroom";
+  uint8_t bundle[2 * CONFIG_BUNDLE_MAX_SIZE];
+  size_t length = encodeBundle(config, bundle);
+  size_t chunks = (length + mtu - SIM_GATT_WRITE_HEADER - CONFIG_CHUNK_HEADER_SIZE - 1) /
+                  (mtu - SIM_GATT_WRITE_HEADER - CONFIG_CHUNK_HEADER_SIZE);
+  SimGattCost cost = {};
+  ConfigBundle decoded;
+
+  if (chunks > 2)
+  {
+    simExpect(sendChunks(bundle, length, mtu, &cost, 1) == CONFIG_BUNDLE_BAD_SEQUENCE, "gatt", "a lost chunk");
+    simExpect(sendChunks(bundle, length, mtu, &cost, -1, 1) == CONFIG_BUNDLE_BAD_SEQUENCE, "gatt", "a repeated chunk");
+  }
+  uint8_t broken[sizeof(bundle)];
+  memcpy(broken, bundle, length);
+  broken[length / 2] ^= 0x10;
+  simExpect(decodeSent(sendChunks(broken, length, mtu, &cost), &decoded) == CONFIG_BUNDLE_BAD_CRC, "gatt",
+            "a corrupted byte");
+  memcpy(broken, bundle, length);
+  broken[0] = CONFIG_BUNDLE_VERSION + 1;
+  simExpect(decodeSent(sendChunks(broken, length, mtu, &cost), &decoded) == CONFIG_BUNDLE_UNSUPPORTED_VERSION, "gatt",
+            "a bundle of a later version");
+  simExpect(decodeSent(sendChunks(bundle, length - 1, mtu, &cost), &decoded) == CONFIG_BUNDLE_BAD_LENGTH, "gatt",
+            "a bundle cut short");
+
+  SimGattConfig wrong = config;
+  wrong.deviceName = "";
+  size_t wrongLength = encodeBundle(wrong, broken);
+  simExpect(decodeSent(sendChunks(broken, wrongLength, mtu, &cost), &decoded) == CONFIG_BUNDLE_BAD_FIELD, "gatt",
+            "an empty device name");
+  Alarm alarm = gattAlarm(0);
+  alarm.number = MAX_ALARMS + 1;
+  uint8_t record[ALARM_RECORD_MAX_SIZE];
+  size_t fields = putField(broken + 3, CONFIG_FIELD_ALARM, record, alarmProtocolEncode(&alarm, record, sizeof(record)));
+  wrongLength = finishBundle(broken, fields);
+  simExpect(decodeSent(sendChunks(broken, wrongLength, mtu, &cost), &decoded) == CONFIG_BUNDLE_INVALID_ALARM, "gatt",
+            "an alarm out of range");
+
+  memset(broken, 0, sizeof(broken));
+  simExpect(sendChunks(broken, CONFIG_BUNDLE_MAX_SIZE + 1, mtu, &cost) == CONFIG_BUNDLE_TOO_LARGE, "gatt",
+            "a bundle too large");
+  uint8_t stray[] = {3, 0, 1, 2};
+  simExpect(configBundleAddChunk(&gattReader, stray, sizeof(stray)) == CONFIG_BUNDLE_BAD_SEQUENCE, "gatt",
+            "a chunk without a first one");
+  simExpect(configBundleAddChunk(&gattReader, stray, 1) == CONFIG_BUNDLE_BAD_LENGTH, "gatt",
+            "a chunk without a header");
+
+  bool taken = decodeSent(sendChunks(bundle, length, mtu, &cost), &decoded) == CONFIG_BUNDLE_COMPLETE &&
+               checkDecoded(config, decoded);
+  simExpect(taken, "gatt", "the bundle is taken again after the faults");
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simGattCheck configures the device that many times for each MTU and
+// number of alarms, with a bundle and setting by setting, returning false
+// if the firmware did not get the configuration sent or took a broken one
+bool simGattCheck(uint32_t configurations)
+{
+  configBundleReset(&gattReader);
+  printf("%-6s %-7s %8s %8s %8s %8s %8s %8s %8s\n", "mtu", "alarms", "chunks", "ops", "legacy", "bytes", "legacy",
+         "ms", "legacy");
+  for (uint16_t mtu : SIM_GATT_MTUS)
+  {
+    for (uint8_t alarms = 0; alarms <= MAX_ALARMS; alarms++)
+    {
+      SimGattConfig config = SIM_GATT_CONFIG;
+      config.alarms = alarms;
+      uint8_t bundle[CONFIG_BUNDLE_MAX_SIZE];
+      size_t length = encodeBundle(config, bundle);
+      SimGattCost cost = {};
+      for (uint32_t i = 0; i < configurations; i++)
+      {
+        cost = {};
+        ConfigBundle decoded;
+        bool taken = decodeSent(sendChunks(bundle, length, mtu, &cost), &decoded) == CONFIG_BUNDLE_COMPLETE &&
+                     checkDecoded(config, decoded);
+        simExpect(taken, "gatt", "the bundle is taken");
+      }
+      SimGattCost legacy = legacyCost(config, mtu);
+      if (alarms == 0 || alarms == 1 || alarms == MAX_ALARMS)
+      {
+        printf("%-6u %-7u %8u %8u %8u %8u %8u %8u %8u\n", mtu, alarms, cost.commands,
+               cost.commands + cost.requests, legacy.requests, cost.bytes, legacy.bytes,
+               gattMs(cost), gattMs(legacy));
+      }
+    }
+    checkFaults(mtu);
+  }
+  printf("gatt checks:         %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
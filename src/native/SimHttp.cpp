@@ -0,0 +1,737 @@
+// The HTTP configuration in the native simulation. simHttpCheck serves
+// the configuration as the configuration state does once wifi is
+// connected (see ConfigurationHttp.cpp), on a loopback port, to a test
+// client in the same process: the server task runs whenever the client
+// waits, as the virtual clock moves. The client checks the responses to
+// valid and invalid requests, including bodies arriving a byte at a time,
+// pipelined requests, keep-alive and stalled clients, then benchmarks the
+// requests per second of real time, on a keep-alive connection, with a
+// connection per request, pipelined, and changing the configuration.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../AlarmProtocol.h"
+#include "../ConfigBundle.h"
+#include "../ConfigurationHttp.h"
+#include "../GlobalStatus.h"
+#include "../Settings.h"
+#include "../SyncState.h"
+#include "../TimeZone.h"
+#include "../WifiServices.h"
+#include "Simulation.h"
+
+// how far the virtual clock moves while the client waits for the
+// server, and how many times it waits for a response before giving up
+const uint64_t SIM_HTTP_WAIT_US = 1000;
+const uint32_t SIM_HTTP_MAX_WAITS = 2000;
+
+const size_t SIM_HTTP_BUFFER_SIZE = 8192;
+const uint32_t SIM_HTTP_PIPELINE = 8;
+
+// the configuration the checks start from
+const char SIM_HTTP_DEVICE_NAME[] = "Alarmista sim";
+const char SIM_HTTP_TOKEN[] = "sim-token";
+const char SIM_HTTP_ALARM[] = "1,25200,sunrise,127";
+const char SIM_HTTP_CONFIGURATION[] =
+    "{\"deviceName\":\"Alarmista sim\",\"wifiSsid\":\"simulation\",\"timeZone\":\"WET0WEST,M3.5.0/1,M10.5.0\","
+    "\"householdSync\":false,\"alarms\":[{\"number\":1,\"when\":25200,\"song\":\"sunrise\",\"days\":127}]}";
+
+// a change of all the fields but the wifi, and the configuration after it
+const char SIM_HTTP_CHANGE[] =
+    "{ \"deviceName\" : \"Kitchen \\\"clock\\\" \\u00e9\\ud83d\\ude00\", \"timeZone\": \"CET-1CEST,M3.5.0,M10.5.0/3\",\n"
+    "  \"householdSync\": true,\n"
+    "  \"alarms\": [ {\"number\": 2, \"when\": 23400, \"song\": \"birds\", \"days\": 31},\n"
+    "              {\"days\": 96, \"song\": \"sunrise\", \"when\": 30600, \"number\": 4} ] }";
+const char SIM_HTTP_CHANGED[] =
+    "{\"deviceName\":\"Kitchen \\\"clock\\\" \xc3\xa9\xf0\x9f\x98\x80\",\"wifiSsid\":\"simulation\","
+    "\"timeZone\":\"CET-1CEST,M3.5.0,M10.5.0/3\",\"householdSync\":true,\"alarms\":["
+    "{\"number\":2,\"when\":23400,\"song\":\"birds\",\"days\":31},{\"number\":4,\"when\":30600,\"song\":\"sunrise\",\"days\":96}]}";
+
+// SimHttpInvalid is a configuration that must be refused with its status,
+// changing nothing
+struct SimHttpInvalid
+{
+  const char *name;
+  const char *body;
+  uint8_t status;
+};
+
+// the header carrying SIM_HTTP_TOKEN, for the changes
+const char SIM_HTTP_AUTHORIZATION[] = "Authorization: Bearer sim-token\r\n";
+
+const SimHttpInvalid SIM_HTTP_INVALID[] = {
+    {"empty body", "", JSON_STREAM_SYNTAX_ERROR},
+    {"truncated", "{\"deviceName\":\"Changed\"", JSON_STREAM_SYNTAX_ERROR},
+    {"trailing data", "{\"deviceName\":\"Changed\"} {}", JSON_STREAM_SYNTAX_ERROR},
+    {"bad literal", "{\"householdSync\":tru}", JSON_STREAM_SYNTAX_ERROR},
+    {"bad number", "{\"alarms\":[{\"number\":01}]}", JSON_STREAM_SYNTAX_ERROR},
+    {"control character", "{\"deviceName\":\"a\tb\"}", JSON_STREAM_SYNTAX_ERROR},
+    {"lone surrogate", "{\"deviceName\":\"\\udc00\"}", JSON_STREAM_SYNTAX_ERROR},
+    {"nul escape", "{\"deviceName\":\"\\u0000\"}", JSON_STREAM_SYNTAX_ERROR},
+    {"long value",
+     "{\"deviceName\":\"0123456789012345678901234567890123456789012345678901234567890123456789012345\"}",
+     JSON_STREAM_TOO_LONG},
+    {"long key", "{\"0123456789012345678901234567890\":1}", JSON_STREAM_TOO_LONG},
+    {"not an object", "[]", CONFIG_BUNDLE_BAD_FIELD},
+    {"unknown field", "{\"deviceName\":\"Changed\",\"volume\":3}", CONFIG_BUNDLE_BAD_FIELD},
+    {"wrong type", "{\"householdSync\":1}", CONFIG_BUNDLE_BAD_FIELD},
+    {"empty name", "{\"deviceName\":\"\"}", CONFIG_BUNDLE_BAD_FIELD},
+    {"long name", "{\"deviceName\":\"0123456789012345678901234567890123\"}", CONFIG_BUNDLE_BAD_FIELD},
+    {"missing field", "{\"alarms\":[{\"number\":1,\"when\":0,\"song\":\"x\"}]}", ALARM_STATUS_MISSING_FIELDS},
+    {"unknown alarm field", "{\"alarms\":[{\"number\":1,\"snooze\":5}]}", ALARM_STATUS_INVALID_FIELDS},
+    {"alarm number", "{\"alarms\":[{\"number\":5,\"when\":0,\"song\":\"x\",\"days\":1}]}", ALARM_STATUS_INVALID_NUMBER},
+    {"same alarm twice",
+     "{\"alarms\":[{\"number\":1,\"when\":0,\"song\":\"x\",\"days\":1},{\"number\":1,\"when\":0,\"song\":\"x\",\"days\":1}]}",
+     ALARM_STATUS_INVALID_NUMBER},
+    {"alarm time", "{\"deviceName\":\"Changed\",\"alarms\":[{\"number\":1,\"when\":86400,\"song\":\"x\",\"days\":1}]}",
+     ALARM_STATUS_INVALID_TIME},
+    {"fractional time", "{\"alarms\":[{\"number\":1,\"when\":1.5,\"song\":\"x\",\"days\":1}]}", ALARM_STATUS_INVALID_TIME},
+    {"alarm days", "{\"alarms\":[{\"number\":1,\"when\":0,\"song\":\"x\",\"days\":128}]}", ALARM_STATUS_INVALID_DAYS},
+    {"song too long", "{\"alarms\":[{\"number\":1,\"when\":0,\"song\":\"0123456789012345678901234\",\"days\":1}]}",
+     ALARM_STATUS_SONG_TOO_LONG},
+    {"time zone", "{\"deviceName\":\"Changed\",\"timeZone\":\"CET-1CEST,M13.5.0\"}", TIME_ZONE_INVALID_DATE},
+};
+
+// SimJsonCase is a document and what the parser must make of it: the
+// tokens, as traced by traceToken, or the error
+struct SimJsonCase
+{
+  const char *document;
+  JsonStreamStatus status;
+  const char *trace;
+};
+
+const SimJsonCase SIM_JSON_CASES[] = {
+    {"{\"a\":[1,\"x\",{\"b\":null}],\"c\" : true , \"d\":{}}", JSON_STREAM_COMPLETE,
+     "0{ 1a[ 2#1 2\"x 2{ 3b~null 2} 1] 1c?true 1d{ 1} 0}"},
+    {"-12.5e+3", JSON_STREAM_COMPLETE, "0#-12.5e+3"},
+    {" \"\\u00e9\\ud83d\\ude00\\n\\\"\\/\" ", JSON_STREAM_COMPLETE, "0\"\xc3\xa9\xf0\x9f\x98\x80\n\"/"},
+    {"[[[[[[[[]]]]]]]]", JSON_STREAM_COMPLETE, "0[ 1[ 2[ 3[ 4[ 5[ 6[ 7[ 7] 6] 5] 4] 3] 2] 1] 0]"},
+    {"[[[[[[[[[]]]]]]]]]", JSON_STREAM_TOO_DEEP, NULL},
+    {"[1,]", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"[1 2]", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"{\"a\" 1}", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"{\"a\":1,}", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"{\"a\":1]", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"[-]", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"[1.]", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"\"\\ud83d\"", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"\"\\x\"", JSON_STREAM_SYNTAX_ERROR, NULL},
+    {"nul", JSON_STREAM_SYNTAX_ERROR, NULL},
+};
+
+// SimHttpClient is a connection of the test client; what it received and
+// did not read yet is kept in the buffer
+struct SimHttpClient
+{
+  int socket;
+  size_t length;
+  bool continued;
+  char buffer[SIM_HTTP_BUFFER_SIZE];
+};
+
+struct SimHttpResponse
+{
+  int status;
+  bool close;
+  size_t length;
+  char body[HTTP_OUTPUT_SIZE];
+};
+
+SimHttpClient httpClients[HTTP_MAX_CONNECTIONS + 1];
+SimHttpResponse httpResponse;
+char jsonTrace[512];
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint64_t clientNowUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// traceToken writes a token to the trace: its depth, its event, its key
+// and its value
+bool traceToken(void * /* context */, const JsonToken *token)
+{
+  static const char EVENTS[] = " {}[]\"#?~";
+  size_t length = strlen(jsonTrace);
+  snprintf(jsonTrace + length, sizeof(jsonTrace) - length, "%s%u%s%c%s", length > 0 ? " " : "", token->depth,
+           token->key, EVENTS[token->event], token->value != NULL ? token->value : "");
+  return true;
+}
+
+// checkJsonStream parses documents whole and a byte at a time, which
+// must make the same tokens
+void checkJsonStream()
+{
+  JsonStream stream;
+  for (const SimJsonCase &json : SIM_JSON_CASES)
+  {
+    for (int pieces = 0; pieces < 2; pieces++)
+    {
+      jsonTrace[0] = '\0';
+      jsonStreamReset(&stream, traceToken, NULL);
+      size_t length = strlen(json.document);
+      size_t step = pieces == 0 ? length : 1;
+      for (size_t i = 0; i < length; i += step)
+      {
+        jsonStreamFeed(&stream, json.document + i, step);
+      }
+      JsonStreamStatus status = jsonStreamFinish(&stream);
+      bool ok = status == json.status && (json.trace == NULL || strcmp(jsonTrace, json.trace) == 0);
+      if (!ok)
+      {
+        printf("%s: %d %s\n", json.document, status, jsonTrace);
+      }
+      simExpect(ok, "http", pieces == 0 ? "a document parsed whole" : "a document parsed a byte at a time");
+    }
+  }
+
+  char buffer[64];
+  JsonOutput output;
+  jsonOutputBegin(&output, buffer, sizeof(buffer));
+  jsonWriteBeginObject(&output, NULL);
+  jsonWriteString(&output, "a\"", "\\\x01\xc3\xa9");
+  jsonWriteBeginArray(&output, "b");
+  jsonWriteInteger(&output, NULL, -3);
+  jsonWriteBool(&output, NULL, false);
+  jsonWriteEndArray(&output);
+  jsonWriteEndObject(&output);
+  simExpect(!output.overflow && strcmp(buffer, "{\"a\\\"\":\"\\\\\\u0001\xc3\xa9\",\"b\":[-3,false]}") == 0, "http",
+            "a document written");
+  jsonOutputBegin(&output, buffer, 8);
+  jsonWriteString(&output, NULL, "too long");
+  simExpect(output.overflow && strlen(buffer) < 8, "http", "a document too long for the buffer");
+}
+
+bool clientOpen(SimHttpClient *client)
+{
+  client->length = 0;
+  client->continued = false;
+  client->socket = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(simTcpPort);
+  if (client->socket < 0 || connect(client->socket, (struct sockaddr *)&address, sizeof(address)) != 0)
+  {
+    perror("connect");
+    return false;
+  }
+  int noDelay = 1;
+  setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  fcntl(client->socket, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+void clientClose(SimHttpClient *client)
+{
+  if (client->socket >= 0)
+  {
+    close(client->socket);
+    client->socket = -1;
+  }
+}
+
+// clientSend sends all the data, letting the server run while the
+// socket is full
+bool clientSend(SimHttpClient *client, const char *data, size_t length)
+{
+  size_t sent = 0;
+  for (uint32_t waits = 0; sent < length && waits < SIM_HTTP_MAX_WAITS; waits++)
+  {
+    ssize_t result = send(client->socket, data + sent, length - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      return false;
+    }
+    if (result > 0)
+    {
+      sent += result;
+      continue;
+    }
+    simAdvance(SIM_HTTP_WAIT_US);
+  }
+  return sent == length;
+}
+
+// clientParse takes the first response of the buffer, if it is all
+// there; a 100 Continue is only noted
+bool clientParse(SimHttpClient *client, SimHttpResponse *response)
+{
+  char *headEnd = (char *)memmem(client->buffer, client->length, "\r\n\r\n", 4);
+  if (headEnd == NULL)
+  {
+    return false;
+  }
+  size_t headLength = headEnd + 4 - client->buffer;
+  *headEnd = '\0';
+  int status = 0;
+  sscanf(client->buffer, "HTTP/1.1 %d", &status);
+  const char *lengthHeader = strcasestr(client->buffer, "\r\nContent-Length:");
+  size_t bodyLength = lengthHeader != NULL ? strtoul(lengthHeader + 17, NULL, 10) : 0;
+  bool close = strcasestr(client->buffer, "\r\nConnection: close") != NULL;
+  *headEnd = '\r';
+  if (headLength + bodyLength > client->length || bodyLength >= sizeof(response->body))
+  {
+    return false;
+  }
+
+  if (status == 100)
+  {
+    client->continued = true;
+  }
+  else
+  {
+    response->status = status;
+    response->close = close;
+    response->length = bodyLength;
+    memcpy(response->body, client->buffer + headLength, bodyLength);
+    response->body[bodyLength] = '\0';
+  }
+  client->length -= headLength + bodyLength;
+  memmove(client->buffer, client->buffer + headLength + bodyLength, client->length);
+  return status != 100 || clientParse(client, response);
+}
+
+// clientReceive waits for the next response. Returns 1 once it is read,
+// 0 if the server closed the connection first, -1 if it never came.
+int clientReceive(SimHttpClient *client, SimHttpResponse *response)
+{
+  for (uint32_t waits = 0; waits < SIM_HTTP_MAX_WAITS; waits++)
+  {
+    if (clientParse(client, response))
+    {
+      return 1;
+    }
+    ssize_t received = recv(client->socket, client->buffer + client->length, SIM_HTTP_BUFFER_SIZE - client->length, 0);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      return 0;
+    }
+    if (received > 0)
+    {
+      client->length += received;
+      continue;
+    }
+    simAdvance(SIM_HTTP_WAIT_US);
+  }
+  return -1;
+}
+
+// clientRequest formats a request, with a body unless it is NULL
+size_t clientRequest(char *buffer, size_t size, const char *method, const char *path, const char *headers,
+                     const char *body)
+{
+  int length;
+  if (body == NULL)
+  {
+    length = snprintf(buffer, size, "%s %s HTTP/1.1\r\nHost: alarmista\r\n%s\r\n", method, path, headers);
+  }
+  else
+  {
+    length = snprintf(buffer, size, "%s %s HTTP/1.1\r\nHost: alarmista\r\n%sContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+                      method, path, headers, strlen(body), body);
+  }
+  return length > 0 && (size_t)length < size ? length : 0;
+}
+
+// clientExchange sends a request and waits for its response
+bool clientExchange(SimHttpClient *client, const char *method, const char *path, const char *headers, const char *body)
+{
+  char request[SIM_HTTP_BUFFER_SIZE];
+  size_t length = clientRequest(request, sizeof(request), method, path, headers, body);
+  return length > 0 && clientSend(client, request, length) && clientReceive(client, &httpResponse) == 1;
+}
+
+// clientClosed waits for the server to close the connection
+bool clientClosed(SimHttpClient *client)
+{
+  SimHttpResponse response;
+  return clientReceive(client, &response) == 0;
+}
+
+// configurationIs checks the configuration the server returns
+bool configurationIs(SimHttpClient *client, const char *expected)
+{
+  return clientExchange(client, "GET", "/config", "", NULL) && httpResponse.status == 200 &&
+         strcmp(httpResponse.body, expected) == 0;
+}
+
+// statusIs checks the response to a configuration change
+bool statusIs(int httpStatus, uint8_t status)
+{
+  char expected[32];
+  snprintf(expected, sizeof(expected), "{\"status\":%u}", status);
+  return httpResponse.status == httpStatus && strcmp(httpResponse.body, expected) == 0;
+}
+
+// configureDevice stores the configuration the checks start from, as the
+// simulated phone would over BLE
+bool configureDevice()
+{
+  Alarm alarm;
+  AlarmTable table = {};
+  if (alarmProtocolParse((const uint8_t *)SIM_HTTP_ALARM, strlen(SIM_HTTP_ALARM), &alarm) != ALARM_STATUS_SUCCESS)
+  {
+    return false;
+  }
+  table.alarms[0] = alarm;
+  return syncStateEnable(false, SIM_HOUSEHOLD_KEY) && settingsSaveDeviceName(SIM_HTTP_DEVICE_NAME) && settingsSaveWifiSsid(SIM_WIFI_SSID) &&
+         settingsSaveWifiPassword(SIM_WIFI_PASSWORD) && settingsSaveAlarmTable(&table) && settingsSaveHttpToken(SIM_HTTP_TOKEN) &&
+         settingsSaveTimeZone(SIM_TIME_ZONE, TIME_ZONE_DEFAULT_FIRST_YEAR) == TIME_ZONE_SUCCESS && settingsFlush();
+}
+
+// checkConfiguration reads, changes and restores the configuration
+void checkConfiguration(SimHttpClient *client)
+{
+  simExpect(configurationIs(client, SIM_HTTP_CONFIGURATION), "http", "GET /config returns the configuration");
+  simExpect(!httpResponse.close, "http", "a response keeps the connection open");
+
+  uint32_t writes = simWorld->stats.kvWrites;
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, SIM_HTTP_CHANGE) && statusIs(200, 0),
+            "http", "PUT /config changes all the fields");
+  writes = simWorld->stats.kvWrites - writes;
+  simExpect(configurationIs(client, SIM_HTTP_CHANGED), "http", "GET /config returns the fields changed");
+  AlarmTable table;
+  settingsGetAlarmTable(&table);
+  simExpect(table.alarms[0].number == 0 && table.alarms[1].number == 2 && table.alarms[3].activeMatrix == 96, "http",
+            "the alarms given replace all the alarms");
+
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, SIM_HTTP_CHANGE) && statusIs(200, 0) &&
+                configurationIs(client, SIM_HTTP_CHANGED),
+            "http", "the same change again changes nothing");
+
+  // a byte at a time, the server running between the bytes
+  char request[SIM_HTTP_BUFFER_SIZE];
+  size_t length = clientRequest(request, sizeof(request), "PUT", "/config", SIM_HTTP_AUTHORIZATION, SIM_HTTP_CONFIGURATION);
+  bool sent = true;
+  for (size_t i = 0; i < length && sent; i++)
+  {
+    sent = clientSend(client, request + i, 1);
+    simAdvance(SIM_HTTP_WAIT_US);
+  }
+  simExpect(sent && clientReceive(client, &httpResponse) == 1 && statusIs(200, 0) &&
+                configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "a request arriving a byte at a time restores the configuration");
+
+  for (const SimHttpInvalid &invalid : SIM_HTTP_INVALID)
+  {
+    bool refused = clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, invalid.body) && statusIs(400, invalid.status);
+    if (!refused)
+    {
+      printf("%s: %d %s\n", invalid.name, httpResponse.status, httpResponse.body);
+    }
+    simExpect(refused && configurationIs(client, SIM_HTTP_CONFIGURATION), "http", invalid.name);
+  }
+
+  // the key is only set over BLE
+  HouseholdSync sync;
+  settingsGetHouseholdSync(&sync);
+  memset(sync.key, 0, sizeof(sync.key));
+  settingsSaveHouseholdSync(&sync);
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, "{\"deviceName\":\"other\",\"householdSync\":true}") &&
+                statusIs(400, ALARM_STATUS_INVALID_FIELDS) && configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "the household sync is not turned on without a key");
+  syncStateEnable(false, SIM_HOUSEHOLD_KEY);
+
+  // the changes carry the token set over BLE; none is let through without one
+  simExpect(clientExchange(client, "PUT", "/config", "", SIM_HTTP_CHANGE) && httpResponse.status == 401 &&
+                configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "a change without the token is refused");
+  simExpect(clientExchange(client, "PUT", "/config", "Authorization: Bearer sim-tokem\r\n", SIM_HTTP_CHANGE) &&
+                httpResponse.status == 401 && configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "a change with another token is refused");
+  settingsSaveHttpToken("");
+  simExpect(clientExchange(client, "PUT", "/config", "Authorization: Bearer \r\n", SIM_HTTP_CHANGE) &&
+                httpResponse.status == 401 && configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "the changes are refused until a token is set");
+  settingsSaveHttpToken(SIM_HTTP_TOKEN);
+
+  // a change whose writes fail leaves the settings as they were, in the
+  // cache and, once the writes work again, in the flash
+  simWorld->kvWritesFail = 1;
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, SIM_HTTP_CHANGE) &&
+                statusIs(500, ALARM_STATUS_NOT_SAVED),
+            "http", "a change that can not be written is refused");
+  simWorld->kvWritesFail = 0;
+  simExpect(configurationIs(client, SIM_HTTP_CONFIGURATION) && settingsFlush() &&
+                halKvGetString("device-name") == SIM_HTTP_DEVICE_NAME,
+            "http", "a change that could not be written is rolled back");
+
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, "{\"wifiSsid\":\"other\",\"wifiPassword\":\"secret\"}") &&
+                statusIs(200, 0),
+            "http", "PUT /config changes the wifi network");
+  simAdvance(SIM_HTTP_WAIT_US * 10);
+  // the http task leaves the reconnection to the loop task
+  updateWifi();
+  simExpect(isWiFiConnected() && settingsGetWifiSsid() == "other" && settingsGetWifiPassword() == "secret", "http",
+            "the wifi connects to the new network after the response");
+  simExpect(clientExchange(client, "GET", "/config", "", NULL) && strstr(httpResponse.body, "secret") == NULL, "http",
+            "the wifi password is never returned");
+  simExpect(clientExchange(client, "PUT", "/config", SIM_HTTP_AUTHORIZATION, "{\"wifiSsid\":\"simulation\",\"wifiPassword\":\"simulation\"}") &&
+                configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "the wifi network is restored");
+
+  printf("configuration changed in one request, %u settings writes\n", writes);
+}
+
+// checkProtocol checks the server side of HTTP: errors, keep-alive,
+// pipelining, several connections and their timeouts
+void checkProtocol(SimHttpClient *client)
+{
+  simExpect(clientExchange(client, "GET", "/nothing", "", NULL) && httpResponse.status == 404 && !httpResponse.close,
+            "http", "an unknown path is not found, keeping the connection open");
+  simExpect(clientExchange(client, "DELETE", "/config", "", "{}") && httpResponse.status == 405 &&
+                configurationIs(client, SIM_HTTP_CONFIGURATION),
+            "http", "an unknown method is not allowed, its body skipped");
+  simExpect(clientExchange(client, "GET", "/config?pretty=1", "", NULL) && httpResponse.status == 200, "http",
+            "the query is ignored");
+
+  char request[SIM_HTTP_BUFFER_SIZE];
+  size_t length = 0;
+  for (uint32_t i = 0; i < SIM_HTTP_PIPELINE; i++)
+  {
+    length += clientRequest(request + length, sizeof(request) - length, "GET", "/config", "", NULL);
+  }
+  bool pipelined = clientSend(client, request, length);
+  for (uint32_t i = 0; i < SIM_HTTP_PIPELINE && pipelined; i++)
+  {
+    pipelined = clientReceive(client, &httpResponse) == 1 && strcmp(httpResponse.body, SIM_HTTP_CONFIGURATION) == 0;
+  }
+  simExpect(pipelined, "http", "pipelined requests are all answered, in order");
+
+  simExpect(clientExchange(client, "PUT", "/config", "Authorization: Bearer sim-token\r\nExpect: 100-continue\r\n", SIM_HTTP_CONFIGURATION) &&
+                client->continued && statusIs(200, 0),
+            "http", "a client expecting 100 Continue gets it");
+  simExpect(clientExchange(client, "GET", "/config", "Connection: close\r\n", NULL) && httpResponse.close &&
+                clientClosed(client),
+            "http", "Connection: close closes the connection after the response");
+  clientClose(client);
+
+  clientOpen(client);
+  length = snprintf(request, sizeof(request), "GET /config HTTP/1.0\r\n\r\n");
+  simExpect(clientSend(client, request, length) && clientReceive(client, &httpResponse) == 1 && httpResponse.close &&
+                clientClosed(client),
+            "http", "an HTTP/1.0 request closes the connection");
+  clientClose(client);
+
+  clientOpen(client);
+  length = snprintf(request, sizeof(request), "GET /config HTTP/1.1\r\nX-Padding: %0*d\r\n\r\n", (int)HTTP_INPUT_SIZE, 0);
+  simExpect(clientSend(client, request, length) && clientReceive(client, &httpResponse) == 1 &&
+                httpResponse.status == 431 && clientClosed(client),
+            "http", "a head too large is refused");
+  clientClose(client);
+
+  clientOpen(client);
+  simExpect(clientExchange(client, "PUT", "/config", "Content-Length: 999999\r\n", NULL) &&
+                httpResponse.status == 413 && clientClosed(client),
+            "http", "a body too large is refused");
+  clientClose(client);
+
+  clientOpen(client);
+  simExpect(clientExchange(client, "PUT", "/config", "Transfer-Encoding: chunked\r\n", NULL) &&
+                httpResponse.status == 501 && clientClosed(client),
+            "http", "a chunked body is refused");
+  clientClose(client);
+
+  // what follows a head refused with the connection closed is never read
+  // as the next request, even if a later header asks to keep it open
+  const char *smuggled[] = {"Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n",
+                            "Content-Length: 999999\r\nConnection: keep-alive\r\n"};
+  for (const char *headers : smuggled)
+  {
+    clientOpen(client);
+    length = snprintf(request, sizeof(request), "PUT /config HTTP/1.1\r\n%s\r\nGET /config HTTP/1.1\r\n\r\n", headers);
+    simExpect(clientSend(client, request, length) && clientReceive(client, &httpResponse) == 1 &&
+                  httpResponse.status >= 400 && httpResponse.close && clientClosed(client),
+              "http", "the body of a request refused with the connection closed is not served");
+    clientClose(client);
+  }
+
+  // a request pipelined after another, whose head only fits the input
+  // once the first is out of it
+  clientOpen(client);
+  length = clientRequest(request, sizeof(request), "GET", "/config", "", NULL);
+  length += snprintf(request + length, sizeof(request) - length, "GET /config HTTP/1.1\r\nX-Padding: %0*d\r\n\r\n",
+                     (int)HTTP_INPUT_SIZE - 64, 0);
+  pipelined = clientSend(client, request, length);
+  for (int i = 0; i < 2 && pipelined; i++)
+  {
+    pipelined = clientReceive(client, &httpResponse) == 1 && httpResponse.status == 200;
+  }
+  simExpect(pipelined, "http", "a pipelined head filling the rest of the input is read");
+  clientClose(client);
+
+  clientOpen(client);
+  length = snprintf(request, sizeof(request), "GET\r\n\r\n");
+  simExpect(clientSend(client, request, length) && clientReceive(client, &httpResponse) == 1 &&
+                httpResponse.status == 400 && clientClosed(client),
+            "http", "a malformed request line is refused");
+  clientClose(client);
+
+  // the request of a client sending its body slowly is served before the
+  // requests of the others, which wait in their sockets
+  SimHttpClient *slow = &httpClients[1];
+  const char *get = "GET /config HTTP/1.1\r\n\r\n";
+  clientOpen(client);
+  clientOpen(slow);
+  length = clientRequest(request, sizeof(request), "PUT", "/config", SIM_HTTP_AUTHORIZATION, SIM_HTTP_CONFIGURATION);
+  size_t half = length / 2;
+  bool served = clientSend(slow, request, half);
+  simAdvance(SIM_HTTP_WAIT_US * 10);
+  served = served && clientSend(client, get, strlen(get));
+  simAdvance(SIM_HTTP_WAIT_US * 10);
+  char peek;
+  served = served && recv(client->socket, &peek, 1, MSG_PEEK) < 0 && clientSend(slow, request + half, length - half);
+  served = served && clientReceive(slow, &httpResponse) == 1 && statusIs(200, 0);
+  served = served && clientReceive(client, &httpResponse) == 1 && httpResponse.status == 200;
+  simExpect(served, "http", "a request waits for the one being received on another connection");
+
+  uint32_t timeouts = configurationHttpServer.stats.timeouts;
+  clientSend(slow, request, 10);
+  simAdvance((uint64_t)HTTP_IDLE_TIMEOUT_MS * 1000 + SIM_HTTP_WAIT_US * 10);
+  simExpect(clientClosed(slow) && clientClosed(client) && configurationHttpServer.stats.timeouts == timeouts + 2,
+            "http", "idle and stalled connections are closed");
+  clientClose(slow);
+  clientClose(client);
+
+  bool evicted = true;
+  for (int i = 0; i <= HTTP_MAX_CONNECTIONS && evicted; i++)
+  {
+    evicted = clientOpen(&httpClients[i]) && clientExchange(&httpClients[i], "GET", "/config", "", NULL);
+  }
+  simExpect(evicted && clientClosed(&httpClients[0]) &&
+                clientExchange(&httpClients[HTTP_MAX_CONNECTIONS], "GET", "/config", "", NULL),
+            "http", "a connection beyond the limit closes the one idle the longest");
+  for (SimHttpClient &other : httpClients)
+  {
+    clientClose(&other);
+  }
+}
+
+// benchmark serves requests as fast as the client makes them, reporting
+// the requests per second of real time. With a connection per request the
+// client closes each; pipelined, it sends them by SIM_HTTP_PIPELINE.
+bool benchmark(const char *name, uint32_t requests, const char *method, bool reconnect, bool pipeline)
+{
+  SimHttpClient *client = &httpClients[0];
+  char request[SIM_HTTP_BUFFER_SIZE];
+  char bodies[2][sizeof(SIM_HTTP_CONFIGURATION)];
+  for (int i = 0; i < 2; i++)
+  {
+    strcpy(bodies[i], SIM_HTTP_CONFIGURATION);
+    *strstr(bodies[i], "25200") = i == 0 ? '1' : '2';
+  }
+
+  uint64_t bytes = 0;
+  uint64_t startedAt = clientNowUs();
+  uint64_t virtualStart = simWorld->nowUs;
+  if (!reconnect && !clientOpen(client))
+  {
+    return false;
+  }
+  for (uint32_t done = 0; done < requests;)
+  {
+    if (reconnect && !clientOpen(client))
+    {
+      return false;
+    }
+    uint32_t batch = pipeline ? SIM_HTTP_PIPELINE : 1;
+    size_t length = 0;
+    for (uint32_t i = 0; i < batch; i++)
+    {
+      const char *body = strcmp(method, "PUT") == 0 ? bodies[(done + i) % 2] : NULL;
+      const char *headers = body != NULL ? SIM_HTTP_AUTHORIZATION : reconnect ? "Connection: close\r\n" : "";
+      length += clientRequest(request + length, sizeof(request) - length, method, "/config", headers, body);
+    }
+    if (!clientSend(client, request, length))
+    {
+      return false;
+    }
+    bytes += length;
+    for (uint32_t i = 0; i < batch; i++)
+    {
+      if (clientReceive(client, &httpResponse) != 1 || httpResponse.status != 200)
+      {
+        printf("%s: request %u failed (%d)\n", name, done + i, httpResponse.status);
+        return false;
+      }
+      bytes += httpResponse.length;
+    }
+    done += batch;
+    if (reconnect)
+    {
+      clientClose(client);
+    }
+  }
+  clientClose(client);
+
+  double seconds = (clientNowUs() - startedAt) / 1e6;
+  printf("%-28s %8u %12.0f %14.0f %12.2f\n", name, requests, requests / seconds, (double)bytes / requests,
+         (simWorld->nowUs - virtualStart) / 1e3 / requests);
+  return true;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simHttpCheck checks the configuration served over HTTP, then benchmarks
+// it with that many requests per benchmark
+bool simHttpCheck(uint32_t requests)
+{
+  settingsInit();
+  if (!configureDevice())
+  {
+    fprintf(stderr, "could not configure the device\n");
+    return false;
+  }
+  connectWifi();
+  initHttp();
+  if (!configurationHttpServer.listening)
+  {
+    fprintf(stderr, "the http server did not start\n");
+    return false;
+  }
+  printf("configuration served on 127.0.0.1:%u\n", simTcpPort);
+
+  SimHttpClient *client = &httpClients[0];
+  if (!clientOpen(client))
+  {
+    return false;
+  }
+  checkJsonStream();
+  checkConfiguration(client);
+  checkProtocol(client);
+  printf("%u checks, %u failed\n", simChecks, simFailures);
+  if (simFailures > 0)
+  {
+    return false;
+  }
+
+  printf("benchmark                    requests   requests/s  bytes/request   virtual ms\n");
+  bool ok = benchmark("GET, keep-alive", requests, "GET", false, false) &&
+            benchmark("GET, connection per request", requests, "GET", true, false) &&
+            benchmark("GET, pipelined", requests, "GET", false, true) &&
+            benchmark("PUT, keep-alive", requests, "PUT", false, false);
+
+  const HttpServerStats &stats = configurationHttpServer.stats;
+  printf("server: %u connections, %u requests, %u on kept alive connections, %u refused, %u timeouts\n",
+         stats.connections, stats.requests, stats.keepAliveRequests, stats.errors, stats.timeouts);
+  return ok;
+}
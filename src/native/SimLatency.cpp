@@ -0,0 +1,215 @@
+// The event latency of the native simulation. simLatencyCheck runs the
+// event loop of the firmware (see main.cpp), eventsWait feeding the state
+// machine, over probe states that only record when they are entered, and
+// posts events at random virtual times: button presses from the
+// interrupt handler, and go to sleep writes from a task as the BLE stack
+// would. It reports the virtual time from each post to the transition it
+// makes, and how late the deadlines the states ask for are reached, next
+// to the latency of the loop it replaced, which polled every second.
+// Every wake of the loop must be for an event or a deadline.
+
+#include <stdio.h>
+
+#include "../Events.h"
+#include "../StateMachine.h"
+#include "Simulation.h"
+
+// the period of the polled loop replaced by eventsWait
+const uint32_t SIM_LATENCY_POLL_MS = 1000;
+
+// the events are posted from 1 ms to this long after the last transition,
+// and the states ask for a deadline within this long, in microseconds
+const uint64_t SIM_LATENCY_MAX_GAP_US = 5000000;
+const uint32_t SIM_LATENCY_MAX_DEADLINE_MS = 6000;
+
+// how often the task posting the BLE writes runs
+const uint32_t SIM_LATENCY_TASK_MS = 1;
+
+// the longest an event or a deadline may wait for its transition: a tick
+// of the FreeRTOS scheduler
+const uint64_t SIM_LATENCY_MAX_US = 1000;
+
+// SimLatencySource is where the events come from, with the latencies of
+// the transitions they made, in virtual microseconds
+struct SimLatencySource
+{
+  const char *name;
+  uint32_t count;
+  uint64_t totalUs;
+  uint64_t maxUs;
+  uint64_t polledTotalUs;
+  uint64_t polledMaxUs;
+};
+
+SimLatencySource latencyButton = {"button interrupt", 0, 0, 0, 0, 0};
+SimLatencySource latencyBle = {"BLE write (task)", 0, 0, 0, 0, 0};
+SimLatencySource latencyDeadline = {"state deadline", 0, 0, 0, 0, 0};
+
+uint32_t latencySeed = 1;
+uint64_t latencyPostedUs = 0;
+uint64_t latencyBleAtUs = 0;
+uint64_t latencyDeadlineUs = 0;
+SimLatencySource *latencyPending = nullptr;
+uint32_t latencyWakes = 0;
+uint32_t latencyEvents = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint32_t latencyRandom()
+{
+  latencySeed = latencySeed * 1103515245 + 12345;
+  return latencySeed >> 1;
+}
+
+// recordLatency counts the time from a post, or a deadline, to now, and
+// the time the polled loop would have taken, running every second from
+// the start
+void recordLatency(SimLatencySource *source, uint64_t fromUs)
+{
+  uint64_t latencyUs = simWorld->nowUs - fromUs;
+  uint64_t pollUs = (uint64_t)SIM_LATENCY_POLL_MS * 1000;
+  uint64_t polledUs = (pollUs - fromUs % pollUs) % pollUs;
+  source->count++;
+  source->totalUs += latencyUs;
+  source->polledTotalUs += polledUs;
+  if (latencyUs > source->maxUs)
+  {
+    source->maxUs = latencyUs;
+  }
+  if (polledUs > source->polledMaxUs)
+  {
+    source->polledMaxUs = polledUs;
+  }
+}
+
+// latencyButtonInterrupt is the interrupt handler of the button
+void latencyButtonInterrupt()
+{
+  latencyPostedUs = simWorld->nowUs;
+  latencyPending = &latencyButton;
+  eventsPostFromISR(EVENT_BUTTON_PRESSED);
+}
+
+// latencyBleStep posts the go to sleep write once it is due, from its
+// task, as the BLE callbacks do
+void latencyBleStep()
+{
+  if (latencyBleAtUs == 0 || simWorld->nowUs < latencyBleAtUs)
+  {
+    return;
+  }
+  latencyBleAtUs = 0;
+  latencyPostedUs = simWorld->nowUs;
+  latencyPending = &latencyBle;
+  eventsPost(EVENT_GO_TO_SLEEP);
+}
+
+// scheduleDeadline asks for a deadline, which may come before the next
+// event, and must then be reached on time
+void scheduleDeadline()
+{
+  uint32_t deadlineMs = 1 + latencyRandom() % SIM_LATENCY_MAX_DEADLINE_MS;
+  latencyDeadlineUs = simWorld->nowUs + (uint64_t)deadlineMs * 1000;
+  eventsRequestWakeIn(deadlineMs);
+}
+
+// probeTransition records the latency of the event that made the
+// transition, then posts the next one at a random time: from the awake
+// state a BLE write, from the sleeping one a button press
+void probeTransition(bool toSleep)
+{
+  if (latencyPending != nullptr)
+  {
+    recordLatency(latencyPending, latencyPostedUs);
+    latencyPending = nullptr;
+  }
+  uint64_t atUs = simWorld->nowUs + 1000 + latencyRandom() % SIM_LATENCY_MAX_GAP_US;
+  if (toSleep)
+  {
+    simWorld->buttonPressUs = atUs;
+  }
+  else
+  {
+    latencyBleAtUs = atUs;
+  }
+  scheduleDeadline();
+}
+
+void probeEnterAwake()
+{
+  probeTransition(false);
+}
+
+void probeEnterAsleep()
+{
+  probeTransition(true);
+}
+
+// probeUpdate runs for a deadline reached before the event, and asks
+// for the next one
+void probeUpdate()
+{
+  recordLatency(&latencyDeadline, latencyDeadlineUs);
+  scheduleDeadline();
+}
+
+constexpr StateDefinition PROBE_STATES[STATE_COUNT] = {
+    {STATE_CONFIGURATION, "Awake", probeEnterAwake, probeUpdate, nullptr},
+    {STATE_DEEP_SLEEP, "Asleep", probeEnterAsleep, probeUpdate, nullptr},
+    {STATE_SUNRISE, "Sunrise", nullptr, nullptr, nullptr},
+    {STATE_SYNC, "Sync", nullptr, nullptr, nullptr},
+};
+static_assert(stateMachineStatesValid(PROBE_STATES), "a state is missing or out of order");
+
+constexpr TransitionDefinition PROBE_TRANSITIONS[] = {
+    {STATE_CONFIGURATION, EVENT_GO_TO_SLEEP, STATE_DEEP_SLEEP, nullptr},
+    {STATE_DEEP_SLEEP, EVENT_BUTTON_PRESSED, STATE_CONFIGURATION, nullptr},
+};
+constexpr TransitionTable PROBE_TABLE = stateMachineBuildTable(PROBE_TRANSITIONS);
+static_assert(PROBE_TABLE.valid, "a transition is out of range or repeated");
+
+void printLatency(const SimLatencySource &source)
+{
+  uint32_t count = source.count > 0 ? source.count : 1;
+  printf("%-18s %8u %12.3f %12.3f %12.1f %12.1f\n", source.name, source.count, source.totalUs / 1e3 / count,
+         source.maxUs / 1e3, source.polledTotalUs / 1e3 / count, source.polledMaxUs / 1e3);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simLatencyCheck runs the event loop until that many events made a
+// transition, returning false if any was late or the loop woke for
+// nothing
+bool simLatencyCheck(uint32_t events)
+{
+  eventsInit();
+  halButtonAttach(latencyButtonInterrupt);
+  halTaskStart("ble", latencyBleStep, SIM_LATENCY_TASK_MS, 1, 0, HAL_TASK_STACK_SIZE);
+  stateMachineInit(PROBE_STATES, &PROBE_TABLE);
+  stateMachineStart(STATE_CONFIGURATION);
+
+  while (latencyButton.count + latencyBle.count < events)
+  {
+    Event event = eventsWait();
+    latencyWakes++;
+    latencyEvents += event != EVENT_NONE;
+    stateMachineDispatch(event);
+  }
+
+  printf("%-18s %8s %12s %12s %12s %12s\n", "source", "events", "mean (ms)", "max (ms)", "polled mean", "polled max");
+  printLatency(latencyButton);
+  printLatency(latencyBle);
+  printLatency(latencyDeadline);
+  uint32_t spurious = latencyWakes - latencyEvents - latencyDeadline.count;
+  printf("loop wakes:        %u (%u events, %u deadlines, %u for nothing)\n", latencyWakes, latencyEvents,
+         latencyDeadline.count, spurious);
+
+  bool ok = latencyButton.maxUs <= SIM_LATENCY_MAX_US && latencyBle.maxUs <= SIM_LATENCY_MAX_US &&
+            latencyDeadline.maxUs <= SIM_LATENCY_MAX_US && spurious == 0;
+  printf("event latency checks: %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
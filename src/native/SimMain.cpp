@@ -0,0 +1,582 @@
+// alarmista-sim runs the firmware state machine on Linux against the
+// simulated hardware, through many configuration -> deep sleep -> sunrise
+// cycles, and reports how it went. Exits with a non zero status if the
+// firmware crashes, stalls, stops sleeping, is slow to light the leds
+// after a timer wake or stops an alarm nobody stopped before its timeout.
+// A cycle is not cheap: the firmware decodes every sample of the alarm
+// song it plays, 675 s of it at 8 kHz per cycle on average, which is
+// about 90% of the real time; the fork and RTC copy of each boot are
+// about 2%. The default run makes about 23 cycles per second.
+// With -t the profile trace is written after every boot, in the format
+// read by scripts/profile-decode.py. With -e the energy totals are
+// written at the end, in the format read by scripts/energy-project.py.
+// With -y the simulated phone enables the household sync, and the device
+// syncs with a simulated peer in the windows it wakes for between the
+// alarms; after each one it must hold what the peer holds.
+// With any of these options no firmware runs: a part of it is checked or
+// benchmarked instead.
+//   -b  the state machine dispatch is benchmarked (see SimBench.cpp)
+//   -l  the latency from an event to the transition it makes is measured
+//       (see SimLatency.cpp)
+//   -n  the alarm scheduler is checked and benchmarked over a full week,
+//       that many times (see SimScheduler.cpp)
+//   -c  the sunrise curve is checked and benchmarked against the palette
+//       path (see SimCurve.cpp)
+//   -p  the clock is synced with an NTP stand-in that many times over
+//       drifting clocks and uneven, jittery or slow networks (see
+//       SimNtp.cpp)
+//   -k  that many alarm tables are written and read back, and the alarms
+//       of older firmware versions migrated, some of the writes failing
+//       (see SimSettings.cpp)
+//   -r  the alarm protocol is fuzzed with that many writes, then its parse
+//       cost compared with the path it replaced (see SimProtocol.cpp)
+//   -g  a phone configures the device that many times with a bundle, and
+//       setting by setting, counting the GATT operations (see SimGatt.cpp)
+//   -a  the audio decoder is checked and benchmarked (see SimAudio.cpp)
+//   -u  songs are uploaded over a link losing that percentage of its
+//       packets, for a range of MTUs and windows (see SimTransfer.cpp)
+//   -f  firmware updates by delta patches are checked and benchmarked,
+//       each best of that many runs (see SimDelta.cpp)
+//   -z  the time zones are checked against the C library of the host (see
+//       SimTimeZone.cpp)
+//   -s  households of 2 to that many units sync over loopback multicast
+//       (see SimSync.cpp)
+//   -w  the configuration is served over HTTP to a loopback client,
+//       checked and benchmarked with that many requests each time (see
+//       SimHttp.cpp)
+// With -D, a patch is made from the old image file to the new one, and
+// with -P applied to the old image file, to write the new one.
+//
+// usage: alarmista-sim [-v] [-d clock drift in ppm] [-t trace file] [-e energy file] [-y] [cycles]
+//        alarmista-sim [-v] -b dispatches | -l events | -n repeats | -c frames | -k tables | -r writes
+//                      | -g configurations | -p syncs | -a audio seconds | -u loss percent | -f repeats
+//                      | -z | -s units | -w requests
+//        alarmista-sim -D patch file old image file new image file
+//        alarmista-sim -P new image file old image file patch file
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Simulation.h"
+#include "../Energy.h"
+#include "../Logger.h"
+#include "../HouseholdSync.h"
+#include "../Profiler.h"
+#include "../SunriseCurve.h"
+#include "../SunriseState.h"
+#include "../WakeContext.h"
+
+extern char __start_rtc_data[];
+extern char __stop_rtc_data[];
+
+const uint32_t SIM_DEFAULT_CYCLES = 1000;
+const int32_t SIM_DEFAULT_DRIFT_PPM = 40;
+
+// every SIM_BUTTON_CYCLES cycles the sunrise is stopped with the button
+const uint32_t SIM_BUTTON_CYCLES = 4;
+const uint64_t SIM_BUTTON_AFTER_US = 10ULL * 60 * 1000000;
+
+// every SIM_LOST_CONTEXT_CYCLES cycles the wake context is lost during
+// the deep sleep before an alarm, which must ring all the same
+const uint32_t SIM_LOST_CONTEXT_CYCLES = 10;
+
+// a boot taking longer than this, in real time, is considered hung
+const unsigned int SIM_BOOT_TIMEOUT_S = 10;
+
+// the longest acceptable time from a timer wake to the first frame, in virtual time
+const uint64_t SIM_MAX_FIRST_FRAME_US = 5000;
+
+// the largest acceptable error of a timer wake, once the firmware knows
+// the drift of its clock; before, it only knows its clock is within
+// TIME_SYNC_MAX_ERROR_MS
+const int64_t SIM_MAX_WAKE_ERROR_MS = 50;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// realTimeUs returns a monotonic real time, in microseconds
+uint64_t realTimeUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// isLocalAlarmTime returns true if an epoch is the time of day of the
+// alarm of the simulated phone, in its time zone
+bool isLocalAlarmTime(uint32_t epoch)
+{
+  time_t time = epoch;
+  struct tm local;
+  localtime_r(&time, &local);
+  return (uint32_t)(local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec) == SIM_ALARM_LOCAL_TIME;
+}
+
+// runBoot runs one boot of the firmware in a child process, until it
+// enters deep sleep. Returns false if it ended any other way.
+bool runBoot()
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0)
+  {
+    alarm(SIM_BOOT_TIMEOUT_S);
+    simBoot();
+    setup();
+    for (;;)
+    {
+      loop();
+    }
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status))
+  {
+    fprintf(stderr, "boot %u killed by signal %d (%s)\n", simWorld->stats.boots, WTERMSIG(status), strsignal(WTERMSIG(status)));
+    return false;
+  }
+  if (WEXITSTATUS(status) != 0 || !simWorld->sleeping)
+  {
+    fprintf(stderr, "boot %u ended with status %d without sleeping\n", simWorld->stats.boots, WEXITSTATUS(status));
+    return false;
+  }
+  return true;
+}
+
+// savedWakeContext returns the wake context the firmware saved in RTC
+// memory before sleeping
+const WakeContext *savedWakeContext()
+{
+  return (const WakeContext *)(simWorld->rtc + ((char *)&wakeContext - __start_rtc_data));
+}
+
+// expectedWakeEpoch returns when the firmware expected to wake
+uint32_t expectedWakeEpoch()
+{
+  return savedWakeContext()->expectedWakeEpoch;
+}
+
+// isSyncWake returns true if the firmware expected to wake for a household
+// sync window rather than an alarm
+bool isSyncWake()
+{
+  return savedWakeContext()->syncWake;
+}
+
+// loseWakeContext corrupts the wake context in RTC memory, as a brown out
+// can, so the next boot finds it invalid
+void loseWakeContext()
+{
+  ((WakeContext *)savedWakeContext())->checksum ^= 1;
+}
+
+// writeHex writes a characteristic value as a line of hex
+void writeHex(FILE *file, const uint8_t *value, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    fprintf(file, "%02x", value[i]);
+  }
+  fputc('\n', file);
+}
+
+// loadRtc loads the RTC memory left by the last boot, so what it kept
+// can be encoded as the firmware would
+void loadRtc()
+{
+  memcpy(__start_rtc_data, simWorld->rtc, __stop_rtc_data - __start_rtc_data);
+  simWorld->bootUs = simWorld->nowUs;
+}
+
+// writeTrace writes the profile trace left by the last boot
+void writeTrace(FILE *file)
+{
+  loadRtc();
+  uint8_t trace[PROFILE_TRACE_ENCODED_SIZE];
+  writeHex(file, trace, profilerEncode(trace, sizeof(trace)));
+}
+
+// writeEnergy writes the energy totals left by the last boot
+void writeEnergy(FILE *file)
+{
+  loadRtc();
+  uint8_t totals[ENERGY_TOTALS_ENCODED_SIZE];
+  writeHex(file, totals, energyEncode(totals, sizeof(totals)));
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+int main(int argc, char *argv[])
+{
+  int logLevel = LOG_LEVEL_SILENT;
+  int32_t driftPpm = SIM_DEFAULT_DRIFT_PPM;
+  FILE *traceFile = NULL;
+  FILE *energyFile = NULL;
+  uint32_t benchDispatches = 0;
+  uint32_t latencyEvents = 0;
+  uint32_t schedulerRepeats = 0;
+  uint32_t curveFrames = 0;
+  uint32_t settingsTables = 0;
+  uint32_t protocolWrites = 0;
+  uint32_t gattConfigurations = 0;
+  uint32_t ntpSyncs = 0;
+  int32_t audioSeconds = -1;
+  int32_t lossPercent = -1;
+  uint32_t deltaRepeats = 0;
+  const char *patchPath = NULL;
+  const char *applyPath = NULL;
+  bool checkTimeZones = false;
+  uint32_t syncUnits = 0;
+  uint32_t httpRequests = 0;
+  bool householdSync = false;
+  int option;
+  while ((option = getopt(argc, argv, "vd:t:e:b:l:n:c:k:r:g:p:a:u:f:zs:w:yD:P:")) != -1)
+  {
+    switch (option)
+    {
+    case 'v':
+      logLevel = LOG_LEVEL_VERBOSE;
+      break;
+    case 'd':
+      driftPpm = atoi(optarg);
+      break;
+    case 't':
+      traceFile = fopen(optarg, "w");
+      if (traceFile == NULL)
+      {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    case 'e':
+      energyFile = fopen(optarg, "w");
+      if (energyFile == NULL)
+      {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    case 'b':
+      benchDispatches = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      latencyEvents = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      schedulerRepeats = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      curveFrames = strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      settingsTables = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      protocolWrites = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      gattConfigurations = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      ntpSyncs = strtoul(optarg, NULL, 10);
+      break;
+    case 'a':
+      audioSeconds = atoi(optarg);
+      break;
+    case 'u':
+      lossPercent = atoi(optarg);
+      break;
+    case 'f':
+      deltaRepeats = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      checkTimeZones = true;
+      break;
+    case 's':
+      syncUnits = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      httpRequests = strtoul(optarg, NULL, 10);
+      break;
+    case 'y':
+      householdSync = true;
+      break;
+    case 'D':
+      patchPath = optarg;
+      break;
+    case 'P':
+      applyPath = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-v] [-d clock drift in ppm] [-t trace file] [-e energy file] [-y] [cycles]\n"
+              "       %s [-v] -b dispatches | -l events | -n repeats | -c frames | -k tables | -r writes\n"
+              "                     | -g configurations | -p syncs | -a audio seconds | -u loss percent | -f repeats\n"
+              "                     | -z | -s units | -w requests\n"
+              "       %s -D patch file old image file new image file\n"
+              "       %s -P new image file old image file patch file\n",
+              argv[0], argv[0], argv[0], argv[0]);
+      return 2;
+    }
+  }
+  if (patchPath != NULL || applyPath != NULL)
+  {
+    if (argc - optind != 2)
+    {
+      fprintf(stderr, "%s needs two image files\n", patchPath != NULL ? "-D" : "-P");
+      return 2;
+    }
+    if (patchPath != NULL)
+    {
+      return simDeltaDiff(argv[optind], argv[optind + 1], patchPath) ? 0 : 1;
+    }
+    return simDeltaApply(argv[optind], argv[optind + 1], applyPath) ? 0 : 1;
+  }
+  uint32_t cycles = optind < argc ? strtoul(argv[optind], NULL, 10) : SIM_DEFAULT_CYCLES;
+
+  void *shared = mmap(NULL, sizeof(SimWorld), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("mmap");
+    return 1;
+  }
+  simWorld = (SimWorld *)shared;
+  memset(simWorld, 0, sizeof(SimWorld));
+
+  // after a cold boot the RTC memory holds garbage and the clock is not
+  // set; the songs partition starts erased
+  memset(simWorld->rtc, 0xA5, SIM_RTC_SIZE);
+  memset(simWorld->songs, 0xFF, SIM_SONGS_SIZE);
+  simWorld->wallClockOffsetMs = -SIM_START_EPOCH_MS;
+  simWorld->clockDriftPpm = driftPpm;
+  simWorld->wakeCause = HAL_WAKE_COLD_BOOT;
+  simWorld->logLevel = logLevel;
+  simWorld->householdSync = householdSync;
+  simWorld->ntp = SimNtpNetwork{SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 0};
+
+  if (benchDispatches > 0)
+  {
+    return simBenchStateMachine(benchDispatches) ? 0 : 1;
+  }
+  if (latencyEvents > 0)
+  {
+    return simLatencyCheck(latencyEvents) ? 0 : 1;
+  }
+  if (schedulerRepeats > 0)
+  {
+    return simSchedulerCheck(schedulerRepeats) ? 0 : 1;
+  }
+  if (curveFrames > 0)
+  {
+    return simCurveCheck(curveFrames) ? 0 : 1;
+  }
+  if (settingsTables > 0)
+  {
+    return simSettingsCheck(settingsTables) ? 0 : 1;
+  }
+  if (protocolWrites > 0)
+  {
+    return simProtocolCheck(protocolWrites) ? 0 : 1;
+  }
+  if (gattConfigurations > 0)
+  {
+    return simGattCheck(gattConfigurations) ? 0 : 1;
+  }
+  if (ntpSyncs > 0)
+  {
+    return simNtpCheck(ntpSyncs) ? 0 : 1;
+  }
+  if (audioSeconds >= 0)
+  {
+    return simAudioCheck(audioSeconds) ? 0 : 1;
+  }
+  if (lossPercent >= 0)
+  {
+    return simTransferSweep(lossPercent) ? 0 : 1;
+  }
+  if (deltaRepeats > 0)
+  {
+    return simDeltaCheck(deltaRepeats) ? 0 : 1;
+  }
+  if (checkTimeZones)
+  {
+    return simTimeZoneCheck() ? 0 : 1;
+  }
+  if (syncUnits > 0)
+  {
+    return simSyncCheck(syncUnits) ? 0 : 1;
+  }
+  if (httpRequests > 0)
+  {
+    return simHttpCheck(httpRequests) ? 0 : 1;
+  }
+  if (!simAudioInstallSongs())
+  {
+    fprintf(stderr, "the songs do not fit in the songs partition\n");
+    return 1;
+  }
+
+  // the alarms are checked against the time zone of the simulated phone
+  setenv("TZ", SIM_TIME_ZONE, 1);
+  tzset();
+  uint32_t offLocalTime = 0;
+  uint32_t syncWindows = 0;
+  uint32_t offSyncWindow = 0;
+  uint32_t outOfSync = 0;
+  uint32_t alarmsCutShort = 0;
+  uint32_t lostContexts = 0;
+  int64_t maxWakeErrorMs = 0;
+  int64_t firstWakeErrorMs = 0;
+  uint64_t startedAt = realTimeUs();
+
+  if (!runBoot())
+  {
+    return 1;
+  }
+  if (traceFile != NULL)
+  {
+    writeTrace(traceFile);
+  }
+  for (uint32_t cycle = 0; cycle < cycles; cycle++)
+  {
+    // the deep sleep timer runs on the drifting device clock
+    simWorld->nowUs += simWorld->sleepUs * 1000000 / (1000000 + simWorld->clockDriftPpm);
+    simWorld->sleeping = 0;
+    simWorld->wakeCause = HAL_WAKE_TIMER;
+    simWorld->stats.timerWakes++;
+
+    int64_t wakeErrorMs = SIM_START_EPOCH_MS + (int64_t)(simWorld->nowUs / 1000) - (int64_t)expectedWakeEpoch() * 1000;
+    int64_t &wakeError = savedWakeContext()->clock.driftSamples > 0 ? maxWakeErrorMs : firstWakeErrorMs;
+    if (llabs(wakeErrorMs) > wakeError)
+    {
+      wakeError = llabs(wakeErrorMs);
+    }
+    bool syncWake = isSyncWake();
+    if (syncWake)
+    {
+      syncWindows++;
+      if (expectedWakeEpoch() % HOUSEHOLD_SYNC_PERIOD_S != HOUSEHOLD_SYNC_PHASE_S)
+      {
+        offSyncWindow++;
+      }
+    }
+    else if (!isLocalAlarmTime(expectedWakeEpoch()))
+    {
+      offLocalTime++;
+    }
+
+    bool buttonPressed = !syncWake && cycle % SIM_BUTTON_CYCLES == SIM_BUTTON_CYCLES - 1;
+    if (buttonPressed)
+    {
+      simWorld->buttonPressUs = simWorld->nowUs + SIM_BUTTON_AFTER_US;
+    }
+
+    if (!syncWake && !buttonPressed && cycle % SIM_LOST_CONTEXT_CYCLES == SIM_LOST_CONTEXT_CYCLES - 2)
+    {
+      loseWakeContext();
+      lostContexts++;
+    }
+
+    uint64_t wokeUs = simWorld->nowUs;
+    if (!runBoot())
+    {
+      return 1;
+    }
+    // an alarm nobody stops rings at full volume past the sunrise, until
+    // it times out
+    if (!syncWake && !buttonPressed &&
+        simWorld->audioWrittenUs < wokeUs + (uint64_t)(SUNRISE_DURATION_MS + SUNRISE_ALARM_TIMEOUT_MS) * 1000)
+    {
+      alarmsCutShort++;
+    }
+    if (syncWake && !simSyncPeerMatches(&savedWakeContext()->householdSync, &savedWakeContext()->alarms))
+    {
+      outOfSync++;
+    }
+    if (traceFile != NULL)
+    {
+      writeTrace(traceFile);
+    }
+  }
+
+  double elapsedS = (realTimeUs() - startedAt) / 1e6;
+  if (energyFile != NULL)
+  {
+    writeEnergy(energyFile);
+  }
+  const SimStats &stats = simWorld->stats;
+  printf("cycles:              %u\n", cycles);
+  printf("boots:               %u (%.0f per second)\n", stats.boots, stats.boots / elapsedS);
+  printf("real time:           %.3f s (%.0f cycles per second)\n", elapsedS, cycles / elapsedS);
+  printf("virtual time:        %.1f days\n", simWorld->nowUs / 86400e6);
+  printf("awake per boot:      %.1f s (virtual)\n", stats.awakeUs / 1e6 / stats.boots);
+  printf("button presses:      %u\n", stats.buttonPresses);
+  printf("frames shown:        %llu\n", (unsigned long long)stats.framesShown);
+  printf("wake to first frame: %.1f ms (max %.1f ms, virtual)\n",
+         stats.firstFrames > 0 ? stats.firstFrameUs / 1e3 / stats.firstFrames : 0.0, stats.maxFirstFrameUs / 1e3);
+  printf("songs played:        %u (%.1f s of audio, %u underruns)\n", stats.songsPlayed,
+         stats.audioUs / 1e6, stats.audioUnderruns);
+  printf("ntp exchanges:       %u\n", stats.ntpExchanges);
+  printf("settings reads:      %u\n", stats.kvReads);
+  printf("settings writes:     %u\n", stats.kvWrites);
+  printf("max wake error:      %lld ms (%lld ms before the drift was known)\n", (long long)maxWakeErrorMs,
+         (long long)firstWakeErrorMs);
+  printf("local time misses:   %u\n", offLocalTime);
+  printf("alarms cut short:    %u (%u wake contexts lost before one)\n", alarmsCutShort, lostContexts);
+  if (householdSync)
+  {
+    printf("sync windows:        %u (%u off time, %u out of sync, %u peer changes)\n", syncWindows, offSyncWindow,
+           outOfSync, simWorld->syncPeer.changes);
+    printf("sync packets:        %u sent (%llu bytes), %u received (%llu bytes)\n", stats.syncPacketsSent,
+           (unsigned long long)stats.syncBytesSent, stats.syncPacketsReceived, (unsigned long long)stats.syncBytesReceived);
+  }
+
+  if (stats.maxFirstFrameUs > SIM_MAX_FIRST_FRAME_US)
+  {
+    fprintf(stderr, "the first frame took up to %.1f ms after a timer wake\n", stats.maxFirstFrameUs / 1e3);
+    return 1;
+  }
+  if (maxWakeErrorMs > SIM_MAX_WAKE_ERROR_MS)
+  {
+    fprintf(stderr, "a timer wake was %lld ms off\n", (long long)maxWakeErrorMs);
+    return 1;
+  }
+  if (stats.audioUnderruns > 0)
+  {
+    fprintf(stderr, "the audio output ran dry %u times\n", stats.audioUnderruns);
+    return 1;
+  }
+  if (offLocalTime > 0)
+  {
+    fprintf(stderr, "%u alarms were not set for %02u:%02u local time\n", offLocalTime, SIM_ALARM_LOCAL_TIME / 3600,
+            SIM_ALARM_LOCAL_TIME / 60 % 60);
+    return 1;
+  }
+  if (alarmsCutShort > 0)
+  {
+    fprintf(stderr, "%u alarms stopped ringing before the button or their timeout\n", alarmsCutShort);
+    return 1;
+  }
+  if (householdSync && (syncWindows == 0 || offSyncWindow > 0 || outOfSync > 0))
+  {
+    fprintf(stderr, "%u household sync windows, %u off time, %u left the device out of sync\n", syncWindows,
+            offSyncWindow, outOfSync);
+    return 1;
+  }
+  return 0;
+}
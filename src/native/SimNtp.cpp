@@ -0,0 +1,289 @@
+// The NTP stand-in of the native simulation, and its check. The stand-in
+// is a UDP socket on the loopback interface, answering for pool.ntp.org
+// port 123 only (see halUdpOpen in HalNative.cpp). It takes each request
+// in as it is sent, and sends the answer when the network of
+// SimWorld.ntp would bring it back, in virtual time: after the delay of
+// each way, up to the jitter more, from a server clock off the real time
+// by the offset.
+// simNtpCheck syncs the clock of the firmware (see TimeKeeper.h) with it
+// once a day, over clocks drifting either way, a clock set a day off,
+// uneven and jittery delays, a server off the real time and a round trip
+// over the timeout. After each sync the clock must be as close to the
+// server as the round trip allows, and once the drift is estimated, the
+// deep sleep timer must wake the device for an alarm a day later within
+// a bound of it.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../Events.h"
+#include "../Settings.h"
+#include "../TimeKeeper.h"
+#include "../TimeSync.h"
+#include "../WakeContext.h"
+#include "../WifiServices.h"
+#include "Simulation.h"
+
+const char SIM_NTP_HOST[] = "pool.ntp.org";
+const uint16_t SIM_NTP_PORT = 123;
+
+// the requests the stand-in can be answering at once; more are dropped
+const int SIM_NTP_PENDING = 4;
+
+// the largest clock error a sync may leave on top of what the round trip
+// allows, and a sleep on top of that, for the rounding to milliseconds
+// and seconds along the way
+const int64_t SIM_NTP_SLACK_MS = 2;
+
+// SimNtpAnswer is an answer of the stand-in, sent once due
+struct SimNtpAnswer
+{
+  uint64_t dueUs;
+  struct sockaddr_in client;
+  uint8_t packet[NTP_PACKET_SIZE];
+};
+
+// SimNtpCase is a clock and a network the firmware syncs over: the
+// clock drifting that fast and set that far off the real time
+struct SimNtpCase
+{
+  const char *name;
+  int32_t driftPpm;
+  int64_t clockOffsetMs;
+  SimNtpNetwork network;
+  bool syncs;
+};
+
+const SimNtpCase SIM_NTP_CASES[] = {
+    {"steady clock", 0, 0, {SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 0}, true},
+    {"clock 40 ppm fast", 40, 0, {SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 0}, true},
+    {"clock 200 ppm slow", -200, 0, {SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 0}, true},
+    {"clock a day off", 40, 86400000, {SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 0}, true},
+    {"uneven delays", 40, 0, {5, 120, 0, 0}, true},
+    {"jittery delays", -100, 0, {20, 20, 150, 0}, true},
+    {"server 800 ms off", 40, 0, {SIM_NETWORK_DELAY_MS, SIM_NETWORK_DELAY_MS, 0, 800}, true},
+    {"round trip too long", 40, 0, {150, 300, 0, 0}, false},
+};
+
+int ntpServerSocket = -1;
+uint16_t ntpServerPort = 0;
+SimNtpAnswer ntpAnswers[SIM_NTP_PENDING];
+int ntpAnswerCount = 0;
+uint32_t ntpSeed = 11;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint32_t ntpRandom()
+{
+  ntpSeed = ntpSeed * 1103515245 + 12345;
+  return ntpSeed >> 1;
+}
+
+// ntpWayUs returns the delay of a packet one way, in microseconds
+uint64_t ntpWayUs(uint32_t delayMs)
+{
+  uint32_t jitterMs = simWorld->ntp.jitterMs > 0 ? ntpRandom() % (simWorld->ntp.jitterMs + 1) : 0;
+  return (uint64_t)(delayMs + jitterMs) * 1000;
+}
+
+// writeNtpTimestamp stores unix milliseconds as a big endian NTP timestamp
+void writeNtpTimestamp(uint8_t *buffer, int64_t unixMs)
+{
+  uint32_t seconds = (uint32_t)(unixMs / 1000) + 2208988800UL;
+  uint32_t fraction = (uint32_t)(((uint64_t)(unixMs % 1000) << 32) / 1000);
+  for (int i = 0; i < 4; i++)
+  {
+    buffer[i] = seconds >> (24 - 8 * i);
+    buffer[4 + i] = fraction >> (24 - 8 * i);
+  }
+}
+
+// serverNowMs returns the time on the clock of the server
+int64_t serverNowMs(uint64_t atUs)
+{
+  return SIM_START_EPOCH_MS + (int64_t)(atUs / 1000) + simWorld->ntp.serverOffsetMs;
+}
+
+// openNtpServer opens the socket of the stand-in, once per process
+bool openNtpServer()
+{
+  if (ntpServerSocket >= 0)
+  {
+    return true;
+  }
+  int server = socket(AF_INET, SOCK_DGRAM, 0);
+  if (server < 0)
+  {
+    return false;
+  }
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || fcntl(server, F_SETFL, O_NONBLOCK) != 0 ||
+      getsockname(server, (struct sockaddr *)&address, &length) != 0)
+  {
+    close(server);
+    return false;
+  }
+  ntpServerSocket = server;
+  ntpServerPort = ntohs(address.sin_port);
+  return true;
+}
+
+// takeRequests answers the requests waiting on the socket, the answers
+// to be sent once the network brought the request there and them back
+void takeRequests()
+{
+  uint8_t request[NTP_PACKET_SIZE + 1];
+  struct sockaddr_in client;
+  socklen_t length = sizeof(client);
+  ssize_t received;
+  while ((received = recvfrom(ntpServerSocket, request, sizeof(request), 0, (struct sockaddr *)&client, &length)) >= 0)
+  {
+    length = sizeof(client);
+    if (received != NTP_PACKET_SIZE || ntpAnswerCount == SIM_NTP_PENDING)
+    {
+      continue;
+    }
+    uint64_t upUs = ntpWayUs(simWorld->ntp.upDelayMs);
+    uint64_t downUs = ntpWayUs(simWorld->ntp.downDelayMs);
+    int64_t receivedMs = serverNowMs(simWorld->nowUs + upUs);
+
+    SimNtpAnswer &answer = ntpAnswers[ntpAnswerCount++];
+    answer.dueUs = simWorld->nowUs + upUs + downUs;
+    answer.client = client;
+    memset(answer.packet, 0, NTP_PACKET_SIZE);
+    answer.packet[0] = (4 << 3) | 4;
+    answer.packet[1] = 2;
+    memcpy(answer.packet + 24, request + 40, 8);
+    writeNtpTimestamp(answer.packet + 32, receivedMs);
+    writeNtpTimestamp(answer.packet + 40, receivedMs);
+    simWorld->stats.ntpExchanges++;
+  }
+}
+
+// runNtpCase syncs over a case once a day, each time sleeping for an
+// alarm a day later, and prints how close the clock and the wakes were
+void runNtpCase(const SimNtpCase &ntpCase, uint32_t syncs)
+{
+  memset(&wakeContext.clock, 0, sizeof(ClockModel));
+  simWorld->clockDriftPpm = ntpCase.driftPpm;
+  simWorld->wallClockOffsetMs = ntpCase.clockOffsetMs;
+  simWorld->ntp = ntpCase.network;
+  const SimNtpNetwork &network = ntpCase.network;
+  int64_t uneven = llabs((int64_t)network.upDelayMs - network.downDelayMs) + network.jitterMs;
+  int64_t clockBoundMs = uneven / 2 + SIM_NTP_SLACK_MS;
+  int64_t wakeBoundMs = 3 * clockBoundMs + SIM_NTP_SLACK_MS;
+
+  int64_t maxClockMs = 0;
+  int64_t firstWakeMs = 0;
+  int64_t maxWakeMs = 0;
+  uint32_t synced = 0;
+  for (uint32_t i = 0; i < syncs; i++)
+  {
+    int64_t offsetMs = simWorld->wallClockOffsetMs;
+    if (!timeKeeperSync())
+    {
+      simExpect(!ntpCase.syncs, ntpCase.name, "the clock syncs");
+      simExpect(simWorld->wallClockOffsetMs == offsetMs, ntpCase.name, "a failed sync leaves the clock alone");
+      simAdvance((uint64_t)SECONDS_PER_DAY * 1000000);
+      continue;
+    }
+    simExpect(ntpCase.syncs, ntpCase.name, "a round trip over the timeout is refused");
+    synced++;
+    int64_t clockMs = llabs(timeKeeperNowMs() - serverNowMs(simWorld->nowUs));
+    maxClockMs = clockMs > maxClockMs ? clockMs : maxClockMs;
+
+    // sleep for an alarm a day later, the timer running on the drifting clock
+    bool driftKnown = wakeContext.clock.driftSamples > 0;
+    uint32_t alarmEpoch = serverNowMs(simWorld->nowUs) / 1000 + SECONDS_PER_DAY;
+    uint64_t sleepUs = timeKeeperSleepUs(alarmEpoch);
+    simWorld->nowUs += sleepUs * 1000000 / (1000000 + simWorld->clockDriftPpm);
+    int64_t wakeMs = llabs(serverNowMs(simWorld->nowUs) - (int64_t)alarmEpoch * 1000);
+    if (!driftKnown)
+    {
+      firstWakeMs = wakeMs > firstWakeMs ? wakeMs : firstWakeMs;
+    }
+    else if (wakeMs > maxWakeMs)
+    {
+      maxWakeMs = wakeMs;
+    }
+  }
+  simExpect(maxClockMs <= clockBoundMs, ntpCase.name, "the clock error after a sync");
+  simExpect(maxWakeMs <= wakeBoundMs, ntpCase.name, "the wake error once the drift is known");
+
+  printf("%-20s %7u %12lld %12lld %14lld %12lld %12.1f\n", ntpCase.name, synced, (long long)maxClockMs,
+         (long long)clockBoundMs, (long long)firstWakeMs, (long long)maxWakeMs,
+         -wakeContext.clock.driftPpb / 1000.0);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simNtpResolve returns the loopback port of the stand-in if it answers
+// for that host and port, 0 if none does
+uint16_t simNtpResolve(const char *host, uint16_t port)
+{
+  if (strcmp(host, SIM_NTP_HOST) != 0 || port != SIM_NTP_PORT || !openNtpServer())
+  {
+    return 0;
+  }
+  return ntpServerPort;
+}
+
+// simNtpServe takes the requests sent to the stand-in in, and sends the
+// answers due by now; it runs whenever the firmware sends or polls for
+// a datagram
+void simNtpServe()
+{
+  if (ntpServerSocket < 0)
+  {
+    return;
+  }
+  takeRequests();
+  int kept = 0;
+  for (int i = 0; i < ntpAnswerCount; i++)
+  {
+    const SimNtpAnswer &answer = ntpAnswers[i];
+    if (answer.dueUs > simWorld->nowUs)
+    {
+      ntpAnswers[kept++] = answer;
+      continue;
+    }
+    sendto(ntpServerSocket, answer.packet, NTP_PACKET_SIZE, 0, (const struct sockaddr *)&answer.client,
+           sizeof(answer.client));
+  }
+  ntpAnswerCount = kept;
+}
+
+// simNtpCheck syncs the clock over each case that many times
+bool simNtpCheck(uint32_t syncs)
+{
+  eventsInit();
+  settingsInit();
+  settingsSaveWifiSsid(SIM_WIFI_SSID);
+  connectWifi();
+  simExpect(halUdpOpen(SIM_NTP_HOST, SIM_NTP_PORT, 0) && !halUdpOpen("time.example.org", SIM_NTP_PORT, 0) &&
+                !halUdpOpen(SIM_NTP_HOST, SIM_NTP_PORT + 1, 0),
+            "the stand-in", "answers for its host and port only");
+  halUdpClose();
+
+  printf("%-20s %7s %12s %12s %14s %12s %12s\n", "case", "syncs", "clock (ms)", "bound (ms)", "first wake",
+         "wake (ms)", "drift (ppm)");
+  for (const SimNtpCase &ntpCase : SIM_NTP_CASES)
+  {
+    runNtpCase(ntpCase, syncs);
+  }
+  printf("ntp checks:          %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
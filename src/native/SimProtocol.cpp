@@ -0,0 +1,410 @@
+// The alarm protocol on the host. simProtocolCheck fuzzes the parser of
+// the alarm writes (see AlarmProtocol.h): random bytes, and binary and CSV
+// records of valid alarms with bytes flipped, inserted, removed, the
+// record cut short or run on. Each input is placed right before a page
+// that cannot be read, so a read past its end crashes the check. An alarm
+// accepted must be valid and encode to a record parsing back to it, and
+// the valid alarms must parse back from both formats. Then it compares
+// the parse cost and heap use of both formats with the path the parser
+// replaced, StringSplitter over a String copy of the write, reimplemented
+// below; its Strings are std::strings here, which keep short values
+// inline as the String of the ESP32 core does.
+
+#include <malloc.h>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "../AlarmProtocol.h"
+#include "../AlarmScheduler.h"
+#include "Simulation.h"
+
+// the longest fuzz input, well past the longest record
+const size_t SIM_PROTOCOL_MAX_INPUT = ALARM_RECORD_MAX_SIZE + 16;
+
+// the bytes mutations of CSV records are made of
+const char SIM_PROTOCOL_CSV_BYTES[] = ",,0123456789-+ a\xff";
+
+// SimProtocolCost is the cost of a parse path, per write
+struct SimProtocolCost
+{
+  const char *name;
+  double ns;
+  double allocations;
+  double bytes;
+  double leakedBytes;
+};
+
+uint32_t protocolSeed = 11;
+uint32_t protocolStatuses[ALARM_STATUS_SONG_TOO_LONG + 1];
+
+// the heap use of the sim, counted while protocolCounting is set
+bool protocolCounting = false;
+uint64_t protocolAllocations = 0;
+uint64_t protocolAllocatedBytes = 0;
+int64_t protocolLiveBytes = 0;
+
+// the page an input ends at, followed by one that cannot be read
+uint8_t *protocolPage = nullptr;
+size_t protocolPageSize = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+void expectProtocol(bool ok, const char *what, const uint8_t *input, size_t length)
+{
+  if (simExpect(ok, "alarm protocol", what) || simFailures > SIM_EXPECT_MAX_REPORTS)
+  {
+    return;
+  }
+  fprintf(stderr, " ");
+  for (size_t i = 0; i < length; i++)
+  {
+    fprintf(stderr, " %02x", input[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+uint32_t protocolRandom()
+{
+  protocolSeed = protocolSeed * 1103515245 + 12345;
+  return protocolSeed >> 1;
+}
+
+uint64_t protocolNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// randomAlarm returns a valid alarm, at the edges of its ranges at times;
+// the song never holds a comma, so it can be written as CSV
+Alarm randomAlarm()
+{
+  Alarm alarm = {};
+  alarm.number = 1 + protocolRandom() % MAX_ALARMS;
+  uint32_t pick = protocolRandom() % 4;
+  alarm.when = pick == 0 ? 0 : pick == 1 ? SECONDS_PER_DAY - 1 : protocolRandom() % SECONDS_PER_DAY;
+  alarm.activeMatrix = 1 + protocolRandom() % 0x7F;
+  uint32_t length = protocolRandom() % ALARM_SONG_SIZE;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    alarm.song[i] = 'a' + protocolRandom() % 26;
+  }
+  return alarm;
+}
+
+size_t writeCsv(const Alarm &alarm, uint8_t *buffer, size_t size)
+{
+  int length = snprintf((char *)buffer, size, "%u,%d,%s,%u", alarm.number, alarm.when, alarm.song,
+                        alarm.activeMatrix);
+  return length < 0 || (size_t)length >= size ? size - 1 : length;
+}
+
+// mutate changes a record a few times: a byte flipped or set, inserted
+// or removed, the record cut short or run on
+size_t mutate(uint8_t *input, size_t length, bool csv)
+{
+  uint32_t mutations = 1 + protocolRandom() % 3;
+  for (uint32_t m = 0; m < mutations; m++)
+  {
+    uint8_t byte = csv ? SIM_PROTOCOL_CSV_BYTES[protocolRandom() % (sizeof(SIM_PROTOCOL_CSV_BYTES) - 1)]
+                       : (uint8_t)protocolRandom();
+    size_t at = length > 0 ? protocolRandom() % length : 0;
+    switch (protocolRandom() % 5)
+    {
+    case 0:
+      if (length > 0)
+      {
+        input[at] = csv ? byte : input[at] ^ (1 << protocolRandom() % 8);
+      }
+      break;
+    case 1:
+      if (length < SIM_PROTOCOL_MAX_INPUT)
+      {
+        memmove(input + at + 1, input + at, length - at);
+        input[at] = byte;
+        length++;
+      }
+      break;
+    case 2:
+      if (length > 0)
+      {
+        memmove(input + at, input + at + 1, length - at - 1);
+        length--;
+      }
+      break;
+    case 3:
+      length = at;
+      break;
+    default:
+      while (length < SIM_PROTOCOL_MAX_INPUT && protocolRandom() % 2 == 0)
+      {
+        input[length++] = byte;
+      }
+      break;
+    }
+  }
+  return length;
+}
+
+// parseAtPageEnd parses an input placed right before the page that
+// cannot be read
+AlarmStatus parseAtPageEnd(const uint8_t *input, size_t length, Alarm *alarm)
+{
+  uint8_t *at = protocolPage + protocolPageSize - length;
+  memcpy(at, input, length);
+  return alarmProtocolParse(at, length, alarm);
+}
+
+// checkParsed checks what the parser made of an input: a known status,
+// and an accepted alarm valid and parsing back from its record
+void checkParsed(const uint8_t *input, size_t length)
+{
+  Alarm alarm;
+  memset(&alarm, 0xA5, sizeof(Alarm));
+  AlarmStatus status = parseAtPageEnd(input, length, &alarm);
+  bool known = status <= ALARM_STATUS_SONG_TOO_LONG && status != ALARM_STATUS_NOT_SAVED;
+  expectProtocol(known, "a known status", input, length);
+  if (!known)
+  {
+    return;
+  }
+  protocolStatuses[status]++;
+  if (status != ALARM_STATUS_SUCCESS)
+  {
+    return;
+  }
+
+  expectProtocol(alarmValidate(&alarm) == ALARM_STATUS_SUCCESS, "an accepted alarm is valid", input, length);
+  uint8_t record[ALARM_RECORD_MAX_SIZE];
+  size_t size = alarmProtocolEncode(&alarm, record, sizeof(record));
+  Alarm back;
+  bool same = size > 0 && parseAtPageEnd(record, size, &back) == ALARM_STATUS_SUCCESS &&
+              memcmp(&alarm, &back, sizeof(Alarm)) == 0;
+  expectProtocol(same, "an accepted alarm parses back from its record", input, length);
+}
+
+// checkRoundTrip checks a valid alarm parses back from both formats, and
+// is not encoded into a buffer too small for its record
+void checkRoundTrip(const Alarm &alarm)
+{
+  uint8_t input[SIM_PROTOCOL_MAX_INPUT];
+  for (int format = 0; format < 2; format++)
+  {
+    size_t length = format == 0 ? alarmProtocolEncode(&alarm, input, sizeof(input))
+                                : writeCsv(alarm, input, sizeof(input));
+    Alarm back;
+    bool same = parseAtPageEnd(input, length, &back) == ALARM_STATUS_SUCCESS &&
+                memcmp(&alarm, &back, sizeof(Alarm)) == 0;
+    expectProtocol(same, format == 0 ? "a binary record parses back" : "a CSV record parses back", input, length);
+  }
+  size_t size = ALARM_RECORD_HEADER_SIZE + strlen(alarm.song);
+  expectProtocol(alarmProtocolEncode(&alarm, input, size - 1) == 0, "a record is not encoded short", input, 0);
+}
+
+// fuzz parses that many inputs: random bytes, and records of valid alarms
+// in both formats, mutated or whole
+void fuzz(uint32_t writes)
+{
+  uint8_t input[SIM_PROTOCOL_MAX_INPUT];
+  for (uint32_t i = 0; i < writes && simFailures == 0; i++)
+  {
+    Alarm alarm = randomAlarm();
+    size_t length = 0;
+    uint32_t kind = protocolRandom() % 8;
+    if (kind == 0)
+    {
+      length = protocolRandom() % (SIM_PROTOCOL_MAX_INPUT + 1);
+      for (size_t b = 0; b < length; b++)
+      {
+        input[b] = protocolRandom();
+      }
+    }
+    else if (kind <= 4)
+    {
+      length = alarmProtocolEncode(&alarm, input, sizeof(input));
+      length = kind == 1 ? length : mutate(input, length, false);
+    }
+    else
+    {
+      length = writeCsv(alarm, input, sizeof(input));
+      length = kind == 5 ? length : mutate(input, length, true);
+    }
+    if (kind == 1 || kind == 5)
+    {
+      checkRoundTrip(alarm);
+    }
+    checkParsed(input, length);
+  }
+}
+
+// LegacySplitter is the StringSplitter the CSV path used: up to limit
+// fields, the last holding the rest of the value, each a String copy
+struct LegacySplitter
+{
+  std::string items[4];
+  int count;
+
+  LegacySplitter(const std::string &value, char delimiter, int limit) : count(0)
+  {
+    size_t start = 0;
+    while (count < limit - 1)
+    {
+      size_t end = value.find(delimiter, start);
+      if (end == std::string::npos)
+      {
+        break;
+      }
+      items[count++] = value.substr(start, end - start);
+      start = end + 1;
+    }
+    items[count++] = value.substr(start);
+  }
+};
+
+// legacyParse is the CSV path the parser replaced: the write copied to a
+// String, split by a StringSplitter that was never freed, and each field
+// converted with toInt
+bool legacyParse(const uint8_t *data, size_t length, Alarm *alarm)
+{
+  std::string value((const char *)data, length);
+  LegacySplitter *splitter = new LegacySplitter(value, ',', 4);
+  if (splitter->count != 4)
+  {
+    return false;
+  }
+  memset(alarm, 0, sizeof(Alarm));
+  alarm->number = strtol(splitter->items[0].c_str(), nullptr, 10);
+  alarm->when = strtol(splitter->items[1].c_str(), nullptr, 10);
+  snprintf(alarm->song, ALARM_SONG_SIZE, "%s", splitter->items[2].c_str());
+  alarm->activeMatrix = strtol(splitter->items[3].c_str(), nullptr, 10);
+  return alarm->number != 0 && alarm->when != 0 && alarm->activeMatrix != 0;
+}
+
+// measure parses the writes that many times along a path, counting the
+// time and the heap it takes per write
+SimProtocolCost measure(const char *name, int path, const uint8_t writes[][SIM_PROTOCOL_MAX_INPUT],
+                        const size_t *lengths, uint32_t count, uint32_t repeats)
+{
+  volatile uint32_t sink = 0;
+  protocolAllocations = 0;
+  protocolAllocatedBytes = 0;
+  protocolLiveBytes = 0;
+  protocolCounting = true;
+  uint64_t startedAt = protocolNanos();
+  for (uint32_t r = 0; r < repeats; r++)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      Alarm alarm = {};
+      bool ok = path == 2 ? legacyParse(writes[i], lengths[i], &alarm)
+                          : alarmProtocolParse(writes[i], lengths[i], &alarm) == ALARM_STATUS_SUCCESS;
+      sink = sink + ok + alarm.when;
+    }
+  }
+  uint64_t elapsedNs = protocolNanos() - startedAt;
+  protocolCounting = false;
+  double parses = (double)repeats * count;
+  return SimProtocolCost{name, elapsedNs / parses, protocolAllocations / parses, protocolAllocatedBytes / parses,
+                         protocolLiveBytes / parses};
+}
+
+// compareCosts times the parse of a few typical writes, as binary records,
+// as CSV and along the path the parser replaced
+void compareCosts(uint32_t writes)
+{
+  const Alarm alarms[] = {{1, 25200, "sunrise", 127}, {2, 23400, "birds-in-the-morning", 62}, {4, 86399, "", 65}};
+  const uint32_t count = sizeof(alarms) / sizeof(Alarm);
+  uint8_t binary[count][SIM_PROTOCOL_MAX_INPUT];
+  uint8_t csv[count][SIM_PROTOCOL_MAX_INPUT];
+  size_t binaryLengths[count];
+  size_t csvLengths[count];
+  for (uint32_t i = 0; i < count; i++)
+  {
+    binaryLengths[i] = alarmProtocolEncode(&alarms[i], binary[i], SIM_PROTOCOL_MAX_INPUT);
+    csvLengths[i] = writeCsv(alarms[i], csv[i], SIM_PROTOCOL_MAX_INPUT);
+  }
+
+  uint32_t repeats = writes / count > 0 ? writes / count : 1;
+  const SimProtocolCost costs[] = {measure("binary", 0, binary, binaryLengths, count, repeats),
+                                   measure("CSV", 1, csv, csvLengths, count, repeats),
+                                   measure("StringSplitter", 2, csv, csvLengths, count, repeats)};
+  printf("%-16s %10s %12s %12s %12s\n", "path", "parse (ns)", "allocations", "heap bytes", "leaked bytes");
+  for (const SimProtocolCost &cost : costs)
+  {
+    printf("%-16s %10.1f %12.2f %12.1f %12.1f\n", cost.name, cost.ns, cost.allocations, cost.bytes, cost.leakedBytes);
+  }
+  expectProtocol(costs[0].allocations == 0 && costs[1].allocations == 0, "the parser does not allocate", nullptr, 0);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simProtocolCheck fuzzes the alarm protocol with that many inputs, then
+// times that many parses of each path
+bool simProtocolCheck(uint32_t writes)
+{
+  protocolPageSize = sysconf(_SC_PAGESIZE);
+  void *pages = mmap(NULL, 2 * protocolPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED || mprotect((uint8_t *)pages + protocolPageSize, protocolPageSize, PROT_NONE) != 0)
+  {
+    perror("mmap");
+    return false;
+  }
+  protocolPage = (uint8_t *)pages;
+
+  fuzz(writes);
+  printf("fuzzed writes:       %u (%u accepted)\n", writes, protocolStatuses[ALARM_STATUS_SUCCESS]);
+  printf("statuses:           ");
+  for (uint32_t status = 0; status <= ALARM_STATUS_SONG_TOO_LONG; status++)
+  {
+    printf(" %u:%u", status, protocolStatuses[status]);
+  }
+  printf("\n");
+  compareCosts(writes);
+  munmap(pages, 2 * protocolPageSize);
+
+  printf("alarm protocol checks: %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
+
+// every allocation of the sim goes through these, counted while a parse
+// path is measured
+void *operator new(size_t size)
+{
+  void *pointer = malloc(size > 0 ? size : 1);
+  if (pointer == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  if (protocolCounting)
+  {
+    protocolAllocations++;
+    protocolAllocatedBytes += size;
+    protocolLiveBytes += malloc_usable_size(pointer);
+  }
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+  if (protocolCounting && pointer != nullptr)
+  {
+    protocolLiveBytes -= malloc_usable_size(pointer);
+  }
+  free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  operator delete(pointer);
+}
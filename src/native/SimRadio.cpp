@@ -0,0 +1,171 @@
+// The radios for the native simulation: wifi connects at once to the
+// configured network, and a simulated phone configures the device over
+// BLE, joining the household sync with -y, and sends it to sleep once
+// per boot, when the configuration state brings BLE up.
+
+#include <Arduino.h>
+
+#include "../AlarmProtocol.h"
+#include "../ConfigurationBLE.h"
+#include "../Energy.h"
+#include "../Events.h"
+#include "../GlobalStatus.h"
+#include "../Logger.h"
+#include "../Settings.h"
+#include "../SyncState.h"
+#include "../TimeKeeper.h"
+#include "../WifiServices.h"
+#include "Simulation.h"
+
+// the alarm the simulated phone configures, in the legacy format:
+// 07:00 every day, local time (see SIM_TIME_ZONE)
+const char *SIM_ALARM = "1,25200,sunrise,127";
+
+bool wifiConnected = false;
+bool wifiReconnectRequested = false;
+bool simPhoneSentToSleep = false;
+void (*wifiStatusCallback)() = nullptr;
+
+/* =========================================================================
+   Public functions: wifi
+   ========================================================================= */
+
+String getVerboseWifiStatus()
+{
+  return wifiConnected ? "connected" : "disconnected";
+}
+
+bool isWiFiConnected()
+{
+  return wifiConnected;
+}
+
+bool isWiFiConnecting()
+{
+  return false;
+}
+
+WifiConnectTimings getWifiConnectTimings()
+{
+  return WifiConnectTimings{};
+}
+
+void disconnectWifi()
+{
+  energyRadio(ENERGY_WIFI, false);
+  if (wifiConnected)
+  {
+    wifiConnected = false;
+    eventsPost(EVENT_WIFI_DISCONNECTED);
+  }
+}
+
+void connectWifi()
+{
+  if (wifiConnected || settingsGetWifiSsid() == "")
+  {
+    return;
+  }
+
+  energyRadio(ENERGY_WIFI, true);
+  simAdvance(SIM_WIFI_START_MS * 1000);
+  wifiConnected = true;
+  eventsPost(EVENT_WIFI_CONNECTED);
+  if (wifiStatusCallback != nullptr)
+  {
+    wifiStatusCallback();
+  }
+}
+
+void initWifi()
+{
+  connectWifi();
+}
+
+void setWifiStatusCallback(void (*callback)())
+{
+  wifiStatusCallback = callback;
+}
+
+// updateWifi reconnects, if asked to; the simulated wifi connects at once
+void updateWifi()
+{
+  if (wifiReconnectRequested)
+  {
+    wifiReconnectRequested = false;
+    disconnectWifi();
+    initWifi();
+  }
+}
+
+void requestWifiReconnect()
+{
+  wifiReconnectRequested = true;
+  eventsPost(EVENT_WIFI_WORK);
+}
+
+void forgetWifiLease()
+{
+}
+
+/* =========================================================================
+   Public functions: BLE
+   ========================================================================= */
+
+// initBLE plays the phone: configures the wifi and an alarm if there
+// is none yet and asks the device to go to sleep
+void initBLE()
+{
+  if (!globalStatus.isBleInitialized)
+  {
+    simAdvance(SIM_BLE_START_MS * 1000);
+  }
+  globalStatus.isBleInitialized = true;
+  energyRadio(ENERGY_BLE, true);
+
+  AlarmSchedule schedule;
+  if (settingsGetAlarmSchedule(&schedule) == 0)
+  {
+    LOG_NOTICE("simulated phone: configuring the device\n");
+    globalStatus.wifiSsid = SIM_WIFI_SSID;
+    globalStatus.wifiPassword = SIM_WIFI_PASSWORD;
+    settingsSaveWifiSsid(globalStatus.wifiSsid);
+    settingsSaveWifiPassword(globalStatus.wifiPassword);
+    initWifi();
+
+    Alarm alarm;
+    uint16_t firstYear = timeKeeperIsValid() ? timeZoneYear(timeKeeperNow()) : TIME_ZONE_DEFAULT_FIRST_YEAR;
+    if (alarmProtocolParse((const uint8_t *)SIM_ALARM, strlen(SIM_ALARM), &alarm) != ALARM_STATUS_SUCCESS || !settingsSaveAlarm(alarm) ||
+        settingsSaveTimeZone(SIM_TIME_ZONE, firstYear) != TIME_ZONE_SUCCESS || !settingsFlush())
+    {
+      simStall("could not configure the alarm");
+    }
+    if (simWorld->householdSync)
+    {
+      if (!syncStateEnable(true, SIM_HOUSEHOLD_KEY) || !settingsFlush())
+      {
+        simStall("could not enable the household sync");
+      }
+    }
+    eventsPost(EVENT_CONFIGURATION_CHANGED);
+  }
+
+  if (!simPhoneSentToSleep)
+  {
+    LOG_NOTICE("simulated phone: going to sleep\n");
+    simPhoneSentToSleep = true;
+    eventsPost(EVENT_GO_TO_SLEEP);
+  }
+}
+
+// updateFirmware has nothing to do, the simulated phone updates no firmware
+void updateFirmware()
+{
+}
+
+// deinitBLE turns the simulated radio off; initBLE plays the phone again
+void deinitBLE()
+{
+  globalStatus.isBleInitialized = false;
+  energyRadio(ENERGY_BLE, false);
+}
@@ -0,0 +1,260 @@
+// The alarm scheduler on the host. simSchedulerCheck checks the next
+// alarm the schedule finds (see AlarmScheduler.h) against a search of
+// every alarm on every day ahead: for a single alarm at midnight, at the
+// last second of the day and in between with each of the 127 weekday
+// masks, and for random sets of alarms, from every minute of a week, from
+// the seconds around each midnight and around each alarm, and across the
+// end of the week. Then it benchmarks the schedule against that search
+// over the full week of minute offsets.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../AlarmScheduler.h"
+#include "Simulation.h"
+
+// a Sunday at 00:00 UTC, the start of the week checked
+const uint32_t SIM_SCHEDULER_WEEK_START = 1767484800;
+const uint32_t SIM_SCHEDULER_MINUTES = DAYS_PER_WEEK * 24 * 60;
+
+const uint32_t SIM_SCHEDULER_RANDOM_SETS = 2000;
+const uint32_t SIM_SCHEDULER_SINGLE_TIMES[] = {0, 1, 7 * 3600, 12 * 3600, SECONDS_PER_DAY - 1};
+
+struct SimSchedulerAlarm
+{
+  uint8_t number;
+  uint32_t when;
+  uint8_t activeMatrix;
+};
+
+uint64_t schedulerChecks = 0;
+uint32_t schedulerSeed = 7;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint32_t schedulerRandom()
+{
+  schedulerSeed = schedulerSeed * 1103515245 + 12345;
+  return schedulerSeed >> 1;
+}
+
+uint64_t schedulerNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// searchNext is the reference: every alarm on every day from today to a
+// week ahead, the earliest after epoch winning, the first added on a tie
+bool searchNext(const SimSchedulerAlarm *alarms, uint8_t count, uint32_t epoch, uint32_t *secondsToNext,
+                uint8_t *alarmNumber)
+{
+  uint32_t dayStart = epoch - epoch % SECONDS_PER_DAY;
+  uint8_t weekday = (epoch / SECONDS_PER_DAY + 4) % DAYS_PER_WEEK;
+  bool found = false;
+  for (uint8_t ahead = 0; ahead <= DAYS_PER_WEEK; ahead++)
+  {
+    uint8_t day = (weekday + ahead) % DAYS_PER_WEEK;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      uint32_t fires = dayStart + ahead * SECONDS_PER_DAY + alarms[i].when;
+      if ((alarms[i].activeMatrix & (1 << day)) == 0 || fires <= epoch)
+      {
+        continue;
+      }
+      if (!found || fires - epoch < *secondsToNext)
+      {
+        *secondsToNext = fires - epoch;
+        *alarmNumber = alarms[i].number;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+bool buildSchedule(AlarmSchedule *schedule, const SimSchedulerAlarm *alarms, uint8_t count)
+{
+  alarmSchedulerClear(schedule);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (!alarmSchedulerAdd(schedule, alarms[i].number, alarms[i].when, alarms[i].activeMatrix))
+    {
+      return false;
+    }
+  }
+  alarmSchedulerBuild(schedule);
+  return true;
+}
+
+// checkFrom checks the next alarm from an epoch
+void checkFrom(const AlarmSchedule *schedule, const SimSchedulerAlarm *alarms, uint8_t count, uint32_t epoch)
+{
+  uint32_t expectedSeconds = 0;
+  uint8_t expectedNumber = 0;
+  bool expected = searchNext(alarms, count, epoch, &expectedSeconds, &expectedNumber);
+  uint32_t seconds = 0;
+  uint8_t number = 0;
+  bool found = alarmSchedulerNext(schedule, epoch, &seconds, &number);
+  schedulerChecks++;
+  if (found == expected && (!found || (seconds == expectedSeconds && number == expectedNumber)))
+  {
+    return;
+  }
+  simExpect(false, "scheduler", "the next alarm");
+  if (simFailures <= SIM_EXPECT_MAX_REPORTS)
+  {
+    fprintf(stderr, "  from %u with %u alarms (first at %u, mask 0x%02x): alarm %u in %u s, expected %u in %u s\n",
+            epoch, count, alarms[0].when, alarms[0].activeMatrix, number, seconds, expectedNumber, expectedSeconds);
+  }
+}
+
+// checkWeek checks the next alarm from every minute of a week, from the
+// seconds around each midnight and each alarm, and across the end of the
+// week into the next one
+void checkWeek(const SimSchedulerAlarm *alarms, uint8_t count)
+{
+  AlarmSchedule schedule;
+  if (!simExpect(buildSchedule(&schedule, alarms, count), "scheduler", "a valid set of alarms is accepted"))
+  {
+    return;
+  }
+  for (uint32_t minute = 0; minute < SIM_SCHEDULER_MINUTES; minute++)
+  {
+    checkFrom(&schedule, alarms, count, SIM_SCHEDULER_WEEK_START + minute * 60);
+  }
+  for (uint8_t day = 0; day <= DAYS_PER_WEEK; day++)
+  {
+    uint32_t midnight = SIM_SCHEDULER_WEEK_START + day * SECONDS_PER_DAY;
+    for (int32_t offset = -2; offset <= 2; offset++)
+    {
+      checkFrom(&schedule, alarms, count, midnight + offset);
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+      for (int32_t offset = -1; offset <= 1; offset++)
+      {
+        checkFrom(&schedule, alarms, count, midnight + alarms[i].when + offset);
+      }
+    }
+  }
+}
+
+// checkSingles checks an alarm alone, at the edges of the day and in
+// between, with every weekday mask
+void checkSingles()
+{
+  for (uint32_t when : SIM_SCHEDULER_SINGLE_TIMES)
+  {
+    for (uint8_t mask = 1; mask < 0x80; mask++)
+    {
+      SimSchedulerAlarm alarm = {1, when, mask};
+      checkWeek(&alarm, 1);
+    }
+  }
+}
+
+// checkRandomSets checks sets of 2 to MAX_ALARMS alarms, some at the same
+// time or at the edges of the day
+void checkRandomSets()
+{
+  SimSchedulerAlarm alarms[MAX_ALARMS];
+  for (uint32_t set = 0; set < SIM_SCHEDULER_RANDOM_SETS; set++)
+  {
+    uint8_t count = 2 + schedulerRandom() % (MAX_ALARMS - 1);
+    for (uint8_t i = 0; i < count; i++)
+    {
+      uint32_t pick = schedulerRandom() % 8;
+      uint32_t when = pick == 0 ? 0 : pick == 1 ? SECONDS_PER_DAY - 1 : schedulerRandom() % SECONDS_PER_DAY;
+      if (pick == 2 && i > 0)
+      {
+        when = alarms[i - 1].when;
+      }
+      alarms[i] = SimSchedulerAlarm{(uint8_t)(i + 1), when, (uint8_t)(1 + schedulerRandom() % 0x7F)};
+    }
+    checkWeek(alarms, count);
+  }
+}
+
+// checkLimits checks what the schedule refuses and the empty schedule
+void checkLimits()
+{
+  AlarmSchedule schedule;
+  alarmSchedulerClear(&schedule);
+  alarmSchedulerBuild(&schedule);
+  uint32_t seconds;
+  uint8_t number;
+  bool ok = !alarmSchedulerNext(&schedule, SIM_SCHEDULER_WEEK_START, &seconds, &number);
+  ok = ok && !alarmSchedulerAdd(&schedule, 1, SECONDS_PER_DAY, 0x7F) && !alarmSchedulerAdd(&schedule, 1, 0, 0) &&
+       !alarmSchedulerAdd(&schedule, 1, 0, 0x80);
+  for (uint8_t i = 0; i < SCHEDULER_MAX_ALARMS; i++)
+  {
+    ok = ok && alarmSchedulerAdd(&schedule, i + 1, i, 0x01);
+  }
+  ok = ok && !alarmSchedulerAdd(&schedule, SCHEDULER_MAX_ALARMS + 1, 0, 0x01);
+  simExpect(ok, "scheduler", "the schedule limits");
+}
+
+// benchmarkWeek times the next alarm from every minute of the week, with
+// the schedule and with the search, that many times over
+void benchmarkWeek(uint32_t repeats)
+{
+  const SimSchedulerAlarm alarms[MAX_ALARMS] = {
+      {1, 6 * 3600 + 30 * 60, 0x3E}, {2, 9 * 3600, 0x41}, {3, 7 * 3600, 0x3E}, {4, 23 * 3600 + 59 * 60, 0x10}};
+  AlarmSchedule schedule;
+  uint64_t startedAt = schedulerNanos();
+  for (uint32_t i = 0; i < repeats; i++)
+  {
+    buildSchedule(&schedule, alarms, MAX_ALARMS);
+  }
+  double buildNs = (double)(schedulerNanos() - startedAt) / repeats;
+
+  volatile uint32_t sink = 0;
+  double nextNs[2];
+  for (int path = 0; path < 2; path++)
+  {
+    startedAt = schedulerNanos();
+    for (uint32_t i = 0; i < repeats; i++)
+    {
+      for (uint32_t minute = 0; minute < SIM_SCHEDULER_MINUTES; minute++)
+      {
+        uint32_t epoch = SIM_SCHEDULER_WEEK_START + minute * 60;
+        uint32_t seconds = 0;
+        uint8_t number = 0;
+        if (path == 0)
+        {
+          alarmSchedulerNext(&schedule, epoch, &seconds, &number);
+        }
+        else
+        {
+          searchNext(alarms, MAX_ALARMS, epoch, &seconds, &number);
+        }
+        sink = sink + seconds + number;
+      }
+    }
+    nextNs[path] = (double)(schedulerNanos() - startedAt) / repeats / SIM_SCHEDULER_MINUTES;
+  }
+  printf("schedule:            %zu bytes, built in %.1f ns\n", sizeof(AlarmSchedule), buildNs);
+  printf("next alarm:          %.1f ns (search of every alarm on every day: %.1f ns)\n", nextNs[0], nextNs[1]);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simSchedulerCheck checks the alarm scheduler, then benchmarks the full
+// week that many times
+bool simSchedulerCheck(uint32_t repeats)
+{
+  checkLimits();
+  checkSingles();
+  checkRandomSets();
+  printf("scheduler checks:    %llu from %u alarm sets\n", (unsigned long long)schedulerChecks,
+         (uint32_t)(sizeof(SIM_SCHEDULER_SINGLE_TIMES) / sizeof(uint32_t)) * 0x7F + SIM_SCHEDULER_RANDOM_SETS);
+  benchmarkWeek(repeats);
+  printf("scheduler checks:    %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
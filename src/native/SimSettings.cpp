@@ -0,0 +1,312 @@
+// The settings on the host. simSettingsCheck runs each case in boots of
+// its own, forked processes as the firmware boots, all of them cold so
+// the settings come from the key-value store: alarm tables written and
+// read back, the per alarm keys of older firmware versions migrated to
+// the table, a song name too long for it dropped, a migration whose
+// writes fail, the keys kept until a later flush writes the table or the
+// next boot migrates them again, and a table and a setting saved while
+// the writes fail, written by the next flush once they work. It reports
+// the reads and writes of the key-value store of a boot of each kind.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../Logger.h"
+#include "../Settings.h"
+#include "Simulation.h"
+
+// the keys Settings.cpp stores the alarms under, now and before the
+// alarm table
+const char SIM_ALARM_TABLE_KEY[] = "alarm-table";
+const char *const SIM_LEGACY_ALARM_KEYS[] = {"alarm-number-", "alarm-when-", "alarm-song-", "alarm-active-"};
+
+const char SIM_LONG_SONG[] = "a-song-name-far-too-long-for-the-table";
+const char SIM_RETRIED_SSID[] = "retried-ssid";
+
+// SimKvCost is what a kind of boot reads and writes in the key-value store
+struct SimKvCost
+{
+  const char *name;
+  uint32_t reads;
+  uint32_t writes;
+};
+
+uint32_t kvCheckSeed = 3;
+
+// what the boot running checks against, set before it is forked
+AlarmTable kvCheckExpected;
+SimKvCost kvCheckCosts[4] = {{"write a table", 0, 0}, {"read the table", 0, 0}, {"migrate", 0, 0}, {"failed migration", 0, 0}};
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint32_t kvCheckRandom()
+{
+  kvCheckSeed = kvCheckSeed * 1103515245 + 12345;
+  return kvCheckSeed >> 1;
+}
+
+// runColdBoot runs a boot in a child process, after a cold boot, and
+// counts what it read and wrote as a boot of that kind. Returns false if
+// a check failed in the boot, or it crashed.
+bool runColdBoot(void (*boot)(), SimKvCost *cost)
+{
+  memset(simWorld->rtc, 0xA5, SIM_RTC_SIZE);
+  uint32_t reads = simWorld->stats.kvReads;
+  uint32_t writes = simWorld->stats.kvWrites;
+  uint32_t failures = simFailures;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0)
+  {
+    simBoot();
+    loggerInit();
+    boot();
+    loggerFlush();
+    fflush(stdout);
+    _exit(simFailures > failures ? 1 : 0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  cost->reads = simWorld->stats.kvReads - reads;
+  cost->writes = simWorld->stats.kvWrites - writes;
+  return simExpect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "settings", "the boot ends without a failed check");
+}
+
+// randomTable fills a table with alarms in random slots, songs from
+// empty to the longest the table holds
+void randomTable(AlarmTable *table)
+{
+  memset(table, 0, sizeof(AlarmTable));
+  for (uint32_t number = 1; number <= MAX_ALARMS; number++)
+  {
+    if (kvCheckRandom() % 4 == 0)
+    {
+      continue;
+    }
+    Alarm &alarm = table->alarms[number - 1];
+    alarm.number = number;
+    alarm.when = kvCheckRandom() % SECONDS_PER_DAY;
+    alarm.activeMatrix = 1 + kvCheckRandom() % 0x7F;
+    uint32_t length = kvCheckRandom() % ALARM_SONG_SIZE;
+    for (uint32_t i = 0; i < length; i++)
+    {
+      alarm.song[i] = 'a' + kvCheckRandom() % 26;
+    }
+  }
+}
+
+// putLegacyAlarm stores an alarm under the keys of older firmware versions
+void putLegacyAlarm(const Alarm &alarm, const char *song)
+{
+  char key[SIM_KV_KEY_SIZE];
+  uint32_t values[] = {alarm.number, (uint32_t)alarm.when, 0, alarm.activeMatrix};
+  for (int i = 0; i < 4; i++)
+  {
+    snprintf(key, sizeof(key), "%s%u", SIM_LEGACY_ALARM_KEYS[i], alarm.number);
+    if (i == 2)
+    {
+      halKvPutString(key, song);
+    }
+    else
+    {
+      halKvPutBytes(key, &values[i], sizeof(uint32_t));
+    }
+  }
+}
+
+// legacyKeysLeft returns how many keys of older firmware versions are stored
+uint32_t legacyKeysLeft()
+{
+  uint32_t left = 0;
+  char key[SIM_KV_KEY_SIZE];
+  for (uint32_t number = 1; number <= MAX_ALARMS; number++)
+  {
+    for (const char *prefix : SIM_LEGACY_ALARM_KEYS)
+    {
+      snprintf(key, sizeof(key), "%s%u", prefix, number);
+      left += halKvGetBytesLength(key) > 0;
+    }
+  }
+  return left;
+}
+
+// expectAlarms checks the table of the settings, and each alarm of it,
+// against the one expected
+void expectAlarms(const char *what)
+{
+  AlarmTable table;
+  bool ok = settingsGetAlarmTable(&table) &&
+            memcmp(table.alarms, kvCheckExpected.alarms, sizeof(kvCheckExpected.alarms)) == 0;
+  for (uint32_t number = 1; number <= MAX_ALARMS; number++)
+  {
+    Alarm alarm = settingsGetAlarm(number);
+    ok = ok && memcmp(&alarm, &kvCheckExpected.alarms[number - 1], sizeof(Alarm)) == 0;
+  }
+  simExpect(ok, "settings", what);
+}
+
+void writeTableBoot()
+{
+  settingsInit();
+  AlarmTable table = kvCheckExpected;
+  simExpect(settingsSaveAlarmTable(&table) && settingsFlush(), "settings", "the table is written");
+}
+
+void readTableBoot()
+{
+  settingsInit();
+  expectAlarms("the table read back is the one written");
+}
+
+void migrateBoot()
+{
+  settingsInit();
+  expectAlarms("the alarms are migrated to the table");
+  simExpect(legacyKeysLeft() == 0, "settings", "the keys of the older firmware are removed");
+  simExpect(halKvGetBytesLength(SIM_ALARM_TABLE_KEY) == sizeof(AlarmTable), "settings",
+            "the migrated table is written");
+}
+
+// failedMigrationBoot migrates with every write failing: the alarms are
+// there for this boot, the keys are kept until a flush writes the table
+void failedMigrationBoot()
+{
+  settingsInit();
+  expectAlarms("the alarms are kept after a failed migration");
+  simExpect(!settingsFlush(), "settings", "a flush fails while the migrated table can not be written");
+  simExpect(legacyKeysLeft() > 0, "settings", "the keys of the older firmware are kept while the table is not written");
+}
+
+// recoveredMigrationBoot migrates with every write failing, then
+// flushes once the writes work again
+void recoveredMigrationBoot()
+{
+  failedMigrationBoot();
+  simWorld->kvWritesFail = 0;
+  simExpect(settingsFlush(), "settings", "the flush writes the migrated table once the writes work");
+  simExpect(legacyKeysLeft() == 0, "settings", "the keys of the older firmware are removed after the table is written");
+  simExpect(halKvGetBytesLength(SIM_ALARM_TABLE_KEY) == sizeof(AlarmTable), "settings",
+            "the migrated table is written");
+}
+
+// retriedSaveBoot saves a table and a setting while every write fails:
+// each flush fails until the writes work again, then writes them
+void retriedSaveBoot()
+{
+  settingsInit();
+  AlarmTable table = kvCheckExpected;
+  simWorld->kvWritesFail = 1;
+  simExpect(settingsSaveAlarmTable(&table) && settingsSaveWifiSsid(SIM_RETRIED_SSID), "settings",
+            "the changes are saved");
+  simExpect(!settingsFlush(), "settings", "a flush fails while the writes fail");
+  simExpect(!settingsFlush(), "settings", "the next flush writes the changes again");
+  simWorld->kvWritesFail = 0;
+  simExpect(settingsFlush(), "settings", "the flush writes the changes once the writes work");
+}
+
+void readRetriedBoot()
+{
+  settingsInit();
+  expectAlarms("the table written by the retried flush is read back");
+  simExpect(settingsGetWifiSsid() == SIM_RETRIED_SSID, "settings",
+            "the setting written by the retried flush is read back");
+}
+
+// putLegacyAlarms stores alarms 1, 3 and 4 under the keys of older
+// firmware versions, the song of 3 the longest the table holds and the
+// one of 4 too long for it, and expects them migrated, song 4 dropped
+void putLegacyAlarms()
+{
+  memset(simWorld->kv, 0, sizeof(simWorld->kv));
+  memset(&kvCheckExpected, 0, sizeof(AlarmTable));
+  const Alarm alarms[] = {
+      {1, 7 * 3600, "birds", 0x3E}, {3, 0, "abcdefghijklmnopqrstuvw", 0x41}, {4, SECONDS_PER_DAY - 1, "", 0x7F}};
+  for (const Alarm &alarm : alarms)
+  {
+    putLegacyAlarm(alarm, alarm.number == 4 ? SIM_LONG_SONG : alarm.song);
+    kvCheckExpected.alarms[alarm.number - 1] = alarm;
+  }
+}
+
+// checkRoundTrips writes random tables, each read back by the next boot
+void checkRoundTrips(uint32_t tables)
+{
+  memset(simWorld->kv, 0, sizeof(simWorld->kv));
+  for (uint32_t i = 0; i < tables && simFailures == 0; i++)
+  {
+    randomTable(&kvCheckExpected);
+    runColdBoot(writeTableBoot, &kvCheckCosts[0]);
+    runColdBoot(readTableBoot, &kvCheckCosts[1]);
+  }
+}
+
+void checkMigration()
+{
+  putLegacyAlarms();
+  runColdBoot(migrateBoot, &kvCheckCosts[2]);
+  SimKvCost after;
+  runColdBoot(readTableBoot, &after);
+  simExpect(after.writes == 0, "settings", "the migration runs once");
+}
+
+void checkFailedMigrations()
+{
+  putLegacyAlarms();
+  simWorld->kvWritesFail = 1;
+  runColdBoot(failedMigrationBoot, &kvCheckCosts[3]);
+  simWorld->kvWritesFail = 0;
+  SimKvCost cost;
+  runColdBoot(migrateBoot, &cost);
+  runColdBoot(readTableBoot, &cost);
+
+  putLegacyAlarms();
+  simWorld->kvWritesFail = 1;
+  runColdBoot(recoveredMigrationBoot, &cost);
+  simWorld->kvWritesFail = 0;
+  runColdBoot(readTableBoot, &cost);
+}
+
+// checkRetriedSaves saves a table over another while the writes fail
+void checkRetriedSaves()
+{
+  memset(simWorld->kv, 0, sizeof(simWorld->kv));
+  randomTable(&kvCheckExpected);
+  SimKvCost cost;
+  runColdBoot(writeTableBoot, &cost);
+  randomTable(&kvCheckExpected);
+  runColdBoot(retriedSaveBoot, &cost);
+  simWorld->kvWritesFail = 0;
+  runColdBoot(readRetriedBoot, &cost);
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simSettingsCheck checks the settings, writing and reading back that
+// many random alarm tables
+bool simSettingsCheck(uint32_t tables)
+{
+  checkRoundTrips(tables);
+  checkMigration();
+  checkFailedMigrations();
+  checkRetriedSaves();
+
+  printf("%-18s %10s %10s\n", "boot", "kv reads", "kv writes");
+  for (const SimKvCost &cost : kvCheckCosts)
+  {
+    printf("%-18s %10u %10u\n", cost.name, cost.reads, cost.writes);
+  }
+  printf("settings checks:     %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
@@ -0,0 +1,690 @@
+// The household sync in the native simulation. simSyncCheck runs the
+// windows of several units of a household on real UDP multicast sockets
+// of the loopback interface, in rounds: the units open their windows a
+// few milliseconds apart, as units whose clocks disagree a little, some
+// after changing items. Each round checks all the units end with the
+// same items, the latest change winning, and reports the bytes sent
+// against every unit sending all its items, and how long after the last
+// window opened the units agreed. The windows are much shorter than on
+// the device: loopback takes microseconds where wifi takes milliseconds.
+//
+// Then a unit is handed packets of a host without the key of the
+// household, which it must ignore.
+//
+// With -y the simulated device syncs with a simulated peer instead, the
+// other unit of its household: it answers on the group the device joins
+// (see HalNative.cpp) and changes the days of the first alarm every few
+// windows.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../AlarmProtocol.h"
+#include "../Crc.h"
+#include "../Settings.h"
+#include "../TimeZone.h"
+#include "Simulation.h"
+
+// the node id of the simulated peer, and every how many windows it
+// changes the days of the first alarm, between every day and weekdays
+const uint32_t SIM_SYNC_PEER_NODE = 0x5EE50001;
+const uint32_t SIM_SYNC_PEER_CHANGE_WINDOWS = 3;
+const uint32_t SIM_SYNC_EVERY_DAY = 0x7F;
+const uint32_t SIM_SYNC_WEEKDAYS = 0x3E;
+
+// the loopback units: their group, how far apart their windows open, how
+// soon they send their summary again while it is wanted,
+// and how long their windows stay open, in the ratio of the device
+const char *SIM_SYNC_GROUP = "239.255.72.83";
+const uint16_t SIM_SYNC_FIRST_PORT = 40000;
+const uint64_t SIM_SYNC_STAGGER_US = 2000;
+const uint64_t SIM_SYNC_RETRY_US = 2000;
+const uint64_t SIM_SYNC_WINDOW_US = 20000;
+
+const uint32_t SIM_SYNC_ROUNDS = 10;
+const uint32_t SIM_SYNC_LOSS_PERCENT = 20;
+
+const char *SIM_SYNC_SONGS[] = {"sunrise", "birds", "waves", "chimes"};
+const char *SIM_SYNC_ZONES[] = {
+    "WET0WEST,M3.5.0/1,M10.5.0", "CET-1CEST,M3.5.0,M10.5.0/3", "EST5EDT,M3.2.0,M11.1.0",
+    "AEST-10AEDT,M10.1.0,M4.1.0/3", "JST-9", "<-03>3",
+};
+
+enum SimSyncScenario
+{
+  SIM_SYNC_JOINING,
+  SIM_SYNC_QUIET,
+  SIM_SYNC_ONE_CHANGE,
+  SIM_SYNC_CONCURRENT,
+  SIM_SYNC_NEW_UNIT,
+  SIM_SYNC_LOSSY,
+};
+
+const char *SIM_SYNC_SCENARIOS[] = {"joining", "in sync", "one change", "concurrent", "new unit", "20% loss"};
+
+// SimSyncUnit is a unit of the household on the loopback interface, and
+// how its window goes
+struct SimSyncUnit
+{
+  HouseholdSync sync;
+  HouseholdSyncSession session;
+  SimSyncItems items;
+  int socket;
+  uint64_t opensUs;
+  uint64_t summarySentUs;
+  bool open;
+};
+
+// the items callbacks of HouseholdSync work on these, the items of the
+// unit handling a packet
+SimSyncItems *syncItems = nullptr;
+HouseholdSyncSession syncPeerSession;
+
+sockaddr_in syncGroupAddress;
+uint32_t syncPacketsSent = 0;
+uint64_t syncBytesSent = 0;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// syncNowUs returns a monotonic real time, in microseconds
+uint64_t syncNowUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// readSimItem writes an item of the unit handling a packet
+size_t readSimItem(uint8_t item, uint8_t *buffer, size_t size)
+{
+  size_t length = syncItems->lengths[item] < size ? syncItems->lengths[item] : size;
+  memcpy(buffer, syncItems->content[item], length);
+  return length;
+}
+
+// writeSimItem stores an item checked as the device does: an alarm
+// record for its slot, or a time zone rule that compiles
+bool writeSimItem(uint8_t item, const uint8_t *content, size_t length)
+{
+  if (length > HOUSEHOLD_SYNC_MAX_ITEM_SIZE)
+  {
+    return false;
+  }
+  if (item == HOUSEHOLD_SYNC_ITEM_TIME_ZONE)
+  {
+    TimeZoneTable table;
+    if (length >= TIME_ZONE_RULE_SIZE ||
+        timeZoneCompile((const char *)content, length, TIME_ZONE_DEFAULT_FIRST_YEAR, &table) != TIME_ZONE_SUCCESS)
+    {
+      return false;
+    }
+  }
+  else if (length > 0)
+  {
+    Alarm alarm;
+    if (alarmProtocolParseBinary(content, length, &alarm) != ALARM_STATUS_SUCCESS || alarm.number != item + 1u)
+    {
+      return false;
+    }
+  }
+  memcpy(syncItems->content[item], content, length);
+  syncItems->lengths[item] = length;
+  return true;
+}
+
+// setSimAlarm sets an alarm slot of simulated items
+void setSimAlarm(SimSyncItems *items, const Alarm *alarm)
+{
+  uint8_t item = alarm->number - 1;
+  items->lengths[item] = alarmProtocolEncode(alarm, items->content[item], HOUSEHOLD_SYNC_MAX_ITEM_SIZE);
+}
+
+// changeSimItem changes an item of simulated items: another time zone, or
+// another alarm or sometimes none
+void changeSimItem(SimSyncItems *items, uint8_t item)
+{
+  if (item == HOUSEHOLD_SYNC_ITEM_TIME_ZONE)
+  {
+    const char *zone;
+    do
+    {
+      zone = SIM_SYNC_ZONES[rand() % (sizeof(SIM_SYNC_ZONES) / sizeof(SIM_SYNC_ZONES[0]))];
+    } while (items->lengths[item] == strlen(zone) && memcmp(items->content[item], zone, strlen(zone)) == 0);
+    items->lengths[item] = strlen(zone);
+    memcpy(items->content[item], zone, strlen(zone));
+    return;
+  }
+
+  if (items->lengths[item] > 0 && rand() % 5 == 0)
+  {
+    items->lengths[item] = 0;
+    return;
+  }
+  Alarm alarm = {};
+  alarm.number = item + 1;
+  alarm.when = rand() % 86400;
+  strcpy(alarm.song, SIM_SYNC_SONGS[rand() % (sizeof(SIM_SYNC_SONGS) / sizeof(SIM_SYNC_SONGS[0]))]);
+  alarm.activeMatrix = rand() % 127 + 1;
+  setSimAlarm(items, &alarm);
+}
+
+// openSyncSocket joins the group on the loopback interface, at the port
+// of syncGroupAddress, without blocking; every socket joined gets every packet, its own included
+int openSyncSocket()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  int reuse = 1;
+  ip_mreq membership = {};
+  membership.imr_multiaddr = syncGroupAddress.sin_addr;
+  membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+  in_addr interface = {};
+  interface.s_addr = htonl(INADDR_LOOPBACK);
+  unsigned char loop = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+      bind(fd, (const sockaddr *)&syncGroupAddress, sizeof(syncGroupAddress)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) != 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+  {
+    perror("multicast socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// sendSyncPacket multicasts a packet of a unit
+void sendSyncPacket(const SimSyncUnit *unit, const uint8_t *packet, size_t length)
+{
+  if (sendto(unit->socket, packet, length, 0, (const sockaddr *)&syncGroupAddress, sizeof(syncGroupAddress)) !=
+      (ssize_t)length)
+  {
+    perror("sendto");
+    return;
+  }
+  syncPacketsSent++;
+  syncBytesSent += length;
+}
+
+// sendUnitSummary multicasts the packet opening the window of a unit, or
+// else its summary as a retry
+void sendUnitSummary(SimSyncUnit *unit, bool announce, uint64_t now)
+{
+  uint8_t packet[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  syncItems = &unit->items;
+  size_t length = announce ? householdSyncAnnounce(&unit->session, packet, sizeof(packet))
+                           : householdSyncRetry(&unit->session, packet, sizeof(packet));
+  sendSyncPacket(unit, packet, length);
+  unit->summarySentUs = now;
+}
+
+// receiveUnitPackets handles the packets a unit received, dropping them
+// while its window is not open or when the link loses them. Returns the
+// number handled.
+uint32_t receiveUnitPackets(SimSyncUnit *unit, uint32_t lossPercent)
+{
+  uint8_t packet[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  uint8_t reply[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  uint32_t handled = 0;
+  ssize_t length;
+  while ((length = recv(unit->socket, packet, sizeof(packet), 0)) > 0)
+  {
+    if (!unit->open || (uint32_t)(rand() % 100) < lossPercent)
+    {
+      continue;
+    }
+    syncItems = &unit->items;
+    size_t replyLength;
+    HouseholdSyncResult result =
+        householdSyncReceive(&unit->session, packet, length, reply, sizeof(reply), &replyLength);
+    if (result == HOUSEHOLD_SYNC_IGNORED)
+    {
+      continue;
+    }
+    handled++;
+    if (replyLength > 0)
+    {
+      sendSyncPacket(unit, reply, replyLength);
+    }
+  }
+  return handled;
+}
+
+// unitsAgree returns true if all the units hold the same items with the
+// same stamps, and know the same changes
+bool unitsAgree(const SimSyncUnit *units, uint32_t count)
+{
+  for (uint32_t i = 1; i < count; i++)
+  {
+    const HouseholdSync &a = units[0].sync;
+    const HouseholdSync &b = units[i].sync;
+    if (!householdSyncCovers(&a.known, &b.known) || !householdSyncCovers(&b.known, &a.known))
+    {
+      return false;
+    }
+    for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+    {
+      if (a.items[item].stamp.counter != b.items[item].stamp.counter ||
+          a.items[item].stamp.node != b.items[item].stamp.node ||
+          units[0].items.lengths[item] != units[i].items.lengths[item] ||
+          memcmp(units[0].items.content[item], units[i].items.content[item], units[0].items.lengths[item]) != 0)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// fullStateBytes returns what a round would send if every unit multicast
+// all its items once instead
+size_t fullStateBytes(const SimSyncUnit *units, uint32_t count)
+{
+  size_t bytes = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    bytes += HOUSEHOLD_SYNC_HEADER_SIZE + 1 + 8 * units[i].sync.known.count + 1 + HOUSEHOLD_SYNC_TAG_SIZE;
+    for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+    {
+      bytes += HOUSEHOLD_SYNC_ITEM_HEADER_SIZE + units[i].items.lengths[item];
+    }
+  }
+  return bytes;
+}
+
+// runSyncRound runs the windows of the units once. Returns how long after
+// the last window opened the units agreed, if they did in the end, or -1.
+int64_t runSyncRound(SimSyncUnit *units, uint32_t count, uint32_t lossPercent)
+{
+  uint64_t start = syncNowUs();
+  uint64_t lastOpensUs = start;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    SimSyncUnit *unit = &units[i];
+    uint8_t stale[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+    while (recv(unit->socket, stale, sizeof(stale), 0) > 0)
+    {
+    }
+    unit->open = false;
+    unit->opensUs = start + rand() % SIM_SYNC_STAGGER_US;
+    if (unit->opensUs > lastOpensUs)
+    {
+      lastOpensUs = unit->opensUs;
+    }
+  }
+
+  pollfd fds[HOUSEHOLD_SYNC_MAX_NODES];
+  for (uint32_t i = 0; i < count; i++)
+  {
+    fds[i] = pollfd{units[i].socket, POLLIN, 0};
+  }
+  uint64_t agreedUs = 0;
+  uint64_t now = start;
+  while (now < lastOpensUs + SIM_SYNC_WINDOW_US)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      SimSyncUnit *unit = &units[i];
+      if (now >= unit->opensUs + SIM_SYNC_WINDOW_US)
+      {
+        unit->open = false;
+      }
+      else if (!unit->open && now >= unit->opensUs)
+      {
+        syncItems = &unit->items;
+        householdSyncBegin(&unit->session, &unit->sync, unit->session.household, readSimItem, writeSimItem);
+        unit->open = true;
+        sendUnitSummary(unit, true, now);
+      }
+      else if (unit->open && now - unit->summarySentUs >= SIM_SYNC_RETRY_US && householdSyncWantsRetry(&unit->session))
+      {
+        sendUnitSummary(unit, false, now);
+      }
+    }
+
+    poll(fds, count, 1);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      receiveUnitPackets(&units[i], lossPercent);
+    }
+    now = syncNowUs();
+    if (now < lastOpensUs || !unitsAgree(units, count))
+    {
+      agreedUs = 0;
+    }
+    else if (agreedUs == 0)
+    {
+      agreedUs = now;
+    }
+  }
+  return agreedUs == 0 ? -1 : agreedUs - lastOpensUs;
+}
+
+// newSyncUnit resets a unit as a unit never synced, with no items, given
+// the key of the household
+void newSyncUnit(SimSyncUnit *unit, uint32_t household, const uint8_t *key)
+{
+  householdSyncReset(&unit->sync, (uint32_t)rand() + 1);
+  memcpy(unit->sync.key, key, HOUSEHOLD_SYNC_KEY_SIZE);
+  memset(&unit->items, 0, sizeof(unit->items));
+  unit->session.household = household;
+}
+
+// syncScenario runs the rounds of a scenario, reporting them on a line;
+// the last concurrent change must win. Returns false if a round failed.
+bool syncScenario(SimSyncUnit *units, uint32_t count, SimSyncScenario scenario, uint32_t rounds)
+{
+  uint32_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t fullBytes = 0;
+  int64_t totalUs = 0;
+  int64_t maxUs = 0;
+  uint32_t rejected = 0;
+  uint32_t deltas = 0;
+  uint32_t items = 0;
+  for (uint32_t round = 0; round < rounds; round++)
+  {
+    uint8_t item = rand() % HOUSEHOLD_SYNC_ITEMS;
+    HouseholdSyncStamp winner = {0, 0};
+    SimSyncItems expected;
+    switch (scenario)
+    {
+    case SIM_SYNC_JOINING:
+      for (uint8_t i = 0; i < HOUSEHOLD_SYNC_ITEMS; i++)
+      {
+        changeSimItem(&units[0].items, i);
+      }
+      break;
+    case SIM_SYNC_ONE_CHANGE:
+    case SIM_SYNC_LOSSY:
+      changeSimItem(&units[rand() % count].items, item);
+      break;
+    case SIM_SYNC_CONCURRENT:
+      // the stamps the changes get when the windows open
+      for (uint32_t i = 0; i < count && i < 3; i++)
+      {
+        changeSimItem(&units[i].items, item);
+        HouseholdSyncStamp stamp = {units[i].sync.clock + 1, units[i].sync.node};
+        if (stamp.counter > winner.counter || (stamp.counter == winner.counter && stamp.node > winner.node))
+        {
+          winner = stamp;
+          expected = units[i].items;
+        }
+      }
+      break;
+    case SIM_SYNC_NEW_UNIT:
+      newSyncUnit(&units[count - 1], units[0].session.household, units[0].sync.key);
+      break;
+    case SIM_SYNC_QUIET:
+      break;
+    }
+
+    syncPacketsSent = 0;
+    syncBytesSent = 0;
+    int64_t agreedUs = runSyncRound(units, count, scenario == SIM_SYNC_LOSSY ? SIM_SYNC_LOSS_PERCENT : 0);
+    if (agreedUs < 0)
+    {
+      fprintf(stderr, "%u units, %s, round %u: the units did not agree when their windows closed\n", count, SIM_SYNC_SCENARIOS[scenario], round);
+      return false;
+    }
+    if (winner.counter > 0 && (units[0].items.lengths[item] != expected.lengths[item] ||
+                               memcmp(units[0].items.content[item], expected.content[item], expected.lengths[item]) != 0))
+    {
+      fprintf(stderr, "%u units, %s, round %u: the change of node %08x did not win\n", count,
+              SIM_SYNC_SCENARIOS[scenario], round, winner.node);
+      return false;
+    }
+    packets += syncPacketsSent;
+    bytes += syncBytesSent;
+    fullBytes += fullStateBytes(units, count);
+    totalUs += agreedUs;
+    maxUs = agreedUs > maxUs ? agreedUs : maxUs;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      rejected += units[i].session.stats.itemsRejected;
+      deltas += units[i].session.stats.deltasMade;
+      items += units[i].session.stats.itemsSent;
+    }
+  }
+
+  printf("%5u  %-10s  %6u  %7.1f  %6.1f  %5.1f  %6.0f  %10.0f  %6.0f / %6lld us\n", count, SIM_SYNC_SCENARIOS[scenario],
+         rounds, (double)packets / rounds, (double)deltas / rounds, (double)items / rounds, (double)bytes / rounds,
+         (double)fullBytes / rounds, (double)totalUs / rounds, (long long)maxUs);
+  if (rejected > 0)
+  {
+    fprintf(stderr, "%u units, %s: %u items rejected\n", count, SIM_SYNC_SCENARIOS[scenario], rejected);
+    return false;
+  }
+  return true;
+}
+
+// forgedIgnored hands a unit a packet of another, returning true if it
+// was ignored and changed nothing
+bool forgedIgnored(SimSyncUnit *unit, const uint8_t *packet, size_t length)
+{
+  HouseholdSync before = unit->sync;
+  uint8_t reply[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  size_t replyLength;
+  syncItems = &unit->items;
+  return householdSyncReceive(&unit->session, packet, length, reply, sizeof(reply), &replyLength) ==
+             HOUSEHOLD_SYNC_IGNORED &&
+         replyLength == 0 && memcmp(&before, &unit->sync, sizeof(HouseholdSync)) == 0;
+}
+
+// checkForgedPackets hands a unit the delta of a host of the household
+// network without its key, changing every item, and a delta made with the
+// key but changed on the way. Returns false if either was not ignored.
+bool checkForgedPackets(SimSyncUnit *units)
+{
+  SimSyncUnit intruder;
+  newSyncUnit(&intruder, units[0].session.household, units[0].sync.key);
+  intruder.sync.key[0] ^= 1;
+  for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+  {
+    changeSimItem(&intruder.items, item);
+  }
+  uint8_t packet[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  syncItems = &intruder.items;
+  householdSyncBegin(&intruder.session, &intruder.sync, intruder.session.household, readSimItem, writeSimItem);
+  size_t length = householdSyncAnnounce(&intruder.session, packet, sizeof(packet));
+  bool ok = forgedIgnored(&units[0], packet, length);
+
+  intruder.sync.key[0] ^= 1;
+  syncItems = &intruder.items;
+  householdSyncBegin(&intruder.session, &intruder.sync, intruder.session.household, readSimItem, writeSimItem);
+  intruder.session.opening = HouseholdSyncVector{};
+  length = householdSyncAnnounce(&intruder.session, packet, sizeof(packet));
+  packet[length - HOUSEHOLD_SYNC_TAG_SIZE - 1] ^= 1;
+  ok = ok && forgedIgnored(&units[0], packet, length);
+  if (!ok)
+  {
+    fprintf(stderr, "a packet without the key of the household was not ignored\n");
+  }
+  return ok;
+}
+
+// syncHousehold runs all the scenarios for a household of count units
+bool syncHousehold(uint32_t count)
+{
+  SimSyncUnit units[HOUSEHOLD_SYNC_MAX_NODES];
+  uint32_t household = (uint32_t)rand();
+  uint8_t key[HOUSEHOLD_SYNC_KEY_SIZE];
+  for (uint8_t &byte : key)
+  {
+    byte = rand();
+  }
+  for (uint32_t i = 0; i < count; i++)
+  {
+    newSyncUnit(&units[i], household, key);
+    units[i].socket = openSyncSocket();
+    if (units[i].socket < 0)
+    {
+      for (uint32_t j = 0; j < i; j++)
+      {
+        close(units[j].socket);
+      }
+      return false;
+    }
+  }
+
+  // a unit replaced by a new one keeps its entry in the version vectors,
+  // which have room for HOUSEHOLD_SYNC_MAX_NODES units over the life of
+  // the household, so a full household gets no new unit
+  bool ok = syncScenario(units, count, SIM_SYNC_JOINING, 1) && syncScenario(units, count, SIM_SYNC_QUIET, SIM_SYNC_ROUNDS) &&
+            syncScenario(units, count, SIM_SYNC_ONE_CHANGE, SIM_SYNC_ROUNDS) &&
+            syncScenario(units, count, SIM_SYNC_CONCURRENT, SIM_SYNC_ROUNDS) &&
+            (count == HOUSEHOLD_SYNC_MAX_NODES || syncScenario(units, count, SIM_SYNC_NEW_UNIT, 1)) &&
+            syncScenario(units, count, SIM_SYNC_LOSSY, SIM_SYNC_ROUNDS) && checkForgedPackets(units);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    close(units[i].socket);
+  }
+  return ok;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simSyncPeerOpen opens the window of the simulated peer with the one of
+// the device, changing the first alarm every few windows, and queues its
+// summary
+void simSyncPeerOpen()
+{
+  SimSyncPeer *peer = &simWorld->syncPeer;
+  if (peer->sync.version != HOUSEHOLD_SYNC_STATE_VERSION)
+  {
+    householdSyncReset(&peer->sync, SIM_SYNC_PEER_NODE);
+    memcpy(peer->sync.key, SIM_HOUSEHOLD_KEY, HOUSEHOLD_SYNC_KEY_SIZE);
+  }
+  peer->queueFirst = 0;
+  peer->queued = 0;
+  peer->windows++;
+
+  Alarm alarm;
+  if (peer->windows % SIM_SYNC_PEER_CHANGE_WINDOWS == 0 && peer->items.lengths[0] > 0 &&
+      alarmProtocolParseBinary(peer->items.content[0], peer->items.lengths[0], &alarm) == ALARM_STATUS_SUCCESS)
+  {
+    alarm.activeMatrix = alarm.activeMatrix == SIM_SYNC_EVERY_DAY ? SIM_SYNC_WEEKDAYS : SIM_SYNC_EVERY_DAY;
+    setSimAlarm(&peer->items, &alarm);
+    peer->changes++;
+  }
+
+  syncItems = &peer->items;
+  householdSyncBegin(&syncPeerSession, &peer->sync, householdSyncHousehold(SIM_WIFI_SSID, SIM_WIFI_PASSWORD),
+                     readSimItem, writeSimItem);
+  peer->queueLengths[0] = householdSyncAnnounce(&syncPeerSession, peer->queue[0], sizeof(peer->queue[0]));
+  peer->queued = 1;
+}
+
+// simSyncPeerReceive hands a packet of the device to the simulated peer,
+// queuing its reply if the queue has room
+void simSyncPeerReceive(const uint8_t *packet, size_t length)
+{
+  SimSyncPeer *peer = &simWorld->syncPeer;
+  uint8_t reply[HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+  size_t replyLength;
+  syncItems = &peer->items;
+  householdSyncReceive(&syncPeerSession, packet, length, reply, sizeof(reply), &replyLength);
+  if (replyLength == 0 || peer->queued == SIM_SYNC_QUEUE)
+  {
+    return;
+  }
+  uint8_t slot = (peer->queueFirst + peer->queued) % SIM_SYNC_QUEUE;
+  memcpy(peer->queue[slot], reply, replyLength);
+  peer->queueLengths[slot] = replyLength;
+  peer->queued++;
+}
+
+// simSyncPeerSend gives the device the next packet of the simulated peer,
+// returning its length, or 0 if there is none
+int simSyncPeerSend(uint8_t *buffer, size_t size)
+{
+  SimSyncPeer *peer = &simWorld->syncPeer;
+  if (peer->queued == 0 || size < peer->queueLengths[peer->queueFirst])
+  {
+    return 0;
+  }
+  uint16_t length = peer->queueLengths[peer->queueFirst];
+  memcpy(buffer, peer->queue[peer->queueFirst], length);
+  peer->queueFirst = (peer->queueFirst + 1) % SIM_SYNC_QUEUE;
+  peer->queued--;
+  return length;
+}
+
+// simSyncPeerMatches returns true if the device holds the items of the
+// simulated peer, with the same stamps, as it should after a window
+bool simSyncPeerMatches(const HouseholdSync *sync, const AlarmTable *alarms)
+{
+  const SimSyncPeer *peer = &simWorld->syncPeer;
+  if (!householdSyncCovers(&sync->known, &peer->sync.known) || !householdSyncCovers(&peer->sync.known, &sync->known))
+  {
+    return false;
+  }
+  for (uint8_t item = 0; item < HOUSEHOLD_SYNC_ITEMS; item++)
+  {
+    const HouseholdSyncItem &a = sync->items[item];
+    const HouseholdSyncItem &b = peer->sync.items[item];
+    if (a.stamp.counter != b.stamp.counter || a.stamp.node != b.stamp.node ||
+        a.crc != crc32(peer->items.content[item], peer->items.lengths[item]))
+    {
+      return false;
+    }
+    if (item == HOUSEHOLD_SYNC_ITEM_TIME_ZONE)
+    {
+      continue;
+    }
+    uint8_t content[HOUSEHOLD_SYNC_MAX_ITEM_SIZE];
+    const Alarm *alarm = &alarms->alarms[item];
+    size_t length = alarm->number == 0 ? 0 : alarmProtocolEncode(alarm, content, sizeof(content));
+    if (length != peer->items.lengths[item] || memcmp(content, peer->items.content[item], length) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// simSyncCheck runs the household sync scenarios on the loopback
+// interface for households of 2 to nodes units
+bool simSyncCheck(uint32_t nodes)
+{
+  if (nodes < 2 || nodes > HOUSEHOLD_SYNC_MAX_NODES)
+  {
+    fprintf(stderr, "a household has 2 to %u units\n", HOUSEHOLD_SYNC_MAX_NODES);
+    return false;
+  }
+  srand(getpid());
+  syncGroupAddress = sockaddr_in{};
+  syncGroupAddress.sin_family = AF_INET;
+  syncGroupAddress.sin_port = htons(SIM_SYNC_FIRST_PORT + getpid() % 20000);
+  inet_pton(AF_INET, SIM_SYNC_GROUP, &syncGroupAddress.sin_addr);
+
+  printf("household sync on %s:%u over loopback, items of %u alarms and a time zone\n", SIM_SYNC_GROUP,
+         ntohs(syncGroupAddress.sin_port), MAX_ALARMS);
+  printf("units  scenario    rounds  packets  deltas  items   bytes  full state  agreed after (mean / max)\n");
+  for (uint32_t count = 2; count <= nodes; count++)
+  {
+    if (!syncHousehold(count))
+    {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,426 @@
+// The time zones on the host. simTimeZoneCheck compiles a set of TZ rules
+// (see TimeZone.h) and checks them against the C library of the host,
+// which implements the same rules: the offset of every quarter of an hour
+// of the compiled years and of every second around each transition, and
+// the UTC time of every local second around each transition, the first
+// occurrence of a repeated one and the moment the clocks jump past a
+// skipped one. Then alarms set around each transition, in the skipped and
+// repeated hours and at their edges, are scheduled from every few minutes
+// around it and checked against all the days they could fire on, and
+// followed from one to the next so none fires twice or is missed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../AlarmScheduler.h"
+#include "../TimeZone.h"
+#include "Simulation.h"
+
+// checked around each transition: the offsets and local times within this
+// many seconds, the alarms scheduled from every SIM_ZONE_SCHEDULE_STEP_S
+// seconds within SIM_ZONE_SCHEDULE_SPAN_S seconds, and from every second
+// within SIM_ZONE_EDGE_S seconds of the transition
+const int64_t SIM_ZONE_WINDOW_S = 2 * 3600;
+const int64_t SIM_ZONE_SCHEDULE_SPAN_S = 26 * 3600;
+const int64_t SIM_ZONE_SCHEDULE_STEP_S = 300;
+const int64_t SIM_ZONE_EDGE_S = 120;
+const int64_t SIM_ZONE_OFFSET_STEP_S = 900;
+
+const uint32_t SIM_ZONE_LOOKUPS = 1000000;
+
+struct SimZoneCase
+{
+  const char *name;
+  const char *rule;
+};
+
+// Lord Howe changes by half an hour, Troll by two hours, Dublin has its
+// summer time as standard time, and Nuuk changes at negative hours
+const SimZoneCase SIM_ZONE_CASES[] = {
+    {"Europe/Lisbon", "WET0WEST,M3.5.0/1,M10.5.0"},
+    {"Europe/Paris", "CET-1CEST,M3.5.0,M10.5.0/3"},
+    {"Europe/Dublin", "IST-1GMT0,M10.5.0,M3.5.0/1"},
+    {"America/New_York", "EST5EDT,M3.2.0,M11.1.0"},
+    {"America/Nuuk", "<-02>2<-01>,M3.5.0/-1,M10.5.0/0"},
+    {"America/Santiago", "<-04>4<-03>,M9.1.6/24,M4.1.6/24"},
+    {"Australia/Sydney", "AEST-10AEDT,M10.1.0,M4.1.0/3"},
+    {"Australia/Lord_Howe", "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0"},
+    {"Pacific/Chatham", "<+1245>-12:45<+1345>,M9.5.0/2:45,M4.1.0/3:45"},
+    {"Antarctica/Troll", "<+00>0<+02>-2,M3.5.0/1,M10.5.0/3"},
+    {"Julian days", "<-03>3<-02>,J60/1:30,J300"},
+    {"zero based days", "<+03>-3<+04>,59/0,299/0"},
+    {"Asia/Tokyo", "JST-9"},
+    {"UTC", ""},
+};
+
+struct SimZoneStatusCase
+{
+  const char *rule;
+  TimeZoneStatus status;
+};
+
+const SimZoneStatusCase SIM_ZONE_STATUS_CASES[] = {
+    {"UTC0", TIME_ZONE_SUCCESS},
+    {"<+0330>-3:30", TIME_ZONE_SUCCESS},
+    {"EST+5EDT+4:00:00,M3.2.0/2:00:00,M11.1.0/2", TIME_ZONE_SUCCESS},
+    {"<-03>3<-02>,M3.5.0/-167,M10.5.0/167", TIME_ZONE_SUCCESS},
+    {"ES5", TIME_ZONE_INVALID_NAME},
+    {"<+03-3", TIME_ZONE_INVALID_NAME},
+    {"<+3>-3", TIME_ZONE_INVALID_NAME},
+    {"EST5E", TIME_ZONE_INVALID_NAME},
+    {"UTC0x", TIME_ZONE_INVALID_NAME},
+    {"EST", TIME_ZONE_INVALID_OFFSET},
+    {"EST25", TIME_ZONE_INVALID_OFFSET},
+    {"EST5:60", TIME_ZONE_INVALID_OFFSET},
+    {"EST5EDT:00", TIME_ZONE_INVALID_OFFSET},
+    {"EST5EDT,M3.2.0", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,M13.2.0,M11.1.0", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,M3.6.0,M11.1.0", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,M3.2.7,M11.1.0", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,J0,J300", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,366,300", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT,M3.2.0/168,M11.1.0", TIME_ZONE_INVALID_DATE},
+    {"EST5EDT;M3.2.0,M11.1.0", TIME_ZONE_INVALID_OFFSET},
+    {"EST5EDT,M3.2.0,M11.1.0,", TIME_ZONE_TRAILING_DATA},
+    {"EST5EDT,M3.2.0,M3.2.0", TIME_ZONE_OUT_OF_RANGE},
+    {"<-03>3<-02>,0/0,J365/25", TIME_ZONE_OUT_OF_RANGE},
+    {"<+00000000000000000000000000000000000000000000000000000000000000000000>0", TIME_ZONE_RULE_TOO_LONG},
+};
+
+// SimZoneAlarm is an alarm as the reference schedules it
+struct SimZoneAlarm
+{
+  uint8_t number;
+  uint32_t when;
+  uint8_t activeMatrix;
+};
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+// zoneFail counts a failed check, describing the first few
+void zoneFail(const char *name, const char *what, int64_t at, int64_t expected, int64_t got)
+{
+  simExpect(false, "time zone", what);
+  if (simFailures <= SIM_EXPECT_MAX_REPORTS)
+  {
+    fprintf(stderr, "  %s at %lld: expected %lld, got %lld\n", name, (long long)at, (long long)expected,
+            (long long)got);
+  }
+}
+
+// hostOffset returns the offset from UTC the host has for epoch, in the
+// zone set in TZ
+int32_t hostOffset(int64_t epoch)
+{
+  time_t time = epoch;
+  struct tm local;
+  localtime_r(&time, &local);
+  return local.tm_gmtoff;
+}
+
+// setHostZone sets the zone of the host to a rule
+void setHostZone(const char *rule)
+{
+  setenv("TZ", rule[0] == '\0' ? "UTC0" : rule, 1);
+  tzset();
+}
+
+// checkStatuses checks the status of the rules, valid or not
+void checkStatuses()
+{
+  TimeZoneTable table;
+  for (const SimZoneStatusCase &statusCase : SIM_ZONE_STATUS_CASES)
+  {
+    TimeZoneStatus status = timeZoneCompile(statusCase.rule, strlen(statusCase.rule), 2026, &table);
+    if (status != statusCase.status)
+    {
+      zoneFail(statusCase.rule, "status", 0, statusCase.status, status);
+    }
+  }
+
+  // the C library follows its posixrules file without dates, not the US dates
+  TimeZoneTable usDates;
+  timeZoneCompile("<-07>7<-06>", 11, 2026, &table);
+  timeZoneCompile("<-07>7<-06>,M3.2.0,M11.1.0", 26, 2026, &usDates);
+  if (memcmp(&table, &usDates, sizeof(TimeZoneTable)) != 0)
+  {
+    zoneFail("<-07>7<-06>", "US dates by default", 0, usDates.transitions[0], table.transitions[0]);
+  }
+
+  if (timeZoneCompile("CET-1CEST,M3.5.0,M10.5.0/3", 26, 2091, &table) != TIME_ZONE_OUT_OF_RANGE)
+  {
+    zoneFail("CET-1CEST", "status past the 32 bits epoch", 2091, TIME_ZONE_OUT_OF_RANGE, table.version);
+  }
+  for (uint32_t epoch : {0U, 951782400U, 1767225599U, 1767225600U, 4102444800U, UINT32_MAX})
+  {
+    time_t time = epoch;
+    struct tm utc;
+    gmtime_r(&time, &utc);
+    if (timeZoneYear(epoch) != utc.tm_year + 1900)
+    {
+      zoneFail("timeZoneYear", "year", epoch, utc.tm_year + 1900, timeZoneYear(epoch));
+    }
+  }
+}
+
+// checkOffsets checks the offset of every quarter of an hour of the
+// compiled years, and of every second around each transition
+void checkOffsets(const SimZoneCase &zoneCase, const TimeZoneTable *table, int64_t from, int64_t to)
+{
+  for (int64_t epoch = from; epoch < to; epoch += SIM_ZONE_OFFSET_STEP_S)
+  {
+    int32_t expected = hostOffset(epoch);
+    int32_t got = timeZoneOffset(table, epoch);
+    if (got != expected)
+    {
+      zoneFail(zoneCase.name, "offset", epoch, expected, got);
+    }
+  }
+  for (uint8_t i = 0; i < table->count; i++)
+  {
+    int64_t transition = table->transitions[i];
+    for (int64_t epoch = transition - SIM_ZONE_WINDOW_S; epoch <= transition + SIM_ZONE_WINDOW_S; epoch++)
+    {
+      int32_t expected = hostOffset(epoch);
+      int32_t got = timeZoneOffset(table, epoch);
+      if (got != expected)
+      {
+        zoneFail(zoneCase.name, "offset", epoch, expected, got);
+      }
+      if (timeZoneToLocal(table, epoch) != epoch + expected)
+      {
+        zoneFail(zoneCase.name, "local time", epoch, epoch + expected, timeZoneToLocal(table, epoch));
+      }
+    }
+  }
+}
+
+// checkLocalTimes checks the UTC time of every local second around each
+// transition: the first second the host shows it, or for a skipped local
+// time the first second the host shows a later one
+void checkLocalTimes(const SimZoneCase &zoneCase, const TimeZoneTable *table)
+{
+  for (uint8_t i = 0; i < table->count; i++)
+  {
+    int64_t transition = table->transitions[i];
+    int64_t lowOffset = table->offsets[0] < table->offsets[1] ? table->offsets[0] : table->offsets[1];
+    int64_t highOffset = table->offsets[0] + table->offsets[1] - lowOffset;
+    int64_t span = SIM_ZONE_WINDOW_S + highOffset - lowOffset + 1;
+
+    // the first epoch each local time shows at, -1 if none
+    int64_t firstLocal = transition - span + lowOffset;
+    size_t count = 2 * span + highOffset - lowOffset + 1;
+    int64_t *firstEpoch = (int64_t *)malloc(count * sizeof(int64_t));
+    for (size_t j = 0; j < count; j++)
+    {
+      firstEpoch[j] = -1;
+    }
+    for (int64_t epoch = transition - span; epoch <= transition + span; epoch++)
+    {
+      int64_t local = epoch + hostOffset(epoch);
+      if (firstEpoch[local - firstLocal] < 0)
+      {
+        firstEpoch[local - firstLocal] = epoch;
+      }
+    }
+
+    int64_t from = transition + lowOffset - SIM_ZONE_WINDOW_S;
+    int64_t to = transition + highOffset + SIM_ZONE_WINDOW_S;
+    int64_t expected = -1;
+    for (int64_t local = to; local >= from; local--)
+    {
+      if (firstEpoch[local - firstLocal] >= 0)
+      {
+        expected = firstEpoch[local - firstLocal];
+      }
+      uint32_t got = timeZoneToUtc(table, local);
+      if (got != expected)
+      {
+        zoneFail(zoneCase.name, "utc time of local time", local, expected, got);
+      }
+    }
+    free(firstEpoch);
+  }
+}
+
+// referenceNext returns when the earliest alarm fires after epoch, trying
+// every day it could fire on; the earliest local time wins a tie
+bool referenceNext(const SimZoneAlarm *alarms, uint8_t count, const TimeZoneTable *table, uint32_t epoch,
+                   uint32_t *fires, uint8_t *number)
+{
+  int64_t today = timeZoneToLocal(table, epoch) / SECONDS_PER_DAY;
+  bool found = false;
+  for (int64_t day = today - 1; day <= today + DAYS_PER_WEEK + 1; day++)
+  {
+    uint8_t weekday = (day + 4) % DAYS_PER_WEEK;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if ((alarms[i].activeMatrix & (1 << weekday)) == 0)
+      {
+        continue;
+      }
+      uint32_t candidate = timeZoneToUtc(table, day * SECONDS_PER_DAY + alarms[i].when);
+      if (candidate > epoch && (!found || candidate < *fires))
+      {
+        found = true;
+        *fires = candidate;
+        *number = alarms[i].number;
+      }
+    }
+  }
+  return found;
+}
+
+// checkScheduleFrom checks the alarm scheduled from an epoch
+void checkScheduleFrom(const SimZoneCase &zoneCase, const AlarmSchedule *schedule, const SimZoneAlarm *alarms,
+                       uint8_t count, const TimeZoneTable *table, uint32_t epoch)
+{
+  uint32_t expected = 0;
+  uint8_t expectedNumber = 0;
+  uint32_t secondsToNext = 0;
+  uint8_t number = 0;
+  bool found = alarmSchedulerNextInZone(schedule, table, epoch, &secondsToNext, &number);
+  if (!referenceNext(alarms, count, table, epoch, &expected, &expectedNumber) || !found)
+  {
+    zoneFail(zoneCase.name, "alarm found", epoch, true, found);
+    return;
+  }
+  if (epoch + secondsToNext != expected)
+  {
+    zoneFail(zoneCase.name, "alarm time", epoch, expected, epoch + secondsToNext);
+  }
+  else if (number != expectedNumber)
+  {
+    zoneFail(zoneCase.name, "alarm number", epoch, expectedNumber, number);
+  }
+}
+
+// checkAlarms schedules alarms set around a transition from every few
+// minutes around it, and follows them from one to the next
+void checkAlarms(const SimZoneCase &zoneCase, const TimeZoneTable *table, uint8_t transition,
+                 const SimZoneAlarm *alarms, uint8_t count)
+{
+  AlarmSchedule schedule;
+  alarmSchedulerClear(&schedule);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    alarmSchedulerAdd(&schedule, alarms[i].number, alarms[i].when, alarms[i].activeMatrix);
+  }
+  alarmSchedulerBuild(&schedule);
+
+  int64_t at = table->transitions[transition];
+  for (int64_t epoch = at - SIM_ZONE_SCHEDULE_SPAN_S; epoch <= at + SIM_ZONE_SCHEDULE_SPAN_S;
+       epoch += SIM_ZONE_SCHEDULE_STEP_S)
+  {
+    checkScheduleFrom(zoneCase, &schedule, alarms, count, table, epoch);
+  }
+  for (int64_t epoch = at - SIM_ZONE_EDGE_S; epoch <= at + SIM_ZONE_EDGE_S; epoch++)
+  {
+    checkScheduleFrom(zoneCase, &schedule, alarms, count, table, epoch);
+  }
+
+  // waking when each alarm fires, the next one is the next the reference
+  // finds, so each alarm fires once a day it is active on
+  uint32_t epoch = at - SIM_ZONE_SCHEDULE_SPAN_S;
+  while (epoch < at + SIM_ZONE_SCHEDULE_SPAN_S)
+  {
+    uint32_t expected = 0;
+    uint8_t expectedNumber = 0;
+    uint32_t secondsToNext = 0;
+    uint8_t number = 0;
+    if (!alarmSchedulerNextInZone(&schedule, table, epoch, &secondsToNext, &number) ||
+        !referenceNext(alarms, count, table, epoch, &expected, &expectedNumber) || epoch + secondsToNext != expected)
+    {
+      zoneFail(zoneCase.name, "alarm followed", epoch, expected, epoch + secondsToNext);
+      return;
+    }
+    epoch += secondsToNext;
+  }
+}
+
+// checkSchedules sets alarms at the local times of a transition, before
+// and after it, in the skipped or repeated time and at its edges
+void checkSchedules(const SimZoneCase &zoneCase, const TimeZoneTable *table)
+{
+  for (uint8_t i = 0; i < table->count; i++)
+  {
+    int64_t before = table->transitions[i] + table->offsets[i % 2];
+    int64_t after = table->transitions[i] + table->offsets[(i + 1) % 2];
+    uint32_t beforeTime = before % SECONDS_PER_DAY;
+    uint32_t afterTime = after % SECONDS_PER_DAY;
+    uint32_t middleTime = ((before + after) / 2) % SECONDS_PER_DAY;
+    uint8_t weekday = (before / SECONDS_PER_DAY + 4) % DAYS_PER_WEEK;
+
+    const SimZoneAlarm everyDay[] = {
+        {1, (beforeTime + SECONDS_PER_DAY - 3600) % SECONDS_PER_DAY, 0x7F},
+        {2, (beforeTime + SECONDS_PER_DAY - 1) % SECONDS_PER_DAY, 0x7F},
+        {3, beforeTime, 0x7F},
+        {4, (beforeTime + 1) % SECONDS_PER_DAY, 0x7F},
+        {5, middleTime, 0x7F},
+        {6, (afterTime + SECONDS_PER_DAY - 1) % SECONDS_PER_DAY, 0x7F},
+        {7, afterTime, 0x7F},
+        {8, (afterTime + 1) % SECONDS_PER_DAY, 0x7F},
+    };
+    checkAlarms(zoneCase, table, i, everyDay, sizeof(everyDay) / sizeof(SimZoneAlarm));
+
+    const SimZoneAlarm thatDay[] = {{1, middleTime, (uint8_t)(1 << weekday)}};
+    checkAlarms(zoneCase, table, i, thatDay, 1);
+
+    const SimZoneAlarm dayAfter[] = {{1, beforeTime, (uint8_t)(1 << ((weekday + 1) % DAYS_PER_WEEK))},
+                                     {2, middleTime, (uint8_t)(1 << ((weekday + 1) % DAYS_PER_WEEK))}};
+    checkAlarms(zoneCase, table, i, dayAfter, 2);
+  }
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+bool simTimeZoneCheck()
+{
+  checkStatuses();
+
+  printf("time zone table:       %zu bytes, %u years\n", sizeof(TimeZoneTable), TIME_ZONE_YEARS);
+  printf("%-22s %-44s %11s %11s %11s\n", "zone", "rule", "transitions", "compile (us)", "to utc (ns)");
+  for (const SimZoneCase &zoneCase : SIM_ZONE_CASES)
+  {
+    setHostZone(zoneCase.rule);
+    TimeZoneTable table;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TimeZoneStatus status = timeZoneCompile(zoneCase.rule, strlen(zoneCase.rule), 2026, &table);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double compileUs = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    if (status != TIME_ZONE_SUCCESS)
+    {
+      zoneFail(zoneCase.name, "status", 0, TIME_ZONE_SUCCESS, status);
+      continue;
+    }
+
+    uint32_t last = table.count > 0 ? table.transitions[table.count - 1] : 1767225600U;
+    checkOffsets(zoneCase, &table, 1767225600, last + SIM_ZONE_OFFSET_STEP_S);
+    checkLocalTimes(zoneCase, &table);
+    checkSchedules(zoneCase, &table);
+
+    volatile uint32_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < SIM_ZONE_LOOKUPS; i++)
+    {
+      sink = sink + timeZoneToUtc(&table, 1767225600U + i * 499);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double lookupNs = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / SIM_ZONE_LOOKUPS;
+    printf("%-22s %-44s %11u %11.1f %11.1f\n", zoneCase.name, zoneCase.rule[0] == '\0' ? "(empty)" : zoneCase.rule,
+           table.count, compileUs, lookupNs);
+  }
+  unsetenv("TZ");
+  tzset();
+
+  printf("time zone checks:      %s\n", simFailures == 0 ? "passed" : "FAILED");
+  return simFailures == 0;
+}
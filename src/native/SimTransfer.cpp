@@ -0,0 +1,373 @@
+// The song upload simulation: a phone uploads a file to the song
+// transfer of the firmware (see SongTransfer.h) over a simulated BLE
+// link, which loses and reorders writes, for a range of MTUs and
+// windows. It reports the throughput of each, then checks an upload
+// interrupted halfway resumes, with another MTU, where it stopped.
+//
+// The link runs in connection events: in each, the phone sends as many
+// writes without response as fit in SIM_LINK_PACKETS link layer packets,
+// and the device notifies its acknowledgements, which the phone gets at
+// the next event.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Crc.h"
+#include "../SongStore.h"
+#include "../SongTransfer.h"
+#include "Simulation.h"
+
+const uint32_t SIM_LINK_INTERVAL_US = 15000;
+const uint32_t SIM_LINK_PACKETS = 6;
+// link layer payload, with the data length extension
+const uint32_t SIM_LINK_PAYLOAD = 251;
+// the headers of a write: L2CAP (4) and ATT (3)
+const uint32_t SIM_LINK_WRITE_OVERHEAD = 7;
+const uint32_t SIM_LINK_REORDER_PERCENT = 5;
+
+// the phone sends the unacknowledged chunks again after this many events
+// without writes nor progress
+const uint32_t SIM_TRANSFER_TIMEOUT_EVENTS = 6;
+const uint32_t SIM_TRANSFER_MAX_EVENTS = 200000;
+
+const char *SIM_UPLOAD_NAME = "upload";
+const uint32_t SIM_UPLOAD_LENGTH = 96 * 1024;
+
+const uint16_t SIM_MTUS[] = {23, 185, 247, 517};
+const uint8_t SIM_WINDOWS[] = {1, 4, 8, 16, 32};
+
+// SimPhone is the client side of a transfer
+struct SimPhone
+{
+  const uint8_t *file;
+  uint32_t length;
+  uint16_t chunkSize;
+  uint8_t window;
+  uint16_t chunkCount;
+  uint16_t base;
+  uint16_t nextNew;
+  uint32_t lastActivity;
+  bool *acked;
+  bool *resend;
+  uint8_t status;
+  uint32_t writes;
+  uint32_t resent;
+};
+
+// SimTransferResult is how a transfer went
+struct SimTransferResult
+{
+  uint8_t status;
+  uint32_t events;
+  uint32_t writes;
+  uint32_t resent;
+  uint32_t dropped;
+};
+
+SongTransfer simTransfer;
+uint32_t simRandom = 1;
+
+/* =========================================================================
+   Private functions
+   ========================================================================= */
+
+uint32_t nextRandom()
+{
+  simRandom = simRandom * 1103515245 + 12345;
+  return (simRandom >> 16) & 0x7FFF;
+}
+
+bool chance(uint32_t percent)
+{
+  return nextRandom() % 100 < percent;
+}
+
+// writeChunk encodes a chunk as the phone writes it, returning its length
+size_t writeChunk(const SimPhone *phone, uint16_t sequence, uint8_t *write)
+{
+  uint32_t offset = (uint32_t)sequence * phone->chunkSize;
+  uint32_t length = phone->length - offset < phone->chunkSize ? phone->length - offset : phone->chunkSize;
+  uint32_t crc = crc32(phone->file + offset, length);
+  write[0] = sequence;
+  write[1] = sequence >> 8;
+  for (int i = 0; i < 4; i++)
+  {
+    write[2 + i] = crc >> (8 * i);
+  }
+  memcpy(write + SONG_TRANSFER_CHUNK_HEADER_SIZE, phone->file + offset, length);
+  return SONG_TRANSFER_CHUNK_HEADER_SIZE + length;
+}
+
+// openTransfer opens, or resumes, the transfer as the phone does for a
+// MTU, returning the acknowledgement of the device
+SongTransferAck openTransfer(SimPhone *phone, uint16_t mtu, uint8_t window)
+{
+  uint8_t command[SONG_TRANSFER_OPEN_SIZE + ALARM_SONG_SIZE];
+  size_t nameLength = strlen(SIM_UPLOAD_NAME);
+  uint32_t crc = crc32(phone->file, phone->length);
+  uint32_t maxChunk = mtu - 3 - SONG_TRANSFER_CHUNK_HEADER_SIZE;
+  phone->chunkSize = maxChunk < SONG_TRANSFER_MAX_CHUNK_SIZE ? maxChunk : SONG_TRANSFER_MAX_CHUNK_SIZE;
+  phone->window = window;
+  phone->chunkCount = (phone->length + phone->chunkSize - 1) / phone->chunkSize;
+
+  command[0] = SONG_TRANSFER_OPEN;
+  for (int i = 0; i < 4; i++)
+  {
+    command[1 + i] = phone->length >> (8 * i);
+    command[5 + i] = crc >> (8 * i);
+  }
+  command[9] = phone->chunkSize;
+  command[10] = phone->chunkSize >> 8;
+  command[11] = window;
+  memcpy(command + SONG_TRANSFER_OPEN_SIZE, SIM_UPLOAD_NAME, nameLength);
+
+  SongTransferAck ack;
+  songTransferCommand(&simTransfer, command, SONG_TRANSFER_OPEN_SIZE + nameLength, &ack);
+
+  // every chunk before next is taken, whatever was sent before
+  memset(phone->acked, 0, phone->chunkCount * sizeof(bool));
+  memset(phone->resend, 0, phone->chunkCount * sizeof(bool));
+  for (uint16_t i = 0; i < ack.next; i++)
+  {
+    phone->acked[i] = true;
+  }
+  phone->base = ack.next;
+  phone->nextNew = ack.next;
+  phone->status = ack.status;
+  return ack;
+}
+
+// receiveAck moves the window of the phone, and marks for sending again
+// the chunks missing before one that was received
+void receiveAck(SimPhone *phone, const SongTransferAck &ack, uint32_t event)
+{
+  phone->status = ack.status;
+  if (ack.status != SONG_TRANSFER_IN_PROGRESS || ack.next < phone->base)
+  {
+    return;
+  }
+  if (ack.next > phone->base)
+  {
+    phone->lastActivity = event;
+  }
+  for (uint16_t i = phone->base; i < ack.next; i++)
+  {
+    phone->acked[i] = true;
+  }
+  phone->base = ack.next;
+
+  int highest = 31;
+  while (highest >= 0 && !((ack.mask >> highest) & 1))
+  {
+    highest--;
+  }
+  for (int i = -1; i < highest; i++)
+  {
+    uint32_t sequence = ack.next + 1 + i;
+    if (i >= 0 && ((ack.mask >> i) & 1))
+    {
+      phone->acked[sequence] = true;
+    }
+    else if (sequence < phone->nextNew)
+    {
+      phone->resend[sequence] = true;
+    }
+  }
+}
+
+// timeOut sends again every chunk in flight after the link went quiet
+void timeOut(SimPhone *phone, uint32_t event)
+{
+  if (event - phone->lastActivity < SIM_TRANSFER_TIMEOUT_EVENTS)
+  {
+    return;
+  }
+  phone->lastActivity = event;
+  for (uint16_t i = phone->base; i < phone->nextNew; i++)
+  {
+    phone->resend[i] = !phone->acked[i];
+  }
+}
+
+// nextWrite picks the next chunk to write: one to send again first, then
+// a new one in the window. Returns false if there is none.
+bool nextWrite(SimPhone *phone, uint16_t *sequence)
+{
+  uint32_t end = (uint32_t)phone->base + phone->window;
+  for (uint32_t i = phone->base; i < phone->nextNew && i < end; i++)
+  {
+    if (phone->resend[i] && !phone->acked[i])
+    {
+      phone->resend[i] = false;
+      phone->resent++;
+      *sequence = i;
+      return true;
+    }
+  }
+  if (phone->nextNew < end && phone->nextNew < phone->chunkCount)
+  {
+    *sequence = phone->nextNew++;
+    return true;
+  }
+  return false;
+}
+
+// runTransfer runs the link until the transfer ends, or for maxEvents
+SimTransferResult runTransfer(SimPhone *phone, uint16_t mtu, uint32_t lossPercent, uint32_t maxEvents)
+{
+  SimTransferResult result = {};
+  uint32_t fragments = (mtu + 4 + SIM_LINK_PAYLOAD - 1) / SIM_LINK_PAYLOAD;
+  uint32_t writesPerEvent = SIM_LINK_PACKETS / fragments;
+  uint8_t writes[SIM_LINK_PACKETS][SONG_TRANSFER_CHUNK_HEADER_SIZE + SONG_TRANSFER_MAX_CHUNK_SIZE];
+  size_t lengths[SIM_LINK_PACKETS];
+  SongTransferAck acks[SIM_LINK_PACKETS];
+  uint32_t ackCount = 0;
+  phone->writes = 0;
+  phone->resent = 0;
+  phone->lastActivity = 0;
+
+  uint32_t event = 0;
+  for (; event < maxEvents && phone->status == SONG_TRANSFER_IN_PROGRESS; event++)
+  {
+    // the acknowledgements notified at the last event
+    for (uint32_t i = 0; i < ackCount; i++)
+    {
+      if (!chance(lossPercent))
+      {
+        receiveAck(phone, acks[i], event);
+      }
+    }
+    ackCount = 0;
+    if (phone->status != SONG_TRANSFER_IN_PROGRESS)
+    {
+      break;
+    }
+    timeOut(phone, event);
+
+    uint32_t count = 0;
+    uint16_t sequence;
+    while (count < writesPerEvent && nextWrite(phone, &sequence))
+    {
+      lengths[count] = writeChunk(phone, sequence, writes[count]);
+      count++;
+    }
+    phone->writes += count;
+    if (count > 0)
+    {
+      phone->lastActivity = event;
+    }
+
+    // a write overtakes the next one, or is lost
+    for (uint32_t i = 0; i + 1 < count; i++)
+    {
+      if (chance(SIM_LINK_REORDER_PERCENT))
+      {
+        uint8_t swap[sizeof(writes[0])];
+        size_t swapLength = lengths[i];
+        memcpy(swap, writes[i], lengths[i]);
+        memcpy(writes[i], writes[i + 1], lengths[i + 1]);
+        lengths[i] = lengths[i + 1];
+        memcpy(writes[i + 1], swap, swapLength);
+        lengths[i + 1] = swapLength;
+        i++;
+      }
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      SongTransferAck ack;
+      if (chance(lossPercent))
+      {
+        result.dropped++;
+      }
+      else if (songTransferWrite(&simTransfer, writes[i], lengths[i], &ack))
+      {
+        acks[ackCount++] = ack;
+      }
+    }
+  }
+  result.status = phone->status;
+  result.events = event;
+  result.writes = phone->writes;
+  result.resent = phone->resent;
+  return result;
+}
+
+// storedMatches returns true if the song store has the file
+bool storedMatches(const SimPhone *phone)
+{
+  SongEntry entry;
+  return songStoreFind(SIM_UPLOAD_NAME, &entry) && entry.length == phone->length &&
+         memcmp(simWorld->songs + entry.offset, phone->file, phone->length) == 0;
+}
+
+/* =========================================================================
+   Public functions
+   ========================================================================= */
+
+// simTransferSweep uploads a file for every MTU and window with a share
+// of the writes and acknowledgements lost, then an upload interrupted
+// and resumed. Returns false if any upload failed.
+bool simTransferSweep(uint32_t lossPercent)
+{
+  uint8_t *file = (uint8_t *)malloc(SIM_UPLOAD_LENGTH);
+  bool *acked = (bool *)malloc(SIM_UPLOAD_LENGTH);
+  bool *resend = (bool *)malloc(SIM_UPLOAD_LENGTH);
+  if (file == NULL || acked == NULL || resend == NULL)
+  {
+    perror("malloc");
+    return false;
+  }
+  for (uint32_t i = 0; i < SIM_UPLOAD_LENGTH; i++)
+  {
+    file[i] = nextRandom();
+  }
+  SimPhone phone = {};
+  phone.file = file;
+  phone.length = SIM_UPLOAD_LENGTH;
+  phone.acked = acked;
+  phone.resend = resend;
+  bool passed = true;
+
+  printf("upload of %u bytes, %u%% of the packets lost, %u%% of the writes reordered, %u ms connection interval\n",
+         SIM_UPLOAD_LENGTH, lossPercent, SIM_LINK_REORDER_PERCENT, SIM_LINK_INTERVAL_US / 1000);
+  printf("  mtu window  chunks  writes    lost  resent  time (s)  throughput (KB/s)\n");
+  for (uint16_t mtu : SIM_MTUS)
+  {
+    for (uint8_t window : SIM_WINDOWS)
+    {
+      memset(&simTransfer.stats, 0, sizeof(simTransfer.stats));
+      openTransfer(&phone, mtu, window);
+      SimTransferResult result = runTransfer(&phone, mtu, lossPercent, SIM_TRANSFER_MAX_EVENTS);
+      double seconds = (double)result.events * SIM_LINK_INTERVAL_US / 1e6;
+      printf("  %3u %6u %7u %7u %7u %7u %9.2f %18.1f\n", mtu, window, phone.chunkCount, result.writes, result.dropped,
+             result.resent, seconds, SIM_UPLOAD_LENGTH / 1024.0 / seconds);
+      if (result.status != SONG_TRANSFER_COMPLETE || !storedMatches(&phone))
+      {
+        fprintf(stderr, "upload with mtu %u and window %u ended with status %d\n", mtu, window, result.status);
+        passed = false;
+      }
+    }
+  }
+
+  // the link drops halfway, and the phone comes back with another MTU
+  memset(&simTransfer.stats, 0, sizeof(simTransfer.stats));
+  openTransfer(&phone, 247, 16);
+  SimTransferResult first = runTransfer(&phone, 247, lossPercent, phone.chunkCount / 2 / SIM_LINK_PACKETS);
+  SongTransferAck ack = openTransfer(&phone, 185, 16);
+  uint32_t resumedAt = (uint32_t)ack.next * phone.chunkSize;
+  SimTransferResult second = runTransfer(&phone, 185, lossPercent, SIM_TRANSFER_MAX_EVENTS);
+  printf("resumed at:          %u of %u bytes, after %u events\n", resumedAt, SIM_UPLOAD_LENGTH, first.events);
+  printf("resumed writes:      %u (%u before the drop)\n", second.writes, first.writes);
+  if (ack.status != SONG_TRANSFER_IN_PROGRESS || resumedAt == 0 || second.status != SONG_TRANSFER_COMPLETE ||
+      simTransfer.stats.resumes != 1 || !storedMatches(&phone))
+  {
+    fprintf(stderr, "the interrupted upload did not resume (status %d)\n", second.status);
+    passed = false;
+  }
+
+  free(file);
+  free(acked);
+  free(resend);
+  return passed;
+}
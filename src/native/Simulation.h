@@ -0,0 +1,263 @@
+#ifndef Simulation_h
+#define Simulation_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../Hal.h"
+#include "../HouseholdSync.h"
+
+// The native simulation runs every boot of the firmware in a forked
+// process, so a deep sleep really loses the RAM. What survives a deep
+// sleep on the device (RTC memory, flash, the RTC clock) lives in the
+// SimWorld, shared by all the boots.
+//
+// Time is virtual: it only moves when the firmware waits, delays or
+// sleeps, and then it jumps, so a night of sleep and a 30 minutes
+// sunrise take microseconds of real time.
+
+const size_t SIM_RTC_SIZE = 8192;
+const int SIM_KV_ENTRIES = 32;
+const size_t SIM_KV_KEY_SIZE = 16;
+const size_t SIM_KV_VALUE_SIZE = 256;
+
+// the size of the songs partition (see partitions.csv), erased in sectors
+const size_t SIM_SONGS_SIZE = 0x90000;
+const uint32_t SIM_FLASH_SECTOR_SIZE = 4096;
+
+// the size of each of the two OTA slots (see partitions.csv), and the
+// first byte of a firmware image, checked before one is activated
+const size_t SIM_FIRMWARE_SLOT_SIZE = 0x1B0000;
+const uint8_t SIM_FIRMWARE_IMAGE_MAGIC = 0xE9;
+
+// unix time when the simulation starts: 2026-01-01 00:00:00 UTC
+const int64_t SIM_START_EPOCH_MS = 1767225600000LL;
+
+// the time zone the simulated phone configures, Europe/Lisbon, and the
+// local time of day its alarm is set to (see SimRadio.cpp)
+const char SIM_TIME_ZONE[] = "WET0WEST,M3.5.0/1,M10.5.0";
+const uint32_t SIM_ALARM_LOCAL_TIME = 7 * 3600;
+
+// the network the simulated phone configures
+const char SIM_WIFI_SSID[] = "simulation";
+const char SIM_WIFI_PASSWORD[] = "simulation";
+
+// the key of the household the simulated phone sets with the household
+// sync, the one of its peer
+const uint8_t SIM_HOUSEHOLD_KEY[HOUSEHOLD_SYNC_KEY_SIZE] = {
+    0x6b, 0x65, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x69, 0x6d, 0x75, 0x6c,
+    0x61, 0x74, 0x65, 0x64, 0x20, 0x68, 0x6f, 0x75, 0x73, 0x65, 0x68, 0x6f, 0x6c, 0x64, 0x21, 0x0a};
+
+// one way network delay of the simulated NTP server and sync peer
+const uint32_t SIM_NETWORK_DELAY_MS = 15;
+
+// the packets the sync peer can have on the way to the device
+const uint8_t SIM_SYNC_QUEUE = 4;
+
+// rough costs of the slow operations of the device, so the virtual clock
+// shows what the firmware does before it gets to the leds
+const uint32_t SIM_KV_READ_US = 100;
+const uint32_t SIM_KV_WRITE_US = 5000;
+const uint32_t SIM_WIFI_START_MS = 100;
+const uint32_t SIM_BLE_START_MS = 300;
+const uint32_t SIM_TASK_START_US = 50;
+// a frame is shown once each led got its 24 bits, and the strip latched it
+const uint32_t SIM_LED_BIT_NS = 1250;
+const uint32_t SIM_LED_LATCH_US = 50;
+
+const uint32_t SIM_IDLE_FOREVER = UINT32_MAX;
+
+// exit status of a boot that waited for an event that can never come
+const int SIM_EXIT_STALLED = 3;
+
+// only the first few failed checks are described
+const uint32_t SIM_EXPECT_MAX_REPORTS = 10;
+
+struct SimKvEntry
+{
+    char key[SIM_KV_KEY_SIZE];
+    uint16_t length;
+    uint8_t used;
+    uint8_t value[SIM_KV_VALUE_SIZE];
+};
+
+// SimSyncItems are the items a simulated unit of the household syncs,
+// as readItem gives them (see HouseholdSync.h)
+struct SimSyncItems
+{
+    uint8_t content[HOUSEHOLD_SYNC_ITEMS][HOUSEHOLD_SYNC_MAX_ITEM_SIZE];
+    uint8_t lengths[HOUSEHOLD_SYNC_ITEMS];
+};
+
+// SimSyncPeer is the other unit of the household the device syncs with,
+// when enabled (see SimSync.cpp); its packets wait in the queue until the
+// device reads them
+struct SimSyncPeer
+{
+    HouseholdSync sync;
+    SimSyncItems items;
+    uint8_t queue[SIM_SYNC_QUEUE][HOUSEHOLD_SYNC_MAX_PACKET_SIZE];
+    uint16_t queueLengths[SIM_SYNC_QUEUE];
+    uint8_t queueFirst;
+    uint8_t queued;
+    uint32_t windows;
+    uint32_t changes;
+};
+
+// SimNtpNetwork is the way to the NTP stand-in (see SimNtp.cpp): the
+// delay of each way, up to jitterMs more for each packet, and how far the
+// clock of the server is off the real time
+struct SimNtpNetwork
+{
+    uint32_t upDelayMs;
+    uint32_t downDelayMs;
+    uint32_t jitterMs;
+    int32_t serverOffsetMs;
+};
+
+struct SimStats
+{
+    uint32_t boots;
+    uint32_t deepSleeps;
+    uint32_t timerWakes;
+    uint32_t buttonPresses;
+    uint32_t ntpExchanges;
+    uint32_t kvReads;
+    uint32_t kvWrites;
+    uint64_t framesShown;
+    uint64_t awakeUs;
+
+    // from a timer wake to the first frame sent to the leds
+    uint32_t firstFrames;
+    uint64_t firstFrameUs;
+    uint64_t maxFirstFrameUs;
+
+    // the songs played and how long the audio sent to the output plays,
+    // and how often it ran dry while playing
+    uint32_t songsPlayed;
+    uint64_t audioUs;
+    uint32_t audioUnderruns;
+
+    // the sectors of the songs partition erased
+    uint32_t flashErases;
+
+    // the household sync packets the device sent and received
+    uint32_t syncPacketsSent;
+    uint32_t syncPacketsReceived;
+    uint64_t syncBytesSent;
+    uint64_t syncBytesReceived;
+};
+
+struct SimWorld
+{
+    // virtual time since the simulation started, and when the running boot started
+    uint64_t nowUs;
+    uint64_t bootUs;
+
+    // the device wall clock runs clockDriftPpm fast and is offset from the real time
+    int32_t clockDriftPpm;
+    int64_t wallClockOffsetMs;
+
+    HalWakeCause wakeCause;
+    uint8_t sleeping;
+    uint64_t sleepUs;
+
+    // virtual time of the next button press, 0 if none is scheduled
+    uint64_t buttonPressUs;
+
+    // virtual time the audio output was last fed
+    uint64_t audioWrittenUs;
+
+    int logLevel;
+
+    SimNtpNetwork ntp;
+
+    alignas(8) uint8_t rtc[SIM_RTC_SIZE];
+    SimKvEntry kv[SIM_KV_ENTRIES];
+
+    // while set, every write to the key-value store fails, as on a full
+    // or worn out flash
+    uint8_t kvWritesFail;
+
+    uint8_t songs[SIM_SONGS_SIZE];
+
+    // the OTA slots: the firmware running, and the one booted next
+    uint8_t firmware[2][SIM_FIRMWARE_SLOT_SIZE];
+    uint8_t runningSlot;
+    uint8_t bootSlot;
+
+    // the simulated phone enables the household sync, with this peer
+    uint8_t householdSync;
+    SimSyncPeer syncPeer;
+
+    SimStats stats;
+};
+
+extern SimWorld *simWorld;
+
+// the checks made and those that failed, over every suite (see simExpect)
+extern uint32_t simChecks;
+extern uint32_t simFailures;
+
+// the loopback port the TCP server listens on (see HalNative.cpp)
+extern uint16_t simTcpPort;
+
+struct AlarmTable;
+
+void simBoot();
+
+void simAdvance(uint64_t microseconds);
+
+void simIdle(uint32_t milliseconds, const volatile uint32_t *pending);
+
+[[noreturn]] void simStall(const char *reason);
+
+bool simExpect(bool ok, const char *suite, const char *what);
+
+bool simBenchStateMachine(uint32_t dispatches);
+
+bool simLatencyCheck(uint32_t events);
+
+bool simSchedulerCheck(uint32_t repeats);
+
+bool simCurveCheck(uint32_t frames);
+
+bool simSettingsCheck(uint32_t tables);
+
+bool simProtocolCheck(uint32_t writes);
+
+bool simGattCheck(uint32_t configurations);
+
+bool simAudioInstallSongs();
+
+bool simAudioCheck(uint32_t benchSeconds);
+
+bool simTransferSweep(uint32_t lossPercent);
+
+bool simDeltaCheck(uint32_t repeats);
+
+bool simDeltaDiff(const char *oldPath, const char *newPath, const char *patchPath);
+
+bool simDeltaApply(const char *oldPath, const char *patchPath, const char *newPath);
+
+bool simTimeZoneCheck();
+
+uint16_t simNtpResolve(const char *host, uint16_t port);
+
+void simNtpServe();
+
+bool simNtpCheck(uint32_t syncs);
+
+void simSyncPeerOpen();
+
+void simSyncPeerReceive(const uint8_t *packet, size_t length);
+
+int simSyncPeerSend(uint8_t *buffer, size_t size);
+
+bool simSyncPeerMatches(const HouseholdSync *sync, const AlarmTable *alarms);
+
+bool simSyncCheck(uint32_t nodes);
+
+bool simHttpCheck(uint32_t requests);
+
+#endif
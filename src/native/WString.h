@@ -0,0 +1,51 @@
+#ifndef WString_h
+#define WString_h
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+// String is the subset of the Arduino String used by the firmware,
+// for the native simulation
+class String
+{
+public:
+    String(const char *value = "") : value(value != nullptr ? value : "") {}
+    String(const std::string &value) : value(value) {}
+    explicit String(char value) : value(1, value) {}
+    explicit String(unsigned char value) : value(std::to_string(value)) {}
+    explicit String(int value) : value(std::to_string(value)) {}
+    explicit String(unsigned int value) : value(std::to_string(value)) {}
+    explicit String(long value) : value(std::to_string(value)) {}
+    explicit String(unsigned long value) : value(std::to_string(value)) {}
+    explicit String(float value, unsigned int decimalPlaces = 2) : String((double)value, decimalPlaces) {}
+    explicit String(double value, unsigned int decimalPlaces = 2)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.*f", decimalPlaces, value);
+        this->value = buffer;
+    }
+
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+    long toInt() const { return strtol(value.c_str(), nullptr, 10); }
+
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator!=(const String &other) const { return value != other.value; }
+    bool operator==(const char *other) const { return value == other; }
+    bool operator!=(const char *other) const { return value != other; }
+
+    String &operator+=(const String &other)
+    {
+        value += other.value;
+        return *this;
+    }
+
+    friend String operator+(const String &left, const String &right) { return String(left.value + right.value); }
+
+private:
+    std::string value;
+};
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef FreeRTOS_h
+#define FreeRTOS_h
+
+#include <stdint.h>
+
+// the FreeRTOS types used by the firmware, for the native simulation,
+// with a tick of one millisecond
+
+typedef long BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(milliseconds) ((TickType_t)(milliseconds))
+#define portYIELD_FROM_ISR(...)
+
+#endif
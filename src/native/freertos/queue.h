@@ -0,0 +1,71 @@
+#ifndef queue_h
+#define queue_h
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "../Simulation.h"
+
+// The FreeRTOS queue functions used by the firmware, for the native
+// simulation. There is a single task, so waiting for an item is idling
+// the virtual clock until a simulated interrupt posts one.
+
+const uint32_t SIM_QUEUE_CAPACITY = 32;
+const uint32_t SIM_QUEUE_ITEM_SIZE = 8;
+
+struct SimQueue
+{
+    uint8_t items[SIM_QUEUE_CAPACITY][SIM_QUEUE_ITEM_SIZE];
+    uint32_t length;
+    uint32_t itemSize;
+    uint32_t head;
+    volatile uint32_t count;
+};
+
+typedef SimQueue *QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(uint32_t length, uint32_t itemSize)
+{
+    if (length > SIM_QUEUE_CAPACITY || itemSize > SIM_QUEUE_ITEM_SIZE)
+    {
+        return nullptr;
+    }
+    QueueHandle_t queue = new SimQueue();
+    queue->length = length;
+    queue->itemSize = itemSize;
+    return queue;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t /* ticksToWait */)
+{
+    if (queue->count == queue->length)
+    {
+        return pdFALSE;
+    }
+    memcpy(queue->items[(queue->head + queue->count) % queue->length], item, queue->itemSize);
+    queue->count++;
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t * /* higherPriorityTaskWoken */)
+{
+    return xQueueSend(queue, item, 0);
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticksToWait)
+{
+    if (queue->count == 0 && ticksToWait > 0)
+    {
+        simIdle(ticksToWait == portMAX_DELAY ? SIM_IDLE_FOREVER : ticksToWait, &queue->count);
+    }
+    if (queue->count == 0)
+    {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items[queue->head], queue->itemSize);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdTRUE;
+}
+
+#endif